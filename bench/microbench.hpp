@@ -0,0 +1,264 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/// Default minimum measured time (seconds) per benchmark
+#define MICRO_MIN_TIME 0.5
+
+/// Default measured batches per benchmark
+#define MICRO_REPETITIONS 5
+
+using steadyclock = std::chrono::steady_clock;
+
+/**
+ * @brief Micro State
+ *
+ * This class times one batch of a micro-benchmark body.
+ * Setup goes before the loop and teardown after it, only the loop is timed:
+ * `while (state.keepRunning()) { ... }`
+ */
+class MicroState
+{
+  public:
+    MicroState(int64_t iterations) : _iterations(iterations), _done(0), _elapsed(0.0), _items(0), _skipped(false)
+    {
+    }
+
+    /// Whether to run the body once more, starts the clock on first call and stops it on last
+    bool keepRunning()
+    {
+        if (_done == 0 && _elapsed == 0.0)
+            _startT = steadyclock::now();
+        if (_done < _iterations)
+        {
+            _done++;
+            return true;
+        }
+        _elapsed = std::chrono::duration<double>(steadyclock::now() - _startT).count();
+        return false;
+    }
+
+    /// Items (pixels, samples, packets, bytes) processed per iteration, for throughput
+    void setItems(int64_t items, const std::string &unit)
+    {
+        _items = items;
+        _unit = unit;
+    }
+
+    /// Mark benchmark as not runnable, e.g. a codec missing from the FFmpeg build
+    void skip(const std::string &reason)
+    {
+        _skipped = true;
+        _reason = reason;
+    }
+
+    int64_t iterations() const
+    {
+        return _done;
+    }
+
+    double elapsed() const
+    {
+        return _elapsed;
+    }
+
+    int64_t items() const
+    {
+        return _items;
+    }
+
+    const std::string &unit() const
+    {
+        return _unit;
+    }
+
+    bool skipped() const
+    {
+        return _skipped;
+    }
+
+    const std::string &reason() const
+    {
+        return _reason;
+    }
+
+  private:
+    int64_t _iterations, _done;
+    steadyclock::time_point _startT;
+    double _elapsed;
+    int64_t _items;
+    std::string _unit;
+    bool _skipped;
+    std::string _reason;
+};
+
+/// Benchmark body, runs the timed loop of one batch
+using MicroBody = std::function<void(MicroState &)>;
+
+/**
+ * @brief Micro Result
+ *
+ * This structure stores timings of one micro-benchmark.
+ */
+struct MicroResult
+{
+    std::string name;
+    bool skipped;
+    std::string reason;
+    int64_t iterations;         // per batch
+    double median, best, worst; // nanoseconds per iteration over batches
+    double throughput;          // items per second at median
+    std::string unit;
+
+    MicroResult() : skipped(false), iterations(0), median(0.0), best(0.0), worst(0.0), throughput(0.0)
+    {
+    }
+};
+
+/**
+ * @brief Micro Runner
+ *
+ * This class registers micro-benchmarks and runs them in batches,
+ * growing the iteration count until one batch takes its share of the minimum time.
+ */
+class MicroRunner
+{
+  public:
+    MicroRunner() : _minTime(MICRO_MIN_TIME), _repetitions(MICRO_REPETITIONS)
+    {
+    }
+
+    /// Register benchmark under given name, e.g. sws_scale/bgr0-yuv420p/1080p
+    void add(const std::string &name, const MicroBody &body)
+    {
+        _benches.push_back({name, body});
+    }
+
+    /// Minimum measured seconds per benchmark
+    void setMinTime(double seconds)
+    {
+        _minTime = (std::max)(0.01, seconds);
+    }
+
+    /// Measured batches per benchmark
+    void setRepetitions(int repetitions)
+    {
+        _repetitions = (std::max)(1, repetitions);
+    }
+
+    /**
+     * @brief Run Benchmarks
+     *
+     * @param filter Only run benchmarks whose name contains this, empty for all
+     * @param out Human readable progress
+     * @return std::vector<MicroResult>
+     */
+    std::vector<MicroResult> run(const std::string &filter, std::ostream &out)
+    {
+        std::vector<MicroResult> results;
+        for (auto &bench : _benches)
+        {
+            if (!filter.empty() && bench.first.find(filter) == std::string::npos)
+                continue;
+            results.push_back(runOne(bench.first, bench.second));
+            print(out, results.back());
+        }
+        return results;
+    }
+
+    /// Print names of registered benchmarks
+    void list(std::ostream &out)
+    {
+        for (auto &bench : _benches)
+            out << bench.first << std::endl;
+    }
+
+    /// Write results as one JSON document
+    static void writeJson(std::ostream &out, const std::vector<MicroResult> &results)
+    {
+        out << "{\n  \"benchmarks\": [";
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            auto &r = results[i];
+            out << (i ? "," : "") << "\n    {\"name\": \"" << r.name << "\"";
+            if (r.skipped)
+                out << ", \"skipped\": \"" << r.reason << "\"}";
+            else
+                out << ", \"iterations\": " << r.iterations << ", \"ns_median\": " << r.median
+                    << ", \"ns_best\": " << r.best << ", \"ns_worst\": " << r.worst
+                    << ", \"throughput\": " << r.throughput << ", \"unit\": \"" << r.unit << "/s\"}";
+        }
+        out << "\n  ]\n}" << std::endl;
+    }
+
+  private:
+    /// Calibrate & measure one benchmark
+    MicroResult runOne(const std::string &name, const MicroBody &body)
+    {
+        MicroResult result;
+        result.name = name;
+        double batchTime = _minTime / _repetitions;
+        // grow batch until it is long enough to time
+        int64_t iterations = 1;
+        while (true)
+        {
+            MicroState state(iterations);
+            body(state);
+            if (state.skipped())
+            {
+                result.skipped = true;
+                result.reason = state.reason();
+                return result;
+            }
+            if (state.elapsed() >= batchTime || iterations >= (int64_t(1) << 30))
+                break;
+            double perIter = state.elapsed() / (std::max)(int64_t(1), state.iterations());
+            int64_t next = perIter > 0.0 ? static_cast<int64_t>(batchTime / perIter * 1.2) : iterations * 10;
+            iterations = std::clamp(next, iterations + 1, iterations * 10);
+        }
+        std::vector<double> times;
+        for (int i = 0; i < _repetitions; i++)
+        {
+            MicroState state(iterations);
+            body(state);
+            times.push_back(state.elapsed() * 1e9 / (std::max)(int64_t(1), state.iterations()));
+            result.unit = state.unit();
+            if (state.items() > 0 && i == 0)
+                result.throughput = state.items();
+        }
+        std::sort(times.begin(), times.end());
+        result.iterations = iterations;
+        result.median = times[times.size() / 2];
+        result.best = times.front();
+        result.worst = times.back();
+        result.throughput = result.median > 0.0 ? result.throughput * 1e9 / result.median : 0.0;
+        return result;
+    }
+
+    /// Print one result line
+    static void print(std::ostream &out, const MicroResult &r)
+    {
+        char line[256];
+        if (r.skipped)
+            std::snprintf(line, sizeof(line), "%-48s skipped: %s", r.name.c_str(), r.reason.c_str());
+        else if (r.throughput > 0.0)
+            std::snprintf(line, sizeof(line), "%-48s %12.0f ns %12.0f ns best %10.2f M%s/s", r.name.c_str(), r.median,
+                          r.best, r.throughput * 1e-6, r.unit.c_str());
+        else
+            std::snprintf(line, sizeof(line), "%-48s %12.0f ns %12.0f ns best", r.name.c_str(), r.median, r.best);
+        out << line << std::endl;
+    }
+
+    double _minTime;
+    int _repetitions;
+    std::vector<std::pair<std::string, MicroBody>> _benches;
+};
@@ -0,0 +1,383 @@
+#include "muxer.hpp"
+#include "session.hpp"
+#include "utils.hpp"
+
+extern "C"
+{
+#include <libavutil/avutil.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using sysclock = std::chrono::system_clock;
+
+// End-to-end benchmark: records synthetic sources through the real pipeline
+// for every output format, size and frame rate, and writes the results as JSON.
+
+static const std::string NAME = "RecordBench";
+
+/// Output extensions accepted by MediaHandler
+static const std::vector<std::string> BENCH_FORMATS = {"mp4", "mov", "wmv", "gif", "webm",
+                                                       "avi", "flv", "apng", "mpg"};
+
+/// MP4/MOV layout names, indexed by OUTPUT_LAYOUT_*
+static const std::vector<std::string> BENCH_LAYOUTS = {"default", "fragmented", "faststart"};
+
+/**
+ * @brief Bench Size
+ *
+ * This structure stores one benchmarked capture size.
+ */
+struct BenchSize
+{
+    std::string name;
+    int w, h;
+};
+
+/// Benchmarked capture sizes
+static const std::vector<BenchSize> BENCH_SIZES = {
+    {"720p", 1280, 720}, {"1080p", 1920, 1080}, {"1440p", 2560, 1440}, {"4k", 3840, 2160}};
+
+/**
+ * @brief Bench Result
+ *
+ * This structure stores measurements of one benchmark run.
+ */
+struct BenchResult
+{
+    std::string format, size;
+    int w, h, fps;
+    bool success;
+    double wallTime;  // seconds from start until outputs are finished
+    double mediaTime; // seconds of written video
+    double stopTime;  // seconds to stop, mostly the trailer of mp4/mov
+    int64_t frames, dropped;
+    double cpuTotal, cpuCapture, cpuMux;
+    int64_t outputBytes;
+    std::array<StageSummary, STATS_STAGES> stages;
+
+    BenchResult()
+        : w(0), h(0), fps(0), success(false), wallTime(0.0), mediaTime(0.0), stopTime(0.0), frames(0), dropped(0),
+          cpuTotal(0.0), cpuCapture(0.0), cpuMux(0.0), outputBytes(0), stages{}
+    {
+    }
+};
+
+/**
+ * @brief Bench Config
+ *
+ * This structure stores settings of one benchmark invocation.
+ */
+struct BenchConfig
+{
+    std::vector<std::string> formats;
+    std::vector<BenchSize> sizes;
+    std::vector<int> fps;
+    double duration;  // wall seconds per run
+    double mediaTime; // seconds of video per run instead of duration, 0 to disable
+    int32_t layout;   // one of OUTPUT_LAYOUT_* for mp4/mov
+    std::string videoGraph, audioGraph;
+    std::string dir;    // directory of recorded files
+    std::string output; // JSON path, - for stdout
+    std::string label;  // free text stored with the results, e.g. a version
+    bool keep;          // keep recorded files
+    bool stageStats;    // run stage timers, off to measure their overhead
+
+    BenchConfig()
+        : formats(BENCH_FORMATS), sizes(BENCH_SIZES), fps{30, 60}, duration(5.0), mediaTime(0.0),
+          layout(OUTPUT_LAYOUT_DEFAULT), videoGraph(SOURCE_LAVFI_SCREEN),
+          audioGraph(SOURCE_LAVFI_AUDIO), dir("bench_out"), output("record_bench.json"), keep(false),
+          stageStats(true)
+    {
+    }
+};
+
+/// Split comma separated list
+static std::vector<std::string> splitList(const std::string &arg)
+{
+    std::vector<std::string> items;
+    std::stringstream ss(arg);
+    std::string item;
+    while (std::getline(ss, item, ','))
+    {
+        if (!item.empty())
+            items.push_back(item);
+    }
+    return items;
+}
+
+/// Quote string for JSON
+static std::string quote(const std::string &s)
+{
+    std::string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out += c;
+    }
+    return out + "\"";
+}
+
+/// Record one format, size & frame rate for the configured duration
+static BenchResult runOne(const BenchConfig &config, const std::string &format, const BenchSize &size, int fps)
+{
+    BenchResult result;
+    result.format = format;
+    result.size = size.name;
+    result.w = size.w;
+    result.h = size.h;
+    result.fps = fps;
+    auto path = fs::absolute(fs::path(config.dir) / (size.name + "_" + std::to_string(fps) + "." + format)).string();
+    std::error_code ec;
+    fs::remove(path, ec);
+
+    SessionConfig sessionConfig;
+    sessionConfig.output = path;
+    sessionConfig.region = {0, 0, size.w, size.h};
+    sessionConfig.video.type = SOURCE_LAVFI;
+    sessionConfig.video.url = config.videoGraph;
+    sessionConfig.audio.type = SOURCE_LAVFI;
+    sessionConfig.audio.url = config.audioGraph;
+    sessionConfig.fps = fps;
+    sessionConfig.skipTime = 0;
+    sessionConfig.layout = config.layout;
+    // reservation just covers the run, a longer one would only pad the file
+    sessionConfig.expectedTime = static_cast<int32_t>(std::ceil(config.mediaTime / 60.0));
+    RecordSession session;
+    session.handler().StageStats().setEnabled(config.stageStats);
+    if (!session.configure(sessionConfig))
+        return result;
+
+    // generators are unpaced, so the pipeline runs as fast as it can for the whole run
+    auto startCpu = process_cpu_time();
+    auto startT = sysclock::now();
+    if (!session.start())
+        return result;
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto elapsed = std::chrono::duration<double>(sysclock::now() - startT).count();
+        auto stats = session.stats();
+        bool done = config.mediaTime > 0.0 ? stats.mediaTime >= config.mediaTime : elapsed >= config.duration;
+        if (done || (elapsed > 1.0 && !stats.recording))
+            break;
+    }
+    auto stopT = sysclock::now();
+    result.success = session.stop();
+    result.stopTime = std::chrono::duration<double>(sysclock::now() - stopT).count();
+    result.wallTime = std::chrono::duration<double>(sysclock::now() - startT).count();
+    result.cpuTotal = process_cpu_time() - startCpu;
+
+    auto stats = session.stats();
+    result.mediaTime = stats.mediaTime;
+    result.frames = stats.frames;
+    result.dropped = stats.dropped;
+    result.cpuCapture = stats.captureCpu;
+    result.cpuMux = stats.muxCpu;
+    result.success = result.success && result.frames > 0;
+    for (int i = 0; i < STATS_STAGES; i++)
+        result.stages[i] = session.handler().StageStats().summary(i, false);
+    result.outputBytes = fs::exists(path, ec) ? static_cast<int64_t>(fs::file_size(path, ec)) : 0;
+    if (!config.keep)
+    {
+        fs::remove(path, ec);
+        fs::remove(path + ".stats.json", ec);
+    }
+    return result;
+}
+
+/// Write results as one JSON document
+static void writeJson(std::ostream &out, const BenchConfig &config, const std::vector<BenchResult> &results)
+{
+    char stamp[32];
+    auto now = sysclock::to_time_t(sysclock::now());
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", std::localtime(&now));
+    out << "{\n";
+    out << "  \"label\": " << quote(config.label) << ",\n";
+    out << "  \"time\": " << quote(stamp) << ",\n";
+    out << "  \"ffmpeg\": " << quote(av_version_info()) << ",\n";
+    out << "  \"cores\": " << std::thread::hardware_concurrency() << ",\n";
+    out << "  \"duration\": " << config.duration << ",\n";
+    out << "  \"media_duration\": " << config.mediaTime << ",\n";
+    out << "  \"layout\": " << quote(BENCH_LAYOUTS[config.layout]) << ",\n";
+    out << "  \"video_source\": " << quote(config.videoGraph) << ",\n";
+    out << "  \"audio_source\": " << quote(config.audioGraph) << ",\n";
+    out << "  \"stage_stats\": " << (config.stageStats ? "true" : "false") << ",\n";
+    out << "  \"runs\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        auto &r = results[i];
+        // sustained rate is what the pipeline delivered per wall second, real-time when it reaches the target
+        double fps = r.wallTime > 0.0 ? r.frames / r.wallTime : 0.0;
+        double perFrame = r.frames > 0 ? 1000.0 / r.frames : 0.0;
+        out << (i ? "," : "") << "\n    {";
+        out << "\"format\": " << quote(r.format) << ", \"size\": " << quote(r.size) << ", \"width\": " << r.w
+            << ", \"height\": " << r.h << ", \"fps\": " << r.fps << ", \"success\": " << (r.success ? "true" : "false")
+            << ",\n     \"wall_time\": " << r.wallTime << ", \"media_time\": " << r.mediaTime
+            << ", \"stop_time\": " << r.stopTime
+            << ", \"frames\": " << r.frames << ", \"sustained_fps\": " << fps
+            << ", \"realtime\": " << (fps >= r.fps ? "true" : "false") << ", \"dropped\": " << r.dropped
+            << ",\n     \"cpu\": {\"total\": " << r.cpuTotal << ", \"capture\": " << r.cpuCapture
+            << ", \"mux\": " << r.cpuMux << ", \"other\": " << (std::max)(0.0, r.cpuTotal - r.cpuCapture - r.cpuMux)
+            << "}, \"cpu_ms_per_frame\": " << r.cpuTotal * perFrame << ", \"output_bytes\": " << r.outputBytes;
+        // per-stage wall time, in microseconds per packet
+        out << ",\n     \"stages_us\": {";
+        bool first = true;
+        for (int s = 0; s < STATS_STAGES; s++)
+        {
+            auto &st = r.stages[s];
+            if (st.count == 0)
+                continue;
+            out << (first ? "" : ", ") << "\"" << PipelineStats::stageName(s) << "\": {\"count\": " << st.count
+                << ", \"p50\": " << st.p50 << ", \"p99\": " << st.p99 << ", \"max\": " << st.max
+                << ", \"total_s\": " << st.total << "}";
+            first = false;
+        }
+        out << "}}";
+    }
+    out << "\n  ]\n}" << std::endl;
+}
+
+/// Print usage
+static void usage(const char *argv0)
+{
+    std::cout << "usage: " << argv0 << " [--formats mp4,webm,...] [--sizes 720p,1080p,1440p,4k] [--fps 30,60]"
+              << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv0), ' ')
+              << " [--duration S | --media-duration S] [--layout default|fragmented|faststart]" << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv0), ' ')
+              << " [--video-source graph] [--audio-source graph] [--dir path] [--output file.json|-]" << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv0), ' ') << " [--label text] [--keep] [--no-stage-stats]"
+              << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config;
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--formats") == 0 && hasValue)
+            config.formats = splitList(argv[++i]);
+        else if (std::strcmp(argv[i], "--sizes") == 0 && hasValue)
+        {
+            config.sizes.clear();
+            for (auto &name : splitList(argv[++i]))
+            {
+                auto it = std::find_if(BENCH_SIZES.begin(), BENCH_SIZES.end(),
+                                       [&name](const BenchSize &size) { return size.name == name; });
+                int w = 0, h = 0;
+                if (it != BENCH_SIZES.end())
+                    config.sizes.push_back(*it);
+                else if (std::sscanf(name.c_str(), "%dx%d", &w, &h) == 2 && w > 0 && h > 0)
+                    config.sizes.push_back({name, w, h});
+                else
+                {
+                    display_message(NAME, "size must be 720p, 1080p, 1440p, 4k or WxH", MESSAGE_ERROR);
+                    return -1;
+                }
+            }
+        }
+        else if (std::strcmp(argv[i], "--fps") == 0 && hasValue)
+        {
+            config.fps.clear();
+            for (auto &fps : splitList(argv[++i]))
+                config.fps.push_back((std::max)(1, std::atoi(fps.c_str())));
+        }
+        else if (std::strcmp(argv[i], "--duration") == 0 && hasValue)
+            config.duration = (std::max)(0.5, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--media-duration") == 0 && hasValue)
+            config.mediaTime = (std::max)(0.5, std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--layout") == 0 && hasValue)
+        {
+            auto it = std::find(BENCH_LAYOUTS.begin(), BENCH_LAYOUTS.end(), argv[++i]);
+            if (it == BENCH_LAYOUTS.end())
+            {
+                display_message(NAME, "layout must be default, fragmented or faststart", MESSAGE_ERROR);
+                return -1;
+            }
+            config.layout = static_cast<int32_t>(it - BENCH_LAYOUTS.begin());
+        }
+        else if (std::strcmp(argv[i], "--video-source") == 0 && hasValue)
+            config.videoGraph = argv[++i];
+        else if (std::strcmp(argv[i], "--audio-source") == 0 && hasValue)
+            config.audioGraph = argv[++i];
+        else if (std::strcmp(argv[i], "--dir") == 0 && hasValue)
+            config.dir = argv[++i];
+        else if (std::strcmp(argv[i], "--output") == 0 && hasValue)
+            config.output = argv[++i];
+        else if (std::strcmp(argv[i], "--label") == 0 && hasValue)
+            config.label = argv[++i];
+        else if (std::strcmp(argv[i], "--keep") == 0)
+            config.keep = true;
+        else if (std::strcmp(argv[i], "--no-stage-stats") == 0)
+            config.stageStats = false;
+        else
+        {
+            usage(argv[0]);
+            return std::strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
+    }
+    for (auto &format : config.formats)
+    {
+        if (std::find(BENCH_FORMATS.begin(), BENCH_FORMATS.end(), format) == BENCH_FORMATS.end())
+        {
+            display_message(NAME, "unsupported format " + format, MESSAGE_ERROR);
+            return -1;
+        }
+    }
+    std::error_code ec;
+    fs::create_directories(config.dir, ec);
+    if (ec)
+    {
+        display_message(NAME, "failed to create " + config.dir, MESSAGE_ERROR);
+        return -1;
+    }
+
+    std::vector<BenchResult> results;
+    for (auto &format : config.formats)
+    {
+        for (auto &size : config.sizes)
+        {
+            for (auto fps : config.fps)
+            {
+                display_message(NAME, format + " " + size.name + " @ " + std::to_string(fps) + " fps", MESSAGE_INFO);
+                results.push_back(runOne(config, format, size, fps));
+                if (!results.back().success)
+                    display_message(NAME, "run failed", MESSAGE_WARN);
+            }
+        }
+    }
+
+    if (config.output == "-")
+    {
+        writeJson(std::cout, config, results);
+        return 0;
+    }
+    std::ofstream f(config.output);
+    writeJson(f, config, results);
+    if (!f.good())
+    {
+        display_message(NAME, "failed to write " + config.output, MESSAGE_ERROR);
+        return -1;
+    }
+    display_message(NAME, "results written to " + config.output, MESSAGE_INFO);
+    return 0;
+}
@@ -0,0 +1,405 @@
+#include "microbench.hpp"
+#include "utils.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavformat/avformat.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/hash.h>
+#include <libavutil/opt.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+}
+
+#include <cinttypes>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Micro-benchmarks of the per-frame primitives of the capture pipeline, each set up the way
+// VideoCapture, AudioCapture and MediaMuxer set them up, at capture sizes and sample counts.
+
+static const std::string NAME = "RecordMicroBench";
+
+/// Samples per captured audio packet
+#define MICRO_AUDIO_SAMPLES 1024
+
+/// Capture sample rate of audio server
+#define MICRO_AUDIO_RATE 44100
+
+/// Frames between keyframes of muxed video, as set by VideoCapture::openEncoder
+#define MICRO_GOP_SIZE 12
+
+struct MicroSize
+{
+    std::string name;
+    int w, h;
+};
+
+static const std::vector<MicroSize> MICRO_SIZES = {{"720p", 1280, 720}, {"1080p", 1920, 1080}, {"4k", 3840, 2160}};
+
+/// Allocate video frame filled with a gradient
+static AVFrame *allocVideoFrame(int w, int h, AVPixelFormat format)
+{
+    auto frame = av_frame_alloc();
+    frame->width = w;
+    frame->height = h;
+    frame->format = format;
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    for (int p = 0; p < AV_NUM_DATA_POINTERS && frame->data[p]; p++)
+    {
+        int rows = p == 0 ? h : (h + 1) / 2;
+        for (int y = 0; y < rows; y++)
+            for (int x = 0; x < frame->linesize[p]; x++)
+                frame->data[p][y * frame->linesize[p] + x] = static_cast<uint8_t>(x + y * 3);
+    }
+    return frame;
+}
+
+/// Allocate interleaved s16 stereo frame holding a tone
+static AVFrame *allocAudioFrame(int samples, int rate)
+{
+    auto frame = av_frame_alloc();
+    frame->nb_samples = samples;
+    frame->format = AV_SAMPLE_FMT_S16;
+    frame->sample_rate = rate;
+    frame->channel_layout = AV_CH_LAYOUT_STEREO;
+    frame->channels = 2;
+    if (av_frame_get_buffer(frame, 0) < 0)
+    {
+        av_frame_free(&frame);
+        return nullptr;
+    }
+    auto data = reinterpret_cast<int16_t *>(frame->data[0]);
+    for (int i = 0; i < samples * 2; i++)
+        data[i] = static_cast<int16_t>((i * 37) % 20000 - 10000);
+    return frame;
+}
+
+/// Colour conversion of captured frame to encoder format, as in VideoCapture::configOStream
+static void benchScale(MicroState &state, const MicroSize &size, AVPixelFormat src, AVPixelFormat dst)
+{
+    auto swsCtx = sws_getContext(size.w, size.h, src, size.w, size.h, dst, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    auto in = allocVideoFrame(size.w, size.h, src);
+    auto out = allocVideoFrame(size.w, size.h, dst);
+    if (!swsCtx || !in || !out)
+        state.skip("failed to prepare sws context");
+    else
+    {
+        state.setItems(int64_t(size.w) * size.h, "pix");
+        while (state.keepRunning())
+            sws_scale(swsCtx, in->data, in->linesize, 0, size.h, out->data, out->linesize);
+    }
+    sws_freeContext(swsCtx);
+    av_frame_free(&in);
+    av_frame_free(&out);
+}
+
+/// Resample captured packets into encoder frames, as in the loop of AudioCapture::writeFrame
+static void benchResample(MicroState &state, int outRate, int frameSize)
+{
+    auto swrCtx = swr_alloc();
+    av_opt_set_int(swrCtx, "in_sample_rate", MICRO_AUDIO_RATE, 0);
+    av_opt_set_channel_layout(swrCtx, "in_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_sample_fmt(swrCtx, "in_sample_fmt", AV_SAMPLE_FMT_S16, 0);
+    av_opt_set_int(swrCtx, "out_sample_rate", outRate, 0);
+    av_opt_set_channel_layout(swrCtx, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+    av_opt_set_sample_fmt(swrCtx, "out_sample_fmt", AV_SAMPLE_FMT_FLTP, 0);
+    auto in = allocAudioFrame(MICRO_AUDIO_SAMPLES, MICRO_AUDIO_RATE);
+    auto out = av_frame_alloc();
+    out->nb_samples = frameSize;
+    out->format = AV_SAMPLE_FMT_FLTP;
+    out->channel_layout = AV_CH_LAYOUT_STEREO;
+    out->channels = 2;
+    if (swr_init(swrCtx) < 0 || !in || av_frame_get_buffer(out, 0) < 0)
+        state.skip("failed to init resampler context");
+    else
+    {
+        state.setItems(MICRO_AUDIO_SAMPLES, "samples");
+        while (state.keepRunning())
+        {
+            av_frame_make_writable(out);
+            if (swr_convert(swrCtx, out->data, out->nb_samples, const_cast<const uint8_t **>(in->data),
+                            in->nb_samples) > 0)
+            {
+                while (swr_get_delay(swrCtx, outRate) > out->nb_samples)
+                {
+                    if (swr_convert(swrCtx, out->data, out->nb_samples, nullptr, 0) <= 0)
+                        break;
+                }
+            }
+        }
+    }
+    swr_free(&swrCtx);
+    av_frame_free(&in);
+    av_frame_free(&out);
+}
+
+/// Mix desktop & mic packets, graph built as in AudioCapture::configFilter
+static void benchMix(MicroState &state)
+{
+    auto graph = avfilter_graph_alloc();
+    AVFilterContext *bufOut = nullptr, *bufMic = nullptr, *mix = nullptr, *sink = nullptr;
+    char args[512];
+    std::snprintf(args, sizeof(args), "time_base=1/%d:sample_rate=%d:sample_fmt=%s:channel_layout=0x%" PRIx64,
+                  MICRO_AUDIO_RATE, MICRO_AUDIO_RATE, av_get_sample_fmt_name(AV_SAMPLE_FMT_S16),
+                  static_cast<uint64_t>(AV_CH_LAYOUT_STEREO));
+    bool success = graph &&
+                   avfilter_graph_create_filter(&bufOut, avfilter_get_by_name("abuffer"), "player", args, nullptr,
+                                                graph) >= 0 &&
+                   avfilter_graph_create_filter(&bufMic, avfilter_get_by_name("abuffer"), "mic", args, nullptr,
+                                                graph) >= 0 &&
+                   avfilter_graph_create_filter(&mix, avfilter_get_by_name("amix"), "amix", nullptr, nullptr, graph) >=
+                       0 &&
+                   avfilter_graph_create_filter(&sink, avfilter_get_by_name("abuffersink"), "sink", nullptr, nullptr,
+                                                graph) >= 0;
+    if (success)
+    {
+        const enum AVSampleFormat out_fmts[] = {AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_NONE};
+        const int64_t out_layouts[] = {AV_CH_LAYOUT_STEREO, -1};
+        const int out_srs[] = {MICRO_AUDIO_RATE, -1};
+        av_opt_set_int_list(sink, "sample_fmts", out_fmts, -1, AV_OPT_SEARCH_CHILDREN);
+        av_opt_set_int_list(sink, "channel_layouts", out_layouts, -1, AV_OPT_SEARCH_CHILDREN);
+        av_opt_set_int_list(sink, "sample_rates", out_srs, -1, AV_OPT_SEARCH_CHILDREN);
+        success = avfilter_link(bufOut, 0, mix, 0) >= 0 && avfilter_link(bufMic, 0, mix, 1) >= 0 &&
+                  avfilter_link(mix, 0, sink, 0) >= 0 && avfilter_graph_config(graph, nullptr) >= 0;
+    }
+    auto in = allocAudioFrame(MICRO_AUDIO_SAMPLES, MICRO_AUDIO_RATE);
+    auto out = av_frame_alloc();
+    if (!success || !in)
+        state.skip("failed to configure filter graph");
+    else
+    {
+        state.setItems(MICRO_AUDIO_SAMPLES, "samples");
+        int64_t pts = 0;
+        while (state.keepRunning())
+        {
+            in->pts = pts;
+            pts += MICRO_AUDIO_SAMPLES;
+            // buffer sources take a new reference each, input keeps its data
+            av_buffersrc_write_frame(bufOut, in);
+            av_buffersrc_write_frame(bufMic, in);
+            while (av_buffersink_get_frame(sink, out) >= 0)
+                av_frame_unref(out);
+        }
+    }
+    avfilter_graph_free(&graph);
+    av_frame_free(&in);
+    av_frame_free(&out);
+}
+
+/// Output position of discarding I/O
+struct NullOutput
+{
+    int64_t pos, size;
+};
+
+/// Discard written bytes
+static int nullWrite(void *opaque, uint8_t *, int bufSize)
+{
+    auto out = static_cast<NullOutput *>(opaque);
+    out->pos += bufSize;
+    out->size = (std::max)(out->size, out->pos);
+    return bufSize;
+}
+
+/// Seek within discarded bytes, for muxers that rewrite their header
+static int64_t nullSeek(void *opaque, int64_t offset, int whence)
+{
+    auto out = static_cast<NullOutput *>(opaque);
+    switch (whence & ~AVSEEK_FORCE)
+    {
+    case AVSEEK_SIZE:
+        return out->size;
+    case SEEK_SET:
+        out->pos = offset;
+        break;
+    case SEEK_CUR:
+        out->pos += offset;
+        break;
+    case SEEK_END:
+        out->pos = out->size + offset;
+        break;
+    default:
+        return -1;
+    }
+    return out->pos;
+}
+
+/// Rescale & write encoded video packets, as in MediaMuxer::muxPacket, without disk I/O
+static void benchMux(MicroState &state, const std::string &format, AVCodecID codecId, int fps)
+{
+    AVFormatContext *oc = nullptr;
+    avformat_alloc_output_context2(&oc, nullptr, format.c_str(), nullptr);
+    NullOutput nullOut{0, 0};
+    const int ioSize = 1 << 15;
+    auto ioBuf = static_cast<uint8_t *>(av_malloc(ioSize));
+    auto pb = avio_alloc_context(ioBuf, ioSize, 1, &nullOut, nullptr, nullWrite, nullSeek);
+    auto st = oc ? avformat_new_stream(oc, nullptr) : nullptr;
+    auto pkt = av_packet_alloc();
+    bool success = oc && pb && st && pkt;
+    if (success)
+    {
+        oc->pb = pb;
+        oc->flags |= AVFMT_FLAG_CUSTOM_IO;
+        st->codecpar->codec_type = AVMEDIA_TYPE_VIDEO;
+        st->codecpar->codec_id = codecId;
+        st->codecpar->width = 1920;
+        st->codecpar->height = 1080;
+        st->codecpar->format = AV_PIX_FMT_YUV420P;
+        st->time_base = {1, fps};
+        success = avformat_write_header(oc, nullptr) >= 0 && av_new_packet(pkt, 1 << 16) >= 0;
+    }
+    if (!success)
+        state.skip("failed to open " + format + " muxer");
+    else
+    {
+        std::memset(pkt->data, 0x5a, pkt->size);
+        // keyframes are larger than the frames between them
+        const int keySize = pkt->size, frameSize = pkt->size / 8;
+        state.setItems(1, "packets");
+        int64_t samples = 0;
+        while (state.keepRunning())
+        {
+            bool isKey = samples % MICRO_GOP_SIZE == 0;
+            pkt->size = isKey ? keySize : frameSize;
+            pkt->flags = isKey ? AV_PKT_FLAG_KEY : 0;
+            pkt->pts = pkt->dts = ++samples;
+            pkt->duration = 1;
+            pkt->stream_index = 0;
+            av_packet_rescale_ts(pkt, {1, fps}, st->time_base);
+            // muxer takes the packet, write a fresh reference each time
+            auto ref = av_packet_clone(pkt);
+            av_interleaved_write_frame(oc, ref);
+            av_packet_free(&ref);
+        }
+        av_write_trailer(oc);
+    }
+    av_packet_free(&pkt);
+    if (pb)
+        av_freep(&pb->buffer);
+    avio_context_free(&pb);
+    if (oc)
+        avformat_free_context(oc);
+}
+
+/// Hash encoder frame planes, candidate digests for detecting repeated frames
+static void benchHash(MicroState &state, const MicroSize &size, const std::string &algorithm)
+{
+    AVHashContext *hash = nullptr;
+    auto frame = allocVideoFrame(size.w, size.h, AV_PIX_FMT_YUV420P);
+    if (av_hash_alloc(&hash, algorithm.c_str()) < 0 || !frame)
+        state.skip("hash " + algorithm + " not available");
+    else
+    {
+        int planes[3];
+        for (int p = 0; p < 3; p++)
+            planes[p] = frame->linesize[p] * (p == 0 ? size.h : (size.h + 1) / 2);
+        state.setItems(int64_t(planes[0]) + planes[1] + planes[2], "B");
+        uint8_t digest[AV_HASH_MAX_SIZE];
+        while (state.keepRunning())
+        {
+            av_hash_init(hash);
+            for (int p = 0; p < 3; p++)
+                av_hash_update(hash, frame->data[p], planes[p]);
+            av_hash_final(hash, digest);
+        }
+    }
+    av_hash_freep(&hash);
+    av_frame_free(&frame);
+}
+
+/// Print usage
+static void usage(const char *argv0)
+{
+    std::cout << "usage: " << argv0 << " [--filter text] [--min-time S] [--repetitions N] [--json file|-] [--list]"
+              << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter, json;
+    bool list = false;
+    MicroRunner runner;
+    for (int i = 1; i < argc; i++)
+    {
+        bool hasValue = i + 1 < argc;
+        if (std::strcmp(argv[i], "--filter") == 0 && hasValue)
+            filter = argv[++i];
+        else if (std::strcmp(argv[i], "--min-time") == 0 && hasValue)
+            runner.setMinTime(std::atof(argv[++i]));
+        else if (std::strcmp(argv[i], "--repetitions") == 0 && hasValue)
+            runner.setRepetitions(std::atoi(argv[++i]));
+        else if (std::strcmp(argv[i], "--json") == 0 && hasValue)
+            json = argv[++i];
+        else if (std::strcmp(argv[i], "--list") == 0)
+            list = true;
+        else
+        {
+            usage(argv[0]);
+            return std::strcmp(argv[i], "--help") == 0 ? 0 : -1;
+        }
+    }
+    av_log_set_level(AV_LOG_ERROR);
+
+    // x11grab & gdigrab deliver bgr0, encoders take yuv420p, gif rgb8 and apng rgba
+    const std::vector<std::pair<std::string, AVPixelFormat>> scaleTargets = {
+        {"yuv420p", AV_PIX_FMT_YUV420P}, {"rgb8", AV_PIX_FMT_RGB8}, {"rgba", AV_PIX_FMT_RGBA}};
+    for (auto &size : MICRO_SIZES)
+    {
+        for (auto &target : scaleTargets)
+        {
+            auto dst = target.second;
+            runner.add("sws_scale/bgr0-" + target.first + "/" + size.name,
+                       [size, dst](MicroState &state) { benchScale(state, size, AV_PIX_FMT_BGR0, dst); });
+        }
+    }
+    // aac frames at capture rate, and opus-like frames after rate conversion
+    runner.add("swr_convert/s16-fltp/44100-44100/1024",
+               [](MicroState &state) { benchResample(state, MICRO_AUDIO_RATE, 1024); });
+    runner.add("swr_convert/s16-fltp/44100-48000/960", [](MicroState &state) { benchResample(state, 48000, 960); });
+    runner.add("amix/2x-s16-stereo/44100", [](MicroState &state) { benchMix(state); });
+    runner.add("mux/mp4/mpeg4/30", [](MicroState &state) { benchMux(state, "mp4", AV_CODEC_ID_MPEG4, 30); });
+    runner.add("mux/webm/vp8/30", [](MicroState &state) { benchMux(state, "webm", AV_CODEC_ID_VP8, 30); });
+    runner.add("mux/avi/mpeg4/30", [](MicroState &state) { benchMux(state, "avi", AV_CODEC_ID_MPEG4, 30); });
+    runner.add("mux/flv/flv1/30", [](MicroState &state) { benchMux(state, "flv", AV_CODEC_ID_FLV1, 30); });
+    for (auto &size : MICRO_SIZES)
+    {
+        for (auto algorithm : {"adler32", "CRC32", "murmur3", "MD5"})
+            runner.add(std::string("hash/") + algorithm + "/" + size.name,
+                       [size, algorithm](MicroState &state) { benchHash(state, size, algorithm); });
+    }
+
+    if (list)
+    {
+        runner.list(std::cout);
+        return 0;
+    }
+    auto results = runner.run(filter, std::cout);
+    if (json.empty())
+        return 0;
+    if (json == "-")
+    {
+        MicroRunner::writeJson(std::cout, results);
+        return 0;
+    }
+    std::ofstream f(json);
+    MicroRunner::writeJson(f, results);
+    if (!f.good())
+    {
+        display_message(NAME, "failed to write " + json, MESSAGE_ERROR);
+        return -1;
+    }
+    return 0;
+}
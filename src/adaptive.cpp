@@ -0,0 +1,152 @@
+#include "adaptive.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+using steadyclock = std::chrono::steady_clock;
+
+AdaptiveController::AdaptiveController() : _level(0), _fps(1), _encodeTime(0.0), _eased(false)
+{
+    reset(1, AdaptiveBounds());
+}
+
+void AdaptiveController::reset(int fps, const AdaptiveBounds &bounds)
+{
+    _fps = (std::max)(1, fps);
+    // each step keeps the ones before, from least to most visible: conversion, bit rate, size, frames
+    _ladder = {{SWS_BICUBIC, 100, 100, 1}};
+    if (bounds.enabled && bounds.fastScale)
+        _ladder.push_back({SWS_FAST_BILINEAR, 100, 100, 1});
+    if (bounds.enabled && bounds.lowBitRate)
+    {
+        int cut = ADAPTIVE_BITRATE_STEP;
+        for (int percent = 100 - cut; percent >= ADAPTIVE_MIN_BITRATE; percent -= cut)
+            _ladder.push_back({_ladder.back().scaleFlags, percent, 100, 1});
+    }
+    if (bounds.enabled && bounds.downscale)
+    {
+        int cut = ADAPTIVE_SCALE_STEP;
+        for (int percent = 100 - cut; percent >= ADAPTIVE_MIN_SCALE; percent -= cut)
+            _ladder.push_back({_ladder.back().scaleFlags, _ladder.back().bitRatePercent, percent, 1});
+    }
+    auto last = _ladder.back();
+    for (int divisor = 2; bounds.enabled && _fps / divisor >= (std::max)(1, bounds.minFps); divisor++)
+        _ladder.push_back({last.scaleFlags, last.bitRatePercent, last.scalePercent, divisor});
+    _level = 0;
+    _encodeTime = 0.0;
+    _lastStep = steadyclock::now();
+    _eased = false;
+    std::lock_guard<std::mutex> lock(_eventsLock);
+    _events.clear();
+}
+
+bool AdaptiveController::update(int queue, double encodeTime, double mediaTime)
+{
+    if (_ladder.size() < 2)
+        return false;
+    _encodeTime = _encodeTime > 0.0 ? _encodeTime + (encodeTime - _encodeTime) * ADAPTIVE_SMOOTHING : encodeTime;
+    auto now = steadyclock::now();
+    auto sinceStep = std::chrono::duration_cast<std::chrono::milliseconds>(now - _lastStep).count();
+    int level = _level;
+    char reason[128];
+    // behind: frames pile up or encoding takes most of the frame interval
+    bool behind = queue >= ADAPTIVE_QUEUE_HIGH || _encodeTime > budget(level) * ADAPTIVE_LOAD_HIGH / 100.0;
+    if (behind)
+    {
+        _eased = false;
+        if (level + 1 < levels() && sinceStep >= ADAPTIVE_STEP_INTERVAL)
+        {
+            std::snprintf(reason, sizeof(reason), "queue %d, encode %.1f ms of %.1f ms", queue, _encodeTime * 1e3,
+                          budget(level) * 1e3);
+            step(level + 1, mediaTime, reason);
+            return true;
+        }
+        return false;
+    }
+    // eased: queue empty and encoding would fit the next higher level with room to spare
+    bool eased = level > 0 && queue <= 1 && _encodeTime < budget(level - 1) * ADAPTIVE_LOAD_LOW / 100.0;
+    if (!eased)
+    {
+        _eased = false;
+        return false;
+    }
+    if (!_eased)
+    {
+        _eased = true;
+        _easedSince = now;
+    }
+    auto easedFor = std::chrono::duration_cast<std::chrono::milliseconds>(now - _easedSince).count();
+    if (easedFor < ADAPTIVE_EASE_TIME || sinceStep < ADAPTIVE_STEP_INTERVAL)
+        return false;
+    std::snprintf(reason, sizeof(reason), "queue %d, encode %.1f ms of %.1f ms", queue, _encodeTime * 1e3,
+                  budget(level - 1) * 1e3);
+    step(level - 1, mediaTime, reason);
+    return true;
+}
+
+AdaptiveLevel AdaptiveController::level()
+{
+    return _ladder[_level];
+}
+
+int AdaptiveController::levelIndex()
+{
+    return _level;
+}
+
+int AdaptiveController::levels()
+{
+    return static_cast<int>(_ladder.size());
+}
+
+std::string AdaptiveController::describe(int index)
+{
+    if (index < 0 || index >= levels())
+        return "unknown";
+    auto &level = _ladder[index];
+    std::string text = level.scaleFlags == SWS_BICUBIC ? "bicubic" : "fast bilinear";
+    if (level.bitRatePercent < 100)
+        text += " " + std::to_string(level.bitRatePercent) + "% bit rate";
+    if (level.scalePercent < 100)
+        text += " " + std::to_string(level.scalePercent) + "% size";
+    return text + " " + std::to_string(_fps / level.fpsDivisor) + " fps";
+}
+
+std::vector<AdaptiveEvent> AdaptiveController::events()
+{
+    std::lock_guard<std::mutex> lock(_eventsLock);
+    return _events;
+}
+
+void AdaptiveController::step(int to, double mediaTime, const std::string &reason)
+{
+    AdaptiveEvent event;
+    char stamp[32];
+    auto wall = std::chrono::system_clock::now();
+    auto now = std::chrono::system_clock::to_time_t(wall);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(wall.time_since_epoch()).count() % 1000;
+    std::strftime(stamp, sizeof(stamp), "%H:%M:%S", std::localtime(&now));
+    std::snprintf(stamp + std::strlen(stamp), sizeof(stamp) - std::strlen(stamp), ".%03d", static_cast<int>(ms));
+    event.time = stamp;
+    event.mediaTime = mediaTime;
+    event.from = _level;
+    event.to = to;
+    event.reason = reason;
+    char at[32];
+    std::snprintf(at, sizeof(at), " at %.3f s: ", mediaTime);
+    display_message(NAME, event.time + at + describe(event.from) + " -> " + describe(to) + " (" + reason + ")",
+                    MESSAGE_INFO);
+    _level = to;
+    _lastStep = steadyclock::now();
+    _eased = false;
+    std::lock_guard<std::mutex> lock(_eventsLock);
+    _events.push_back(event);
+}
+
+double AdaptiveController::budget(int index)
+{
+    return static_cast<double>(_ladder[index].fpsDivisor) / _fps;
+}
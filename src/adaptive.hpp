@@ -0,0 +1,156 @@
+#pragma once
+extern "C"
+{
+#include <libswscale/swscale.h>
+}
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/// Default lowest frame rate the controller steps down to
+#define ADAPTIVE_MIN_FPS 10
+
+/// Queued frames counted as falling behind
+#define ADAPTIVE_QUEUE_HIGH 6
+
+/// Encode time (percent of frame interval) counted as falling behind
+#define ADAPTIVE_LOAD_HIGH 90
+
+/// Encode time (percent of frame interval at next higher quality) counted as eased
+#define ADAPTIVE_LOAD_LOW 50
+
+/// Weight of newest frame in smoothed encode time
+#define ADAPTIVE_SMOOTHING 0.1
+
+/// Minimum time (milliseconds) between two steps
+#define ADAPTIVE_STEP_INTERVAL 1000
+
+/// Time (milliseconds) load must stay eased before a step up
+#define ADAPTIVE_EASE_TIME 5000
+
+/// Bit rate (percent of configured) taken off per encoder step, down to ADAPTIVE_MIN_BITRATE
+#define ADAPTIVE_BITRATE_STEP 25
+#define ADAPTIVE_MIN_BITRATE 50
+
+/// Picture size (percent of output size) taken off per downscale step, down to ADAPTIVE_MIN_SCALE
+#define ADAPTIVE_SCALE_STEP 25
+#define ADAPTIVE_MIN_SCALE 50
+
+/**
+ * @brief Adaptive Bounds
+ *
+ * This structure stores how far the controller may lower quality.
+ */
+struct AdaptiveBounds
+{
+    bool enabled;
+    bool fastScale;  // allow faster, blockier colour conversion
+    bool lowBitRate; // allow lower encoder bit rate, only encoders that reconfigure while running
+    bool downscale;  // allow a smaller picture, padded to the output size
+    int32_t minFps;
+
+    AdaptiveBounds() : enabled(false), fastScale(true), lowBitRate(true), downscale(true), minFps(ADAPTIVE_MIN_FPS)
+    {
+    }
+};
+
+/**
+ * @brief Adaptive Level
+ *
+ * This structure stores the encoder settings of one quality step.
+ */
+struct AdaptiveLevel
+{
+    int scaleFlags;     // SWS_* flags of colour conversion
+    int bitRatePercent; // of configured encoder bit rate
+    int scalePercent;   // of output width & height, the rest is padded
+    int fpsDivisor;     // every n-th frame slot is encoded
+};
+
+/**
+ * @brief Adaptive Event
+ *
+ * This structure stores one quality change.
+ */
+struct AdaptiveEvent
+{
+    std::string time; // local wall clock
+    double mediaTime; // seconds into recording
+    int from, to;     // level indices
+    std::string reason;
+};
+
+/**
+ * @brief Adaptive Controller
+ *
+ * This class steps video quality down while encoding falls behind capture and back up once load eases.
+ * Levels trade colour conversion quality first, then encoder bit rate, then picture size, then frame rate,
+ * so the output file never has to be reopened.
+ */
+class AdaptiveController
+{
+  public:
+    AdaptiveController();
+
+    /**
+     * @brief Reset Controller
+     *
+     * Meant to be called when capture opens, starts at full quality.
+     *
+     * @param fps Capture frame rate
+     * @param bounds Lowest allowed quality
+     */
+    void reset(int fps, const AdaptiveBounds &bounds);
+
+    /**
+     * @brief Update With Written Frame
+     *
+     * Meant to be called from the record thread after each encoded frame.
+     *
+     * @param queue Captured frames waiting for the encoder
+     * @param encodeTime Seconds spent converting & encoding the frame
+     * @param mediaTime Timestamp (seconds) of the frame
+     * @return true if level changed
+     * @return false otherwise
+     */
+    bool update(int queue, double encodeTime, double mediaTime);
+
+    /// Settings of current level
+    AdaptiveLevel level();
+
+    /// Index of current level, 0 is full quality, safe to call from any thread
+    int levelIndex();
+
+    /// Number of levels within bounds
+    int levels();
+
+    /// Short description of level, e.g. "bicubic 30 fps" or "fast bilinear 50% bit rate 75% size 30 fps"
+    std::string describe(int index);
+
+    /// Changes of current or last recording, safe to call from any thread
+    std::vector<AdaptiveEvent> events();
+
+    static inline const std::string NAME = "AdaptiveController";
+
+  private:
+    /// Move to level and log the change
+    void step(int to, double mediaTime, const std::string &reason);
+
+    /// Frame interval (seconds) at level
+    double budget(int index);
+
+    std::vector<AdaptiveLevel> _ladder;
+    std::atomic<int> _level;
+    int _fps;
+    double _encodeTime; // smoothed seconds per frame
+    std::chrono::steady_clock::time_point _lastStep, _easedSince;
+    bool _eased;
+    std::mutex _eventsLock;
+    std::vector<AdaptiveEvent> _events;
+};
@@ -17,7 +17,7 @@ extern "C"
 
 AudioCapture::AudioCapture()
     : _captureOut(false), _captureMic(false), _autoBitRate(true), _sampleRate(AUDIO_DEFAULT_SAMPLE_RATE),
-      _bitRate(AUDIO_DEFAULT_BITRATE)
+      _bitRate(AUDIO_DEFAULT_BITRATE), _stats(nullptr)
 {
 #if __linux__
     _pulse = std::make_unique<PulseAudioHelper>();
@@ -73,14 +73,19 @@ bool AudioCapture::closeCapture()
     return true;
 }
 
-bool AudioCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
+bool AudioCapture::writeFrame(const PacketCallback &onPacket, bool skip, bool flush)
 {
     if (!_captureMic && !_captureOut)
         return false;
+    // each stage records the time it took for this packet when the timers go out of scope
+    StageTimer readT(_stats, STATS_AUDIO_READ), decodeT(_stats, STATS_AUDIO_DECODE), mixT(_stats, STATS_AUDIO_MIX),
+        resampleT(_stats, STATS_AUDIO_RESAMPLE), encodeT(_stats, STATS_AUDIO_ENCODE);
+    readT.start();
     if (_captureOut && av_read_frame(_istOut->fmtCtx, _istOut->pkt) < 0)
         return false;
     if (_captureMic && av_read_frame(_istMic->fmtCtx, _istMic->pkt) < 0)
         return false;
+    readT.stop();
     if (skip)
         return true;
     int nb_samples = 0;
@@ -97,28 +102,25 @@ bool AudioCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
         while (loop)
         {
             loop = false;
-            if (decode(_istOut->decCtx, _istOut->frame, _istOut->pkt, packetSent1) &&
+            if (decode(_istOut->decCtx, _istOut->frame, _istOut->pkt, packetSent1, &decodeT) &&
                 (av_buffersrc_add_frame(_filter->bufOutCtx, _istOut->frame) >= 0))
                 loop = true;
-            if (decode(_istMic->decCtx, _istMic->frame, _istMic->pkt, packetSent2) &&
+            if (decode(_istMic->decCtx, _istMic->frame, _istMic->pkt, packetSent2, &decodeT) &&
                 (av_buffersrc_add_frame(_filter->bufMicCtx, _istMic->frame) >= 0))
                 loop = true;
             av_frame_make_writable(_ost->frame);
-            while (loop && (av_buffersink_get_frame(_filter->sinkCtx, _filter->frame) >= 0))
+            while (loop && mixFrame(&mixT))
             {
-                if ((nb_samples = swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples,
-                                              const_cast<const uint8_t **>(_filter->frame->data),
-                                              _filter->frame->nb_samples) > 0))
+                if ((nb_samples = resample(_filter->frame->data, _filter->frame->nb_samples, &resampleT)) > 0)
                 {
                     _ost->samples += nb_samples;
-                    writePacket(oc);
+                    writePacket(onPacket, &encodeT);
                     while (swr_get_delay(_ost->swrCtx, _ost->encCtx->sample_rate) > _ost->frame->nb_samples)
                     {
-                        if ((nb_samples = swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples, nullptr,
-                                                      0)) <= 0)
+                        if ((nb_samples = resample(nullptr, 0, &resampleT)) <= 0)
                             break;
                         _ost->samples += nb_samples;
-                        writePacket(oc);
+                        writePacket(onPacket, &encodeT);
                     }
                 }
                 av_frame_unref(_filter->frame);
@@ -133,22 +135,19 @@ bool AudioCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
             _istOut->pkt->data = nullptr;
         }
         bool packetSent = false;
-        while (decode(_istOut->decCtx, _istOut->frame, _istOut->pkt, packetSent))
+        while (decode(_istOut->decCtx, _istOut->frame, _istOut->pkt, packetSent, &decodeT))
         {
             av_frame_make_writable(_ost->frame);
-            if ((nb_samples =
-                     swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples,
-                                 const_cast<const uint8_t **>(_istOut->frame->data), _istOut->frame->nb_samples) > 0))
+            if ((nb_samples = resample(_istOut->frame->data, _istOut->frame->nb_samples, &resampleT)) > 0)
             {
                 _ost->samples += nb_samples;
-                writePacket(oc);
+                writePacket(onPacket, &encodeT);
                 while (swr_get_delay(_ost->swrCtx, _ost->encCtx->sample_rate) > _ost->frame->nb_samples)
                 {
-                    if ((nb_samples =
-                             swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples, nullptr, 0)) <= 0)
+                    if ((nb_samples = resample(nullptr, 0, &resampleT)) <= 0)
                         break;
                     _ost->samples += nb_samples;
-                    writePacket(oc);
+                    writePacket(onPacket, &encodeT);
                 }
             }
         }
@@ -162,22 +161,19 @@ bool AudioCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
             _istMic->pkt->data = nullptr;
         }
         bool packetSent = false;
-        while (decode(_istMic->decCtx, _istMic->frame, _istMic->pkt, packetSent))
+        while (decode(_istMic->decCtx, _istMic->frame, _istMic->pkt, packetSent, &decodeT))
         {
             av_frame_make_writable(_ost->frame);
-            if ((nb_samples =
-                     swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples,
-                                 const_cast<const uint8_t **>(_istMic->frame->data), _istMic->frame->nb_samples) > 0))
+            if ((nb_samples = resample(_istMic->frame->data, _istMic->frame->nb_samples, &resampleT)) > 0)
             {
                 _ost->samples += nb_samples;
-                writePacket(oc);
+                writePacket(onPacket, &encodeT);
                 while (swr_get_delay(_ost->swrCtx, _ost->encCtx->sample_rate) > _ost->frame->nb_samples)
                 {
-                    if ((nb_samples =
-                             swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples, nullptr, 0)) <= 0)
+                    if ((nb_samples = resample(nullptr, 0, &resampleT)) <= 0)
                         break;
                     _ost->samples += nb_samples;
-                    writePacket(oc);
+                    writePacket(onPacket, &encodeT);
                 }
             }
         }
@@ -186,6 +182,22 @@ bool AudioCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
     return true;
 }
 
+void AudioCapture::setSource(const SourceConfig &config)
+{
+    _source = config;
+    // a file or generator is captured on its own, without mic
+    if (_source.type != SOURCE_DEVICE)
+    {
+        _captureOut = true;
+        _captureMic = false;
+    }
+}
+
+void AudioCapture::setStats(PipelineStats *stats)
+{
+    _stats = stats;
+}
+
 const OutputStream *AudioCapture::getStream()
 {
     return _ost.get();
@@ -193,31 +205,14 @@ const OutputStream *AudioCapture::getStream()
 
 bool AudioCapture::openDevice(bool isMic)
 {
-    std::string captureSource = "";
-    std::string captureURL = "";
-    // prepare capture source
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
-    // use dshow on windows
-    // TODO: fill for windows
-#elif __linux__
-    // by default use pulse audio
-    captureSource = "pulse";
-    if (isMic)
-        captureURL = std::to_string(_pulse->micIdx);
-    else
-        captureURL = std::to_string(_pulse->outIdx);
-#else
-    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
-    return false;
+    std::string device;
+#if __linux__
+    device = std::to_string(isMic ? _pulse->micIdx : _pulse->outIdx);
 #endif
-    auto formatIn = av_find_input_format(captureSource.c_str());
+    // mic is always a device, other sources replace desktop audio
+    auto source = InputSource::createAudio(isMic ? SourceConfig() : _source, device);
     auto ist = isMic ? _istMic.get() : _istOut.get();
-    if (0 != avformat_open_input(&ist->fmtCtx, captureURL.c_str(), formatIn, nullptr))
-    {
-        display_message(NAME, "failed to open capture source " + captureSource, MESSAGE_WARN);
-        return false;
-    }
-    return true;
+    return source->open(&ist->fmtCtx);
 }
 
 bool AudioCapture::configIStream(InputStream *ist)
@@ -419,9 +414,9 @@ bool AudioCapture::configFilter()
     return true;
 }
 
-bool AudioCapture::configOStream(AVFormatContext *oc)
+bool AudioCapture::openEncoder(OutputStream *ost, AVFormatContext *oc, int &sampleRate, int64_t bitRate)
 {
-    _ost->samples = 0;
+    ost->samples = 0;
     // allocate parameters
     AVCodecParameters *param = avcodec_parameters_alloc();
     {
@@ -430,11 +425,9 @@ bool AudioCapture::configOStream(AVFormatContext *oc)
             display_message(NAME, "failed to allocate codec params", MESSAGE_WARN);
             return false;
         }
-        if (_autoBitRate)
-            _bitRate = _sampleRate * 16 * AUDIO_OUTPUT_CHANNELS / 10;
         if (oc->audio_codec_id != AV_CODEC_ID_MP2)
-            param->bit_rate = _bitRate;
-        param->sample_rate = _sampleRate;
+            param->bit_rate = bitRate;
+        param->sample_rate = sampleRate;
         param->channels = AUDIO_OUTPUT_CHANNELS;
         param->channel_layout = av_get_default_channel_layout(AUDIO_OUTPUT_CHANNELS);
         param->codec_id = oc->audio_codec_id;
@@ -449,8 +442,8 @@ bool AudioCapture::configOStream(AVFormatContext *oc)
             display_message(NAME, "failed to find encoder for " + codecName, MESSAGE_WARN);
             return false;
         }
-        _ost->encCtx = avcodec_alloc_context3(codecOut);
-        if (!_ost->encCtx)
+        ost->encCtx = avcodec_alloc_context3(codecOut);
+        if (!ost->encCtx)
         {
             display_message(NAME, "failed to allocate encoder for " + codecName, MESSAGE_WARN);
             return false;
@@ -458,64 +451,68 @@ bool AudioCapture::configOStream(AVFormatContext *oc)
     }
     // open codec
     {
-        if (avcodec_parameters_to_context(_ost->encCtx, param) < 0)
+        if (avcodec_parameters_to_context(ost->encCtx, param) < 0)
         {
             display_message(NAME, "failed to copy encoder params for " + codecName, MESSAGE_WARN);
             return false;
         }
-        switch (_ost->encCtx->codec_id)
+        switch (ost->encCtx->codec_id)
         {
         case AV_CODEC_ID_MP2:
         case AV_CODEC_ID_OPUS:
-            _ost->encCtx->sample_fmt = AV_SAMPLE_FMT_S16;
+        case AV_CODEC_ID_PCM_S16LE:
+            ost->encCtx->sample_fmt = AV_SAMPLE_FMT_S16;
             break;
         default:
-            _ost->encCtx->sample_fmt = AV_SAMPLE_FMT_FLTP;
+            ost->encCtx->sample_fmt = AV_SAMPLE_FMT_FLTP;
             break;
         }
-        if (avcodec_open2(_ost->encCtx, codecOut, nullptr) < 0)
+        // codec headers must be in extradata so that every output file gets them
+        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+            ost->encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (avcodec_open2(ost->encCtx, codecOut, nullptr) < 0)
         {
             display_message(NAME, "failed to open encoder for " + codecName, MESSAGE_WARN);
             return false;
         }
-        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-            _ost->encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
         if (codecOut->supported_samplerates)
         {
-            auto &sr = _ost->encCtx->sample_rate;
+            auto &sr = ost->encCtx->sample_rate;
             sr = codecOut->supported_samplerates[0];
             for (int i = 1; codecOut->supported_samplerates[i]; i++)
             {
                 auto currSR = codecOut->supported_samplerates[i];
-                if ((std::abs)(currSR - _sampleRate) < (std::abs)(sr - _sampleRate))
+                if ((std::abs)(currSR - sampleRate) < (std::abs)(sr - sampleRate))
                     sr = currSR;
             }
-            if (sr != _sampleRate)
+            if (sr != sampleRate)
             {
-                _sampleRate = sr;
-                display_message(NAME, "sample rate reset to " + std::to_string(_sampleRate), MESSAGE_INFO);
+                sampleRate = sr;
+                display_message(NAME, "sample rate reset to " + std::to_string(sampleRate), MESSAGE_INFO);
             }
         }
     }
     // prepare stream
     {
-        _ost->st = avformat_new_stream(oc, codecOut);
-        if (!_ost->st)
+        ost->st = avformat_new_stream(oc, codecOut);
+        if (!ost->st)
         {
             display_message(NAME, "failed to open encoder stream", MESSAGE_WARN);
             return false;
         }
-        if (avcodec_parameters_copy(_ost->st->codecpar, param) < 0)
+        if (avcodec_parameters_from_context(ost->st->codecpar, ost->encCtx) < 0)
         {
             display_message(NAME, "failed to copy encoder stream params", MESSAGE_WARN);
             return false;
         }
-        _ost->st->id = oc->nb_streams - 1;
+        // muxer expects packets in encoder time base
+        ost->st->time_base = ost->encCtx->time_base;
+        ost->st->id = oc->nb_streams - 1;
     }
     // prepare packet
     {
-        _ost->pkt = av_packet_alloc();
-        if (!_ost->pkt)
+        ost->pkt = av_packet_alloc();
+        if (!ost->pkt)
         {
             display_message(NAME, "failed to allocate encoder packet", MESSAGE_WARN);
             return false;
@@ -523,26 +520,36 @@ bool AudioCapture::configOStream(AVFormatContext *oc)
     }
     // prepare frame
     {
-        _ost->frame = av_frame_alloc();
-        if (!_ost->frame)
+        ost->frame = av_frame_alloc();
+        if (!ost->frame)
         {
             display_message(NAME, "failed to allocate encoder frame", MESSAGE_WARN);
             return false;
         }
-        _ost->frame->channels = _ost->encCtx->channels;
-        _ost->frame->channel_layout = _ost->encCtx->channel_layout;
-        _ost->frame->sample_rate = _ost->encCtx->sample_rate;
-        _ost->frame->format = _ost->encCtx->sample_fmt;
-        if ((_ost->encCtx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
-            _ost->frame->nb_samples = 10000;
+        ost->frame->channels = ost->encCtx->channels;
+        ost->frame->channel_layout = ost->encCtx->channel_layout;
+        ost->frame->sample_rate = ost->encCtx->sample_rate;
+        ost->frame->format = ost->encCtx->sample_fmt;
+        if ((ost->encCtx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE))
+            ost->frame->nb_samples = 10000;
         else
-            _ost->frame->nb_samples = _ost->encCtx->frame_size;
-        if (av_frame_get_buffer(_ost->frame, 0) < 0)
+            ost->frame->nb_samples = ost->encCtx->frame_size;
+        if (av_frame_get_buffer(ost->frame, 0) < 0)
         {
             display_message(NAME, "failed to allocate encoder frame buffer", MESSAGE_WARN);
             return false;
         }
     }
+    avcodec_parameters_free(&param);
+    return true;
+}
+
+bool AudioCapture::configOStream(AVFormatContext *oc)
+{
+    if (_autoBitRate)
+        _bitRate = _sampleRate * 16 * AUDIO_OUTPUT_CHANNELS / 10;
+    if (!openEncoder(_ost.get(), oc, _sampleRate, _bitRate))
+        return false;
     // allocate resample context
     {
         _ost->swrCtx = swr_alloc();
@@ -575,12 +582,13 @@ bool AudioCapture::configOStream(AVFormatContext *oc)
             return false;
         }
     }
-    avcodec_parameters_free(&param);
     return true;
 }
 
-bool AudioCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent)
+bool AudioCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent,
+                          StageTimer *timer)
 {
+    StageScope scope(timer);
     int ret;
     char buf[512];
     if (!packetSent && (ret = avcodec_send_packet(codecCtx, pkt)) < 0)
@@ -593,8 +601,10 @@ bool AudioCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pk
     return avcodec_receive_frame(codecCtx, frame) >= 0;
 }
 
-bool AudioCapture::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent)
+bool AudioCapture::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent,
+                          StageTimer *timer)
 {
+    StageScope scope(timer);
     int ret;
     char buf[512];
     if (!frameSent && (ret = avcodec_send_frame(codecCtx, frame) < 0))
@@ -607,16 +617,27 @@ bool AudioCapture::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pk
     return avcodec_receive_packet(codecCtx, pkt) >= 0;
 }
 
-void AudioCapture::writePacket(AVFormatContext *oc)
+bool AudioCapture::mixFrame(StageTimer *timer)
+{
+    StageScope scope(timer);
+    return av_buffersink_get_frame(_filter->sinkCtx, _filter->frame) >= 0;
+}
+
+int AudioCapture::resample(uint8_t **data, int count, StageTimer *timer)
+{
+    StageScope scope(timer);
+    return swr_convert(_ost->swrCtx, _ost->frame->data, _ost->frame->nb_samples, const_cast<const uint8_t **>(data),
+                       count);
+}
+
+void AudioCapture::writePacket(const PacketCallback &onPacket, StageTimer *timer)
 {
     bool frameSent = false;
     _ost->frame->pts = av_rescale_q(_ost->samples, {1, _ost->encCtx->sample_rate}, _ost->encCtx->time_base);
-    while (encode(_ost->encCtx, _ost->frame, _ost->pkt, frameSent))
+    while (encode(_ost->encCtx, _ost->frame, _ost->pkt, frameSent, timer))
     {
-        av_packet_rescale_ts(_ost->pkt, _ost->encCtx->time_base, _ost->st->time_base);
         _ost->pkt->stream_index = _ost->st->index;
-        if (av_interleaved_write_frame(oc, _ost->pkt) != 0)
-            display_message(NAME, "failed to write frame", MESSAGE_WARN);
+        onPacket(_ost->pkt);
         av_packet_unref(_ost->pkt);
     }
 }
@@ -11,6 +11,8 @@ extern "C"
 #if __linux__
 #include "pulsehelper.hpp"
 #endif
+#include "source.hpp"
+#include "stats.hpp"
 #include "streams.hpp"
 
 #include <array>
@@ -66,13 +68,25 @@ class AudioCapture
      *
      * Meant to be called from MediaHandler.
      *
-     * @param oc Output format context
+     * @param onPacket Callback receiving encoded packets
      * @param skip Whether to skip writing current frame
      * @param flush Whether to flush output with empty packets
      * @return true if success
      * @return false otherwise
      */
-    bool writeFrame(AVFormatContext *oc, bool skip, bool flush);
+    bool writeFrame(const PacketCallback &onPacket, bool skip, bool flush);
+
+    /**
+     * @brief Set Input Source
+     *
+     * Replaces desktop audio, takes effect on next capture.
+     *
+     * @param config Source configs
+     */
+    void setSource(const SourceConfig &config);
+
+    /// Set stage timers receiver, nullptr disables timing
+    void setStats(PipelineStats *stats);
 
     /**
      * @brief Get the Output Stream
@@ -88,10 +102,24 @@ class AudioCapture
      */
     void UI();
 
-    const std::string NAME = "AudioCapture";
+    /**
+     * @brief Open Audio Encoder
+     *
+     * Adds encoder stream to format context, also used for offline transcoding.
+     *
+     * @param ost Output stream to configure
+     * @param oc Output format context, its audio codec is used
+     * @param sampleRate Requested sample rate, set to closest supported one
+     * @param bitRate Bit rate
+     * @return true if success
+     * @return false otherwise
+     */
+    static bool openEncoder(OutputStream *ost, AVFormatContext *oc, int &sampleRate, int64_t bitRate);
+
+    static inline const std::string NAME = "AudioCapture";
 
   private:
-    /// Open audio capture device
+    /// Open audio input source
     bool openDevice(bool isMic);
 
     /// Configure input stream
@@ -103,14 +131,22 @@ class AudioCapture
     /// Configure output stream
     bool configOStream(AVFormatContext *oc);
 
-    /// Decode frame from input stream packet
-    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent);
+    /// Decode frame from input stream packet, time spent is added to timer if given
+    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent,
+                StageTimer *timer = nullptr);
+
+    /// Encode frame to output stream packet, time spent is added to timer if given
+    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent,
+                StageTimer *timer = nullptr);
+
+    /// Pull mixed frame from filter graph
+    bool mixFrame(StageTimer *timer);
 
-    /// Encode frame to output stream packet
-    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent);
+    /// Convert samples into encoder frame, nullptr input drains resampler
+    int resample(uint8_t **data, int count, StageTimer *timer);
 
     /// encode and write packet to output stream
-    void writePacket(AVFormatContext *oc);
+    void writePacket(const PacketCallback &onPacket, StageTimer *timer = nullptr);
 
     std::unique_ptr<InputStream> _istOut;
     std::unique_ptr<InputStream> _istMic;
@@ -118,7 +154,9 @@ class AudioCapture
     std::unique_ptr<OutputStream> _ost;
 
     bool _captureOut, _captureMic, _autoBitRate;
+    SourceConfig _source;
     int _sampleRate, _bitRate;
+    PipelineStats *_stats;
 
 #if __linux__
     std::unique_ptr<PulseAudioHelper> _pulse;
@@ -0,0 +1,401 @@
+#include "calibration.hpp"
+#include "streams.hpp"
+#include "utils.hpp"
+#include "videocapture.hpp"
+
+extern "C"
+{
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+namespace fs = std::filesystem;
+
+using steadyclock = std::chrono::steady_clock;
+
+EncoderCalibration::EncoderCalibration()
+    : _active(false), _running(false), _cancel(false), _progress(0.0f), _codecId(AV_CODEC_ID_NONE),
+      _pendingCodec(AV_CODEC_ID_NONE), _width(0), _height(0), _pendingWidth(0), _pendingHeight(0)
+{
+}
+
+EncoderCalibration::~EncoderCalibration()
+{
+    cancel();
+}
+
+void EncoderCalibration::request(AVCodecID codecId, int width, int height)
+{
+    // raw outputs have nothing to calibrate
+    if (codecId == AV_CODEC_ID_NONE || codecId == AV_CODEC_ID_RAWVIDEO || codecId == AV_CODEC_ID_WRAPPED_AVFRAME ||
+        width < 2 || height < 2)
+        return;
+    std::lock_guard<std::mutex> lock(_targetLock);
+    if (codecId != _pendingCodec || width != _pendingWidth || height != _pendingHeight)
+    {
+        _pendingCodec = codecId;
+        _pendingWidth = width;
+        _pendingHeight = height;
+        _pendingSince = steadyclock::now();
+    }
+    // a running thread picks up the new target once it settled
+    if (_active || (codecId == _codecId && !isSignificant(_width, _height, width, height)))
+        return;
+    if (_t.joinable())
+        _t.join();
+    _active = true;
+    _cancel = false;
+    _t = std::thread([this] { calibrateInternal(); });
+}
+
+bool EncoderCalibration::running()
+{
+    return _running;
+}
+
+float EncoderCalibration::progress()
+{
+    return _progress;
+}
+
+std::vector<CalibrationResult> EncoderCalibration::results()
+{
+    std::lock_guard<std::mutex> lock(_resultsLock);
+    return _results;
+}
+
+int EncoderCalibration::select(int fps, bool &sustained)
+{
+    std::lock_guard<std::mutex> lock(_resultsLock);
+    sustained = false;
+    if (_results.empty())
+        return -1;
+    // slower presets give better quality at the same bit rate, take the slowest that keeps up
+    int best = _results.front().preset;
+    for (auto &result : _results)
+    {
+        if (result.fps * 100.0 >= fps * CALIBRATION_HEADROOM && (!sustained || result.preset > best))
+        {
+            best = result.preset;
+            sustained = true;
+        }
+    }
+    return best;
+}
+
+void EncoderCalibration::cancel()
+{
+    _cancel = true;
+    if (_t.joinable())
+        _t.join();
+}
+
+void EncoderCalibration::calibrateInternal()
+{
+    while (!_cancel)
+    {
+        AVCodecID codecId;
+        int width, height;
+        {
+            // wait for size to settle while the window is being resized
+            std::unique_lock<std::mutex> lock(_targetLock);
+            auto settled = _pendingSince + std::chrono::milliseconds(CALIBRATION_SETTLE);
+            if (steadyclock::now() < settled)
+            {
+                lock.unlock();
+                std::this_thread::sleep_for(std::chrono::milliseconds(CALIBRATION_POLL));
+                continue;
+            }
+            codecId = _pendingCodec;
+            width = _pendingWidth;
+            height = _pendingHeight;
+            if (codecId == _codecId && !isSignificant(_width, _height, width, height))
+            {
+                _active = false;
+                return;
+            }
+        }
+        auto codec = VideoCapture::findEncoder(codecId);
+        if (codec && codecId != _codecId)
+        {
+            // presets of another encoder do not apply
+            std::lock_guard<std::mutex> lock(_resultsLock);
+            _results.clear();
+        }
+        if (codec && !loadCache(codec->name, width, height))
+            measureAll(codec, width, height);
+        // a failed run is not retried until the target changes, a cancelled one is
+        std::lock_guard<std::mutex> lock(_targetLock);
+        if (!_cancel)
+        {
+            _codecId = codecId;
+            _width = width;
+            _height = height;
+        }
+    }
+    std::lock_guard<std::mutex> lock(_targetLock);
+    _active = false;
+}
+
+void EncoderCalibration::measureAll(const AVCodec *codec, int width, int height)
+{
+    auto size = std::to_string(width) + "x" + std::to_string(height);
+    display_message(NAME, "calibrating " + std::string(codec->name) + " at " + size, MESSAGE_INFO);
+    _running = true;
+    _progress = 0.0f;
+    int presets = VideoCapture::presetCount(codec);
+    int count = (std::max)(1, presets);
+    std::vector<AVFrame *> frames;
+    std::vector<CalibrationResult> results;
+    for (int i = 0; i < count && !_cancel; i++)
+    {
+        int preset = presets > 0 ? i : -1;
+        double fps = measure(codec->id, width, height, preset, frames);
+        _progress = static_cast<float>(i + 1) / count;
+        if (fps <= 0.0)
+            continue;
+        results.push_back({preset, fps});
+        // later presets are only slower
+        if (fps < 1.0)
+            break;
+    }
+    for (auto frame : frames)
+        av_frame_free(&frame);
+    _running = false;
+    // a cancelled run keeps the previous results
+    if (_cancel || results.empty())
+        return;
+    saveCache(codec->name, width, height, results);
+    std::string summary;
+    for (auto &result : results)
+        summary += (summary.empty() ? "" : ", ") + VideoCapture::presetName(codec, result.preset) + " " +
+                   std::to_string(static_cast<int>(result.fps)) + " fps";
+    display_message(NAME, std::string(codec->name) + " at " + size + ": " + summary, MESSAGE_INFO);
+    std::lock_guard<std::mutex> lock(_resultsLock);
+    _results = results;
+}
+
+double EncoderCalibration::measure(AVCodecID codecId, int width, int height, int preset,
+                                   std::vector<AVFrame *> &frames)
+{
+    // encoder needs a format context for its stream, nothing is written
+    AVFormatContext *oc = nullptr;
+    if (avformat_alloc_output_context2(&oc, nullptr, "null", nullptr) < 0)
+    {
+        display_message(NAME, "failed to allocate format", MESSAGE_WARN);
+        return 0.0;
+    }
+    oc->video_codec_id = codecId;
+    double fps = 0.0;
+    {
+        OutputStream ost;
+        width &= ~1;
+        height &= ~1;
+        bool success =
+            VideoCapture::openEncoder(&ost, oc, width, height, CALIBRATION_FPS,
+                                      int64_t(width) * height * CALIBRATION_FPS, AV_PIX_FMT_YUV420P, 0, preset) &&
+            (!frames.empty() || makeFrames(ost.encCtx, frames));
+        int64_t sent = 0;
+        auto startT = steadyclock::now();
+        auto elapsed = [&startT] {
+            return std::chrono::duration_cast<std::chrono::milliseconds>(steadyclock::now() - startT).count();
+        };
+        while (success && !_cancel && (elapsed() < CALIBRATION_TIME || sent < CALIBRATION_FRAMES))
+        {
+            auto frame = frames[sent % frames.size()];
+            frame->pts = sent++;
+            success = avcodec_send_frame(ost.encCtx, frame) >= 0;
+            while (avcodec_receive_packet(ost.encCtx, ost.pkt) >= 0)
+                av_packet_unref(ost.pkt);
+        }
+        // frames held in lookahead are part of the cost
+        if (success)
+        {
+            avcodec_send_frame(ost.encCtx, nullptr);
+            while (avcodec_receive_packet(ost.encCtx, ost.pkt) >= 0)
+                av_packet_unref(ost.pkt);
+            auto seconds = std::chrono::duration<double>(steadyclock::now() - startT).count();
+            fps = _cancel || seconds <= 0.0 ? 0.0 : sent / seconds;
+        }
+    }
+    avformat_free_context(oc);
+    return fps;
+}
+
+bool EncoderCalibration::makeFrames(const AVCodecContext *encCtx, std::vector<AVFrame *> &frames)
+{
+    int width = encCtx->width, height = encCtx->height;
+    auto swsCtx = sws_getContext(width, height, AV_PIX_FMT_BGR0, width, height, encCtx->pix_fmt, SWS_BICUBIC, nullptr,
+                                 nullptr, nullptr);
+    if (!swsCtx)
+    {
+        display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
+        return false;
+    }
+    std::vector<uint8_t> bgr(size_t(width) * height * 4);
+    const uint8_t *srcData[4] = {bgr.data(), nullptr, nullptr, nullptr};
+    const int srcLinesize[4] = {width * 4, 0, 0, 0};
+    bool success = true;
+    for (int i = 0; i < CALIBRATION_FRAMES && success; i++)
+    {
+        // desktop, a window with scrolling text-like rows and a moving cursor block
+        int wx0 = width / 10, wx1 = width - width / 10, wy0 = height / 10, wy1 = height - height / 10;
+        int cursorX = wx0 + (i * width / 64) % (wx1 - wx0), cursorY = height / 2;
+        for (int y = 0; y < height; y++)
+        {
+            auto row = bgr.data() + size_t(y) * width * 4;
+            int textRow = (y - wy0 + i * 2) / 12, rowY = (y - wy0 + i * 2) % 12;
+            for (int x = 0; x < width; x++)
+            {
+                uint8_t value = 0x38;
+                if (x >= wx0 && x < wx1 && y >= wy0 && y < wy1)
+                {
+                    // glyph cells of 8x12 pixels, about half of them inked
+                    unsigned cell = static_cast<unsigned>(textRow * 977 + (x - wx0) / 8) * 2654435761u;
+                    bool inked = rowY >= 2 && rowY < 10 && (cell >> 28) < 8 && ((cell >> (x % 8)) & 1);
+                    value = inked ? 0x20 : 0xf0;
+                }
+                if (x >= cursorX && x < cursorX + width / 16 && y >= cursorY && y < cursorY + height / 16)
+                    value = static_cast<uint8_t>(x + y + i * 8);
+                row[x * 4 + 0] = value;
+                row[x * 4 + 1] = value;
+                row[x * 4 + 2] = static_cast<uint8_t>(value + (value < 0x80 ? 0x10 : 0));
+                row[x * 4 + 3] = 0xff;
+            }
+        }
+        auto frame = av_frame_alloc();
+        success = frame != nullptr;
+        if (success)
+        {
+            frame->width = width;
+            frame->height = height;
+            frame->format = encCtx->pix_fmt;
+            success = av_frame_get_buffer(frame, 0) >= 0;
+            frames.push_back(frame);
+        }
+        if (success)
+            sws_scale(swsCtx, srcData, srcLinesize, 0, height, frame->data, frame->linesize);
+        else
+            display_message(NAME, "failed to allocate frame", MESSAGE_WARN);
+    }
+    sws_freeContext(swsCtx);
+    return success;
+}
+
+bool EncoderCalibration::loadCache(const std::string &encoder, int width, int height)
+{
+    std::ifstream f(cachePath());
+    if (!f.is_open())
+        return false;
+    auto machine = machineId();
+    // line: machine \t encoder \t width \t height \t preset \t fps
+    std::vector<std::pair<std::array<int, 2>, CalibrationResult>> entries;
+    std::string line;
+    while (std::getline(f, line))
+    {
+        std::istringstream fields(line);
+        std::string lineMachine, lineEncoder;
+        std::array<int, 2> size;
+        CalibrationResult result;
+        if (std::getline(fields, lineMachine, '\t') && std::getline(fields, lineEncoder, '\t') &&
+            fields >> size[0] >> size[1] >> result.preset >> result.fps && lineMachine == machine &&
+            lineEncoder == encoder)
+            entries.push_back({size, result});
+    }
+    // closest cached area
+    std::array<int, 2> best = {0, 0};
+    for (auto &entry : entries)
+    {
+        auto &size = entry.first;
+        auto diff = std::abs(int64_t(size[0]) * size[1] - int64_t(width) * height);
+        if (!isSignificant(size[0], size[1], width, height) &&
+            (best[0] == 0 || diff < std::abs(int64_t(best[0]) * best[1] - int64_t(width) * height)))
+            best = size;
+    }
+    if (best[0] == 0)
+        return false;
+    std::vector<CalibrationResult> results;
+    for (auto &entry : entries)
+        if (entry.first == best)
+            results.push_back(entry.second);
+    std::sort(results.begin(), results.end(), [](auto &a, auto &b) { return a.preset < b.preset; });
+    std::lock_guard<std::mutex> lock(_resultsLock);
+    _results = results;
+    return true;
+}
+
+void EncoderCalibration::saveCache(const std::string &encoder, int width, int height,
+                                   const std::vector<CalibrationResult> &results)
+{
+    auto path = cachePath();
+    auto machine = machineId();
+    auto key = machine + "\t" + encoder + "\t" + std::to_string(width) + "\t" + std::to_string(height) + "\t";
+    // keep other entries
+    std::vector<std::string> lines;
+    {
+        std::ifstream f(path);
+        std::string line;
+        while (std::getline(f, line))
+            if (line.compare(0, key.size(), key) != 0)
+                lines.push_back(line);
+    }
+    for (auto &result : results)
+        lines.push_back(key + std::to_string(result.preset) + "\t" + std::to_string(result.fps));
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    std::ofstream f(path, std::ios::trunc);
+    if (!f.is_open())
+    {
+        display_message(NAME, "failed to write " + path, MESSAGE_WARN);
+        return;
+    }
+    for (auto &line : lines)
+        f << line << "\n";
+}
+
+std::string EncoderCalibration::machineId()
+{
+    std::string cpu;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    auto identifier = std::getenv("PROCESSOR_IDENTIFIER");
+    cpu = identifier ? identifier : "";
+#else
+    std::ifstream f("/proc/cpuinfo");
+    std::string line;
+    while (cpu.empty() && std::getline(f, line))
+    {
+        if (line.compare(0, 10, "model name") == 0 && line.find(':') != std::string::npos)
+            cpu = line.substr(line.find(':') + 2);
+    }
+#endif
+    auto id = (cpu.empty() ? "unknown cpu" : cpu) + " x" + std::to_string(std::thread::hardware_concurrency()) +
+              " ffmpeg " + av_version_info();
+    std::replace(id.begin(), id.end(), '\t', ' ');
+    return id;
+}
+
+std::string EncoderCalibration::cachePath()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    auto base = std::getenv("LOCALAPPDATA");
+    auto dir = base ? fs::path(base) : fs::current_path();
+#else
+    auto xdg = std::getenv("XDG_CACHE_HOME");
+    auto home = std::getenv("HOME");
+    auto dir = xdg ? fs::path(xdg) : (home ? fs::path(home) / ".cache" : fs::current_path());
+#endif
+    return (dir / "record" / CALIBRATION_CACHE).string();
+}
+
+bool EncoderCalibration::isSignificant(int width0, int height0, int width1, int height1)
+{
+    auto area0 = int64_t(width0) * height0, area1 = int64_t(width1) * height1;
+    return std::abs(area1 - area0) * 100 > (std::max)(area0, int64_t(1)) * CALIBRATION_SIZE_CHANGE;
+}
@@ -0,0 +1,139 @@
+#pragma once
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+}
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** @file */
+
+/// Time (milliseconds) encoding is measured per preset
+#define CALIBRATION_TIME 500
+
+/// Distinct synthetic frames, encoded in a loop
+#define CALIBRATION_FRAMES 30
+
+/// Frame rate the encoder is opened with, affects rate control only
+#define CALIBRATION_FPS 30
+
+/// Encode speed (percent of target FPS) a preset must reach, leaves room for grab, conversion & muxing
+#define CALIBRATION_HEADROOM 150
+
+/// Capture area change (percent) after which results are measured again
+#define CALIBRATION_SIZE_CHANGE 25
+
+/// Time (milliseconds) a new capture size must stay unchanged before calibrating
+#define CALIBRATION_SETTLE 1000
+
+/// Interval (milliseconds) the background thread checks whether a new target settled
+#define CALIBRATION_POLL 100
+
+/// Cache file name, under the user cache directory
+#define CALIBRATION_CACHE "calibration.txt"
+
+/**
+ * @brief Calibration Result
+ *
+ * This structure stores the measured encode speed of one preset.
+ */
+struct CalibrationResult
+{
+    int preset; // -1 for encoders without presets
+    double fps; // frames encoded per second
+};
+
+/**
+ * @brief Encoder Calibration
+ *
+ * This class measures encode speed per preset on synthetic screen-like frames in background,
+ * and caches results per machine, encoder and capture size.
+ */
+class EncoderCalibration
+{
+  public:
+    EncoderCalibration();
+    ~EncoderCalibration();
+
+    /**
+     * @brief Request Results
+     *
+     * Meant to be called while idle, whenever codec or capture size change. Once the codec or the capture area
+     * (by CALIBRATION_SIZE_CHANGE) changed and stayed for CALIBRATION_SETTLE, cached results are loaded or
+     * measured in background. Previous results stay selectable until new ones replace them.
+     *
+     * @param codecId Video codec of output format
+     * @param width Capture width
+     * @param height Capture height
+     */
+    void request(AVCodecID codecId, int width, int height);
+
+    /// Whether a background run is measuring
+    bool running();
+
+    /// Progress of background run in [0, 1]
+    float progress();
+
+    /// Results of last finished run, fastest preset first, empty before the first one for the codec
+    std::vector<CalibrationResult> results();
+
+    /**
+     * @brief Select Preset
+     *
+     * @param fps Target frame rate
+     * @param sustained Set to whether the selected preset sustains fps with CALIBRATION_HEADROOM
+     * @return int Best quality preset sustaining fps, fastest preset if none does, -1 without presets or results
+     */
+    int select(int fps, bool &sustained);
+
+    /// Stop background run, its partial results are dropped and it runs again on the next request
+    void cancel();
+
+    static inline const std::string NAME = "EncoderCalibration";
+
+  private:
+    /// Internal calibration process, runs until results match the settled target
+    void calibrateInternal();
+
+    /// Measure every preset of encoder, results are kept unless cancelled or nothing measured
+    void measureAll(const AVCodec *codec, int width, int height);
+
+    /// Encode synthetic frames with preset, frames are made on first call, returns frames per second or 0
+    double measure(AVCodecID codecId, int width, int height, int preset, std::vector<AVFrame *> &frames);
+
+    /// Draw screen-like frames in encoder pixel format
+    bool makeFrames(const AVCodecContext *encCtx, std::vector<AVFrame *> &frames);
+
+    /// Load results of closest cached size, false if none is close enough
+    bool loadCache(const std::string &encoder, int width, int height);
+
+    /// Replace cached results of machine, encoder & size
+    void saveCache(const std::string &encoder, int width, int height, const std::vector<CalibrationResult> &results);
+
+    /// CPU, thread count & FFmpeg version
+    static std::string machineId();
+
+    /// Cache file in user cache directory
+    static std::string cachePath();
+
+    /// Whether areas differ by more than CALIBRATION_SIZE_CHANGE
+    static bool isSignificant(int width0, int height0, int width1, int height1);
+
+    std::thread _t;
+    std::atomic<bool> _active; // background thread waits for a target or measures
+    std::atomic<bool> _running, _cancel;
+    std::atomic<float> _progress;
+    std::mutex _resultsLock;
+    std::vector<CalibrationResult> _results;
+
+    // target of current results, and of a change waiting to settle
+    std::mutex _targetLock;
+    AVCodecID _codecId, _pendingCodec;
+    int _width, _height, _pendingWidth, _pendingHeight;
+    std::chrono::steady_clock::time_point _pendingSince;
+};
@@ -0,0 +1,279 @@
+#include "cli.hpp"
+#include "editor.hpp"
+#include "session.hpp"
+#include "transcoder.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cctype>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+using sysclock = std::chrono::system_clock;
+
+static const std::string NAME = "Recorder";
+
+static volatile std::sig_atomic_t interrupted = 0;
+
+/// Stop headless recording on SIGINT / SIGTERM
+static void onInterrupt(int)
+{
+    interrupted = 1;
+}
+
+/// Parse source argument: device, file:<path>, lavfi, lavfi:<graph> or window:<id|name>
+static bool parseSource(const std::string &arg, SourceConfig &config)
+{
+    auto colon = arg.find(':');
+    auto kind = arg.substr(0, colon);
+    config.url = colon != std::string::npos ? arg.substr(colon + 1) : "";
+    if (kind == "device")
+        config.type = SOURCE_DEVICE;
+    else if (kind == "file" && !config.url.empty())
+        config.type = SOURCE_FILE;
+    else if (kind == "lavfi")
+        config.type = SOURCE_LAVFI;
+    else if (kind == "window" && !config.url.empty())
+        config.type = SOURCE_WINDOW;
+    else
+    {
+        display_message(NAME, "source must be device, file:<path>, lavfi, lavfi:<graph> or window:<id|name>",
+                        MESSAGE_ERROR);
+        return false;
+    }
+    return true;
+}
+
+/// Parse monitor list: all or comma separated indices
+static bool parseMonitors(const std::string &arg, std::vector<int> &monitors)
+{
+    monitors.clear();
+    if (arg == "all")
+    {
+        auto count = ScreenSource::listMonitors().size();
+        for (size_t i = 0; i < count; i++)
+            monitors.push_back(static_cast<int>(i));
+        return !monitors.empty();
+    }
+    size_t start = 0;
+    while (start <= arg.size())
+    {
+        auto end = arg.find(',', start);
+        auto item = arg.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        bool digits = std::all_of(item.begin(), item.end(), [](unsigned char c) { return std::isdigit(c) != 0; });
+        if (item.empty() || !digits)
+            return false;
+        monitors.push_back(std::atoi(item.c_str()));
+        if (end == std::string::npos)
+            break;
+        start = end + 1;
+    }
+    return !monitors.empty();
+}
+
+/// Record without UI: --record [--region x,y,w,h] [--fps N] [--output path] [--duration S] ..., see usage below
+static int recordMain(int argc, char **argv)
+{
+    SessionConfig config;
+    auto &region = config.region;
+    double duration = 0.0;
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--region") == 0 && i + 1 < argc)
+        {
+            if (std::sscanf(argv[++i], "%d,%d,%d,%d", &region[0], &region[1], &region[2], &region[3]) != 4)
+            {
+                display_message(NAME, "region must be x,y,w,h", MESSAGE_ERROR);
+                return -1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+            config.fps = std::atoi(argv[++i]);
+        else if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+            config.output = argv[++i];
+        else if (std::strcmp(argv[i], "--duration") == 0 && i + 1 < argc)
+            duration = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--video-source") == 0 && i + 1 < argc)
+        {
+            if (!parseSource(argv[++i], config.video))
+                return -1;
+        }
+        else if (std::strcmp(argv[i], "--audio-source") == 0 && i + 1 < argc)
+        {
+            if (!parseSource(argv[++i], config.audio))
+                return -1;
+            if (config.audio.type == SOURCE_WINDOW)
+            {
+                display_message(NAME, "window source has no audio", MESSAGE_ERROR);
+                return -1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--monitors") == 0 && i + 1 < argc)
+        {
+            if (!parseMonitors(argv[++i], config.monitors))
+            {
+                display_message(NAME, "monitors must be all or indices like 0,1", MESSAGE_ERROR);
+                return -1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--monitor-output") == 0 && i + 1 < argc)
+        {
+            std::string output = argv[++i];
+            if (output == "tracks")
+                config.monitorOutput = OUTPUT_MONITORS_TRACKS;
+            else if (output == "files")
+                config.monitorOutput = OUTPUT_MONITORS_FILES;
+            else
+            {
+                display_message(NAME, "monitor output must be tracks or files", MESSAGE_ERROR);
+                return -1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--control") == 0)
+            config.control = true;
+        else if (std::strcmp(argv[i], "--drop-policy") == 0 && i + 1 < argc)
+        {
+            std::string policy = argv[++i];
+            if (policy == "oldest")
+                config.dropPolicy = VIDEO_DROP_OLDEST;
+            else if (policy == "newest")
+                config.dropPolicy = VIDEO_DROP_NEWEST;
+            else if (policy == "duplicate")
+                config.dropPolicy = VIDEO_DROP_DUPLICATE;
+            else
+            {
+                display_message(NAME, "drop policy must be oldest, newest or duplicate", MESSAGE_ERROR);
+                return -1;
+            }
+        }
+        else if (std::strcmp(argv[i], "--adaptive") == 0)
+        {
+            // lowest frame rate is optional
+            config.adaptive.enabled = true;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                config.adaptive.minFps = (std::max)(1, std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "--trace") == 0)
+        {
+            // memory is optional
+            config.traceMemory = TRACE_DEFAULT_MEMORY;
+            if (i + 1 < argc && std::isdigit(static_cast<unsigned char>(argv[i + 1][0])))
+                config.traceMemory = (std::max)(1, std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "--record") != 0)
+        {
+            display_message(NAME, "unknown argument " + std::string(argv[i]), MESSAGE_ERROR);
+            return -1;
+        }
+    }
+    std::unique_ptr<RecordSession> session;
+    try
+    {
+        session = std::make_unique<RecordSession>();
+    }
+    catch (const std::exception &e)
+    {
+        display_message(NAME, e.what(), MESSAGE_ERROR);
+        return -1;
+    }
+    if (!session->configure(config))
+        return -1;
+    std::signal(SIGINT, onInterrupt);
+    std::signal(SIGTERM, onInterrupt);
+    // with control, recording is driven through the control socket until interrupted
+    if (!config.control && !session->start())
+        return -1;
+    if (config.control)
+        display_message(NAME, "waiting for commands, press Ctrl+C to quit", MESSAGE_INFO);
+    else
+        display_message(NAME,
+                        duration > 0.0 ? "recording for " + std::to_string(duration) + " s" : "press Ctrl+C to stop",
+                        MESSAGE_INFO);
+    // poll until interrupted, timed out, or the pipeline stopped by itself
+    auto startT = sysclock::now();
+    while (!interrupted)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(CLI_POLL_INTERVAL));
+        auto elapsed = std::chrono::duration<double>(sysclock::now() - startT).count();
+        if (!config.control &&
+            ((duration > 0.0 && elapsed >= duration) || (elapsed > 1.0 && !session->stats().recording)))
+            break;
+    }
+    // flushes encoders & writes trailers
+    session->stop();
+    return 0;
+}
+
+/// Offline conversion: --transcode <input> <output> [--jobs N]
+static int transcodeMain(int argc, char **argv)
+{
+    auto config = Transcoder::convertConfig(argv[2], argv[3]);
+    if (argc > 5 && std::strcmp(argv[4], "--jobs") == 0)
+        config.jobs = std::max(1, std::atoi(argv[5]));
+    Transcoder transcoder;
+    bool success = false;
+    if (!transcoder.start(config, [&success](bool result) { success = result; }))
+        return -1;
+    transcoder.wait();
+    display_message(NAME, success ? "done" : "transcode failed", success ? MESSAGE_INFO : MESSAGE_WARN);
+    return success ? 0 : -1;
+}
+
+/// Trim & join: --edit <output> <input>... [--start S] [--end E] [--exact]
+static int editMain(int argc, char **argv)
+{
+    EditConfig config;
+    config.output.path = argv[2];
+    for (int i = 3; i < argc; i++)
+    {
+        if (std::strcmp(argv[i], "--start") == 0 && i + 1 < argc)
+            config.start = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--end") == 0 && i + 1 < argc)
+            config.end = std::atof(argv[++i]);
+        else if (std::strcmp(argv[i], "--exact") == 0)
+            config.exact = true;
+        else
+            config.inputs.push_back(argv[i]);
+    }
+    StreamEditor editor;
+    bool success = editor.run(config);
+    display_message(NAME, success ? "done" : "edit failed", success ? MESSAGE_INFO : MESSAGE_WARN);
+    return success ? 0 : -1;
+}
+
+int cliMain(int argc, char **argv)
+{
+#if __linux__
+    // a pipe or FIFO reader going away must fail the output, not kill the program
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+    if (argc >= 4 && std::strcmp(argv[1], "--transcode") == 0)
+        return transcodeMain(argc, argv);
+    if (argc >= 4 && std::strcmp(argv[1], "--edit") == 0)
+        return editMain(argc, argv);
+    if (argc < 2 || (std::strcmp(argv[1], "--help") != 0 && std::strcmp(argv[1], "-h") != 0))
+        return recordMain(argc, argv);
+    std::cout << "usage: " << argv[0] << " [--record] [--region x,y,w,h] [--fps N] [--output path] [--duration S]"
+              << " [--control] [--trace [MB]]" << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv[0]), ' ')
+              << " [--drop-policy oldest|newest|duplicate] [--adaptive [MIN_FPS]]" << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv[0]), ' ')
+              << " [--video-source device|file:<path>|lavfi[:<graph>]|window:<id|name>]" << std::endl;
+    std::cout << "       " << std::string(std::strlen(argv[0]), ' ')
+              << " [--audio-source ...] [--monitors all|<i>,<j>...] [--monitor-output tracks|files]" << std::endl;
+    std::cout << "       " << argv[0] << " --transcode <input> <output> [--jobs N]" << std::endl;
+    std::cout << "       " << argv[0] << " --edit <output> <input>... [--start S] [--end E] [--exact]" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    return cliMain(argc, argv);
+}
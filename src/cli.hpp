@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+
+/** @file */
+
+/// Poll interval (milliseconds) of headless recording
+#define CLI_POLL_INTERVAL 50
+
+/**
+ * @brief Command Line Entry
+ *
+ * Runs recording and file tools without window, OpenGL or ImGui.
+ * Called from main of recorder-cli, the GUI binary does not link it.
+ *
+ * @param argc Argument count
+ * @param argv Arguments
+ * @return int Exit code
+ */
+int cliMain(int argc, char **argv);
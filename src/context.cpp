@@ -5,6 +5,7 @@
 #include "context.hpp"
 #include "utils.hpp"
 
+#include <algorithm>
 #include <cstring>
 #include <sstream>
 #include <stdexcept>
@@ -12,6 +13,7 @@
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
 #include <Windows.h>
 #define WINHOTKEY_ID 100
+#define WINHOTKEY_REPLAY_ID 101
 #define GLFW_EXPOSE_NATIVE_WIN32
 #elif __linux__
 #include <X11/Xlib.h>
@@ -146,6 +148,17 @@ void AppContext::glfw_windowsize_callback(GLFWwindow *window, int w, int h)
     AppContext *user = reinterpret_cast<AppContext *>(glfwGetWindowUserPointer(window));
     user->_winWidth = w;
     user->_winHeight = h;
+    if (!user->_mediaHandler)
+        return;
+    // a recording follows the window, fullscreen recordings hide it instead
+    if (user->_mediaHandler->IsRecording())
+    {
+        if (!user->_fullscreen)
+            user->configCapture();
+        return;
+    }
+    int border = user->_fullscreen ? 0 : user->_borderNumPixels * 2;
+    user->_mediaHandler->SetCaptureSize(w - border, h - border);
 }
 
 void AppContext::glfw_windowpos_callback(GLFWwindow *window, int x, int y)
@@ -153,6 +166,8 @@ void AppContext::glfw_windowpos_callback(GLFWwindow *window, int x, int y)
     AppContext *user = reinterpret_cast<AppContext *>(glfwGetWindowUserPointer(window));
     user->_winPosX = x;
     user->_winPosY = y;
+    if (user->_mediaHandler && user->_mediaHandler->IsRecording() && !user->_fullscreen)
+        user->configCapture();
 }
 
 void AppContext::glfw_windowfocus_callback(GLFWwindow *window, int focus)
@@ -231,6 +246,27 @@ void AppContext::prepareBorder()
     glDeleteShader(fragShader);
 }
 
+void AppContext::configCapture()
+{
+    // the window may sit on any monitor, so clamp to the desktop spanning all of them
+    int deskWidth = _monWidth, deskHeight = _monHeight, count = 0;
+    auto monitors = glfwGetMonitors(&count);
+    for (int i = 0; i < count; i++)
+    {
+        int mx = 0, my = 0;
+        glfwGetMonitorPos(monitors[i], &mx, &my);
+        auto mode = glfwGetVideoMode(monitors[i]);
+        if (!mode)
+            continue;
+        deskWidth = (std::max)(deskWidth, mx + mode->width);
+        deskHeight = (std::max)(deskHeight, my + mode->height);
+    }
+    _mediaHandler->ConfigWindow(_winPosX + (_fullscreen ? 0 : _borderNumPixels),
+                                _winPosY + (_fullscreen ? 0 : _borderNumPixels),
+                                _winWidth - (_fullscreen ? 0 : (_borderNumPixels * 2)),
+                                _winHeight - (_fullscreen ? 0 : (_borderNumPixels * 2)), deskWidth, deskHeight);
+}
+
 void AppContext::toggleUI()
 {
     _displayUI = !_displayUI;
@@ -272,6 +308,8 @@ void AppContext::toggleUI()
 void AppContext::AttachHandler(std::shared_ptr<MediaHandler> handler)
 {
     _mediaHandler = handler;
+    int border = _fullscreen ? 0 : _borderNumPixels * 2;
+    _mediaHandler->SetCaptureSize(_winWidth - border, _winHeight - border);
 }
 
 void AppContext::AppLoop(std::function<void()> customUI)
@@ -330,6 +368,10 @@ void AppContext::registerHotKey()
     // check valid key
     if (_hotkeyNum < 6)
         throw std::runtime_error("failed to register global hotkey!");
+    // same key with SHIFT saves instant replay
+    if (!RegisterHotKey(glfwGetWin32Window(_window), WINHOTKEY_REPLAY_ID, MOD_CONTROL | MOD_SHIFT | MOD_NOREPEAT,
+                        keys[10 - _hotkeyNum]))
+        display_message(NAME, "failed to bind CTRL+SHIFT+F" + std::to_string(_hotkeyNum), MESSAGE_WARN);
 #elif __linux__
     auto display = XOpenDisplay(0);
     _hotkeyDpy = (void *)display;
@@ -361,6 +403,15 @@ void AppContext::registerHotKey()
     // check valid key
     if (_hotkeyNum < 6)
         throw std::runtime_error("failed to register global hotkey!");
+    // same key with SHIFT saves instant replay
+    XGrabKey(display, XKeysymToKeycode(display, keys[10 - _hotkeyNum]), ControlMask | ShiftMask, window, False,
+             GrabModeAsync, GrabModeAsync);
+    XSync(display, False);
+    if (hasX11Error)
+    {
+        display_message(NAME, "failed to bind CTRL+SHIFT+F" + std::to_string(_hotkeyNum), MESSAGE_WARN);
+        hasX11Error = false;
+    }
     XSelectInput(display, window, KeyPressMask);
 #endif
 }
@@ -369,11 +420,13 @@ void AppContext::unregisterHotKey()
 {
 #if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
     UnregisterHotKey(glfwGetWin32Window(_window), WINHOTKEY_ID);
+    UnregisterHotKey(glfwGetWin32Window(_window), WINHOTKEY_REPLAY_ID);
 #elif __linux__
     auto display = reinterpret_cast<Display *>(_hotkeyDpy);
     auto window = DefaultRootWindow(display);
     const std::vector<KeySym> keys = {XK_F10, XK_F9, XK_F8, XK_F7, XK_F6};
     XUngrabKey(display, XKeysymToKeycode(display, keys[10 - _hotkeyNum]), ControlMask, window);
+    XUngrabKey(display, XKeysymToKeycode(display, keys[10 - _hotkeyNum]), ControlMask | ShiftMask, window);
     XCloseDisplay(display);
 #endif
 }
@@ -401,6 +454,12 @@ void AppContext::hotKeyPollEvents()
     }
     if (!hasHotkey)
         return;
+    if (msg.wParam == WINHOTKEY_REPLAY_ID)
+    {
+        if (_mediaHandler)
+            _mediaHandler->SaveReplay();
+        return;
+    }
 #elif __linux__
     static XEvent e;
     auto display = reinterpret_cast<Display *>(_hotkeyDpy);
@@ -409,6 +468,12 @@ void AppContext::hotKeyPollEvents()
     XNextEvent(display, &e);
     if (e.type != KeyPress)
         return;
+    if (e.xkey.state & ShiftMask)
+    {
+        if (_mediaHandler)
+            _mediaHandler->SaveReplay();
+        return;
+    }
 #endif
     // if pressed update state
     bool success = true;
@@ -420,10 +485,7 @@ void AppContext::hotKeyPollEvents()
             success = _mediaHandler->StopRecord();
         else
         {
-            _mediaHandler->ConfigWindow(_winPosX + (_fullscreen ? 0 : _borderNumPixels),
-                                        _winPosY + (_fullscreen ? 0 : _borderNumPixels),
-                                        _winWidth - (_fullscreen ? 0 : (_borderNumPixels * 2)),
-                                        _winHeight - (_fullscreen ? 0 : (_borderNumPixels * 2)), _monWidth, _monHeight);
+            configCapture();
             success = _mediaHandler->StartRecord();
         }
     }
@@ -81,6 +81,9 @@ class AppContext
     /// toggle UI and related window states
     void toggleUI();
 
+    /// pass capture area inside the border to media handler
+    void configCapture();
+
     /// register global hotkey to refocus window
     void registerHotKey();
 
@@ -0,0 +1,168 @@
+#include "control.hpp"
+#include "utils.hpp"
+
+#if __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+/// Servers opened in this process, numbers the socket paths
+static std::atomic<int> instances{0};
+
+ControlServer::ControlServer() : _fd(-1), _inode(0), _serveLoop(false)
+{
+}
+
+ControlServer::~ControlServer()
+{
+    close();
+}
+
+bool ControlServer::open(const CommandCallback &onCommand)
+{
+#if __linux__
+    close();
+    auto runtimeDir = std::getenv("XDG_RUNTIME_DIR");
+    _path = std::string(runtimeDir ? runtimeDir : "/tmp") + "/recorder-" + std::to_string(getpid()) + "-" +
+            std::to_string(instances++) + ".sock";
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (_path.size() >= sizeof(addr.sun_path))
+    {
+        display_message(NAME, "socket path too long: " + _path, MESSAGE_WARN);
+        return false;
+    }
+    std::strncpy(addr.sun_path, _path.c_str(), sizeof(addr.sun_path) - 1);
+    if (!removeStale(addr))
+    {
+        display_message(NAME, _path + " is in use, not listening", MESSAGE_WARN);
+        return false;
+    }
+    _fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (_fd < 0 || bind(_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(_fd, 4) < 0)
+    {
+        display_message(NAME, "failed to listen on " + _path + " (" + std::strerror(errno) + ")", MESSAGE_WARN);
+        close();
+        return false;
+    }
+    struct stat st;
+    _inode = stat(_path.c_str(), &st) == 0 ? st.st_ino : 0;
+    _onCommand = onCommand;
+    _serveLoop = true;
+    _serveT = std::thread([this] { serveInternal(); });
+    display_message(NAME, "listening on " + _path, MESSAGE_INFO);
+    return true;
+#else
+    display_message(NAME, "control socket is not supported on this platform", MESSAGE_WARN);
+    return false;
+#endif
+}
+
+void ControlServer::close()
+{
+    _serveLoop = false;
+    if (_serveT.joinable())
+        _serveT.join();
+#if __linux__
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        // only our own socket file, the path may have been taken over since
+        struct stat st;
+        if (_inode && stat(_path.c_str(), &st) == 0 && st.st_ino == _inode)
+            unlink(_path.c_str());
+        _fd = -1;
+        _inode = 0;
+    }
+#endif
+}
+
+const std::string &ControlServer::getPath()
+{
+    return _path;
+}
+
+#if __linux__
+bool ControlServer::removeStale(const sockaddr_un &addr)
+{
+    struct stat st;
+    if (lstat(addr.sun_path, &st) != 0)
+        return errno == ENOENT;
+    if (!S_ISSOCK(st.st_mode))
+        return false;
+    // a live server accepts the connection, the file of a crashed one refuses it
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    bool refused = connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) < 0 && errno == ECONNREFUSED;
+    ::close(fd);
+    if (!refused)
+        return false;
+    display_message(NAME, "removing stale socket " + _path, MESSAGE_INFO);
+    return unlink(addr.sun_path) == 0 || errno == ENOENT;
+}
+#endif
+
+void ControlServer::serveInternal()
+{
+#if __linux__
+    while (_serveLoop)
+    {
+        pollfd pfd{_fd, POLLIN, 0};
+        if (poll(&pfd, 1, CONTROL_POLL_INTERVAL) <= 0)
+            continue;
+        int client = accept4(_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+        serveClient(client);
+        ::close(client);
+    }
+#endif
+}
+
+void ControlServer::serveClient(int fd)
+{
+#if __linux__
+    std::string line;
+    char buf[256];
+    while (_serveLoop)
+    {
+        pollfd pfd{fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, CONTROL_POLL_INTERVAL);
+        if (ready < 0)
+            return;
+        if (ready == 0)
+            continue;
+        auto n = read(fd, buf, sizeof(buf));
+        if (n <= 0)
+            return;
+        line.append(buf, n);
+        // answer every complete line, commands are handled as soon as they arrive
+        size_t end;
+        while ((end = line.find('\n')) != std::string::npos)
+        {
+            auto command = line.substr(0, end);
+            line.erase(0, end + 1);
+            if (!command.empty() && command.back() == '\r')
+                command.pop_back();
+            auto response = _onCommand(command) + "\n";
+            if (send(fd, response.data(), response.size(), MSG_NOSIGNAL) < 0)
+                return;
+        }
+        if (line.size() > CONTROL_MAX_LINE)
+        {
+            const std::string response = "error command too long\n";
+            send(fd, response.data(), response.size(), MSG_NOSIGNAL);
+            return;
+        }
+    }
+#endif
+}
@@ -0,0 +1,79 @@
+#pragma once
+#if __linux__
+#include <sys/un.h>
+#endif
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <thread>
+
+/** @file */
+
+/// Maximum length (bytes) of one control command line
+#define CONTROL_MAX_LINE 1024
+
+/// Poll interval (milliseconds) of control socket, bounds close latency
+#define CONTROL_POLL_INTERVAL 100
+
+/// Handles one control command line and returns the response line
+using CommandCallback = std::function<std::string(const std::string &)>;
+
+/**
+ * @brief Control Server
+ *
+ * This class serves line based commands on a local socket at $XDG_RUNTIME_DIR/recorder-<pid>-<n>.sock,
+ * n counting the servers opened in the process, so that every instance gets its own path.
+ * Clients are served one at a time, in order.
+ */
+class ControlServer
+{
+  public:
+    ControlServer();
+    ~ControlServer();
+
+    /**
+     * @brief Open Control Socket
+     *
+     * @param onCommand Called from server thread for every command line
+     * @return true if listening
+     * @return false otherwise
+     */
+    bool open(const CommandCallback &onCommand);
+
+    /**
+     * @brief Close Control Socket
+     *
+     * Stops server thread and removes socket file.
+     */
+    void close();
+
+    /**
+     * @brief Get Socket Path
+     *
+     * @return const std::string&
+     */
+    const std::string &getPath();
+
+    const std::string NAME = "ControlServer";
+
+  private:
+    /// Internal accept process
+    void serveInternal();
+
+    /// Answer commands of one client until it disconnects
+    void serveClient(int fd);
+
+#if __linux__
+    /// Remove a socket file no server listens on anymore, false if the path is in use
+    bool removeStale(const sockaddr_un &addr);
+#endif
+
+    std::string _path;
+    CommandCallback _onCommand;
+    int _fd;
+    uint64_t _inode; // of the socket file, close removes it only while it is ours
+    std::atomic<bool> _serveLoop;
+    std::thread _serveT;
+};
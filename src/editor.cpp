@@ -0,0 +1,400 @@
+#include "editor.hpp"
+#include "utils.hpp"
+#include "videocapture.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+StreamEditor::StreamEditor() : _tmpl(nullptr), _scratch(nullptr), _written(0)
+{
+}
+
+StreamEditor::~StreamEditor()
+{
+    _muxer = nullptr;
+    _inputs.clear();
+    if (_tmpl)
+        avformat_free_context(_tmpl);
+    if (_scratch)
+        avformat_free_context(_scratch);
+}
+
+bool StreamEditor::run(const EditConfig &config)
+{
+    _config = config;
+    _written = 0;
+    if (_config.inputs.empty())
+    {
+        display_message(NAME, "no input to edit", MESSAGE_WARN);
+        return false;
+    }
+    if (!openInputs() || !checkInputs() || !openOutput())
+        return false;
+    if (_config.exact && !canCutExact())
+    {
+        display_message(NAME, "re-encoded GOPs would not match input codec headers, cutting at keyframes",
+                        MESSAGE_WARN);
+        _config.exact = false;
+    }
+    // offline output, wait for disk instead of dropping packets
+    auto output = _config.output;
+    output.blocking = true;
+    _muxer = std::make_unique<MediaMuxer>();
+    if (!_muxer->open(_tmpl, output))
+        return false;
+    // map joined timeline cuts onto every input
+    auto startT = static_cast<int64_t>(_config.start * AV_TIME_BASE);
+    auto endT = _config.end > 0.0 ? static_cast<int64_t>(_config.end * AV_TIME_BASE) : INT64_MAX;
+    bool success = true;
+    for (auto &input : _inputs)
+    {
+        auto from = std::max(int64_t(0), startT - input->offset);
+        auto to = endT == INT64_MAX || endT - input->offset >= input->duration ? INT64_MAX : endT - input->offset;
+        if (to <= 0 || from >= input->duration)
+            continue;
+        if (!copyInput(input.get(), from, to))
+        {
+            success = false;
+            break;
+        }
+    }
+    _muxer->close();
+    success = success && !_muxer->failed();
+    if (success)
+        display_message(NAME,
+                        "wrote " + std::to_string(_written / AV_TIME_BASE) + " s from " +
+                            std::to_string(_inputs.size()) + " inputs to " + _muxer->getPath(),
+                        MESSAGE_INFO);
+    return success;
+}
+
+bool StreamEditor::openInputs()
+{
+    int64_t offset = 0;
+    for (auto &path : _config.inputs)
+    {
+        auto input = std::make_unique<EditInput>();
+        if (avformat_open_input(&input->ic, path.c_str(), nullptr, nullptr) != 0)
+        {
+            display_message(NAME, "failed to open " + path, MESSAGE_WARN);
+            return false;
+        }
+        if (avformat_find_stream_info(input->ic, nullptr) < 0)
+        {
+            display_message(NAME, "failed to get stream info of " + path, MESSAGE_WARN);
+            return false;
+        }
+        input->videoIdx = av_find_best_stream(input->ic, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+        input->audioIdx = av_find_best_stream(input->ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0);
+        if (input->videoIdx < 0 || input->ic->duration == AV_NOPTS_VALUE)
+        {
+            display_message(NAME, "no video or unknown duration in " + path, MESSAGE_WARN);
+            return false;
+        }
+        input->base = input->ic->start_time != AV_NOPTS_VALUE ? input->ic->start_time : 0;
+        input->duration = input->ic->duration;
+        input->offset = offset;
+        offset += input->duration;
+        _inputs.push_back(std::move(input));
+    }
+    return true;
+}
+
+bool StreamEditor::checkInputs()
+{
+    auto same = [](const AVCodecParameters *a, const AVCodecParameters *b) {
+        return a->codec_id == b->codec_id && a->width == b->width && a->height == b->height &&
+               a->sample_rate == b->sample_rate && a->channels == b->channels &&
+               a->extradata_size == b->extradata_size &&
+               (!a->extradata_size || std::memcmp(a->extradata, b->extradata, a->extradata_size) == 0);
+    };
+    auto first = _inputs.front().get();
+    for (auto &input : _inputs)
+    {
+        bool audioMatch = (input->audioIdx < 0) == (first->audioIdx < 0) &&
+                          (first->audioIdx < 0 || same(input->ic->streams[input->audioIdx]->codecpar,
+                                                       first->ic->streams[first->audioIdx]->codecpar));
+        if (!audioMatch ||
+            !same(input->ic->streams[input->videoIdx]->codecpar, first->ic->streams[first->videoIdx]->codecpar))
+        {
+            display_message(NAME, std::string(input->ic->url) + " differs in codecs, transcode it first",
+                            MESSAGE_WARN);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool StreamEditor::openOutput()
+{
+    auto path = _config.output.path.c_str();
+    if (avformat_alloc_output_context2(&_tmpl, nullptr, nullptr, path) < 0 ||
+        avformat_alloc_output_context2(&_scratch, nullptr, nullptr, path) < 0)
+    {
+        display_message(NAME, "failed to allocate format for " + _config.output.path, MESSAGE_WARN);
+        return false;
+    }
+    // output streams: video, then audio if present
+    auto first = _inputs.front().get();
+    for (auto idx : {first->videoIdx, first->audioIdx})
+    {
+        if (idx < 0)
+            continue;
+        auto inSt = first->ic->streams[idx];
+        auto codecName = std::string(avcodec_get_name(inSt->codecpar->codec_id));
+        if (avformat_query_codec(_tmpl->oformat, inSt->codecpar->codec_id, FF_COMPLIANCE_NORMAL) == 0)
+        {
+            display_message(NAME, codecName + " cannot be copied into " + _config.output.path, MESSAGE_WARN);
+            return false;
+        }
+        auto st = avformat_new_stream(_tmpl, nullptr);
+        if (!st || avcodec_parameters_copy(st->codecpar, inSt->codecpar) < 0)
+        {
+            display_message(NAME, "failed to prepare output stream for " + codecName, MESSAGE_WARN);
+            return false;
+        }
+        st->codecpar->codec_tag = 0;
+        st->time_base = inSt->time_base;
+        st->avg_frame_rate = inSt->avg_frame_rate;
+        st->id = _tmpl->nb_streams - 1;
+    }
+    _lastDts.assign(_tmpl->nb_streams, AV_NOPTS_VALUE);
+    return true;
+}
+
+bool StreamEditor::canCutExact()
+{
+    // encoder settings match recording, so headers match unless input came from elsewhere
+    std::unique_ptr<InputStream> ist;
+    std::unique_ptr<OutputStream> ost;
+    auto input = _inputs.front().get();
+    if (!openCutCodecs(input, ist, ost))
+        return false;
+    auto par = input->ic->streams[input->videoIdx]->codecpar;
+    return ost->encCtx->extradata_size == par->extradata_size &&
+           (!par->extradata_size || std::memcmp(ost->encCtx->extradata, par->extradata, par->extradata_size) == 0);
+}
+
+bool StreamEditor::copyInput(EditInput *input, int64_t from, int64_t to)
+{
+    auto ic = input->ic;
+    // keyframe cuts keep whole GOPs, exact cuts re-encode the GOPs holding a cut
+    auto startKey = from > 0 ? findKeyFrame(input, from) : 0;
+    auto endKey = to != INT64_MAX ? findKeyFrame(input, to) : INT64_MAX;
+    auto cutStart = _config.exact ? from : startKey;
+    auto cutEnd = _config.exact ? to : endKey;
+    auto shift = _written - cutStart - input->base;
+    if (avformat_seek_file(ic, -1, INT64_MIN, input->base + startKey, input->base + startKey, 0) < 0)
+    {
+        display_message(NAME, "failed to seek in " + std::string(ic->url), MESSAGE_WARN);
+        return false;
+    }
+    auto pkt = av_packet_alloc();
+    if (!pkt)
+    {
+        display_message(NAME, "failed to allocate packet", MESSAGE_WARN);
+        return false;
+    }
+    std::unique_ptr<InputStream> ist;
+    std::unique_ptr<OutputStream> ost;
+    bool keySeen = false, cutting = false, success = true;
+    int64_t end = cutStart;
+    while (success && av_read_frame(ic, pkt) >= 0)
+    {
+        auto t = packetTime(input, pkt);
+        auto tb = ic->streams[pkt->stream_index]->time_base;
+        if (pkt->stream_index == input->videoIdx)
+        {
+            bool key = pkt->flags & AV_PKT_FLAG_KEY;
+            if (key && t >= cutEnd)
+                break;
+            keySeen = keySeen || key;
+            if (key)
+            {
+                bool partial = _config.exact && ((t == startKey && startKey < from) || (t == endKey && endKey < to));
+                // finish previous partial GOP, its encoder cannot continue into copied packets
+                if (cutting)
+                {
+                    encodeCut(input, ist.get(), ost.get(), nullptr, from, to, shift);
+                    cutting = false;
+                }
+                if (partial)
+                    success = cutting = openCutCodecs(input, ist, ost);
+            }
+            if (keySeen && cutting)
+                encodeCut(input, ist.get(), ost.get(), pkt, from, to, shift);
+            else if (keySeen && success)
+            {
+                end = std::max(end, t + av_rescale_q(pkt->duration, tb, AVRational{1, AV_TIME_BASE}));
+                pkt->stream_index = 0;
+                writePacket(pkt, tb, shift);
+            }
+        }
+        else if (pkt->stream_index == input->audioIdx && t >= cutStart && t < cutEnd)
+        {
+            end = std::max(end, t + av_rescale_q(pkt->duration, tb, AVRational{1, AV_TIME_BASE}));
+            pkt->stream_index = 1;
+            writePacket(pkt, tb, shift);
+        }
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    if (cutting)
+        encodeCut(input, ist.get(), ost.get(), nullptr, from, to, shift);
+    // exact cuts end at the cut, whatever the last copied packet was
+    end = cutEnd != INT64_MAX && _config.exact ? cutEnd : end;
+    _written += std::max(int64_t(0), end - cutStart);
+    return success;
+}
+
+int64_t StreamEditor::findKeyFrame(EditInput *input, int64_t t)
+{
+    auto ic = input->ic;
+    if (avformat_seek_file(ic, -1, INT64_MIN, input->base + t, input->base + t, 0) < 0)
+        return 0;
+    auto pkt = av_packet_alloc();
+    int64_t key = 0;
+    while (pkt && av_read_frame(ic, pkt) >= 0)
+    {
+        bool found = pkt->stream_index == input->videoIdx && (pkt->flags & AV_PKT_FLAG_KEY);
+        if (found)
+            key = packetTime(input, pkt);
+        av_packet_unref(pkt);
+        if (found)
+            break;
+    }
+    av_packet_free(&pkt);
+    return std::min(key, t);
+}
+
+int64_t StreamEditor::packetTime(EditInput *input, const AVPacket *pkt)
+{
+    auto ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+    if (ts == AV_NOPTS_VALUE)
+        return INT64_MIN;
+    return av_rescale_q(ts, input->ic->streams[pkt->stream_index]->time_base, AVRational{1, AV_TIME_BASE}) -
+           input->base;
+}
+
+bool StreamEditor::openCutCodecs(EditInput *input, std::unique_ptr<InputStream> &ist,
+                                 std::unique_ptr<OutputStream> &ost)
+{
+    auto inSt = input->ic->streams[input->videoIdx];
+    auto codecName = std::string(avcodec_get_name(inSt->codecpar->codec_id));
+    // decoder persists across GOPs, it is flushed after each
+    if (!ist)
+    {
+        auto codecIn = avcodec_find_decoder(inSt->codecpar->codec_id);
+        ist = std::make_unique<InputStream>();
+        ist->streamIdx = input->videoIdx;
+        ist->decCtx = codecIn ? avcodec_alloc_context3(codecIn) : nullptr;
+        if (!ist->decCtx || avcodec_parameters_to_context(ist->decCtx, inSt->codecpar) < 0 ||
+            avcodec_open2(ist->decCtx, codecIn, nullptr) < 0 || !(ist->frame = av_frame_alloc()))
+        {
+            display_message(NAME, "failed to open decoder for " + codecName, MESSAGE_WARN);
+            ist = nullptr;
+            return false;
+        }
+        ist->decCtx->pkt_timebase = inSt->time_base;
+    }
+    // encoder is fresh for each GOP, so that it starts with a keyframe
+    auto par = inSt->codecpar;
+    auto rate = av_guess_frame_rate(input->ic, inSt, nullptr);
+    int fps = rate.num > 0 && rate.den > 0 ? static_cast<int>(av_q2d(rate) + 0.5) : VIDEO_DEFAULT_FPS;
+    auto bitRate = par->bit_rate ? par->bit_rate : int64_t(par->width) * par->height * fps;
+    _scratch->video_codec_id = par->codec_id;
+    ost = std::make_unique<OutputStream>();
+    if (!VideoCapture::openEncoder(ost.get(), _scratch, par->width, par->height, fps, bitRate,
+                                   static_cast<AVPixelFormat>(par->format)))
+        return false;
+    ost->swsCtx = sws_getContext(par->width, par->height, static_cast<AVPixelFormat>(par->format), par->width,
+                                 par->height, ost->encCtx->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    if (!ost->swsCtx)
+    {
+        display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
+        return false;
+    }
+    return true;
+}
+
+void StreamEditor::encodeCut(EditInput *input, InputStream *ist, OutputStream *ost, AVPacket *pkt, int64_t from,
+                             int64_t to, int64_t shift)
+{
+    auto tb = input->ic->streams[input->videoIdx]->time_base;
+    auto onFrame = [&](AVFrame *frame) {
+        bool frameSent = false;
+        while (encode(ost->encCtx, frame, ost->pkt, frameSent))
+        {
+            av_packet_rescale_ts(ost->pkt, ost->encCtx->time_base, tb);
+            ost->pkt->stream_index = 0;
+            writePacket(ost->pkt, tb, shift);
+            av_packet_unref(ost->pkt);
+        }
+    };
+    bool packetSent = false;
+    while (decode(ist->decCtx, ist->frame, pkt, packetSent))
+    {
+        auto ts = ist->frame->best_effort_timestamp;
+        auto t = av_rescale_q(ts, tb, AVRational{1, AV_TIME_BASE}) - input->base;
+        if (t < from || t >= to || av_frame_make_writable(ost->frame) < 0)
+            continue;
+        sws_scale(ost->swsCtx, ist->frame->data, ist->frame->linesize, 0, ist->frame->height, ost->frame->data,
+                  ost->frame->linesize);
+        ost->frame->pts = av_rescale_q(ts, tb, ost->encCtx->time_base);
+        onFrame(ost->frame);
+    }
+    if (!pkt)
+    {
+        onFrame(nullptr);
+        avcodec_flush_buffers(ist->decCtx);
+    }
+}
+
+void StreamEditor::writePacket(AVPacket *pkt, AVRational tb, int64_t shift)
+{
+    auto offset = av_rescale_q(shift, AVRational{1, AV_TIME_BASE}, tb);
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts += offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts += offset;
+    av_packet_rescale_ts(pkt, tb, _tmpl->streams[pkt->stream_index]->time_base);
+    // re-encoded GOPs may reorder with another delay than copied ones
+    auto &last = _lastDts[pkt->stream_index];
+    if (pkt->dts != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE && pkt->dts <= last)
+    {
+        pkt->dts = last + 1;
+        if (pkt->pts != AV_NOPTS_VALUE && pkt->pts < pkt->dts)
+            pkt->pts = pkt->dts;
+    }
+    if (pkt->dts != AV_NOPTS_VALUE)
+        last = pkt->dts;
+    _muxer->writePacket(pkt);
+}
+
+bool StreamEditor::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent)
+{
+    int ret;
+    char buf[512];
+    if (!packetSent && (ret = avcodec_send_packet(codecCtx, pkt)) < 0)
+    {
+        display_message(NAME, "decoder packet (" + std::string(av_make_error_string(buf, sizeof(buf), ret)) + ")",
+                        MESSAGE_WARN);
+        return false;
+    }
+    packetSent = true;
+    return avcodec_receive_frame(codecCtx, frame) >= 0;
+}
+
+bool StreamEditor::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent)
+{
+    int ret;
+    char buf[512];
+    if (!frameSent && (ret = avcodec_send_frame(codecCtx, frame)) < 0)
+    {
+        display_message(NAME, "encoder frame (" + std::string(av_make_error_string(buf, sizeof(buf), ret)) + ")",
+                        MESSAGE_WARN);
+        return false;
+    }
+    frameSent = true;
+    return avcodec_receive_packet(codecCtx, pkt) >= 0;
+}
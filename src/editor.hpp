@@ -0,0 +1,131 @@
+#pragma once
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswscale/swscale.h>
+}
+
+#include "muxer.hpp"
+#include "streams.hpp"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/**
+ * @brief Edit Config
+ *
+ * This structure stores settings of one trim & concat job.
+ */
+struct EditConfig
+{
+    std::vector<std::string> inputs; // joined in order
+    MuxerConfig output;
+    double start; // seconds on joined timeline
+    double end;   // seconds on joined timeline, 0 for end of last input
+    bool exact;   // re-encode partial GOPs at cuts instead of cutting at keyframes
+
+    EditConfig() : start(0.0), end(0.0), exact(false)
+    {
+    }
+};
+
+/**
+ * @brief Edit Input
+ *
+ * This structure stores one opened input of an edit job.
+ */
+struct EditInput
+{
+    AVFormatContext *ic;
+    int videoIdx, audioIdx;
+    int64_t base;     // input start time, AV_TIME_BASE units
+    int64_t duration; // AV_TIME_BASE units
+    int64_t offset;   // start on joined timeline, AV_TIME_BASE units
+
+    EditInput() : ic(nullptr), videoIdx(-1), audioIdx(-1), base(0), duration(0), offset(0)
+    {
+    }
+
+    ~EditInput()
+    {
+        if (ic)
+            avformat_close_input(&ic);
+    }
+};
+
+/**
+ * @brief Stream Editor
+ *
+ * This class trims and joins finished recordings by stream copy.
+ * Cuts land on video keyframes, unless exact cuts re-encode the partial GOP around them.
+ */
+class StreamEditor
+{
+  public:
+    StreamEditor();
+    ~StreamEditor();
+
+    /**
+     * @brief Run Edit
+     *
+     * Blocks until the output is written. Inputs must share codecs and codec headers,
+     * which holds for recordings and segments written with the same settings.
+     *
+     * @param config Edit configs
+     * @return true if success
+     * @return false otherwise
+     */
+    bool run(const EditConfig &config);
+
+    const std::string NAME = "StreamEditor";
+
+  private:
+    /// Open all inputs and place them on joined timeline
+    bool openInputs();
+
+    /// Check that inputs can be joined without re-encoding
+    bool checkInputs();
+
+    /// Prepare output streams copied from first input
+    bool openOutput();
+
+    /// Whether re-encoded GOPs would carry the codec headers of input
+    bool canCutExact();
+
+    /// Copy kept range of input, times relative to input start
+    bool copyInput(EditInput *input, int64_t from, int64_t to);
+
+    /// Time of last video keyframe at or before given time, relative to input start
+    int64_t findKeyFrame(EditInput *input, int64_t t);
+
+    /// Packet time relative to input start, AV_TIME_BASE units
+    int64_t packetTime(EditInput *input, const AVPacket *pkt);
+
+    /// Open decoder & encoder for partial GOPs of input
+    bool openCutCodecs(EditInput *input, std::unique_ptr<InputStream> &ist, std::unique_ptr<OutputStream> &ost);
+
+    /// Decode packet of partial GOP and encode frames within kept range, nullptr flushes both
+    void encodeCut(EditInput *input, InputStream *ist, OutputStream *ost, AVPacket *pkt, int64_t from, int64_t to,
+                   int64_t shift);
+
+    /// Shift packet to joined timeline and write it
+    void writePacket(AVPacket *pkt, AVRational tb, int64_t shift);
+
+    /// Decode frame from input stream packet
+    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent);
+
+    /// Encode frame to output stream packet
+    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent);
+
+    EditConfig _config;
+    std::vector<std::unique_ptr<EditInput>> _inputs;
+    AVFormatContext *_tmpl, *_scratch; // output streams, partial GOP encoder streams
+    std::unique_ptr<MediaMuxer> _muxer;
+    std::vector<int64_t> _lastDts;
+    int64_t _written; // end of written output, AV_TIME_BASE units
+};
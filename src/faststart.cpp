@@ -0,0 +1,204 @@
+#include "faststart.hpp"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+/**
+ * @brief Box
+ *
+ * This structure stores the position of one top-level box.
+ */
+struct Box
+{
+    std::string type;
+    int64_t pos, size;
+    int64_t header; // 16 with 64-bit size
+};
+
+static uint32_t readU32(const unsigned char *p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint64_t readU64(const unsigned char *p)
+{
+    return (uint64_t(readU32(p)) << 32) | readU32(p + 4);
+}
+
+static void writeU32(unsigned char *p, uint32_t v)
+{
+    p[0] = static_cast<unsigned char>(v >> 24);
+    p[1] = static_cast<unsigned char>(v >> 16);
+    p[2] = static_cast<unsigned char>(v >> 8);
+    p[3] = static_cast<unsigned char>(v);
+}
+
+static void writeU64(unsigned char *p, uint64_t v)
+{
+    writeU32(p, static_cast<uint32_t>(v >> 32));
+    writeU32(p + 4, static_cast<uint32_t>(v));
+}
+
+/// Top-level boxes of file, empty if one is malformed
+static std::vector<Box> readBoxes(std::fstream &f, int64_t fileSize)
+{
+    std::vector<Box> boxes;
+    int64_t pos = 0;
+    while (pos + BOX_HEADER_BYTES <= fileSize)
+    {
+        unsigned char header[16];
+        f.seekg(pos);
+        f.read(reinterpret_cast<char *>(header), BOX_HEADER_BYTES);
+        if (!f)
+            return {};
+        Box box{std::string(reinterpret_cast<char *>(header + 4), 4), pos, readU32(header), BOX_HEADER_BYTES};
+        if (box.size == 1)
+        {
+            f.read(reinterpret_cast<char *>(header + 8), 8);
+            if (!f)
+                return {};
+            box.size = static_cast<int64_t>(readU64(header + 8));
+            box.header = 16;
+        }
+        else if (box.size == 0)
+            box.size = fileSize - pos;
+        if (box.size < box.header || pos + box.size > fileSize)
+            return {};
+        boxes.push_back(box);
+        pos += box.size;
+    }
+    return boxes;
+}
+
+/// Add delta to chunk offsets of the boxes in data [begin, end), false if a 32-bit offset would overflow
+static bool patchOffsets(std::vector<unsigned char> &data, size_t begin, size_t end, int64_t delta)
+{
+    size_t pos = begin;
+    while (pos + BOX_HEADER_BYTES <= end)
+    {
+        uint64_t size = readU32(&data[pos]);
+        std::string type(reinterpret_cast<const char *>(&data[pos + 4]), 4);
+        size_t header = BOX_HEADER_BYTES;
+        if (size == 1 && pos + 16 <= end)
+        {
+            size = readU64(&data[pos + 8]);
+            header = 16;
+        }
+        else if (size == 0)
+            size = end - pos;
+        if (size < header || pos + size > end)
+            return false;
+        if (type == "trak" || type == "mdia" || type == "minf" || type == "stbl")
+        {
+            if (!patchOffsets(data, pos + header, pos + size, delta))
+                return false;
+        }
+        else if (type == "stco" || type == "co64")
+        {
+            // version & flags, entry count, then one offset per chunk
+            size_t width = type == "stco" ? 4 : 8;
+            size_t entries = pos + header + 8;
+            if (entries > pos + size)
+                return false;
+            uint64_t count = readU32(&data[pos + header + 4]);
+            if (entries + count * width > pos + size)
+                return false;
+            for (uint64_t i = 0; i < count; i++)
+            {
+                auto p = &data[entries + i * width];
+                if (width == 8)
+                {
+                    writeU64(p, readU64(p) + delta);
+                    continue;
+                }
+                // widening stco to co64 would change moov size again, rare enough to keep moov at the end
+                int64_t offset = int64_t(readU32(p)) + delta;
+                if (offset < 0 || offset > int64_t(UINT32_MAX))
+                    return false;
+                writeU32(p, static_cast<uint32_t>(offset));
+            }
+        }
+        pos += size;
+    }
+    return true;
+}
+
+/// Move bytes [begin, end) of file by delta, source & destination may overlap
+static bool moveBytes(std::fstream &f, int64_t begin, int64_t end, int64_t delta)
+{
+    std::vector<char> buffer(FASTSTART_COPY_BYTES);
+    int64_t left = end - begin;
+    while (left > 0)
+    {
+        auto n = (std::min)(left, static_cast<int64_t>(buffer.size()));
+        // forward moves copy from the end, so nothing is overwritten before it is read
+        auto from = delta > 0 ? begin + left - n : end - left;
+        f.seekg(from);
+        f.read(buffer.data(), n);
+        f.seekp(from + delta);
+        f.write(buffer.data(), n);
+        if (!f)
+            return false;
+        left -= n;
+    }
+    return true;
+}
+
+bool moveMoovToFront(const std::string &path, int64_t reserve, bool &shifted)
+{
+    shifted = false;
+    std::error_code ec;
+    auto fileSize = static_cast<int64_t>(fs::file_size(path, ec));
+    if (ec)
+        return false;
+    std::fstream f(path, std::ios::in | std::ios::out | std::ios::binary);
+    if (!f)
+        return false;
+    // reserved free box, ftyp, media, then moov last as the muxer writes it without faststart
+    auto boxes = readBoxes(f, fileSize);
+    if (boxes.size() < 3 || boxes[0].type != "free" || boxes[0].size != reserve || boxes[1].type != "ftyp" ||
+        boxes.back().type != "moov")
+        return false;
+    auto &ftyp = boxes[1];
+    auto &moov = boxes.back();
+    std::vector<unsigned char> ftypData(ftyp.size), moovData(moov.size);
+    f.seekg(ftyp.pos);
+    f.read(reinterpret_cast<char *>(ftypData.data()), ftyp.size);
+    f.seekg(moov.pos);
+    f.read(reinterpret_cast<char *>(moovData.data()), moov.size);
+    if (!f)
+        return false;
+    auto dataPos = ftyp.pos + ftyp.size;
+    auto dataEnd = moov.pos;
+    // media stays in place when moov fits & the rest can be padded by a free box,
+    // otherwise it moves by the difference, offsets are patched before the file is touched
+    auto room = reserve - moov.size;
+    int64_t delta = room == 0 || room >= BOX_HEADER_BYTES ? 0 : -room;
+    if (delta != 0)
+    {
+        if (!patchOffsets(moovData, moov.header, moovData.size(), delta))
+            return false;
+        if (!moveBytes(f, dataPos, dataEnd, delta))
+            return false;
+        shifted = true;
+    }
+    f.seekp(0);
+    f.write(reinterpret_cast<const char *>(ftypData.data()), ftyp.size);
+    f.write(reinterpret_cast<const char *>(moovData.data()), moov.size);
+    if (delta == 0 && room > 0)
+    {
+        std::vector<unsigned char> pad(room, 0);
+        writeU32(pad.data(), static_cast<uint32_t>(room));
+        std::copy_n("free", 4, pad.begin() + 4);
+        f.write(reinterpret_cast<const char *>(pad.data()), room);
+    }
+    f.close();
+    if (!f)
+        return false;
+    fs::resize_file(path, dataEnd + delta, ec);
+    return !ec;
+}
@@ -0,0 +1,27 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+/** @file */
+
+/// Bytes of a box header: 32-bit size & type
+#define BOX_HEADER_BYTES 8
+
+/// Bytes copied per step when mdat is shifted
+#define FASTSTART_COPY_BYTES (4 << 20)
+
+/**
+ * @brief Move MP4/MOV Sample Table To Front
+ *
+ * Rewrites a finished file laid out as [free][ftyp][...][mdat][moov], as written by the mov muxer
+ * after a free box reserved in front of its header, into [ftyp][moov][free][...][mdat].
+ * moov takes the reserved space when it fits and no media byte moves; otherwise mdat is shifted
+ * once, like the muxer's own faststart pass, and chunk offsets (stco, co64) are patched.
+ *
+ * @param path Output file, closed by the muxer
+ * @param reserve Size of the leading free box
+ * @param shifted Set when moov did not fit and mdat was shifted
+ * @return true if moov is at the front
+ * @return false if the file is left as written, still playable with moov at the end
+ */
+bool moveMoovToFront(const std::string &path, int64_t reserve, bool &shifted);
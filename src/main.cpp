@@ -4,20 +4,36 @@
 #include "media.hpp"
 #include "utils.hpp"
 
+#include <csignal>
 #include <memory>
 #include <string>
 
-int main()
+int main(int argc, char **argv)
 {
     std::shared_ptr<AppContext> ctx;
     std::shared_ptr<MediaHandler> handler;
     const std::string appname = "Recorder";
 
+    // command line tools live in recorder-cli, so headless runs never load the OpenGL stack
+    if (argc > 1)
+    {
+        display_message(appname, "recorder takes no arguments, use recorder-cli " + std::string(argv[1]) + " ...",
+                        MESSAGE_ERROR);
+        return 1;
+    }
+
+#if __linux__
+    // a pipe or FIFO reader going away must fail the output, not kill the app
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
     // init variables
     try
     {
         ctx = std::make_shared<AppContext>(appname);
         handler = std::make_shared<MediaHandler>();
+        // a window has no other way to be driven by scripts
+        handler->OpenControl();
     }
     catch (const std::exception &e)
     {
@@ -46,6 +62,11 @@ int main()
                 handler->UI();
                 ImGui::EndTabItem();
             }
+            if (ImGui::BeginTabItem("Stats"))
+            {
+                handler->StatsUI();
+                ImGui::EndTabItem();
+            }
             ImGui::EndTabBar();
         }
         ImGui::End();
@@ -6,10 +6,15 @@
 #include "media.hpp"
 #include "utils.hpp"
 
+#if __linux__
+#include <signal.h>
+#endif
+
 #include <algorithm>
 #include <chrono>
 #include <cstdio>
 #include <cstring>
+#include <ctime>
 #include <fstream>
 #include <stdexcept>
 #include <vector>
@@ -18,22 +23,35 @@ using sysclock = std::chrono::system_clock;
 
 // reference: https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/muxing.c
 
-MediaHandler::MediaHandler() : _recording(false)
+MediaHandler::MediaHandler()
+    : _coutBuf(nullptr), _statsRolling(true), _recording(false), _armed(false), _monitorLoop(false),
+      _monitorSkip(true), _mediaTime(0.0), _frames(0), _dropped(0), _captureCpu(0.0), _muxCpu(0.0)
 {
     _media = std::make_unique<MediaOutput>();
     initMedia();
     _video = std::make_unique<VideoCapture>();
     _audio = std::make_unique<AudioCapture>();
+    _stats = std::make_unique<PipelineStats>();
+    _trace = std::make_unique<PipelineTrace>();
+    _stats->setTrace(_trace.get());
+    _video->setStats(_stats.get());
+    _audio->setStats(_stats.get());
+    _replay = std::make_unique<ReplayBuffer>();
+    _transcoder = std::make_unique<Transcoder>();
     avdevice_register_all();
+    _control = std::make_unique<ControlServer>();
 }
 
 MediaHandler::~MediaHandler()
 {
+    _control->close();
     StopRecord();
+    _transcoder->cancel();
 }
 
 void MediaHandler::ConfigWindow(int x, int y, int w, int h, int mw, int mh)
 {
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
     int xx = (std::max)(0, (std::min)(mw, x + w));
     int yy = (std::max)(0, (std::min)(mh, y + h));
     _media->x = (std::max)(0, (std::min)(mw, x));
@@ -52,25 +70,84 @@ void MediaHandler::ConfigWindow(int x, int y, int w, int h, int mw, int mh)
         _media->h--;
     if (_media->w % 2)
         _media->w--;
+    if (_recording)
+        _video->setRegion({_media->x, _media->y, _media->w, _media->h});
+}
+
+void MediaHandler::SetCaptureSize(int w, int h)
+{
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    if (_recording)
+        return;
+    _media->w = (std::max)(0, w) & ~1;
+    _media->h = (std::max)(0, h) & ~1;
+    requestCalibration();
+}
+
+bool MediaHandler::ArmRecord()
+{
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    return startPipeline(true);
 }
 
 bool MediaHandler::StartRecord()
 {
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    // armed pipeline is already grabbing, output begins with its next frame
+    if (_armed && _recordT.joinable())
+    {
+        _armed = false;
+        return true;
+    }
+    return startPipeline(false);
+}
+
+bool MediaHandler::startPipeline(bool armed)
+{
+    // stopping the previous pipeline also disarms, so arm only after it
     StopRecord();
+    if (_transcoder->isRunning())
+    {
+        display_message(NAME, "previous recording is still being encoded", MESSAGE_WARN);
+        return false;
+    }
     // av_log_set_level(AV_LOG_TRACE);
-    bool success = true;
     // try to lock output file
-    success = success && lockMediaFile();
+    auto locks = outputPaths();
+    if (!lockMediaFile(locks))
+        return false;
+    // refresh output streams
+    bool success = initMedia();
     // init video
-    success = success && _video->openCapture(_media->fmtCtx, {_media->x, _media->y, _media->w, _media->h});
+    success = success && _video->openCapture(_media->recordCtx(), {_media->x, _media->y, _media->w, _media->h},
+                                              _media->renditions);
     // init audio
     if (_media->canAudio)
-        success = success && _audio->openCapture(_media->fmtCtx);
+        success = success && _audio->openCapture(_media->recordCtx());
+    // init extra monitors, tracks must exist before the output opens
+    success = success && openMonitors();
     // open file
     success = success && openMedia();
     if (!success)
+    {
+        // grab threads already run once a capture opened
+        _video->closeCapture();
+        _audio->closeCapture();
+        _monitors.clear();
+        unlockMediaFile(locks);
         return false;
+    }
     // start thread
+    _mediaTime = 0.0;
+    _frames = 0;
+    _dropped = 0;
+    _captureCpu = 0.0;
+    _muxCpu = 0.0;
+    _stats->reset();
+    if (_media->trace)
+        _trace->start(_media->traceMemory);
+    _armed = armed;
+    _recording = true;
     _recordLoop = true;
     _recordT = std::thread([this] { recordInternal(); });
     return true;
@@ -78,52 +155,209 @@ bool MediaHandler::StartRecord()
 
 bool MediaHandler::StopRecord()
 {
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    _armed = false;
     _recordLoop = false;
     if (_recordT.joinable())
         _recordT.join();
     _video->closeCapture();
     _audio->closeCapture();
+    _monitors.clear();
+    if (_trace->active())
+        writeTrace();
+    // size may have changed while recording
+    requestCalibration();
     return true;
 }
 
+bool MediaHandler::SaveReplay()
+{
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    if (!_recording || !_media->replay)
+    {
+        display_message(NAME, "instant replay is not running", MESSAGE_WARN);
+        return false;
+    }
+    // out.mp4 -> out_replay_20220101_120000.mp4
+    char stamp[32];
+    auto now = sysclock::to_time_t(sysclock::now());
+    std::strftime(stamp, sizeof(stamp), "_replay_%Y%m%d_%H%M%S", std::localtime(&now));
+    auto p = fs::path(_media->path);
+    MuxerConfig config;
+    config.path = p.replace_filename(p.stem().string() + stamp + p.extension().string()).string();
+    config.layout = _media->layout;
+    config.expectedTime = _media->replayTime / 60 + 1;
+    config.blocking = true;
+    return _replay->save(config);
+}
+
 void MediaHandler::SelectOutputPath()
 {
+    SetOutputPath(selectFilePath());
+}
+
+bool MediaHandler::SetOutputPath(const std::string &path)
+{
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
+    // extra outputs & monitors are kept when the main output changes
+    auto sinks = std::move(_media->sinks);
+    auto renditions = std::move(_media->renditions);
+    auto monitors = std::move(_media->monitors);
+    auto monitorOutput = _media->monitorOutput;
+    auto old = std::move(_media);
     _media = std::make_unique<MediaOutput>();
-    char filepath[1025] = "out";
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
-    // TODO: implement code for windows
-    filepath[0] = '\0';
-    OPENFILENAMEA f{};
-    f.lStructSize = sizeof(OPENFILENAMEA);
-    f.hwndOwner = NULL;
-    f.lpstrFile = filepath;
-    f.lpstrFilter = "MP4\0*.mp4\0GIF\0*.gif\0WEBM\0*.webm\0MOV\0*.mov\0WMV\0*.wmv\0AVI\0*.avi\0FLV\0*.flv\0APNG\0*."
-                    "apng\0MPG\0*.mpg\0All Files\0*.*\0\0";
-    f.lpstrTitle = "Set Output File";
-    f.nMaxFile = 1024;
-    f.lpstrDefExt = "mp4";
-    f.Flags = OFN_EXPLORER | OFN_PATHMUSTEXIST | OFN_HIDEREADONLY | OFN_OVERWRITEPROMPT;
-    GetOpenFileNameA(&f);
-#elif __linux__
-    FILE *f = popen("zenity --file-selection --save --confirm-overwrite\
-        --title=\"Set Output File\"\
-        --filename=\"out.mp4\"",
-                    "r");
-    fgets(filepath, 1024, f);
-    pclose(f);
-    filepath[strlen(filepath) - 1] = 0;
-#else
-    // unsupported platform
-    _media->setPath(OUTPUT_PATH_DEFAULT);
-    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
-#endif
-    _media->setPath(filepath);
+    _media->setPath(path);
+    // capture area as well, calibration targets it
+    _media->x = old->x;
+    _media->y = old->y;
+    _media->w = old->w;
+    _media->h = old->h;
+    _media->sinks = std::move(sinks);
+    _media->renditions = std::move(renditions);
+    _media->monitors = std::move(monitors);
+    _media->monitorOutput = monitorOutput;
     validateOutputFormat();
     if (!initMedia())
     {
         _media = std::make_unique<MediaOutput>();
+        _media->w = old->w;
+        _media->h = old->h;
         initMedia();
     }
+    if (!_recording)
+        requestCalibration();
+    return _media->path == fs::absolute(path).string();
+}
+
+void MediaHandler::SetFrameRate(int fps)
+{
+    _video->setFrameRate(fps);
+}
+
+void MediaHandler::SetVideoSource(const SourceConfig &config)
+{
+    _video->setSource(config);
+}
+
+void MediaHandler::SetAudioSource(const SourceConfig &config)
+{
+    _audio->setSource(config);
+}
+
+void MediaHandler::SetDropPolicy(int policy)
+{
+    _video->setDropPolicy(policy);
+}
+
+void MediaHandler::SetAdaptive(const AdaptiveBounds &bounds)
+{
+    _video->setAdaptive(bounds);
+}
+
+void MediaHandler::SetMonitors(const std::vector<int> &monitors, int output)
+{
+    _media->monitors.assign(monitors.begin(), monitors.end());
+    _media->monitorOutput = output;
+}
+
+void MediaHandler::SetLive(int live)
+{
+    if (live != OUTPUT_LIVE_NONE && !_media->canFragment)
+    {
+        display_message(NAME, "live output needs mp4 or mov, skipping", MESSAGE_WARN);
+        return;
+    }
+    _media->live = live;
+}
+
+void MediaHandler::SetLayout(int layout, int expectedTime)
+{
+    _media->layout = layout;
+    if (expectedTime > 0)
+        _media->expectedTime = expectedTime;
+}
+
+bool MediaHandler::OpenControl()
+{
+    return _control->open([this](const std::string &command) { return handleCommand(command); });
+}
+
+void MediaHandler::SetSkipTime(int ms)
+{
+    _media->skipTime = (std::max)(0, ms);
+}
+
+void MediaHandler::SetTrace(int memoryMB)
+{
+    _media->trace = memoryMB > 0;
+    if (_media->trace)
+        _media->traceMemory = memoryMB;
+}
+
+PipelineStats &MediaHandler::StageStats()
+{
+    return *_stats;
+}
+
+RecordStats MediaHandler::Stats()
+{
+    RecordStats stats;
+    stats.armed = _armed;
+    stats.recording = _recording && !stats.armed;
+    stats.encoding = _transcoder->isRunning();
+    stats.mediaTime = _mediaTime;
+    stats.encodeProgress = _transcoder->progress();
+    stats.frames = _frames;
+    stats.dropped = _dropped;
+    stats.frameDrops = _video->frameDrops();
+    stats.captureCpu = _captureCpu;
+    stats.muxCpu = _muxCpu;
+    return stats;
+}
+
+void MediaHandler::AddOutputPath()
+{
+    MuxerConfig config;
+    config.path = fs::absolute(selectFilePath()).string();
+    if (validateExtraPath(config.path))
+        _media->sinks.push_back(config);
+}
+
+void MediaHandler::AddRenditionPath()
+{
+    RenditionConfig config;
+    config.path = fs::absolute(selectFilePath()).string();
+    if (validateExtraPath(config.path))
+        _media->renditions.push_back(config);
+}
+
+void MediaHandler::ConvertFile()
+{
+    if (_recording || _transcoder->isRunning())
+    {
+        display_message(NAME, "wait for recording or encoding to finish", MESSAGE_WARN);
+        return;
+    }
+    auto input = selectFilePath(false);
+    if (input.empty() || !fs::exists(input))
+        return;
+    auto output = fs::absolute(selectFilePath()).string();
+    if (!isSupportedFormat(output))
+    {
+        display_message(NAME, "unsupported format " + output, MESSAGE_WARN);
+        return;
+    }
+    std::error_code ec;
+    if (fs::equivalent(input, output, ec))
+    {
+        display_message(NAME, "output must differ from input", MESSAGE_WARN);
+        return;
+    }
+    if (!lockMediaFile({output}))
+        return;
+    auto config = Transcoder::convertConfig(input, output);
+    if (!_transcoder->start(config, [this, output](bool) { unlockMediaFile({output}); }))
+        unlockMediaFile({output});
 }
 
 bool MediaHandler::IsRecording()
@@ -133,84 +367,344 @@ bool MediaHandler::IsRecording()
 
 void MediaHandler::recordInternal()
 {
-    _recording = true;
+    PipelineTrace::nameThread("record");
     // delay info
     if (_media->skipTime)
         display_message(NAME, "skip time (ms) on start: " + std::to_string(_media->skipTime), MESSAGE_INFO);
+    // encoded packets are handed to the muxer thread, or kept in memory for instant replay
+    // every muxer queues its own reference, so outputs cost I/O only
+    PacketCallback onPacket = [this](const AVPacket *pkt) {
+        for (auto &muxer : _muxers)
+            muxer->writePacket(pkt);
+    };
+    if (_media->replay)
+        onPacket = [this](const AVPacket *pkt) { _replay->writePacket(pkt); };
+    // extra monitors encode on their own threads, skipping & stopping with this one
+    _monitorSkip = true;
+    _monitorLoop = true;
+    for (auto &monitor : _monitors)
+        monitor->t = std::thread([this, capture = monitor.get()] { monitorInternal(capture); });
     // start reading frames
     auto startT = sysclock::now();
-    bool videoRead = true, audioRead = true, skip = true;
+    auto startCpu = thread_cpu_time();
+    bool videoRead = true, audioRead = true, skip = true, frameWritten = false;
     do
     {
         if (skip)
         {
-            if (std::chrono::duration_cast<std::chrono::milliseconds>(sysclock::now() - startT).count() >
-                _media->skipTime)
+            // armed start takes effect on the next grabbed frame, warm up already happened while armed
+            if (_armed)
+                startT = sysclock::now() - std::chrono::milliseconds(_media->skipTime + 1);
+            else if (std::chrono::duration_cast<std::chrono::milliseconds>(sysclock::now() - startT).count() >
+                     _media->skipTime)
             {
                 // delay
                 display_message(NAME, "started recording", MESSAGE_INFO);
                 skip = false;
             }
+            _monitorSkip = skip;
         }
         if (videoRead && videoFirst())
-            videoRead = _video->writeFrame(_media->fmtCtx, skip, false);
+        {
+            TraceScope frameScope(_stats->trace(), "video_frame", _frames);
+            videoRead = _video->writeFrame(onPacket, skip, false);
+            _mediaTime = _video->mediaTime();
+            if (!frameWritten && _mediaTime > 0.0)
+            {
+                frameWritten = true;
+                std::lock_guard<std::mutex> lock(_frameLock);
+                _frameCV.notify_all();
+            }
+            updateStats(startCpu);
+        }
         else
-            audioRead = _audio->writeFrame(_media->fmtCtx, skip, false);
+        {
+            TraceScope packetScope(_stats->trace(), "audio_packet");
+            audioRead = _audio->writeFrame(onPacket, skip, false);
+        }
     } while ((videoRead || audioRead) && _recordLoop);
+    closeMonitors();
     // flush outputs
-    _video->writeFrame(_media->fmtCtx, false, true);
-    _audio->writeFrame(_media->fmtCtx, false, true);
+    _video->writeFrame(onPacket, false, true);
+    _audio->writeFrame(onPacket, false, true);
     closeMedia();
+    updateStats(startCpu);
+    if (_stats->enabled())
+        writeStatsSummary(std::chrono::duration<double>(sysclock::now() - startT).count());
     display_message(NAME, "stopped recording", MESSAGE_INFO);
-    display_message(NAME, "output saved to " + _media->path, MESSAGE_INFO);
-    unlockMediaFile();
+    if (_media->captureCtx)
+        startTranscode();
+    else
+        unlockMediaFile(outputPaths());
+    std::lock_guard<std::mutex> lock(_frameLock);
     _recording = false;
+    _frameCV.notify_all();
 }
 
-void MediaHandler::validateOutputFormat()
+std::string MediaHandler::selectFilePath(bool save)
 {
-    const std::vector<std::string> SUPPORT_EXTS = {".mp4", ".mov", ".wmv",  ".gif", ".webm",
-                                                   ".avi", ".flv", ".apng", ".mpg"};
-    auto ext = fs::path(_media->path).extension().string();
+    char filepath[1025] = "out";
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    // TODO: implement code for windows
+    filepath[0] = '\0';
+    OPENFILENAMEA f{};
+    f.lStructSize = sizeof(OPENFILENAMEA);
+    f.hwndOwner = NULL;
+    f.lpstrFile = filepath;
+    f.lpstrFilter = "MP4\0*.mp4\0GIF\0*.gif\0WEBM\0*.webm\0MOV\0*.mov\0WMV\0*.wmv\0AVI\0*.avi\0FLV\0*.flv\0APNG\0*."
+                    "apng\0MPG\0*.mpg\0NUT\0*.nut\0Y4M\0*.y4m\0All Files\0*.*\0\0";
+    f.lpstrTitle = save ? "Set Output File" : "Open Input File";
+    f.nMaxFile = 1024;
+    f.lpstrDefExt = "mp4";
+    f.Flags = OFN_EXPLORER | OFN_PATHMUSTEXIST | OFN_HIDEREADONLY | (save ? OFN_OVERWRITEPROMPT : OFN_FILEMUSTEXIST);
+    GetOpenFileNameA(&f);
+#elif __linux__
+    FILE *f = popen(save ? "zenity --file-selection --save --confirm-overwrite\
+        --title=\"Set Output File\"\
+        --filename=\"out.mp4\""
+                         : "zenity --file-selection --title=\"Open Input File\"",
+                    "r");
+    fgets(filepath, 1024, f);
+    pclose(f);
+    filepath[strlen(filepath) - 1] = 0;
+#else
+    // unsupported platform
+    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
+    return OUTPUT_PATH_DEFAULT;
+#endif
+    return filepath;
+}
+
+std::string MediaHandler::handleCommand(const std::string &command)
+{
+    // media times are output timestamps (seconds) of the frame a command took effect on
+    auto stamp = [](double t) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6f", t);
+        return std::string(buf);
+    };
+    std::unique_lock<std::recursive_mutex> lock(_commandLock);
+    auto space = command.find(' ');
+    auto verb = command.substr(0, space);
+    auto arg = space != std::string::npos ? command.substr(space + 1) : "";
+    if (verb == "arm")
+    {
+        if (_recording)
+            return "error already recording";
+        return ArmRecord() ? "ok armed" : "error failed to open pipeline";
+    }
+    if (verb == "start")
+    {
+        if (_recording && !_armed)
+            return "error already recording";
+        if (!StartRecord())
+            return "error failed to start";
+        // reply once the first frame is written, with its timestamp, other commands may run meanwhile
+        lock.unlock();
+        std::unique_lock<std::mutex> frameLock(_frameLock);
+        _frameCV.wait_for(frameLock, std::chrono::milliseconds(OUTPUT_START_TIMEOUT),
+                          [this] { return _mediaTime > 0.0 || !_recording; });
+        return _mediaTime > 0.0 ? "ok " + stamp(_mediaTime) : "error no frame captured";
+    }
+    if (verb == "stop")
+    {
+        if (!_recording)
+            return "error not recording";
+        StopRecord();
+        return "ok " + stamp(_mediaTime);
+    }
+    if (verb == "mark")
+    {
+        if (!_recording || _armed)
+            return "error not recording";
+        // markers go to a sidecar file, the output itself is still being written
+        double t = _mediaTime;
+        std::ofstream f(_media->path + ".marks", std::ios::app);
+        f << stamp(t) << " " << arg << std::endl;
+        return f.good() ? "ok " + stamp(t) : "error failed to write markers";
+    }
+    if (verb == "status")
+    {
+        auto stats = Stats();
+        std::string state = "idle";
+        if (stats.armed)
+            state = "armed";
+        else if (stats.recording)
+            state = "recording";
+        else if (stats.encoding)
+            state = "encoding";
+        return "ok " + state + " " + stamp(stats.mediaTime) + " " + _media->path;
+    }
+    return "error unknown command " + verb;
+}
+
+bool MediaHandler::isSupportedFormat(const std::string &path)
+{
+    const std::vector<std::string> SUPPORT_EXTS = {".mp4", ".mov", ".wmv", ".gif", ".webm", ".avi",
+                                                   ".flv", ".apng", ".mpg", ".nut", ".y4m"};
+    auto ext = fs::path(path).extension().string();
     for (auto &sup : SUPPORT_EXTS)
     {
         if (!ext.compare(sup))
-            return;
+            return true;
     }
-    display_message(NAME, "unsupported output format " + ext + ", setting to default", MESSAGE_WARN);
-    _media->setPath(OUTPUT_PATH_DEFAULT);
+    return false;
+}
+
+std::vector<std::string> MediaHandler::outputPaths()
+{
+    std::vector<std::string> paths = {_media->path};
+    for (auto &sink : _media->sinks)
+        paths.push_back(sink.path);
+    for (auto &rendition : _media->renditions)
+        paths.push_back(rendition.path);
+    if (monitorFiles())
+        for (auto index : _media->monitors)
+            paths.push_back(monitorPath(index));
+    if (_media->live != OUTPUT_LIVE_NONE)
+        paths.push_back(liveDir());
+    if (isCaptureFirst())
+        paths.push_back(capturePath());
+    return paths;
 }
 
-bool MediaHandler::lockMediaFile()
+std::string MediaHandler::liveDir()
 {
-    auto lockFileName = _media->path + ".lock";
-    // check if lock exists
-    if (fs::exists(lockFileName))
+    // out.mp4 -> out_live/
+    auto p = fs::path(_media->path);
+    return p.replace_filename(p.stem().string() + "_live").string();
+}
+
+std::string MediaHandler::livePlaylist()
+{
+    auto name = _media->live == OUTPUT_LIVE_LHLS ? "master.m3u8" : "index.m3u8";
+    return (fs::path(liveDir()) / name).string();
+}
+
+bool MediaHandler::validateExtraPath(const std::string &path)
+{
+    if (!isSupportedFormat(path))
+    {
+        display_message(NAME, "unsupported output format " + fs::path(path).extension().string(), MESSAGE_WARN);
+        return false;
+    }
+    auto paths = outputPaths();
+    if (std::find(paths.begin(), paths.end(), path) != paths.end())
     {
-        display_message(
-            NAME, "media file is locked by another program. If not, delete \"" + lockFileName + "\" and try again",
-            MESSAGE_WARN);
+        display_message(NAME, "output is already added", MESSAGE_WARN);
         return false;
     }
-    // create lock file
-    std::fstream f(lockFileName, std::ios::out);
-    if (!f.is_open())
+    return true;
+}
+
+void MediaHandler::validateOutputFormat()
+{
+    if (isSupportedFormat(_media->path))
+        return;
+    auto ext = fs::path(_media->path).extension().string();
+    display_message(NAME, "unsupported output format " + ext + ", setting to default", MESSAGE_WARN);
+    _media->setPath(OUTPUT_PATH_DEFAULT);
+}
+
+bool MediaHandler::lockMediaFile(const std::vector<std::string> &paths)
+{
+    for (size_t i = 0; i < paths.size(); i++)
     {
-        display_message(NAME, "failed to lock media file", MESSAGE_WARN);
+        auto lockFileName = paths[i] + ".lock";
+        // check if lock exists
+        if (fs::exists(lockFileName))
+        {
+            display_message(NAME,
+                            "media file is locked by another program. If not, delete \"" + lockFileName +
+                                "\" and try again",
+                            MESSAGE_WARN);
+        }
+        else
+        {
+            // create lock file
+            std::fstream f(lockFileName, std::ios::out);
+            if (f.is_open())
+            {
+                f.close();
+                continue;
+            }
+            display_message(NAME, "failed to lock media file", MESSAGE_WARN);
+        }
+        // release locks taken so far
+        for (size_t j = 0; j < i; j++)
+            fs::remove(paths[j] + ".lock");
         return false;
     }
-    f.close();
     return true;
 }
 
-void MediaHandler::unlockMediaFile()
+void MediaHandler::unlockMediaFile(const std::vector<std::string> &paths)
+{
+    for (auto &path : paths)
+        fs::remove(path + ".lock");
+}
+
+bool MediaHandler::isCaptureFirst()
+{
+    return _media->captureFirst && !_media->replay && !_media->rawStdout;
+}
+
+std::string MediaHandler::capturePath()
+{
+    // out.mp4 -> out_capture.mkv
+    auto p = fs::path(_media->path);
+    return p.replace_filename(p.stem().string() + "_capture.mkv").string();
+}
+
+MuxerConfig MediaHandler::outputConfig()
 {
-    auto lockFileName = _media->path + ".lock";
-    fs::remove(lockFileName);
+    MuxerConfig config;
+    config.path = _media->path;
+    config.layout = _media->layout;
+    config.expectedTime = _media->expectedTime;
+    config.segmentTime = _media->segmentTime;
+    config.segmentSize = _media->segmentSize;
+    return config;
+}
+
+void MediaHandler::startTranscode()
+{
+    TranscodeConfig config;
+    config.input = capturePath();
+    config.output = outputConfig();
+    config.videoCodec = _media->fmtCtx->video_codec_id;
+    config.audioCodec = _media->canAudio ? _media->fmtCtx->audio_codec_id : AV_CODEC_ID_NONE;
+    auto vst = _video->getStream();
+    if (vst && vst->encCtx)
+        config.videoBitRate = vst->encCtx->bit_rate;
+    auto ast = _audio->getStream();
+    if (ast && ast->encCtx)
+        config.sampleRate = ast->encCtx->sample_rate;
+    // files stay locked until the final output is written
+    auto locks = outputPaths();
+    bool started = _transcoder->start(config, [this, locks, input = config.input](bool success) {
+        if (success)
+            fs::remove(input);
+        else
+            display_message(NAME, "lossless capture kept at " + input, MESSAGE_WARN);
+        unlockMediaFile(locks);
+    });
+    if (!started)
+        unlockMediaFile(locks);
 }
 
 bool MediaHandler::initMedia()
 {
+    if (_media->fmtCtx)
+    {
+        avformat_free_context(_media->fmtCtx);
+        _media->fmtCtx = nullptr;
+    }
+    if (_media->captureCtx)
+    {
+        avformat_free_context(_media->captureCtx);
+        _media->captureCtx = nullptr;
+    }
     auto formatOut = av_guess_format(nullptr, _media->path.c_str(), nullptr);
     // allocate format
     {
@@ -226,6 +720,19 @@ bool MediaHandler::initMedia()
         }
         _media->fmtCtx->video_codec_id = formatOut->video_codec;
         _media->fmtCtx->audio_codec_id = formatOut->audio_codec;
+        // uncompressed outputs for external encoders
+        _media->canRaw = true;
+        if (!std::strcmp(formatOut->name, "nut"))
+        {
+            _media->fmtCtx->video_codec_id = AV_CODEC_ID_RAWVIDEO;
+            _media->fmtCtx->audio_codec_id = AV_CODEC_ID_PCM_S16LE;
+        }
+        else if (!std::strcmp(formatOut->name, "yuv4mpegpipe"))
+            _media->fmtCtx->video_codec_id = AV_CODEC_ID_WRAPPED_AVFRAME;
+        else
+            _media->canRaw = false;
+        if (!_media->canRaw)
+            _media->rawStdout = false;
     }
     // check video & audio
     {
@@ -238,43 +745,177 @@ bool MediaHandler::initMedia()
         {
             _media->canAudio = false;
         }
+        // only the mov muxer (mp4, mov) supports layouts, its codecs also fit fMP4 live segments
+        _media->canFragment = !std::strcmp(formatOut->name, "mp4") || !std::strcmp(formatOut->name, "mov");
+        if (!_media->canFragment)
+            _media->live = OUTPUT_LIVE_NONE;
     }
-    // config output
+    // capture-first records with a cheap lossless codec, the chosen format is encoded after stop
+    if (isCaptureFirst())
     {
-        if (formatOut->video_codec == AV_CODEC_ID_APNG)
+        if (avformat_alloc_output_context2(&_media->captureCtx, nullptr, "matroska", capturePath().c_str()) < 0)
         {
-            av_opt_set_int(_media->fmtCtx->priv_data, "plays", 0, 0);
+            display_message(NAME, "failed to allocate format for " + capturePath(), MESSAGE_WARN);
+            return false;
         }
+        _media->captureCtx->video_codec_id = AV_CODEC_ID_UTVIDEO;
+        _media->captureCtx->audio_codec_id = AV_CODEC_ID_PCM_S16LE;
     }
     return true;
 }
 
 bool MediaHandler::openMedia()
 {
-    if (!(_media->fmtCtx->oformat->flags & AVFMT_NOFILE))
+    if (_media->replay)
     {
-        if (avio_open(&_media->fmtCtx->pb, _media->path.c_str(), AVIO_FLAG_WRITE) < 0)
-        {
-            display_message(NAME, "failed to open " + _media->path, MESSAGE_WARN);
-            return false;
-        }
+        _replay->open(_media->recordCtx(), _media->replayTime, int64_t(_media->replayMemory) << 20);
+        display_message(NAME, "instant replay buffering, nothing is written until saved", MESSAGE_INFO);
+        return true;
     }
-    if (avformat_write_header(_media->fmtCtx, nullptr) < 0)
+    auto config = outputConfig();
+    if (_media->captureCtx)
     {
-        display_message(NAME, "failed to write header to " + _media->path, MESSAGE_WARN);
+        // intermediate is a single plain file, layout & segments apply to the final encode
+        config = MuxerConfig();
+        config.path = capturePath();
+    }
+    else if (_media->rawStdout)
+    {
+        // stream goes to stdout, so console messages move to stderr
+        config.path = "pipe:1";
+        config.segmentTime = config.segmentSize = 0;
+        _coutBuf = std::cout.rdbuf(std::cerr.rdbuf());
+    }
+    else if (fs::is_fifo(_media->path))
+        display_message(NAME, "waiting for a reader on " + _media->path, MESSAGE_INFO);
+#if __linux__
+    // signal disposition belongs to the program, only tell it when a closing reader would kill it
+    struct sigaction pipeAction;
+    if ((_media->rawStdout || fs::is_fifo(_media->path)) && sigaction(SIGPIPE, nullptr, &pipeAction) == 0 &&
+        pipeAction.sa_handler == SIG_DFL)
+        display_message(NAME, "SIGPIPE is not ignored, the program ends if the reader goes away", MESSAGE_WARN);
+#endif
+    _muxers.clear();
+    _muxers.push_back(std::make_unique<MediaMuxer>());
+    _muxers.back()->setStats(_stats.get());
+    if (!_muxers.back()->open(_media->recordCtx(), config))
+    {
+        closeMedia();
         return false;
     }
-    av_dump_format(_media->fmtCtx, 0, _media->path.c_str(), 1);
+    if (_media->captureCtx)
+    {
+        if (!_media->sinks.empty() || _media->live != OUTPUT_LIVE_NONE)
+            display_message(NAME, "extra & live outputs are not written in capture-first mode", MESSAGE_WARN);
+        return true;
+    }
+    // a failing extra output must not stop the recording
+    for (auto &sink : _media->sinks)
+    {
+        auto muxer = std::make_unique<MediaMuxer>();
+        muxer->setStats(_stats.get());
+        if (muxer->open(_media->fmtCtx, sink))
+            _muxers.push_back(std::move(muxer));
+        else
+            display_message(NAME, "skipping output " + sink.path, MESSAGE_WARN);
+    }
+    // live playlist shares the encoded packets as well
+    if (_media->live != OUTPUT_LIVE_NONE)
+    {
+        MuxerConfig live;
+        live.path = (fs::path(liveDir()) / (_media->live == OUTPUT_LIVE_LHLS ? "live.mpd" : "index.m3u8")).string();
+        std::error_code ec;
+        fs::create_directories(liveDir(), ec);
+        auto muxer = std::make_unique<MediaMuxer>();
+        muxer->setStats(_stats.get());
+        if (!ec && muxer->open(_media->fmtCtx, live))
+        {
+            _muxers.push_back(std::move(muxer));
+            display_message(NAME, "live playlist at " + livePlaylist(), MESSAGE_INFO);
+        }
+        else
+            display_message(NAME, "skipping live output " + liveDir(), MESSAGE_WARN);
+    }
     return true;
 }
 
 bool MediaHandler::closeMedia()
 {
-    if (av_write_trailer(_media->fmtCtx) != 0)
-        display_message(NAME, "failed to write trailer to " + _media->path, MESSAGE_WARN);
-    if (!(_media->fmtCtx->oformat->flags & AVFMT_NOFILE))
-        avio_closep(&_media->fmtCtx->pb);
-    return true;
+    _replay->close();
+    bool success = true;
+    for (auto &muxer : _muxers)
+    {
+        success = muxer->close() && success;
+        if (muxer->droppedPackets())
+            display_message(NAME,
+                            std::to_string(muxer->droppedPackets()) + " packets dropped for " + muxer->getPath(),
+                            MESSAGE_WARN);
+    }
+    if (_coutBuf)
+    {
+        std::cout.rdbuf(_coutBuf);
+        _coutBuf = nullptr;
+    }
+    return success;
+}
+
+void MediaHandler::updateStats(double startCpu)
+{
+    int64_t dropped = 0;
+    double muxCpu = 0.0;
+    for (auto &muxer : _muxers)
+    {
+        dropped += muxer->droppedPackets();
+        muxCpu += muxer->cpuTime();
+    }
+    if (_video->getStream())
+        _frames = _video->getStream()->samples;
+    _dropped = dropped;
+    _captureCpu = thread_cpu_time() - startCpu;
+    _muxCpu = muxCpu;
+}
+
+void MediaHandler::writeStatsSummary(double wallTime)
+{
+    // out.mp4 -> out.mp4.stats.json
+    auto path = _media->path + ".stats.json";
+    auto stats = Stats();
+    char extra[768];
+    std::snprintf(extra, sizeof(extra),
+                  "  \"wall_time\": %.3f,\n  \"media_time\": %.3f,\n  \"frames\": %lld,\n  \"dropped\": %lld,\n"
+                  "  \"frame_drops\": {\"source_gaps\": %lld, \"queue_drops\": %lld, \"duplicated\": %lld},\n"
+                  "  \"capture_cpu\": %.3f,\n  \"mux_cpu\": %.3f",
+                  wallTime, stats.mediaTime, static_cast<long long>(stats.frames),
+                  static_cast<long long>(stats.dropped), static_cast<long long>(stats.frameDrops.sourceGaps),
+                  static_cast<long long>(stats.frameDrops.queueDrops),
+                  static_cast<long long>(stats.frameDrops.duplicated), stats.captureCpu, stats.muxCpu);
+    // quality steps of adaptive controller
+    std::string members = extra;
+    members += ",\n  \"quality_changes\": [";
+    auto &adaptive = _video->adaptive();
+    auto events = adaptive.events();
+    for (size_t i = 0; i < events.size(); i++)
+    {
+        auto &event = events[i];
+        std::snprintf(extra, sizeof(extra),
+                      "%s\n    {\"time\": \"%s\", \"media_time\": %.3f, \"from\": \"%s\", \"to\": \"%s\", "
+                      "\"reason\": \"%s\"}",
+                      i ? "," : "", event.time.c_str(), event.mediaTime, adaptive.describe(event.from).c_str(),
+                      adaptive.describe(event.to).c_str(), event.reason.c_str());
+        members += extra;
+    }
+    members += events.empty() ? "]" : "\n  ]";
+    if (_stats->writeJson(path, members))
+        display_message(NAME, "stage timings written to " + path, MESSAGE_INFO);
+}
+
+void MediaHandler::writeTrace()
+{
+    _trace->stop();
+    // out.mp4 -> out.mp4.trace.json
+    auto path = _media->path + ".trace.json";
+    if (_trace->write(path))
+        display_message(NAME, "trace written to " + path, MESSAGE_INFO);
 }
 
 bool MediaHandler::videoFirst()
@@ -283,3 +924,124 @@ bool MediaHandler::videoFirst()
     auto ast = _audio->getStream();
     return !ast || (av_compare_ts(vst->samples, vst->encCtx->time_base, ast->samples, ast->encCtx->time_base) <= 0);
 }
+
+void MediaHandler::requestCalibration()
+{
+    if (_media->fmtCtx)
+        _video->setCalibrationTarget(_media->fmtCtx->video_codec_id, _media->w, _media->h);
+}
+
+std::string MediaHandler::monitorPath(int index)
+{
+    // out.mp4 -> out_monitor1.mp4
+    auto p = fs::path(_media->path);
+    return p.replace_filename(p.stem().string() + "_monitor" + std::to_string(index) + p.extension().string())
+        .string();
+}
+
+bool MediaHandler::monitorFiles()
+{
+    if (_media->monitorOutput == OUTPUT_MONITORS_FILES || _media->live != OUTPUT_LIVE_NONE || !_media->fmtCtx)
+        return true;
+    // these formats hold one video stream only
+    auto name = _media->fmtCtx->oformat->name;
+    return !std::strcmp(name, "gif") || !std::strcmp(name, "apng") || !std::strcmp(name, "yuv4mpegpipe") ||
+           !std::strcmp(name, "flv");
+}
+
+bool MediaHandler::openMonitors()
+{
+    _monitors.clear();
+    if (_media->monitors.empty())
+        return true;
+    if (_media->replay || _media->captureCtx)
+    {
+        display_message(NAME, "extra monitors are not captured in replay & capture-first modes", MESSAGE_WARN);
+        return true;
+    }
+    bool files = monitorFiles();
+    if (files && _media->monitorOutput == OUTPUT_MONITORS_TRACKS)
+        display_message(NAME, "output takes one video track, extra monitors go to their own files", MESSAGE_WARN);
+    auto monitors = ScreenSource::listMonitors();
+    for (auto index : _media->monitors)
+    {
+        if (index < 0 || index >= static_cast<int>(monitors.size()))
+        {
+            display_message(NAME, "monitor " + std::to_string(index) + " does not exist", MESSAGE_WARN);
+            return false;
+        }
+        auto capture = std::make_unique<MonitorCapture>();
+        capture->monitor = monitors[index];
+        capture->video = std::make_unique<VideoCapture>();
+        capture->video->copySettings(*_video);
+        capture->video->setStats(_stats.get());
+        auto oc = _media->fmtCtx;
+        if (files)
+        {
+            capture->path = monitorPath(index);
+            if (avformat_alloc_output_context2(&capture->fmtCtx, _media->fmtCtx->oformat, nullptr,
+                                               capture->path.c_str()) < 0)
+            {
+                display_message(NAME, "failed to allocate format for " + capture->path, MESSAGE_WARN);
+                return false;
+            }
+            capture->fmtCtx->video_codec_id = _media->fmtCtx->video_codec_id;
+            oc = capture->fmtCtx;
+        }
+        auto &m = capture->monitor;
+        if (!capture->video->openCapture(oc, {m.x, m.y, m.w & ~1, m.h & ~1}))
+        {
+            display_message(NAME, "failed to capture monitor " + m.name, MESSAGE_WARN);
+            return false;
+        }
+        if (files)
+        {
+            auto config = outputConfig();
+            config.path = capture->path;
+            capture->muxer = std::make_unique<MediaMuxer>();
+            capture->muxer->setStats(_stats.get());
+            if (!capture->muxer->open(capture->fmtCtx, config))
+                return false;
+        }
+        display_message(NAME,
+                        "capturing monitor " + m.name + " (" + std::to_string(m.w) + "x" + std::to_string(m.h) +
+                            ") to " + (files ? capture->path : "track " + std::to_string(oc->nb_streams - 1)),
+                        MESSAGE_INFO);
+        _monitors.push_back(std::move(capture));
+    }
+    return true;
+}
+
+void MediaHandler::monitorInternal(MonitorCapture *monitor)
+{
+    PipelineTrace::nameThread("monitor " + monitor->monitor.name);
+    // tracks share the main outputs, whose muxers queue packets from any thread
+    PacketCallback onPacket = [this](const AVPacket *pkt) {
+        for (auto &muxer : _muxers)
+            muxer->writePacket(pkt);
+    };
+    if (monitor->muxer)
+        onPacket = [monitor](const AVPacket *pkt) { monitor->muxer->writePacket(pkt); };
+    bool videoRead = true;
+    while (videoRead && _monitorLoop)
+        videoRead = monitor->video->writeFrame(onPacket, _monitorSkip, false);
+    monitor->video->writeFrame(onPacket, false, true);
+}
+
+void MediaHandler::closeMonitors()
+{
+    _monitorLoop = false;
+    for (auto &monitor : _monitors)
+    {
+        if (monitor->t.joinable())
+            monitor->t.join();
+        if (!monitor->muxer)
+            continue;
+        monitor->muxer->close();
+        if (monitor->muxer->droppedPackets())
+            display_message(NAME,
+                            std::to_string(monitor->muxer->droppedPackets()) + " packets dropped for " +
+                                monitor->muxer->getPath(),
+                            MESSAGE_WARN);
+    }
+}
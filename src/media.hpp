@@ -7,13 +7,24 @@ extern "C"
 }
 
 #include "audiocapture.hpp"
+#include "control.hpp"
+#include "muxer.hpp"
+#include "replay.hpp"
+#include "stats.hpp"
+#include "transcoder.hpp"
 #include "videocapture.hpp"
 
 #include <array>
+#include <atomic>
+#include <condition_variable>
 #include <filesystem>
+#include <functional>
+#include <iostream>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
 namespace fs = std::filesystem;
 
@@ -25,6 +36,15 @@ namespace fs = std::filesystem;
 /// Video default output path
 #define OUTPUT_PATH_DEFAULT "out.mp4"
 
+/// Maximum wait (milliseconds) for the first frame after a start command
+#define OUTPUT_START_TIMEOUT 2000
+
+/// Extra monitors: one video track per monitor in the main output
+#define OUTPUT_MONITORS_TRACKS 0
+
+/// Extra monitors: one file per monitor next to the main output
+#define OUTPUT_MONITORS_FILES 1
+
 /**
  * @brief Media Output
  *
@@ -33,12 +53,34 @@ namespace fs = std::filesystem;
 struct MediaOutput
 {
     AVFormatContext *fmtCtx;
+    AVFormatContext *captureCtx; // lossless intermediate in capture-first mode
     int32_t x, y, w, h;
     int32_t skipTime;
+    int32_t layout;
+    int32_t expectedTime;
+    int32_t segmentTime, segmentSize;
+    int32_t replayTime, replayMemory;
+    int32_t live;
+    int32_t traceMemory; // MB
     std::string path;
+    std::vector<MuxerConfig> sinks;          // extra outputs sharing the encoded packets
+    std::vector<RenditionConfig> renditions; // extra video encodes sharing the capture
+    std::vector<int32_t> monitors;           // extra monitors captured beside the region, ScreenSource::listMonitors
+    int32_t monitorOutput;                   // one of OUTPUT_MONITORS_*
     bool canAudio;
+    bool canFragment;
+    bool canRaw;
+    bool replay;
+    bool rawStdout;
+    bool captureFirst;
+    bool trace; // write Chrome trace of the recording
 
-    MediaOutput() : fmtCtx(nullptr), x(0), y(0), w(0), h(0), skipTime(OUTPUT_SKIP_TIME), canAudio(true)
+    MediaOutput()
+        : fmtCtx(nullptr), captureCtx(nullptr), x(0), y(0), w(0), h(0), skipTime(OUTPUT_SKIP_TIME),
+          layout(OUTPUT_LAYOUT_DEFAULT), expectedTime(OUTPUT_EXPECTED_TIME), segmentTime(0), segmentSize(0),
+          replayTime(REPLAY_DEFAULT_TIME), replayMemory(REPLAY_DEFAULT_MEMORY), live(OUTPUT_LIVE_NONE),
+          traceMemory(TRACE_DEFAULT_MEMORY), monitorOutput(OUTPUT_MONITORS_TRACKS), canAudio(true), canFragment(false),
+          canRaw(false), replay(false), rawStdout(false), captureFirst(false), trace(false)
     {
         setPath(OUTPUT_PATH_DEFAULT);
     }
@@ -47,6 +89,18 @@ struct MediaOutput
     {
         if (fmtCtx)
             avformat_free_context(fmtCtx);
+        if (captureCtx)
+            avformat_free_context(captureCtx);
+    }
+
+    /**
+     * @brief Get Format Context Captures Write To
+     *
+     * @return AVFormatContext*
+     */
+    AVFormatContext *recordCtx()
+    {
+        return captureCtx ? captureCtx : fmtCtx;
     }
 
     /**
@@ -60,6 +114,54 @@ struct MediaOutput
     }
 };
 
+/**
+ * @brief Monitor Capture
+ *
+ * This structure stores the capture of one extra monitor, with its own grab thread & encoder.
+ */
+struct MonitorCapture
+{
+    MonitorInfo monitor;
+    std::string path;        // own file, empty when written as a track of the main output
+    AVFormatContext *fmtCtx; // format of own file
+    std::unique_ptr<VideoCapture> video;
+    std::unique_ptr<MediaMuxer> muxer;
+    std::thread t;
+
+    MonitorCapture() : fmtCtx(nullptr)
+    {
+    }
+
+    ~MonitorCapture()
+    {
+        if (t.joinable())
+            t.join();
+        video = nullptr;
+        if (fmtCtx)
+            avformat_free_context(fmtCtx);
+    }
+};
+
+/**
+ * @brief Record Stats
+ *
+ * This structure stores a snapshot of recording state.
+ */
+struct RecordStats
+{
+    bool recording, armed, encoding;
+    double mediaTime;      // seconds of written video
+    float encodeProgress;  // background encode progress in [0, 1]
+    int64_t frames;        // written video frames
+    int64_t dropped;       // packets dropped by outputs that could not keep up
+    FrameDrops frameDrops; // video frames lost or inserted by capture
+    double captureCpu;     // CPU seconds of record thread (convert & encode calls)
+    double muxCpu;         // CPU seconds of output threads
+};
+
+/// Receives periodic recording stats
+using StatsCallback = std::function<void(const RecordStats &)>;
+
 /**
  * @brief Media Handler
  *
@@ -74,21 +176,43 @@ class MediaHandler
     /**
      * @brief Configure Capture Window
      *
-     * Is meant to be called from AppContext.
+     * Is meant to be called from AppContext. While recording, the capture moves to the new window
+     * and the output keeps its size.
      *
      * @param x Top-left corner on monitor X-axis
      * @param y Top-left corner on monitor Y-axis
      * @param w Capture width
      * @param h Capture height
-     * @param mw Monitor Width
-     * @param mh Monitor height
+     * @param mw Desktop width, spanning all monitors
+     * @param mh Desktop height, spanning all monitors
      */
     void ConfigWindow(int x, int y, int w, int h, int mw, int mh);
 
+    /**
+     * @brief Set Expected Capture Size
+     *
+     * Is meant to be called when the capture window is resized, so that encoder calibration matches it.
+     *
+     * @param w Width
+     * @param h Height
+     */
+    void SetCaptureSize(int w, int h);
+
+    /**
+     * @brief Arm Recording
+     *
+     * Opens capture & outputs and grabs frames without writing them,
+     * so that a later StartRecord takes effect on the next grabbed frame.
+     *
+     * @return true if success
+     * @return false otherwise
+     */
+    bool ArmRecord();
+
     /**
      * @brief Start Recording
      *
-     * Is meant to be called from AppContext.
+     * Is meant to be called from AppContext. Starts writing when armed.
      *
      * @return true if success
      * @return false otherwise
@@ -105,6 +229,17 @@ class MediaHandler
      */
     bool StopRecord();
 
+    /**
+     * @brief Save Instant Replay
+     *
+     * Is meant to be called from AppContext.
+     * Writes buffered packets to a new file while recording continues.
+     *
+     * @return true if save started
+     * @return false otherwise
+     */
+    bool SaveReplay();
+
     /**
      * @brief Select Output File Path
      *
@@ -112,6 +247,169 @@ class MediaHandler
      */
     void SelectOutputPath();
 
+    /**
+     * @brief Set Output File Path
+     *
+     * Is meant to be called without UI.
+     * Programs writing to a FIFO or stdout should ignore SIGPIPE, as the GUI and recorder-cli do,
+     * so that a reader going away fails the output instead of ending the program.
+     *
+     * @param path Output file path
+     * @return true if path is used
+     * @return false if unsupported, default path is used instead
+     */
+    bool SetOutputPath(const std::string &path);
+
+    /**
+     * @brief Set Capture Frame Rate
+     *
+     * Is meant to be called without UI, before recording starts.
+     *
+     * @param fps Frame rate
+     */
+    void SetFrameRate(int fps);
+
+    /**
+     * @brief Set Live Output
+     *
+     * Is meant to be called without UI, before recording starts.
+     * Only mp4/mov outputs have a live playlist, see livePlaylist.
+     *
+     * @param live One of OUTPUT_LIVE_*
+     */
+    void SetLive(int live);
+
+    /**
+     * @brief Set MP4/MOV Layout
+     *
+     * Is meant to be called without UI, before recording starts.
+     *
+     * @param layout One of OUTPUT_LAYOUT_*
+     * @param expectedTime Minutes of recording the fast start layout reserves moov for, 0 to keep
+     */
+    void SetLayout(int layout, int expectedTime);
+
+    /**
+     * @brief Open Control Socket
+     *
+     * Serves arm, start, stop, mark & status commands, see ControlServer.
+     * Only the GUI and recorder-cli --control open it, other users of the library get no socket.
+     *
+     * @return true if listening
+     * @return false otherwise
+     */
+    bool OpenControl();
+
+    /**
+     * @brief Set Frame Policy Under Load
+     *
+     * Is meant to be called without UI, before recording starts.
+     *
+     * @param policy One of VIDEO_DROP_*
+     */
+    void SetDropPolicy(int policy);
+
+    /**
+     * @brief Set Adaptive Quality
+     *
+     * Is meant to be called without UI, before recording starts.
+     *
+     * @param bounds Lowest quality the controller may step down to
+     */
+    void SetAdaptive(const AdaptiveBounds &bounds);
+
+    /**
+     * @brief Set Extra Monitors
+     *
+     * Is meant to be called without UI, before recording starts.
+     * Each monitor is captured beside the region with its own grab thread & encoder.
+     *
+     * @param monitors Indices into ScreenSource::listMonitors
+     * @param output One of OUTPUT_MONITORS_*
+     */
+    void SetMonitors(const std::vector<int> &monitors, int output);
+
+    /**
+     * @brief Set Video Input Source
+     *
+     * Is meant to be called without UI, before recording starts.
+     * Files and lavfi generators allow recording without display.
+     *
+     * @param config Source configs
+     */
+    void SetVideoSource(const SourceConfig &config);
+
+    /**
+     * @brief Set Audio Input Source
+     *
+     * Is meant to be called without UI, before recording starts.
+     * Files and lavfi generators replace desktop audio & mic.
+     *
+     * @param config Source configs
+     */
+    void SetAudioSource(const SourceConfig &config);
+
+    /**
+     * @brief Set Skip Time
+     *
+     * Is meant to be called without UI, before recording starts.
+     *
+     * @param ms Milliseconds of video skipped on start
+     */
+    void SetSkipTime(int ms);
+
+    /**
+     * @brief Set Trace Export
+     *
+     * Is meant to be called before recording starts.
+     * Traced recordings write per-thread stage spans to <output>.trace.json on stop.
+     *
+     * @param memoryMB Memory for trace events, 0 to disable
+     */
+    void SetTrace(int memoryMB);
+
+    /**
+     * @brief Get Recording Stats
+     *
+     * Safe to call from any thread.
+     *
+     * @return RecordStats
+     */
+    RecordStats Stats();
+
+    /**
+     * @brief Get Stage Timers
+     *
+     * Per-stage durations of the current or last recording, safe to read from any thread.
+     *
+     * @return PipelineStats&
+     */
+    PipelineStats &StageStats();
+
+    /**
+     * @brief Add Extra Output File
+     *
+     * Is meant to be called from UI.
+     * Extra outputs receive the same encoded packets as the main output.
+     */
+    void AddOutputPath();
+
+    /**
+     * @brief Add Video Rendition File
+     *
+     * Is meant to be called from UI.
+     * Renditions encode the captured video again at another size, in the format of their file.
+     */
+    void AddRenditionPath();
+
+    /**
+     * @brief Convert Existing File
+     *
+     * Is meant to be called from UI.
+     * Asks for an input and an output file, then encodes in background with parallel chunks.
+     */
+    void ConvertFile();
+
     /**
      * @brief Is Currently Recording
      *
@@ -127,39 +425,128 @@ class MediaHandler
      */
     void UI();
 
+    /**
+     * @brief Stats UI Calls
+     *
+     * Is meant to be called in customUI function, shows stage timings of the recording.
+     */
+    void StatsUI();
+
     const std::string NAME = "MediaHandler";
 
   private:
     /// Internal record process
     void recordInternal();
 
+    /// Open capture & outputs and start record thread, armed pipelines grab without writing
+    bool startPipeline(bool armed);
+
+    /// Answer control socket command (arm, start, stop, mark <label>, status)
+    std::string handleCommand(const std::string &command);
+
+    /// Show save (or open) file dialog and return selected path
+    std::string selectFilePath(bool save = true);
+
+    /// Whether output file extension is supported
+    bool isSupportedFormat(const std::string &path);
+
+    /// All files written by a recording
+    std::vector<std::string> outputPaths();
+
+    /// Live output directory next to output file
+    std::string liveDir();
+
+    /// Live playlist for players
+    std::string livePlaylist();
+
+    /// Check path of a new extra output
+    bool validateExtraPath(const std::string &path);
+
     /// Validate selected output file format
     void validateOutputFormat();
 
-    /// Try to lock output file
-    bool lockMediaFile();
+    /// Try to lock output files
+    bool lockMediaFile(const std::vector<std::string> &paths);
+
+    /// Unlock files after recording stop
+    void unlockMediaFile(const std::vector<std::string> &paths);
+
+    /// Whether recording goes to a lossless intermediate first
+    bool isCaptureFirst();
+
+    /// Lossless intermediate file next to output file
+    std::string capturePath();
+
+    /// Muxer configs of main output
+    MuxerConfig outputConfig();
 
-    /// Unlock file after recording stop
-    void unlockMediaFile();
+    /// Encode lossless intermediate to output in background
+    void startTranscode();
 
     /// Init media output parameters
     bool initMedia();
 
-    /// Open media file and write header
+    /// Start muxer writing configured streams
     bool openMedia();
 
-    /// Close media file
+    /// Stop muxer and finish output files
     bool closeMedia();
 
     /// Whether to decode/encode video frames first
     bool videoFirst();
 
+    /// Calibrate encoder presets for output codec & capture size, while idle only
+    void requestCalibration();
+
+    /// Output file of extra monitor in files mode
+    std::string monitorPath(int index);
+
+    /// Whether extra monitors go to their own files, tracks need a format that holds several video streams
+    bool monitorFiles();
+
+    /// Open capture of every extra monitor, before the main output is opened
+    bool openMonitors();
+
+    /// Internal write process of one extra monitor
+    void monitorInternal(MonitorCapture *monitor);
+
+    /// Stop extra monitors after flushing their encoders, files mode closes their outputs
+    void closeMonitors();
+
+    /// Publish frame, drop & CPU counters of running recording, called from record thread
+    void updateStats(double startCpu);
+
+    /// Write stage timings & counters of finished recording next to output file
+    void writeStatsSummary(double wallTime);
+
+    /// Stop trace and write it next to output file, once all pipeline threads have finished
+    void writeTrace();
+
     std::unique_ptr<VideoCapture> _video;
     std::unique_ptr<AudioCapture> _audio;
     std::unique_ptr<MediaOutput> _media;
+    std::vector<std::unique_ptr<MediaMuxer>> _muxers;
+    std::vector<std::unique_ptr<MonitorCapture>> _monitors;
+    std::streambuf *_coutBuf;
+    std::unique_ptr<ReplayBuffer> _replay;
+    std::unique_ptr<Transcoder> _transcoder;
+    std::unique_ptr<ControlServer> _control;
+    std::unique_ptr<PipelineStats> _stats;
+    std::unique_ptr<PipelineTrace> _trace;
+    bool _statsRolling; // stats tab shows rolling window instead of whole recording
+
+    // control socket, hotkeys & UI change the pipeline one at a time
+    std::recursive_mutex _commandLock;
 
     // record thread configs
-    bool _recording;
-    bool _recordLoop;
+    std::atomic<bool> _recording;
+    std::atomic<bool> _recordLoop;
+    std::atomic<bool> _armed;
+    std::atomic<bool> _monitorLoop, _monitorSkip; // extra monitors follow record thread
+    std::atomic<double> _mediaTime; // seconds of written video
+    std::mutex _frameLock;
+    std::condition_variable _frameCV; // first written frame or record thread ended
+    std::atomic<int64_t> _frames, _dropped;
+    std::atomic<double> _captureCpu, _muxCpu;
     std::thread _recordT;
 };
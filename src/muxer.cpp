@@ -0,0 +1,394 @@
+#include "muxer.hpp"
+#include "faststart.hpp"
+#include "utils.hpp"
+
+extern "C"
+{
+#include <libavutil/opt.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+using sysclock = std::chrono::system_clock;
+
+MediaMuxer::MediaMuxer()
+    : _tmpl(nullptr), _format(nullptr), _segmentIdx(0), _queueBytes(0), _waitKey(false), _muxLoop(false), _dropped(0),
+      _failed(false), _cpuTime(0.0), _stats(nullptr)
+{
+}
+
+MediaMuxer::~MediaMuxer()
+{
+    close();
+    for (auto pkt : _queue)
+        av_packet_free(&pkt);
+}
+
+bool MediaMuxer::open(const AVFormatContext *tmpl, const MuxerConfig &config)
+{
+    close();
+    _tmpl = tmpl;
+    _config = config;
+    _segmentIdx = 0;
+    _dropped = 0;
+    _failed = false;
+    _cpuTime = 0.0;
+    _waitKey = false;
+    // output may use another container than the template, as long as it takes the same codecs
+    _format = av_guess_format(nullptr, _config.path.c_str(), nullptr);
+    if (!_format)
+        _format = _tmpl->oformat;
+    for (unsigned i = 0; i < _tmpl->nb_streams; i++)
+    {
+        auto codecId = _tmpl->streams[i]->codecpar->codec_id;
+        if (!avformat_query_codec(_format, codecId, FF_COMPLIANCE_NORMAL))
+        {
+            display_message(NAME,
+                            std::string(avcodec_get_name(codecId)) + " is not supported by " + _format->name +
+                                ", cannot write " + _config.path,
+                            MESSAGE_WARN);
+            return false;
+        }
+    }
+    // first segment is opened here so that errors reach the caller
+    _seg = openSegment(0);
+    if (!_seg)
+        return false;
+    _muxLoop = true;
+    _muxT = std::thread([this] { muxInternal(); });
+    return true;
+}
+
+bool MediaMuxer::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(_queueLock);
+        _muxLoop = false;
+    }
+    _queueCV.notify_one();
+    if (_muxT.joinable())
+        _muxT.join();
+    return true;
+}
+
+void MediaMuxer::writePacket(const AVPacket *pkt)
+{
+    if (_failed)
+        return;
+    bool isKey = (pkt->flags & AV_PKT_FLAG_KEY) &&
+                 _tmpl->streams[pkt->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+    {
+        std::unique_lock<std::mutex> lock(_queueLock);
+        if (_config.blocking)
+            _spaceCV.wait(lock, [this, pkt] {
+                return _queue.empty() || _queueBytes + pkt->size <= MUXER_QUEUE_BYTES || _failed;
+            });
+        // a slow output must not stall capture or other outputs,
+        // drop packets and resume on a keyframe so the file stays decodable
+        if (_waitKey && !isKey)
+        {
+            _dropped++;
+            return;
+        }
+        if (_queueBytes + pkt->size > MUXER_QUEUE_BYTES && !_queue.empty())
+        {
+            if (!_waitKey)
+                display_message(NAME, "output too slow, dropping packets for " + _config.path, MESSAGE_WARN);
+            _waitKey = true;
+            _dropped++;
+            return;
+        }
+        _waitKey = false;
+        auto ref = av_packet_clone(pkt);
+        if (!ref)
+        {
+            display_message(NAME, "failed to reference packet", MESSAGE_WARN);
+            return;
+        }
+        _queue.push_back(ref);
+        _queueBytes += ref->size;
+    }
+    _queueCV.notify_one();
+}
+
+const std::string &MediaMuxer::getPath()
+{
+    return _config.path;
+}
+
+int64_t MediaMuxer::droppedPackets()
+{
+    return _dropped;
+}
+
+bool MediaMuxer::failed()
+{
+    return _failed;
+}
+
+double MediaMuxer::cpuTime()
+{
+    return _cpuTime;
+}
+
+void MediaMuxer::setStats(PipelineStats *stats)
+{
+    _stats = stats;
+}
+
+void MediaMuxer::muxInternal()
+{
+    PipelineTrace::nameThread("mux " + fs::path(_config.path).filename().string());
+    auto startCpu = thread_cpu_time();
+    std::unique_lock<std::mutex> lock(_queueLock);
+    while (true)
+    {
+        _queueCV.wait(lock, [this] { return !_queue.empty() || !_muxLoop; });
+        // drain queue before exit
+        if (_queue.empty())
+            break;
+        auto pkt = _queue.front();
+        _queue.pop_front();
+        _queueBytes -= pkt->size;
+        lock.unlock();
+        _spaceCV.notify_one();
+        muxPacket(pkt);
+        av_packet_free(&pkt);
+        _cpuTime = thread_cpu_time() - startCpu;
+        lock.lock();
+    }
+    lock.unlock();
+    if (_prevSeg)
+        closeSegment(_prevSeg.get());
+    if (_seg)
+        closeSegment(_seg.get());
+    _prevSeg = nullptr;
+    _seg = nullptr;
+    _cpuTime = thread_cpu_time() - startCpu;
+}
+
+std::unique_ptr<OutputSegment> MediaMuxer::openSegment(int64_t startTime)
+{
+    auto seg = std::make_unique<OutputSegment>();
+    seg->startTime = startTime;
+    seg->passed.resize(_tmpl->nb_streams, false);
+    seg->path = _config.path;
+    if (_config.segmentTime > 0 || _config.segmentSize > 0)
+    {
+        // out.mp4 -> out_000.mp4, out_001.mp4, ...
+        char idx[16];
+        std::snprintf(idx, sizeof(idx), "_%03d", _segmentIdx++);
+        auto p = fs::path(_config.path);
+        seg->path = p.replace_filename(p.stem().string() + idx + p.extension().string()).string();
+    }
+    // allocate format
+    {
+        if (avformat_alloc_output_context2(&seg->fmtCtx, _format, nullptr, seg->path.c_str()) < 0)
+        {
+            display_message(NAME, "failed to allocate format for " + seg->path, MESSAGE_WARN);
+            return nullptr;
+        }
+        if (_format->video_codec == AV_CODEC_ID_APNG)
+            av_opt_set_int(seg->fmtCtx->priv_data, "plays", 0, 0);
+    }
+    // copy streams
+    for (unsigned i = 0; i < _tmpl->nb_streams; i++)
+    {
+        auto st = avformat_new_stream(seg->fmtCtx, nullptr);
+        if (!st)
+        {
+            display_message(NAME, "failed to allocate stream for " + seg->path, MESSAGE_WARN);
+            return nullptr;
+        }
+        if (avcodec_parameters_copy(st->codecpar, _tmpl->streams[i]->codecpar) < 0)
+        {
+            display_message(NAME, "failed to copy stream params for " + seg->path, MESSAGE_WARN);
+            return nullptr;
+        }
+        st->time_base = _tmpl->streams[i]->time_base;
+        st->avg_frame_rate = _tmpl->streams[i]->avg_frame_rate;
+        st->id = i;
+    }
+    // open file
+    if (!(seg->fmtCtx->oformat->flags & AVFMT_NOFILE))
+    {
+        if (avio_open(&seg->fmtCtx->pb, seg->path.c_str(), AVIO_FLAG_WRITE) < 0)
+        {
+            display_message(NAME, "failed to open " + seg->path, MESSAGE_WARN);
+            return nullptr;
+        }
+    }
+    // only the mov muxer (mp4, mov) supports layouts
+    bool isMov = !std::strcmp(_format->name, "mp4") || !std::strcmp(_format->name, "mov");
+    if (isMov && _config.layout == OUTPUT_LAYOUT_FASTSTART && seg->fmtCtx->pb)
+    {
+        // free box in front of the header, the muxer writes moov at the end as usual
+        // and closeSegment moves it into this space, see moveMoovToFront
+        auto minutes = _config.segmentTime > 0 ? _config.segmentTime : _config.expectedTime;
+        auto packets = estimatePackets((std::max)(1, minutes) * 60.0);
+        seg->moovSize = OUTPUT_MOOV_BASE_BYTES + packets * OUTPUT_MOOV_MARGIN * OUTPUT_MOOV_PACKET_BYTES;
+        std::vector<unsigned char> box(seg->moovSize, 0);
+        box[0] = static_cast<unsigned char>(seg->moovSize >> 24);
+        box[1] = static_cast<unsigned char>(seg->moovSize >> 16);
+        box[2] = static_cast<unsigned char>(seg->moovSize >> 8);
+        box[3] = static_cast<unsigned char>(seg->moovSize);
+        std::copy_n("free", 4, box.begin() + 4);
+        avio_write(seg->fmtCtx->pb, box.data(), static_cast<int>(box.size()));
+    }
+    AVDictionary *options{nullptr};
+    if (isMov && _config.layout == OUTPUT_LAYOUT_FRAGMENTED)
+    {
+        // moov is written up front and every fragment is self-contained,
+        // so the muxer keeps no sample table and a killed process leaves a playable file
+        av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+        av_dict_set_int(&options, "min_frag_duration", OUTPUT_FRAG_DURATION, 0);
+    }
+    else if (!std::strcmp(_format->name, "hls"))
+    {
+        // live playlist, updated as each segment completes,
+        // segments are renamed into place so readers never see a partial file
+        auto dir = fs::path(seg->path).parent_path();
+        av_dict_set(&options, "hls_segment_type", "fmp4", 0);
+        av_dict_set(&options, "hls_time", std::to_string(OUTPUT_LIVE_SEGMENT_TIME).c_str(), 0);
+        av_dict_set(&options, "hls_playlist_type", "event", 0);
+        av_dict_set(&options, "hls_flags", "independent_segments+temp_file", 0);
+        av_dict_set(&options, "hls_segment_filename", (dir / "seg_%05d.m4s").string().c_str(), 0);
+        av_dict_set(&options, "hls_fmp4_init_filename", "init.mp4", 0);
+    }
+    else if (!std::strcmp(_format->name, "dash"))
+    {
+        // LHLS: dash muxer streams chunks of the running segment and announces it
+        // with EXT-X-PREFETCH in its HLS playlists, FFmpeg writes no LL-HLS parts
+        av_dict_set(&options, "hls_playlist", "1", 0);
+        av_dict_set(&options, "lhls", "1", 0);
+        av_dict_set(&options, "streaming", "1", 0);
+        av_dict_set(&options, "seg_duration", std::to_string(OUTPUT_LIVE_SEGMENT_TIME).c_str(), 0);
+        av_dict_set(&options, "frag_type", "duration", 0);
+        av_dict_set(&options, "frag_duration", std::to_string(OUTPUT_LIVE_PART_TIME).c_str(), 0);
+        av_dict_set(&options, "window_size", "0", 0);
+        av_dict_set(&options, "strict", "experimental", 0);
+    }
+    int ret = avformat_write_header(seg->fmtCtx, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+    {
+        display_message(NAME, "failed to write header to " + seg->path, MESSAGE_WARN);
+        if (!(seg->fmtCtx->oformat->flags & AVFMT_NOFILE))
+            avio_closep(&seg->fmtCtx->pb);
+        return nullptr;
+    }
+    av_dump_format(seg->fmtCtx, 0, seg->path.c_str(), 1);
+    return seg;
+}
+
+void MediaMuxer::closeSegment(OutputSegment *seg)
+{
+    auto startT = sysclock::now();
+    bool written = av_write_trailer(seg->fmtCtx) == 0;
+    if (!written)
+        display_message(NAME, "failed to write trailer to " + seg->path, MESSAGE_WARN);
+    if (!(seg->fmtCtx->oformat->flags & AVFMT_NOFILE))
+        avio_closep(&seg->fmtCtx->pb);
+    if (written && seg->moovSize)
+    {
+        // a moov larger than the reservation costs one pass over mdat, like the muxer's faststart
+        bool shifted = false;
+        if (!moveMoovToFront(seg->path, seg->moovSize, shifted))
+            display_message(NAME, "failed to move moov to front of " + seg->path + ", it stays at the end",
+                            MESSAGE_WARN);
+        else if (shifted)
+            display_message(NAME,
+                            "reserved moov (" + std::to_string(seg->moovSize) +
+                                " bytes) was too small, moved mdat once to fit it",
+                            MESSAGE_WARN);
+    }
+    auto trailerTime = std::chrono::duration_cast<std::chrono::milliseconds>(sysclock::now() - startT).count();
+    display_message(NAME, "trailer written in " + std::to_string(trailerTime) + " ms", MESSAGE_INFO);
+    display_message(NAME, "output saved to " + seg->path, MESSAGE_INFO);
+}
+
+void MediaMuxer::muxPacket(AVPacket *pkt)
+{
+    if (_failed)
+        return;
+    auto tmplSt = _tmpl->streams[pkt->stream_index];
+    auto time = av_rescale_q(pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts, tmplSt->time_base,
+                             AVRational{1, AV_TIME_BASE});
+    // rotate segment on a video keyframe
+    if ((_config.segmentTime > 0 || _config.segmentSize > 0) &&
+        tmplSt->codecpar->codec_type == AVMEDIA_TYPE_VIDEO && (pkt->flags & AV_PKT_FLAG_KEY) &&
+        time > _seg->startTime)
+    {
+        bool timeUp = _config.segmentTime > 0 && time - _seg->startTime >= int64_t(_config.segmentTime) * 60 * AV_TIME_BASE;
+        bool sizeUp = _config.segmentSize > 0 && avio_tell(_seg->fmtCtx->pb) >= (int64_t(_config.segmentSize) << 20);
+        if (timeUp || sizeUp)
+        {
+            auto seg = openSegment(time);
+            if (seg)
+            {
+                if (_prevSeg)
+                    closeSegment(_prevSeg.get());
+                _prevSeg = std::move(_seg);
+                _seg = std::move(seg);
+            }
+        }
+    }
+    // packets from before the switch (e.g. audio) still go to previous segment
+    auto seg = _seg.get();
+    if (_prevSeg)
+    {
+        if (time < _seg->startTime)
+            seg = _prevSeg.get();
+        else
+        {
+            _seg->passed[pkt->stream_index] = true;
+            if (std::all_of(_seg->passed.begin(), _seg->passed.end(), [](bool v) { return v; }))
+            {
+                closeSegment(_prevSeg.get());
+                _prevSeg = nullptr;
+            }
+        }
+    }
+    // every segment starts at zero, timeline stays gapless across segments
+    auto offset = av_rescale_q(seg->startTime, AVRational{1, AV_TIME_BASE}, tmplSt->time_base);
+    if (pkt->pts != AV_NOPTS_VALUE)
+        pkt->pts -= offset;
+    if (pkt->dts != AV_NOPTS_VALUE)
+        pkt->dts -= offset;
+    av_packet_rescale_ts(pkt, tmplSt->time_base, seg->fmtCtx->streams[pkt->stream_index]->time_base);
+    StageTimer muxT(_stats, STATS_MUX);
+    muxT.start();
+    int ret = av_interleaved_write_frame(seg->fmtCtx, pkt);
+    muxT.stop();
+    if (ret != 0)
+    {
+        // e.g. disk full, give up on this output only
+        display_message(NAME, "failed to write frame, stopping output " + seg->path, MESSAGE_WARN);
+        _failed = true;
+    }
+}
+
+int64_t MediaMuxer::estimatePackets(double seconds)
+{
+    double packets = 0.0;
+    for (unsigned i = 0; i < _tmpl->nb_streams; i++)
+    {
+        auto st = _tmpl->streams[i];
+        if (st->codecpar->codec_type == AVMEDIA_TYPE_VIDEO)
+        {
+            // time base is only the timestamp precision, e.g. 1/90000 for copied streams
+            auto rate = st->avg_frame_rate.num > 0 ? st->avg_frame_rate : st->r_frame_rate;
+            packets += seconds * (rate.num > 0 && rate.den > 0 ? av_q2d(rate) : OUTPUT_MOOV_DEFAULT_FPS);
+        }
+        else if (st->codecpar->codec_type == AVMEDIA_TYPE_AUDIO)
+            packets += seconds * st->codecpar->sample_rate /
+                       (st->codecpar->frame_size ? st->codecpar->frame_size : 1024);
+    }
+    return static_cast<int64_t>(packets);
+}
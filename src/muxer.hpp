@@ -0,0 +1,213 @@
+#pragma once
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "stats.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** @file */
+
+/// MP4/MOV layout: sample table written at the end
+#define OUTPUT_LAYOUT_DEFAULT 0
+
+/// MP4/MOV layout: empty moov followed by one fragment per keyframe
+#define OUTPUT_LAYOUT_FRAGMENTED 1
+
+/// MP4/MOV layout: sample table written into space reserved after the header
+#define OUTPUT_LAYOUT_FASTSTART 2
+
+/// Minimum fragment duration (microseconds) for fragmented layout
+#define OUTPUT_FRAG_DURATION 1000000
+
+/// Default expected recording length (minutes) for fast start layout
+#define OUTPUT_EXPECTED_TIME 10
+
+/// Estimated moov bytes independent of recording length
+#define OUTPUT_MOOV_BASE_BYTES 4096
+
+/// Estimated moov bytes per packet (stsz, stco, stsc, stss and ctts entries)
+#define OUTPUT_MOOV_PACKET_BYTES 32
+
+/// Reserved moov space relative to the estimate for the expected length
+#define OUTPUT_MOOV_MARGIN 2
+
+/// Frame rate assumed for moov estimate when a video stream does not tell
+#define OUTPUT_MOOV_DEFAULT_FPS 60
+
+/// Live output disabled
+#define OUTPUT_LIVE_NONE 0
+
+/// Live output: HLS playlist of fMP4 segments
+#define OUTPUT_LIVE_HLS 1
+
+/// Live output: experimental LHLS, the running segment is announced with EXT-X-PREFETCH & streamed in chunks;
+/// not LL-HLS, there are no EXT-X-PART or EXT-X-PRELOAD-HINT tags
+#define OUTPUT_LIVE_LHLS 2
+
+/// Live segment duration (seconds)
+#define OUTPUT_LIVE_SEGMENT_TIME 1.0
+
+/// Duration (seconds) of the chunks LHLS streams of the running segment
+#define OUTPUT_LIVE_PART_TIME 0.2
+
+/// Maximum queued packet bytes per muxer before packets are dropped
+#define MUXER_QUEUE_BYTES (64 << 20)
+
+/**
+ * @brief Muxer Config
+ *
+ * This structure stores settings of one muxer output.
+ */
+struct MuxerConfig
+{
+    std::string path;
+    int32_t layout;
+    int32_t expectedTime;
+    int32_t segmentTime; // minutes, 0 to disable
+    int32_t segmentSize; // MB, 0 to disable
+    bool blocking;       // wait for queue space instead of dropping packets
+
+    MuxerConfig()
+        : layout(OUTPUT_LAYOUT_DEFAULT), expectedTime(OUTPUT_EXPECTED_TIME), segmentTime(0), segmentSize(0),
+          blocking(false)
+    {
+    }
+};
+
+/**
+ * @brief Output Segment
+ *
+ * This structure stores one output file written by MediaMuxer.
+ */
+struct OutputSegment
+{
+    AVFormatContext *fmtCtx;
+    std::string path;
+    int64_t startTime; // AV_TIME_BASE units
+    int64_t moovSize; // free box reserved for moov in front of the header, 0 if none
+    std::vector<bool> passed;
+
+    OutputSegment() : fmtCtx(nullptr), startTime(0), moovSize(0)
+    {
+    }
+
+    ~OutputSegment()
+    {
+        if (fmtCtx)
+            avformat_free_context(fmtCtx);
+    }
+};
+
+/**
+ * @brief Media Muxer
+ *
+ * This class writes encoded packets to output files on its own thread.
+ * Supports rolling segments that switch files at video keyframes.
+ */
+class MediaMuxer
+{
+  public:
+    MediaMuxer();
+    ~MediaMuxer();
+
+    /**
+     * @brief Open Muxer
+     *
+     * Meant to be called from MediaHandler, after captures configured their streams.
+     *
+     * @param tmpl Format context holding configured streams
+     * @param config Output configs
+     * @return true if success
+     * @return false otherwise
+     */
+    bool open(const AVFormatContext *tmpl, const MuxerConfig &config);
+
+    /**
+     * @brief Close Muxer
+     *
+     * Writes all queued packets and trailers.
+     *
+     * @return true if success
+     * @return false otherwise
+     */
+    bool close();
+
+    /**
+     * @brief Write Packet to Output
+     *
+     * Meant to be called from capture thread. Packet is referenced and queued,
+     * timestamps are expected in the stream time base of the template context.
+     * Unless config is blocking, a full queue drops packets up to the next video keyframe.
+     *
+     * @param pkt Encoded packet
+     */
+    void writePacket(const AVPacket *pkt);
+
+    /**
+     * @brief Get Output Path
+     *
+     * @return const std::string&
+     */
+    const std::string &getPath();
+
+    /// Number of packets dropped because the output could not keep up
+    int64_t droppedPackets();
+
+    /// Whether output stopped after a write error
+    bool failed();
+
+    /// CPU time (seconds) spent by mux thread since open
+    double cpuTime();
+
+    /// Set stage timers receiver before open, nullptr disables timing
+    void setStats(PipelineStats *stats);
+
+    const std::string NAME = "MediaMuxer";
+
+  private:
+    /// Internal mux process
+    void muxInternal();
+
+    /// Open next output segment starting at given time
+    std::unique_ptr<OutputSegment> openSegment(int64_t startTime);
+
+    /// Write trailer and close output segment
+    void closeSegment(OutputSegment *seg);
+
+    /// Route packet to segment and write it
+    void muxPacket(AVPacket *pkt);
+
+    /// Estimate packet count for given seconds of template streams
+    int64_t estimatePackets(double seconds);
+
+    const AVFormatContext *_tmpl;
+    const AVOutputFormat *_format;
+    MuxerConfig _config;
+    std::unique_ptr<OutputSegment> _seg, _prevSeg;
+    int _segmentIdx;
+
+    std::deque<AVPacket *> _queue;
+    std::mutex _queueLock;
+    std::condition_variable _queueCV, _spaceCV;
+    int64_t _queueBytes;
+    bool _waitKey;
+    bool _muxLoop;
+    std::thread _muxT;
+
+    std::atomic<int64_t> _dropped;
+    std::atomic<bool> _failed;
+    std::atomic<double> _cpuTime;
+    PipelineStats *_stats;
+};
@@ -0,0 +1,139 @@
+#include "replay.hpp"
+#include "utils.hpp"
+
+#include <vector>
+
+ReplayBuffer::ReplayBuffer() : _tmpl(nullptr), _maxTime(0), _maxBytes(0), _bytes(0), _saving(false)
+{
+}
+
+ReplayBuffer::~ReplayBuffer()
+{
+    close();
+}
+
+void ReplayBuffer::open(const AVFormatContext *tmpl, int seconds, int64_t maxBytes)
+{
+    close();
+    _tmpl = tmpl;
+    _maxTime = int64_t(seconds) * AV_TIME_BASE;
+    _maxBytes = maxBytes;
+}
+
+void ReplayBuffer::close()
+{
+    if (_saveT.joinable())
+        _saveT.join();
+    std::lock_guard<std::mutex> lock(_packetsLock);
+    for (auto pkt : _packets)
+        av_packet_free(&pkt);
+    _packets.clear();
+    _bytes = 0;
+}
+
+void ReplayBuffer::writePacket(const AVPacket *pkt)
+{
+    auto ref = av_packet_clone(pkt);
+    if (!ref)
+    {
+        display_message(NAME, "failed to reference packet", MESSAGE_WARN);
+        return;
+    }
+    std::lock_guard<std::mutex> lock(_packetsLock);
+    _packets.push_back(ref);
+    _bytes += ref->size + sizeof(AVPacket);
+    evict();
+}
+
+bool ReplayBuffer::save(const MuxerConfig &config)
+{
+    if (_saving)
+    {
+        display_message(NAME, "previous replay is still being saved", MESSAGE_WARN);
+        return false;
+    }
+    if (_saveT.joinable())
+        _saveT.join();
+    // take references so capture keeps filling the buffer while saving
+    std::vector<AVPacket *> packets;
+    {
+        std::lock_guard<std::mutex> lock(_packetsLock);
+        if (_packets.empty())
+        {
+            display_message(NAME, "replay buffer is empty", MESSAGE_WARN);
+            return false;
+        }
+        for (auto pkt : _packets)
+            packets.push_back(av_packet_clone(pkt));
+    }
+    _saving = true;
+    _saveT = std::thread([this, config, packets] {
+        MediaMuxer muxer;
+        // saved file starts at zero on the first buffered keyframe
+        auto startTime = packetTime(packets.front());
+        bool opened = muxer.open(_tmpl, config);
+        for (auto pkt : packets)
+        {
+            auto tb = _tmpl->streams[pkt->stream_index]->time_base;
+            auto offset = av_rescale_q(startTime, AVRational{1, AV_TIME_BASE}, tb);
+            if (pkt->pts != AV_NOPTS_VALUE)
+                pkt->pts -= offset;
+            if (pkt->dts != AV_NOPTS_VALUE)
+                pkt->dts -= offset;
+            auto ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+            if (opened && ts != AV_NOPTS_VALUE && ts >= 0)
+                muxer.writePacket(pkt);
+            av_packet_free(&pkt);
+        }
+        muxer.close();
+        if (opened)
+            display_message(NAME,
+                            "saved " + std::to_string(packets.size()) + " packets (" +
+                                std::to_string(bufferedBytes() >> 20) + " MB buffered)",
+                            MESSAGE_INFO);
+        _saving = false;
+    });
+    return true;
+}
+
+int64_t ReplayBuffer::bufferedBytes()
+{
+    std::lock_guard<std::mutex> lock(_packetsLock);
+    return _bytes;
+}
+
+double ReplayBuffer::bufferedTime()
+{
+    std::lock_guard<std::mutex> lock(_packetsLock);
+    if (_packets.empty())
+        return 0.0;
+    return (packetTime(_packets.back()) - packetTime(_packets.front())) / static_cast<double>(AV_TIME_BASE);
+}
+
+int64_t ReplayBuffer::packetTime(const AVPacket *pkt)
+{
+    return av_rescale_q(pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts,
+                        _tmpl->streams[pkt->stream_index]->time_base, AVRational{1, AV_TIME_BASE});
+}
+
+bool ReplayBuffer::isKeyFrame(const AVPacket *pkt)
+{
+    return (pkt->flags & AV_PKT_FLAG_KEY) &&
+           _tmpl->streams[pkt->stream_index]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO;
+}
+
+void ReplayBuffer::evict()
+{
+    while (!_packets.empty() &&
+           (_bytes > _maxBytes || packetTime(_packets.back()) - packetTime(_packets.front()) > _maxTime))
+    {
+        // drop a whole GOP, together with packets of other streams queued in between
+        do
+        {
+            auto pkt = _packets.front();
+            _bytes -= pkt->size + sizeof(AVPacket);
+            av_packet_free(&pkt);
+            _packets.pop_front();
+        } while (!_packets.empty() && !isKeyFrame(_packets.front()));
+    }
+}
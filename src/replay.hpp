@@ -0,0 +1,101 @@
+#pragma once
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include "muxer.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/** @file */
+
+/// Replay default buffered time (seconds)
+#define REPLAY_DEFAULT_TIME 30
+
+/// Replay default memory cap (MB)
+#define REPLAY_DEFAULT_MEMORY 256
+
+/**
+ * @brief Replay Buffer
+ *
+ * This class keeps the most recent encoded packets in memory.
+ * Packets are evicted one GOP at a time, so the buffer always starts at a video keyframe.
+ */
+class ReplayBuffer
+{
+  public:
+    ReplayBuffer();
+    ~ReplayBuffer();
+
+    /**
+     * @brief Open Replay Buffer
+     *
+     * Meant to be called from MediaHandler, after captures configured their streams.
+     *
+     * @param tmpl Format context holding configured streams
+     * @param seconds Maximum buffered time
+     * @param maxBytes Maximum buffered packet memory
+     */
+    void open(const AVFormatContext *tmpl, int seconds, int64_t maxBytes);
+
+    /**
+     * @brief Close Replay Buffer
+     *
+     * Waits for a running save and frees buffered packets.
+     */
+    void close();
+
+    /**
+     * @brief Write Packet to Buffer
+     *
+     * Meant to be called from capture thread.
+     *
+     * @param pkt Encoded packet, timestamps in template stream time base
+     */
+    void writePacket(const AVPacket *pkt);
+
+    /**
+     * @brief Save Buffered Packets
+     *
+     * Writes current buffer content to a file on a separate thread.
+     *
+     * @param config Output configs
+     * @return true if save started
+     * @return false otherwise
+     */
+    bool save(const MuxerConfig &config);
+
+    /// Buffered packet memory in bytes
+    int64_t bufferedBytes();
+
+    /// Buffered time in seconds
+    double bufferedTime();
+
+    const std::string NAME = "ReplayBuffer";
+
+  private:
+    /// Packet time in AV_TIME_BASE units
+    int64_t packetTime(const AVPacket *pkt);
+
+    /// Whether packet starts a GOP
+    bool isKeyFrame(const AVPacket *pkt);
+
+    /// Free packets until buffer is within limits
+    void evict();
+
+    const AVFormatContext *_tmpl;
+    int64_t _maxTime, _maxBytes;
+    int64_t _bytes;
+    std::deque<AVPacket *> _packets;
+    std::mutex _packetsLock;
+
+    std::atomic<bool> _saving;
+    std::thread _saveT;
+};
@@ -0,0 +1,150 @@
+#include "session.hpp"
+#include "utils.hpp"
+
+#if __linux__
+#include <X11/Xlib.h>
+#endif
+
+#include <chrono>
+
+RecordSession::RecordSession() : _statsLoop(false)
+{
+    _handler = std::make_unique<MediaHandler>();
+}
+
+RecordSession::~RecordSession()
+{
+    {
+        std::lock_guard<std::mutex> lock(_statsLock);
+        _statsLoop = false;
+    }
+    _statsCV.notify_all();
+    if (_statsT.joinable())
+        _statsT.join();
+    stop();
+}
+
+bool RecordSession::configure(const SessionConfig &config)
+{
+    if (_handler->IsRecording())
+    {
+        display_message(NAME, "cannot configure while recording", MESSAGE_WARN);
+        return false;
+    }
+    {
+        std::lock_guard<std::mutex> lock(_statsLock);
+        _config = config;
+    }
+    // files and generators need no display
+    int sw = 0, sh = 0;
+    if (_config.video.type != SOURCE_DEVICE)
+    {
+        bool hasRegion = _config.region[2] > 0 && _config.region[3] > 0;
+        sw = hasRegion ? _config.region[0] + _config.region[2] : SESSION_DEFAULT_WIDTH;
+        sh = hasRegion ? _config.region[1] + _config.region[3] : SESSION_DEFAULT_HEIGHT;
+    }
+    else if (!screenSize(sw, sh))
+    {
+        display_message(NAME, "failed to open display", MESSAGE_WARN);
+        return false;
+    }
+    if (!_config.output.empty() && !_handler->SetOutputPath(_config.output))
+        return false;
+    _handler->SetVideoSource(_config.video);
+    _handler->SetAudioSource(_config.audio);
+    if (_config.fps > 0)
+        _handler->SetFrameRate(_config.fps);
+    if (_config.skipTime >= 0)
+        _handler->SetSkipTime(_config.skipTime);
+    _handler->SetTrace(_config.traceMemory);
+    if (_config.dropPolicy >= 0)
+        _handler->SetDropPolicy(_config.dropPolicy);
+    if (_config.layout >= 0)
+        _handler->SetLayout(_config.layout, _config.expectedTime);
+    _handler->SetLive(_config.live);
+    _handler->SetAdaptive(_config.adaptive);
+    if (_config.control && !_handler->OpenControl())
+        return false;
+    auto &r = _config.region;
+    // without region the first monitor takes its place, the others are captured beside it
+    auto monitors = _config.monitors;
+    if (!monitors.empty() && (r[2] <= 0 || r[3] <= 0) && _config.video.type == SOURCE_DEVICE)
+    {
+        auto infos = ScreenSource::listMonitors();
+        if (monitors[0] < 0 || monitors[0] >= static_cast<int>(infos.size()))
+        {
+            display_message(NAME, "monitor " + std::to_string(monitors[0]) + " does not exist", MESSAGE_WARN);
+            return false;
+        }
+        auto &m = infos[monitors[0]];
+        r = {m.x, m.y, m.w, m.h};
+        monitors.erase(monitors.begin());
+    }
+    _handler->SetMonitors(monitors, _config.monitorOutput);
+    if (r[2] > 0 && r[3] > 0)
+        _handler->ConfigWindow(r[0], r[1], r[2], r[3], sw, sh);
+    else
+        _handler->ConfigWindow(0, 0, sw, sh, sw, sh);
+    // stats thread lives as long as a callback is set
+    if (_config.onStats && !_statsT.joinable())
+    {
+        _statsLoop = true;
+        _statsT = std::thread([this] { statsInternal(); });
+    }
+    return true;
+}
+
+bool RecordSession::arm()
+{
+    return _handler->ArmRecord();
+}
+
+bool RecordSession::start()
+{
+    return _handler->StartRecord();
+}
+
+bool RecordSession::stop()
+{
+    return _handler->StopRecord();
+}
+
+RecordStats RecordSession::stats()
+{
+    return _handler->Stats();
+}
+
+MediaHandler &RecordSession::handler()
+{
+    return *_handler;
+}
+
+bool RecordSession::screenSize(int &w, int &h)
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    w = GetSystemMetrics(SM_CXSCREEN);
+    h = GetSystemMetrics(SM_CYSCREEN);
+    return w > 0 && h > 0;
+#elif __linux__
+    auto display = XOpenDisplay(nullptr);
+    if (!display)
+        return false;
+    w = DisplayWidth(display, DefaultScreen(display));
+    h = DisplayHeight(display, DefaultScreen(display));
+    XCloseDisplay(display);
+    return true;
+#else
+    return false;
+#endif
+}
+
+void RecordSession::statsInternal()
+{
+    std::unique_lock<std::mutex> lock(_statsLock);
+    while (_statsLoop)
+    {
+        _statsCV.wait_for(lock, std::chrono::milliseconds(SESSION_STATS_INTERVAL), [this] { return !_statsLoop; });
+        if (_statsLoop && _config.onStats)
+            _config.onStats(_handler->Stats());
+    }
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include "media.hpp"
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** @file */
+
+/// Interval (milliseconds) between stats callbacks
+#define SESSION_STATS_INTERVAL 1000
+
+/// Capture width used without display when region is not set
+#define SESSION_DEFAULT_WIDTH 1280
+
+/// Capture height used without display when region is not set
+#define SESSION_DEFAULT_HEIGHT 720
+
+/**
+ * @brief Session Config
+ *
+ * This structure stores settings of one record session.
+ */
+struct SessionConfig
+{
+    std::string output;        // empty for default output path
+    std::array<int, 4> region; // x, y, w, h; zero size for full screen
+    SourceConfig video;        // screen by default
+    SourceConfig audio;        // audio server by default
+    int32_t fps;               // 0 for default
+    int32_t skipTime;          // milliseconds, -1 for default
+    int32_t traceMemory;       // MB for Chrome trace of the recording, 0 for no trace
+    int32_t dropPolicy;        // one of VIDEO_DROP_*, -1 for default
+    int32_t layout;            // one of OUTPUT_LAYOUT_*, -1 for default
+    int32_t expectedTime;      // minutes for fast start layout, 0 for default
+    int32_t live;              // one of OUTPUT_LIVE_*, playlist beside the output
+    AdaptiveBounds adaptive;   // adaptive quality, off by default
+    std::vector<int> monitors; // monitors captured in parallel, the first one is the region if not set
+    int32_t monitorOutput;     // one of OUTPUT_MONITORS_*
+    bool control;              // serve commands on a control socket, see ControlServer
+    StatsCallback onStats;     // called every SESSION_STATS_INTERVAL, may be empty
+
+    SessionConfig()
+        : region{0, 0, 0, 0}, fps(0), skipTime(-1), traceMemory(0), dropPolicy(-1), layout(-1),
+          expectedTime(0), live(OUTPUT_LIVE_NONE), monitorOutput(OUTPUT_MONITORS_TRACKS),
+          control(false)
+    {
+    }
+};
+
+/**
+ * @brief Record Session
+ *
+ * This class is the entry point of the capture engine for programs without UI.
+ * Owns one MediaHandler and reports its stats periodically.
+ */
+class RecordSession
+{
+  public:
+    RecordSession();
+    ~RecordSession();
+
+    /**
+     * @brief Configure Session
+     *
+     * Meant to be called before recording starts.
+     *
+     * @param config Session configs
+     * @return true if success
+     * @return false otherwise
+     */
+    bool configure(const SessionConfig &config);
+
+    /// Open pipeline without writing, see MediaHandler::ArmRecord
+    bool arm();
+
+    /// Start writing, see MediaHandler::StartRecord
+    bool start();
+
+    /// Stop recording and finish outputs
+    bool stop();
+
+    /// Current stats of session
+    RecordStats stats();
+
+    /// Media handler of session, for settings not covered by config
+    MediaHandler &handler();
+
+    /**
+     * @brief Get Screen Size
+     *
+     * Queries primary screen without opening a window.
+     *
+     * @param w Screen width
+     * @param h Screen height
+     * @return true if success
+     * @return false otherwise
+     */
+    static bool screenSize(int &w, int &h);
+
+    const std::string NAME = "RecordSession";
+
+  private:
+    /// Internal stats report process
+    void statsInternal();
+
+    SessionConfig _config;
+    std::unique_ptr<MediaHandler> _handler;
+
+    std::mutex _statsLock;
+    std::condition_variable _statsCV;
+    bool _statsLoop;
+    std::thread _statsT;
+};
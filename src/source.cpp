@@ -0,0 +1,207 @@
+#include "source.hpp"
+#include "utils.hpp"
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+#include <Windows.h>
+#elif __linux__
+#include <X11/Xlib.h>
+#include <X11/extensions/Xrandr.h>
+#endif
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+/// Append monitor to list, gdigrab offsets are virtual screen coordinates as well
+static BOOL CALLBACK addMonitor(HMONITOR monitor, HDC, LPRECT rect, LPARAM data)
+{
+    MONITORINFOEXA info{};
+    info.cbSize = sizeof(info);
+    if (!GetMonitorInfoA(monitor, &info))
+        return TRUE;
+    reinterpret_cast<std::vector<MonitorInfo> *>(data)->push_back(
+        {info.szDevice, static_cast<int32_t>(rect->left), static_cast<int32_t>(rect->top),
+         static_cast<int32_t>(rect->right - rect->left), static_cast<int32_t>(rect->bottom - rect->top),
+         (info.dwFlags & MONITORINFOF_PRIMARY) != 0});
+    return TRUE;
+}
+#endif
+
+std::unique_ptr<InputSource> InputSource::createVideo(const SourceConfig &config, const std::array<int, 5> &window)
+{
+    auto size = std::to_string(window[2]) + "x" + std::to_string(window[3]);
+    auto rate = std::to_string(window[4]);
+    switch (config.type)
+    {
+    case SOURCE_FILE:
+        return std::make_unique<FileSource>(config.url);
+    case SOURCE_LAVFI:
+    {
+        auto graph = config.url.empty() ? SOURCE_LAVFI_VIDEO : config.url;
+        if (graph == SOURCE_LAVFI_SCREEN)
+        {
+            // flat background with a small moving test pattern, like a terminal or cursor over a desktop
+            auto fgSize = std::to_string((window[2] / 4) & ~1) + "x" + std::to_string((window[3] / 8) & ~1);
+            graph = "color=c=0x202428:size=" + size + ":rate=" + rate + "[bg];testsrc2=size=" + fgSize +
+                    ":rate=" + rate + "[fg];[bg][fg]overlay=x='mod(t*200,W-w)':y=H/3";
+        }
+        // bare generator name gets capture size & rate
+        else if (graph.find_first_of("=,;") == std::string::npos)
+            graph += "=size=" + size + ":rate=" + rate;
+        return std::make_unique<LavfiSource>(graph);
+    }
+    default:
+        return std::make_unique<ScreenSource>(window);
+    }
+}
+
+std::unique_ptr<InputSource> InputSource::createAudio(const SourceConfig &config, const std::string &device)
+{
+    switch (config.type)
+    {
+    case SOURCE_FILE:
+        return std::make_unique<FileSource>(config.url);
+    case SOURCE_LAVFI:
+        return std::make_unique<LavfiSource>(config.url.empty() ? SOURCE_LAVFI_AUDIO : config.url);
+    default:
+        return std::make_unique<PulseSource>(device);
+    }
+}
+
+bool InputSource::openInput(AVFormatContext **fmtCtx, const char *formatName, const std::string &url,
+                            AVDictionary **options)
+{
+    const AVInputFormat *formatIn = nullptr;
+    if (formatName && !(formatIn = av_find_input_format(formatName)))
+    {
+        display_message(NAME, std::string("input format ") + formatName + " is not available", MESSAGE_WARN);
+        av_dict_free(options);
+        return false;
+    }
+    bool success = avformat_open_input(fmtCtx, url.c_str(), formatIn, options) == 0;
+    av_dict_free(options);
+    if (!success)
+        display_message(NAME, "failed to open capture source " + name(), MESSAGE_WARN);
+    return success;
+}
+
+ScreenSource::ScreenSource(const std::array<int, 5> &window) : _window(window)
+{
+}
+
+bool ScreenSource::open(AVFormatContext **fmtCtx)
+{
+    AVDictionary *options{nullptr};
+    {
+        auto size = std::to_string(_window[2]) + "x" + std::to_string(_window[3]);
+        av_dict_set(&options, "video_size", size.c_str(), 0);
+        av_dict_set(&options, "framerate", std::to_string(_window[4]).c_str(), 0);
+    }
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    // use gdi on windows
+    av_dict_set(&options, "offset_x", std::to_string(_window[0]).c_str(), 0);
+    av_dict_set(&options, "offset_y", std::to_string(_window[1]).c_str(), 0);
+    return openInput(fmtCtx, "gdigrab", "desktop", &options);
+#elif __linux__
+    // by default assume X11 backend (wayland won't work)
+    av_dict_set(&options, "grab_x", std::to_string(_window[0]).c_str(), 0);
+    av_dict_set(&options, "grab_y", std::to_string(_window[1]).c_str(), 0);
+    return openInput(fmtCtx, "x11grab", "", &options);
+#else
+    av_dict_free(&options);
+    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
+    return false;
+#endif
+}
+
+std::string ScreenSource::name()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    return "gdigrab";
+#else
+    return "x11grab";
+#endif
+}
+
+std::vector<MonitorInfo> ScreenSource::listMonitors()
+{
+    std::vector<MonitorInfo> monitors;
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    EnumDisplayMonitors(nullptr, nullptr, addMonitor, reinterpret_cast<LPARAM>(&monitors));
+#elif __linux__
+    auto dpy = XOpenDisplay(nullptr);
+    if (!dpy)
+        return monitors;
+    // monitors (RandR 1.5) are positioned on the root window x11grab reads from
+    int eventBase = 0, errorBase = 0, major = 0, minor = 0, count = 0;
+    if (XRRQueryExtension(dpy, &eventBase, &errorBase) && XRRQueryVersion(dpy, &major, &minor) &&
+        (major > 1 || (major == 1 && minor >= 5)))
+    {
+        auto infos = XRRGetMonitors(dpy, DefaultRootWindow(dpy), True, &count);
+        for (int i = 0; infos && i < count; i++)
+        {
+            auto atomName = infos[i].name ? XGetAtomName(dpy, infos[i].name) : nullptr;
+            monitors.push_back({atomName ? atomName : "monitor " + std::to_string(i), infos[i].x, infos[i].y,
+                                infos[i].width, infos[i].height, infos[i].primary != 0});
+            if (atomName)
+                XFree(atomName);
+        }
+        if (infos)
+            XRRFreeMonitors(infos);
+    }
+    // without RandR the whole screen is one monitor
+    if (monitors.empty())
+        monitors.push_back({"screen", 0, 0, DisplayWidth(dpy, DefaultScreen(dpy)),
+                            DisplayHeight(dpy, DefaultScreen(dpy)), true});
+    XCloseDisplay(dpy);
+#endif
+    return monitors;
+}
+
+PulseSource::PulseSource(const std::string &device) : _device(device)
+{
+}
+
+bool PulseSource::open(AVFormatContext **fmtCtx)
+{
+#if __linux__
+    AVDictionary *options{nullptr};
+    return openInput(fmtCtx, "pulse", _device, &options);
+#else
+    // TODO: fill for windows (dshow)
+    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
+    return false;
+#endif
+}
+
+std::string PulseSource::name()
+{
+    return "pulse " + _device;
+}
+
+FileSource::FileSource(const std::string &path) : _path(path)
+{
+}
+
+bool FileSource::open(AVFormatContext **fmtCtx)
+{
+    AVDictionary *options{nullptr};
+    return openInput(fmtCtx, nullptr, _path, &options);
+}
+
+std::string FileSource::name()
+{
+    return "file " + _path;
+}
+
+LavfiSource::LavfiSource(const std::string &graph) : _graph(graph)
+{
+}
+
+bool LavfiSource::open(AVFormatContext **fmtCtx)
+{
+    AVDictionary *options{nullptr};
+    return openInput(fmtCtx, "lavfi", _graph, &options);
+}
+
+std::string LavfiSource::name()
+{
+    return "lavfi " + _graph;
+}
@@ -0,0 +1,160 @@
+#pragma once
+extern "C"
+{
+#include <libavdevice/avdevice.h>
+#include <libavformat/avformat.h>
+}
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/// Input source: platform capture device (x11grab / gdigrab, pulse)
+#define SOURCE_DEVICE 0
+
+/// Input source: media file, read as fast as the pipeline takes it
+#define SOURCE_FILE 1
+
+/// Input source: libavfilter graph, generated as fast as the pipeline takes it
+#define SOURCE_LAVFI 2
+
+/// Input source: one X window read from its composite pixmap (Linux), video only
+#define SOURCE_WINDOW 3
+
+/// Default lavfi video generator
+#define SOURCE_LAVFI_VIDEO "testsrc2"
+
+/// Default lavfi audio generator
+#define SOURCE_LAVFI_AUDIO "sine=frequency=440"
+
+/// lavfi source name of a mostly static, screen-like video (small moving area on a flat background)
+#define SOURCE_LAVFI_SCREEN "screen"
+
+/**
+ * @brief Source Config
+ *
+ * This structure stores the selected input source of a capture.
+ */
+struct SourceConfig
+{
+    int32_t type;
+    std::string url; // file path, lavfi graph or window id / name, empty for default generator
+
+    SourceConfig() : type(SOURCE_DEVICE)
+    {
+    }
+};
+
+/**
+ * @brief Monitor Info
+ *
+ * This structure stores one monitor of the desktop, in the coordinates screen captures use.
+ */
+struct MonitorInfo
+{
+    std::string name;
+    int32_t x, y, w, h;
+    bool primary;
+};
+
+/**
+ * @brief Input Source
+ *
+ * This class opens the demuxer a capture reads packets from.
+ */
+class InputSource
+{
+  public:
+    virtual ~InputSource() = default;
+
+    /**
+     * @brief Open Source
+     *
+     * @param fmtCtx Set to opened input context
+     * @return true if success
+     * @return false otherwise
+     */
+    virtual bool open(AVFormatContext **fmtCtx) = 0;
+
+    /// Short description for messages
+    virtual std::string name() = 0;
+
+    /**
+     * @brief Create Video Source
+     *
+     * @param config Source configs
+     * @param window Capture window & rate: x, y, w, h, fps
+     * @return std::unique_ptr<InputSource>
+     */
+    static std::unique_ptr<InputSource> createVideo(const SourceConfig &config, const std::array<int, 5> &window);
+
+    /**
+     * @brief Create Audio Source
+     *
+     * @param config Source configs
+     * @param device Platform device name, used by device sources
+     * @return std::unique_ptr<InputSource>
+     */
+    static std::unique_ptr<InputSource> createAudio(const SourceConfig &config, const std::string &device);
+
+    static inline const std::string NAME = "InputSource";
+
+  protected:
+    /// Open input with given format name and options, options are freed
+    bool openInput(AVFormatContext **fmtCtx, const char *formatName, const std::string &url, AVDictionary **options);
+};
+
+/// Screen grab: x11grab on Linux, gdigrab on Windows
+class ScreenSource : public InputSource
+{
+  public:
+    ScreenSource(const std::array<int, 5> &window);
+    bool open(AVFormatContext **fmtCtx) override;
+    std::string name() override;
+
+    /// Monitors of default display (XRandR on Linux), empty if unknown
+    static std::vector<MonitorInfo> listMonitors();
+
+  private:
+    std::array<int, 5> _window;
+};
+
+/// Audio server device: pulse on Linux
+class PulseSource : public InputSource
+{
+  public:
+    PulseSource(const std::string &device);
+    bool open(AVFormatContext **fmtCtx) override;
+    std::string name() override;
+
+  private:
+    std::string _device;
+};
+
+/// Media file, demuxed with its own format
+class FileSource : public InputSource
+{
+  public:
+    FileSource(const std::string &path);
+    bool open(AVFormatContext **fmtCtx) override;
+    std::string name() override;
+
+  private:
+    std::string _path;
+};
+
+/// libavfilter graph through the lavfi device
+class LavfiSource : public InputSource
+{
+  public:
+    LavfiSource(const std::string &graph);
+    bool open(AVFormatContext **fmtCtx) override;
+    std::string name() override;
+
+  private:
+    std::string _graph;
+};
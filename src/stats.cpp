@@ -0,0 +1,175 @@
+#include "stats.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <fstream>
+
+void StageHistogram::clear()
+{
+    for (auto &bucket : buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    count.store(0, std::memory_order_relaxed);
+    sum.store(0, std::memory_order_relaxed);
+    max.store(0, std::memory_order_relaxed);
+}
+
+PipelineStats::PipelineStats() : _enabled(true), _trace(nullptr), _current(0), _windowStart(0)
+{
+}
+
+void PipelineStats::setEnabled(bool enabled)
+{
+    _enabled = enabled;
+}
+
+void PipelineStats::setTrace(PipelineTrace *trace)
+{
+    _trace = trace;
+}
+
+void PipelineStats::reset()
+{
+    for (auto &hist : _total)
+        hist.clear();
+    for (auto &window : _windows)
+        for (auto &hist : window)
+            hist.clear();
+    _current = 0;
+    _windowStart =
+        std::chrono::duration_cast<std::chrono::milliseconds>(steadyclock::now().time_since_epoch()).count();
+}
+
+void PipelineStats::record(int stage, int64_t ns)
+{
+    if (stage < 0 || stage >= STATS_STAGES)
+        return;
+    // rotate windows, the thread that wins the exchange clears the oldest one
+    auto now = std::chrono::duration_cast<std::chrono::milliseconds>(steadyclock::now().time_since_epoch()).count();
+    auto start = _windowStart.load(std::memory_order_relaxed);
+    if (now - start >= STATS_WINDOW && _windowStart.compare_exchange_strong(start, now))
+    {
+        int next = 1 - _current.load();
+        for (auto &hist : _windows[next])
+            hist.clear();
+        _current = next;
+    }
+    auto bucket = bucketOf(ns);
+    for (auto hist : {&_total[stage], &_windows[_current.load(std::memory_order_relaxed)][stage]})
+    {
+        hist->buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        hist->count.fetch_add(1, std::memory_order_relaxed);
+        hist->sum.fetch_add(ns, std::memory_order_relaxed);
+        auto max = hist->max.load(std::memory_order_relaxed);
+        while (ns > max && !hist->max.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+            ;
+    }
+}
+
+StageSummary PipelineStats::summary(int stage, bool rolling)
+{
+    StageSummary summary{};
+    if (stage < 0 || stage >= STATS_STAGES)
+        return summary;
+    const StageHistogram *hists[2];
+    int n = 0;
+    if (rolling)
+    {
+        hists[n++] = &_windows[0][stage];
+        hists[n++] = &_windows[1][stage];
+    }
+    else
+        hists[n++] = &_total[stage];
+    int64_t sum = 0, max = 0;
+    for (int i = 0; i < n; i++)
+    {
+        summary.count += hists[i]->count.load(std::memory_order_relaxed);
+        sum += hists[i]->sum.load(std::memory_order_relaxed);
+        max = (std::max)(max, hists[i]->max.load(std::memory_order_relaxed));
+    }
+    if (summary.count == 0)
+        return summary;
+    summary.mean = sum / 1e3 / summary.count;
+    summary.p50 = percentile(hists, n, summary.count, 0.50) / 1e3;
+    summary.p95 = percentile(hists, n, summary.count, 0.95) / 1e3;
+    summary.p99 = percentile(hists, n, summary.count, 0.99) / 1e3;
+    summary.max = max / 1e3;
+    summary.total = sum / 1e9;
+    // bucket centres may lie past the exact maximum
+    summary.p50 = (std::min)(summary.p50, summary.max);
+    summary.p95 = (std::min)(summary.p95, summary.max);
+    summary.p99 = (std::min)(summary.p99, summary.max);
+    return summary;
+}
+
+bool PipelineStats::writeJson(const std::string &path, const std::string &extra)
+{
+    std::ofstream f(path);
+    if (!f.is_open())
+    {
+        display_message(NAME, "failed to write " + path, MESSAGE_WARN);
+        return false;
+    }
+    f << "{\n";
+    if (!extra.empty())
+        f << extra << ",\n";
+    f << "  \"stages_us\": {";
+    bool first = true;
+    for (int i = 0; i < STATS_STAGES; i++)
+    {
+        auto s = summary(i, false);
+        if (s.count == 0)
+            continue;
+        char line[256];
+        std::snprintf(line, sizeof(line),
+                      "\"count\": %lld, \"mean\": %.1f, \"p50\": %.1f, \"p95\": %.1f, \"p99\": %.1f, \"max\": %.1f, "
+                      "\"total_s\": %.3f",
+                      static_cast<long long>(s.count), s.mean, s.p50, s.p95, s.p99, s.max, s.total);
+        f << (first ? "" : ",") << "\n    \"" << stageName(i) << "\": {" << line << "}";
+        first = false;
+    }
+    f << "\n  }\n}" << std::endl;
+    return f.good();
+}
+
+const char *PipelineStats::stageName(int stage)
+{
+    static const char *names[STATS_STAGES] = {"video_grab",   "video_decode", "video_convert", "video_encode",
+                                              "audio_read",   "audio_decode", "audio_mix",     "audio_resample",
+                                              "audio_encode", "mux"};
+    return stage >= 0 && stage < STATS_STAGES ? names[stage] : "unknown";
+}
+
+int PipelineStats::bucketOf(int64_t ns)
+{
+    if (ns < 4)
+        return static_cast<int>((std::max)(int64_t(0), ns));
+    // 2 bits below the leading one pick the quarter within the power of two
+    int msb = std::bit_width(static_cast<uint64_t>(ns)) - 1;
+    int bucket = msb * 4 + static_cast<int>((ns >> (msb - 2)) & 3);
+    return (std::min)(bucket, STATS_BUCKETS - 1);
+}
+
+double PipelineStats::bucketValue(int bucket)
+{
+    if (bucket < 8)
+        return bucket;
+    int msb = bucket / 4, quarter = bucket % 4;
+    double width = static_cast<double>(int64_t(1) << (msb - 2));
+    return (4 + quarter) * width + width / 2;
+}
+
+double PipelineStats::percentile(const StageHistogram *hists[], int n, int64_t count, double p)
+{
+    auto rank = static_cast<int64_t>(p * (count - 1)) + 1;
+    int64_t seen = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        for (int i = 0; i < n; i++)
+            seen += hists[i]->buckets[b].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return bucketValue(b);
+    }
+    return bucketValue(STATS_BUCKETS - 1);
+}
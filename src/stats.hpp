@@ -0,0 +1,251 @@
+#pragma once
+#include "trace.hpp"
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+/** @file */
+
+/// Stage: read captured video packet
+#define STATS_VIDEO_GRAB 0
+
+/// Stage: decode captured video packet
+#define STATS_VIDEO_DECODE 1
+
+/// Stage: colour conversion to encoder format
+#define STATS_VIDEO_CONVERT 2
+
+/// Stage: encode video frame
+#define STATS_VIDEO_ENCODE 3
+
+/// Stage: read captured audio packets
+#define STATS_AUDIO_READ 4
+
+/// Stage: decode captured audio packets
+#define STATS_AUDIO_DECODE 5
+
+/// Stage: mix desktop audio & mic
+#define STATS_AUDIO_MIX 6
+
+/// Stage: resample to encoder format
+#define STATS_AUDIO_RESAMPLE 7
+
+/// Stage: encode audio frames
+#define STATS_AUDIO_ENCODE 8
+
+/// Stage: write packet to output file, on muxer threads
+#define STATS_MUX 9
+
+/// Number of timed stages
+#define STATS_STAGES 10
+
+/// Histogram buckets: 4 per power of two nanoseconds, up to about 18 minutes
+#define STATS_BUCKETS 160
+
+/// Length (milliseconds) of one rolling window, live stats cover the last one or two windows
+#define STATS_WINDOW 5000
+
+using steadyclock = std::chrono::steady_clock;
+
+/**
+ * @brief Stage Summary
+ *
+ * This structure stores percentiles of one stage, in microseconds.
+ */
+struct StageSummary
+{
+    int64_t count;
+    double mean, p50, p95, p99, max;
+    double total; // seconds spent in stage
+};
+
+/**
+ * @brief Stage Histogram
+ *
+ * This structure stores log2 bucketed durations of one stage, safe to update from any thread.
+ */
+struct StageHistogram
+{
+    std::array<std::atomic<uint32_t>, STATS_BUCKETS> buckets;
+    std::atomic<int64_t> count, sum, max; // nanoseconds
+
+    StageHistogram()
+    {
+        clear();
+    }
+
+    /// Reset all counters
+    void clear();
+};
+
+/**
+ * @brief Pipeline Stats
+ *
+ * This class keeps per-stage duration histograms of a recording, for the whole session and a rolling window.
+ * Recording is wait-free; when disabled and not tracing, timers cost two relaxed loads.
+ */
+class PipelineStats
+{
+  public:
+    PipelineStats();
+
+    /// Enable or disable stage timers, takes effect on next timed stage
+    void setEnabled(bool enabled);
+
+    /// Whether stage timers are running
+    bool enabled() const
+    {
+        return _enabled.load(std::memory_order_relaxed);
+    }
+
+    /// Set trace receiving a span per timed call, nullptr for none
+    void setTrace(PipelineTrace *trace);
+
+    /// Trace receiving stage spans, nullptr if none is recording
+    PipelineTrace *trace() const
+    {
+        auto trace = _trace.load(std::memory_order_relaxed);
+        return trace && trace->active() ? trace : nullptr;
+    }
+
+    /// Whether timers need the clock, for histograms or trace
+    bool active() const
+    {
+        return enabled() || trace();
+    }
+
+    /// Clear all histograms, meant to be called when recording starts
+    void reset();
+
+    /**
+     * @brief Record Stage Duration
+     *
+     * @param stage Stage index, one of STATS_*
+     * @param ns Duration in nanoseconds
+     */
+    void record(int stage, int64_t ns);
+
+    /**
+     * @brief Get Stage Summary
+     *
+     * @param stage Stage index, one of STATS_*
+     * @param rolling Whether to summarize the rolling window instead of the whole session
+     * @return StageSummary
+     */
+    StageSummary summary(int stage, bool rolling);
+
+    /**
+     * @brief Write Session Summary
+     *
+     * @param path JSON file path
+     * @param extra Additional JSON members (without braces) written before the stages, may be empty
+     * @return true if success
+     * @return false otherwise
+     */
+    bool writeJson(const std::string &path, const std::string &extra);
+
+    /// Short stage name for display
+    static const char *stageName(int stage);
+
+    static inline const std::string NAME = "PipelineStats";
+
+  private:
+    /// Bucket index of duration
+    static int bucketOf(int64_t ns);
+
+    /// Representative duration of bucket
+    static double bucketValue(int bucket);
+
+    /// Percentile over given histograms, in nanoseconds
+    static double percentile(const StageHistogram *hists[], int n, int64_t count, double p);
+
+    std::atomic<bool> _enabled;
+    std::atomic<PipelineTrace *> _trace;
+    std::array<StageHistogram, STATS_STAGES> _total;
+    std::array<std::array<StageHistogram, STATS_STAGES>, 2> _windows;
+    std::atomic<int> _current;
+    std::atomic<int64_t> _windowStart; // steady clock milliseconds
+};
+
+/**
+ * @brief Stage Timer
+ *
+ * This class adds up the time spent in one stage over several start/stop calls,
+ * e.g. all decode calls of one packet, and records the sum as one sample when destroyed.
+ * Every start/stop pair also becomes a span of the running trace.
+ */
+class StageTimer
+{
+  public:
+    StageTimer(PipelineStats *stats, int stage)
+        : _stats(stats && stats->active() ? stats : nullptr), _stage(stage), _elapsed(0), _used(false)
+    {
+    }
+
+    ~StageTimer()
+    {
+        commit();
+    }
+
+    /// Start timing
+    void start()
+    {
+        if (_stats)
+            _startT = steadyclock::now();
+    }
+
+    /// Stop timing and add elapsed time
+    void stop()
+    {
+        if (!_stats)
+            return;
+        auto endT = steadyclock::now();
+        _elapsed += std::chrono::duration_cast<std::chrono::nanoseconds>(endT - _startT).count();
+        _used = true;
+        if (auto trace = _stats->trace())
+            trace->add(PipelineStats::stageName(_stage), _startT, endT);
+    }
+
+    /// Record added time as one sample and start over
+    void commit()
+    {
+        if (_stats && _used && _stats->enabled())
+            _stats->record(_stage, _elapsed);
+        _elapsed = 0;
+        _used = false;
+    }
+
+  private:
+    PipelineStats *_stats;
+    int _stage;
+    steadyclock::time_point _startT;
+    int64_t _elapsed;
+    bool _used;
+};
+
+/**
+ * @brief Stage Scope
+ *
+ * This class times the enclosing scope into a stage timer, nullptr times nothing.
+ */
+class StageScope
+{
+  public:
+    StageScope(StageTimer *timer) : _timer(timer)
+    {
+        if (_timer)
+            _timer->start();
+    }
+
+    ~StageScope()
+    {
+        if (_timer)
+            _timer->stop();
+    }
+
+  private:
+    StageTimer *_timer;
+};
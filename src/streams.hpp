@@ -9,8 +9,13 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+#include <functional>
+
 /** @file */
 
+/// Callback receiving encoded packets, timestamps in encoder time base
+using PacketCallback = std::function<void(const AVPacket *)>;
+
 // reference: https://github.com/FFmpeg/FFmpeg/blob/master/doc/examples/muxing.c
 
 /**
@@ -56,10 +61,12 @@ struct OutputStream
     AVStream *st;
     struct SwsContext *swsCtx;
     struct SwrContext *swrCtx;
+    AVBufferPool *pool;
     int64_t samples;
 
     OutputStream()
-        : encCtx(nullptr), frame(nullptr), pkt(nullptr), st(nullptr), swsCtx(nullptr), swrCtx(nullptr), samples(0)
+        : encCtx(nullptr), frame(nullptr), pkt(nullptr), st(nullptr), swsCtx(nullptr), swrCtx(nullptr), pool(nullptr),
+          samples(0)
     {
     }
 
@@ -75,6 +82,8 @@ struct OutputStream
             sws_freeContext(swsCtx);
         if (swrCtx)
             swr_free(&swrCtx);
+        if (pool)
+            av_buffer_pool_uninit(&pool);
     }
 };
 
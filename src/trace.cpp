@@ -0,0 +1,150 @@
+#include "trace.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+namespace
+{
+/// Buffer cache & name of calling thread
+struct ThreadTrace
+{
+    const PipelineTrace *owner;
+    uint64_t generation;
+    TraceBuffer *buffer;
+    std::string name;
+};
+
+thread_local ThreadTrace threadTrace{nullptr, 0, nullptr, ""};
+
+/// Unique per started trace, so that cached buffers of an older trace are never reused
+std::atomic<uint64_t> nextGeneration{1};
+
+/// Escape string for JSON
+std::string escape(const std::string &s)
+{
+    std::string out;
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += '\\';
+        if (static_cast<unsigned char>(c) >= 0x20)
+            out += c;
+    }
+    return out;
+}
+} // namespace
+
+PipelineTrace::PipelineTrace() : _active(false), _generation(0), _chunksLeft(0), _dropped(0)
+{
+}
+
+void PipelineTrace::start(int memoryMB)
+{
+    std::lock_guard<std::mutex> lock(_buffersLock);
+    _buffers.clear();
+    auto chunkBytes = static_cast<int64_t>(sizeof(TraceEvent)) * TRACE_CHUNK_EVENTS;
+    _chunksLeft = (std::max)(int64_t(1), (int64_t(memoryMB) << 20) / chunkBytes);
+    _dropped = 0;
+    _startT = std::chrono::steady_clock::now();
+    _generation = nextGeneration++;
+    _active = true;
+}
+
+void PipelineTrace::stop()
+{
+    _active = false;
+}
+
+void PipelineTrace::add(const char *name, std::chrono::steady_clock::time_point begin,
+                        std::chrono::steady_clock::time_point end, int64_t arg)
+{
+    if (!active())
+        return;
+    auto buffer = threadBuffer();
+    if (buffer->chunks.empty() || buffer->last == TRACE_CHUNK_EVENTS)
+    {
+        // budget is shared by all threads, a full budget drops events instead of growing
+        if (_chunksLeft.fetch_sub(1, std::memory_order_relaxed) <= 0)
+        {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        buffer->chunks.push_back(std::make_unique<TraceEvent[]>(TRACE_CHUNK_EVENTS));
+        buffer->last = 0;
+    }
+    auto &event = buffer->chunks.back()[buffer->last++];
+    event.name = name;
+    event.begin = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - _startT).count();
+    event.end = std::chrono::duration_cast<std::chrono::nanoseconds>(end - _startT).count();
+    event.arg = arg;
+}
+
+bool PipelineTrace::write(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(_buffersLock);
+    std::ofstream f(path);
+    if (!f.is_open())
+    {
+        display_message(NAME, "failed to write " + path, MESSAGE_WARN);
+        return false;
+    }
+    f << "{\"displayTimeUnit\": \"ms\", \"otherData\": {\"dropped_events\": " << _dropped.load()
+      << "},\n\"traceEvents\": [";
+    bool first = true;
+    char line[256];
+    for (auto &buffer : _buffers)
+    {
+        f << (first ? "" : ",") << "\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid
+          << ", \"args\": {\"name\": \"" << escape(buffer->threadName) << "\"}}";
+        first = false;
+        for (size_t c = 0; c < buffer->chunks.size(); c++)
+        {
+            auto count = c + 1 == buffer->chunks.size() ? buffer->last : TRACE_CHUNK_EVENTS;
+            for (size_t i = 0; i < count; i++)
+            {
+                auto &event = buffer->chunks[c][i];
+                // trace event times are microseconds
+                int n = std::snprintf(line, sizeof(line),
+                                      ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, "
+                                      "\"dur\": %.3f",
+                                      event.name, buffer->tid, event.begin / 1e3, (event.end - event.begin) / 1e3);
+                f.write(line, n);
+                if (event.arg >= 0)
+                    f << ", \"args\": {\"frame\": " << event.arg << "}";
+                f << "}";
+            }
+        }
+    }
+    f << "\n]}" << std::endl;
+    if (_dropped)
+        display_message(NAME, std::to_string(_dropped.load()) + " trace events dropped, raise trace memory",
+                        MESSAGE_WARN);
+    return f.good();
+}
+
+int64_t PipelineTrace::droppedEvents()
+{
+    return _dropped;
+}
+
+void PipelineTrace::nameThread(const std::string &name)
+{
+    threadTrace.name = name;
+}
+
+TraceBuffer *PipelineTrace::threadBuffer()
+{
+    auto generation = _generation.load(std::memory_order_relaxed);
+    if (threadTrace.owner == this && threadTrace.generation == generation)
+        return threadTrace.buffer;
+    std::lock_guard<std::mutex> lock(_buffersLock);
+    auto buffer = std::make_unique<TraceBuffer>();
+    buffer->tid = static_cast<int>(_buffers.size()) + 1;
+    buffer->threadName = threadTrace.name.empty() ? "thread " + std::to_string(buffer->tid) : threadTrace.name;
+    buffer->last = 0;
+    threadTrace = {this, generation, buffer.get(), threadTrace.name};
+    _buffers.push_back(std::move(buffer));
+    return threadTrace.buffer;
+}
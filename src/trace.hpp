@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/// Default trace memory (MB), shared by all threads
+#define TRACE_DEFAULT_MEMORY 64
+
+/// Events per trace chunk, a thread takes a new chunk from the memory budget when its last one is full
+#define TRACE_CHUNK_EVENTS 4096
+
+/**
+ * @brief Trace Event
+ *
+ * This structure stores one complete (begin & end) span of a thread.
+ */
+struct TraceEvent
+{
+    const char *name; // static string
+    int64_t begin;    // nanoseconds since trace start
+    int64_t end;
+    int64_t arg; // frame number, -1 for none
+};
+
+/**
+ * @brief Trace Buffer
+ *
+ * This structure stores the events of one thread. Only the owning thread appends,
+ * readers wait until the trace is stopped and all traced threads have finished.
+ */
+struct TraceBuffer
+{
+    int tid;
+    std::string threadName;
+    std::vector<std::unique_ptr<TraceEvent[]>> chunks;
+    size_t last; // events used in last chunk
+};
+
+/**
+ * @brief Pipeline Trace
+ *
+ * This class records per-thread spans of a recording and exports them as Chrome trace-event JSON,
+ * which chrome://tracing and Perfetto open. Appending is lock-free; a thread only locks once, to register its buffer.
+ */
+class PipelineTrace
+{
+  public:
+    PipelineTrace();
+
+    /**
+     * @brief Start Trace
+     *
+     * Drops events of the previous trace. Meant to be called before traced threads start.
+     *
+     * @param memoryMB Memory budget of all buffers, events beyond it are dropped and counted
+     */
+    void start(int memoryMB);
+
+    /// Stop appending events, buffers are kept for writing
+    void stop();
+
+    /// Whether events are being recorded
+    bool active() const
+    {
+        return _active.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * @brief Add Span of Calling Thread
+     *
+     * @param name Static span name
+     * @param begin Span begin
+     * @param end Span end
+     * @param arg Frame number, -1 for none
+     */
+    void add(const char *name, std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end,
+             int64_t arg = -1);
+
+    /**
+     * @brief Write Trace
+     *
+     * Meant to be called after stop, once traced threads have finished.
+     *
+     * @param path JSON file path
+     * @return true if success
+     * @return false otherwise
+     */
+    bool write(const std::string &path);
+
+    /// Events dropped because the memory budget was used up
+    int64_t droppedEvents();
+
+    /// Name calling thread in traces started later
+    static void nameThread(const std::string &name);
+
+    static inline const std::string NAME = "PipelineTrace";
+
+  private:
+    /// Buffer of calling thread, registered on first use in this trace
+    TraceBuffer *threadBuffer();
+
+    std::atomic<bool> _active;
+    std::atomic<uint64_t> _generation;
+    std::chrono::steady_clock::time_point _startT;
+    std::atomic<int64_t> _chunksLeft;
+    std::atomic<int64_t> _dropped;
+    std::mutex _buffersLock;
+    std::vector<std::unique_ptr<TraceBuffer>> _buffers;
+};
+
+/**
+ * @brief Trace Scope
+ *
+ * This class adds a span covering the enclosing scope, nullptr or inactive trace adds nothing.
+ */
+class TraceScope
+{
+  public:
+    TraceScope(PipelineTrace *trace, const char *name, int64_t arg = -1)
+        : _trace(trace && trace->active() ? trace : nullptr), _name(name), _arg(arg)
+    {
+        if (_trace)
+            _beginT = std::chrono::steady_clock::now();
+    }
+
+    ~TraceScope()
+    {
+        if (_trace)
+            _trace->add(_name, _beginT, std::chrono::steady_clock::now(), _arg);
+    }
+
+  private:
+    PipelineTrace *_trace;
+    const char *_name;
+    int64_t _arg;
+    std::chrono::steady_clock::time_point _beginT;
+};
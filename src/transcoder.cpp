@@ -0,0 +1,703 @@
+#include "transcoder.hpp"
+#include "audiocapture.hpp"
+#include "utils.hpp"
+#include "videocapture.hpp"
+
+extern "C"
+{
+#include <libavutil/opt.h>
+}
+
+#if __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+using sysclock = std::chrono::system_clock;
+
+Transcoder::Transcoder() : _ic(nullptr), _running(false), _cancel(false), _progress(0.0f)
+{
+}
+
+Transcoder::~Transcoder()
+{
+    cancel();
+}
+
+bool Transcoder::start(const TranscodeConfig &config, const std::function<void(bool)> &onDone)
+{
+    if (_running)
+    {
+        display_message(NAME, "previous transcode is still running", MESSAGE_WARN);
+        return false;
+    }
+    if (_transcodeT.joinable())
+        _transcodeT.join();
+    _config = config;
+    _cancel = false;
+    _progress = 0.0f;
+    _running = true;
+    _transcodeT = std::thread([this, onDone] {
+        lowerPriority();
+        display_message(NAME, "encoding " + _config.output.path + " in background", MESSAGE_INFO);
+        auto startT = sysclock::now();
+        bool success = openInput(&_ic);
+        if (success)
+            success = _config.jobs > 1 ? transcodeChunked() : transcodeInternal();
+        // release input before reporting
+        if (_ic)
+            avformat_close_input(&_ic);
+        if (success)
+        {
+            auto seconds = std::chrono::duration_cast<std::chrono::seconds>(sysclock::now() - startT).count();
+            display_message(NAME, "encoded in " + std::to_string(seconds) + " s", MESSAGE_INFO);
+        }
+        else
+            display_message(NAME, "failed to encode " + _config.output.path, MESSAGE_WARN);
+        onDone(success);
+        _running = false;
+    });
+    return true;
+}
+
+void Transcoder::cancel()
+{
+    _cancel = true;
+    wait();
+}
+
+void Transcoder::wait()
+{
+    if (_transcodeT.joinable())
+        _transcodeT.join();
+}
+
+bool Transcoder::isRunning()
+{
+    return _running;
+}
+
+float Transcoder::progress()
+{
+    return _progress;
+}
+
+TranscodeConfig Transcoder::convertConfig(const std::string &input, const std::string &output)
+{
+    TranscodeConfig config;
+    config.input = input;
+    config.output.path = output;
+    auto formatOut = av_guess_format(nullptr, output.c_str(), nullptr);
+    if (formatOut)
+        config.audioCodec = formatOut->audio_codec;
+    config.jobs = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    return config;
+}
+
+bool Transcoder::transcodeInternal()
+{
+    auto vist = openDecoder(_ic, AVMEDIA_TYPE_VIDEO, 0);
+    if (!vist)
+        return false;
+    std::unique_ptr<InputStream> aist;
+    auto tmpl = allocOutput();
+    if (!tmpl)
+        return false;
+    bool success = true;
+    {
+        auto vost = std::make_unique<OutputStream>();
+        auto aost = std::make_unique<OutputStream>();
+        success = openVideoEncoder(vost.get(), tmpl, _ic, vist.get(), 0);
+        if (success && tmpl->audio_codec_id != AV_CODEC_ID_NONE)
+        {
+            aist = openDecoder(_ic, AVMEDIA_TYPE_AUDIO, 0);
+            if (aist)
+                success = openAudioEncoder(aost.get(), tmpl, aist.get());
+        }
+        // offline output, wait for disk instead of dropping packets
+        auto output = _config.output;
+        output.blocking = true;
+        MediaMuxer muxer;
+        success = success && muxer.open(tmpl, output);
+        auto pkt = av_packet_alloc();
+        success = success && pkt;
+        PacketCallback onPacket = [&muxer](const AVPacket *p) { muxer.writePacket(p); };
+        auto vtb = _ic->streams[vist->streamIdx]->time_base;
+        while (success && !_cancel && av_read_frame(_ic, pkt) >= 0)
+        {
+            bool isVideo = pkt->stream_index == vist->streamIdx;
+            bool isAudio = aist && pkt->stream_index == aist->streamIdx;
+            if ((isVideo || isAudio) && pkt->pts != AV_NOPTS_VALUE && _ic->duration > 0)
+            {
+                auto t =
+                    av_rescale_q(pkt->pts, _ic->streams[pkt->stream_index]->time_base, AVRational{1, AV_TIME_BASE});
+                _progress = std::clamp(static_cast<float>(t) / _ic->duration, 0.0f, 1.0f);
+            }
+            auto ist = isVideo ? vist.get() : aist.get();
+            bool packetSent = false;
+            while ((isVideo || isAudio) && decode(ist->decCtx, ist->frame, pkt, packetSent))
+            {
+                if (isVideo)
+                    encodeVideo(vost.get(), vtb, ist->frame, onPacket);
+                else
+                    encodeAudio(aost.get(), ist->frame, onPacket);
+            }
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+        // flush decoders & encoders
+        if (success)
+        {
+            bool packetSent = false;
+            while (decode(vist->decCtx, vist->frame, nullptr, packetSent))
+                encodeVideo(vost.get(), vtb, vist->frame, onPacket);
+            encodeVideo(vost.get(), vtb, nullptr, onPacket);
+            packetSent = false;
+            while (aist && decode(aist->decCtx, aist->frame, nullptr, packetSent))
+                encodeAudio(aost.get(), aist->frame, onPacket);
+            if (aist)
+                encodeAudio(aost.get(), nullptr, onPacket);
+        }
+        muxer.close();
+        success = success && !_cancel && !muxer.failed();
+    }
+    avformat_free_context(tmpl);
+    _progress = 1.0f;
+    return success;
+}
+
+bool Transcoder::transcodeChunked()
+{
+    // split video at keyframes, so every chunk decodes on its own
+    std::vector<int64_t> keys;
+    if (!scanKeyFrames(keys))
+        return false;
+    auto vtb = _ic->streams[av_find_best_stream(_ic, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0)]->time_base;
+    auto total = keys.back() - keys.front();
+    auto minChunk = std::max(av_rescale_q(static_cast<int64_t>(TRANSCODE_MIN_CHUNK_TIME * AV_TIME_BASE),
+                                          AVRational{1, AV_TIME_BASE}, vtb),
+                             total / (_config.jobs * TRANSCODE_CHUNKS_PER_JOB));
+    // parts are written next to the output, where space is expected
+    auto p = fs::path(_config.output.path);
+    auto stamp = std::chrono::duration_cast<std::chrono::milliseconds>(sysclock::now().time_since_epoch()).count();
+    auto tmpDir = p.replace_filename(p.stem().string() + "_chunks_" + std::to_string(stamp));
+    std::error_code ec;
+    if (!fs::create_directory(tmpDir, ec))
+    {
+        display_message(NAME, "failed to create " + tmpDir.string(), MESSAGE_WARN);
+        return false;
+    }
+    std::vector<std::unique_ptr<PacketDump>> chunks;
+    for (size_t i = 0; i < keys.size(); i++)
+    {
+        if (!chunks.empty() && keys[i] - chunks.back()->start < minChunk)
+            continue;
+        if (!chunks.empty())
+            chunks.back()->end = keys[i];
+        chunks.push_back(std::make_unique<PacketDump>());
+        chunks.back()->start = i ? keys[i] : INT64_MIN;
+        chunks.back()->path = (tmpDir / ("video_" + std::to_string(chunks.size()) + ".pkt")).string();
+    }
+    std::unique_ptr<PacketDump> audio;
+    if (_config.audioCodec != AV_CODEC_ID_NONE && av_find_best_stream(_ic, AVMEDIA_TYPE_AUDIO, -1, -1, nullptr, 0) >= 0)
+    {
+        audio = std::make_unique<PacketDump>();
+        audio->path = (tmpDir / "audio.pkt").string();
+    }
+    display_message(NAME,
+                    "encoding " + std::to_string(chunks.size()) + " chunks with " + std::to_string(_config.jobs) +
+                        " jobs",
+                    MESSAGE_INFO);
+    // audio is encoded serially next to the video jobs
+    std::atomic<bool> success = true;
+    std::atomic<size_t> next = 0, done = 0;
+    std::thread audioT;
+    if (audio)
+        audioT = std::thread([this, &audio, &success] {
+            lowerPriority();
+            if (!transcodeAudio(audio.get()))
+                success = false;
+        });
+    std::vector<std::thread> workers;
+    for (int i = 0; i < _config.jobs; i++)
+    {
+        workers.emplace_back([this, &chunks, &success, &next, &done] {
+            lowerPriority();
+            size_t idx;
+            while (success && !_cancel && (idx = next++) < chunks.size())
+            {
+                if (!transcodeChunk(chunks[idx].get()))
+                    success = false;
+                _progress = 0.95f * ++done / chunks.size();
+            }
+        });
+    }
+    for (auto &t : workers)
+        t.join();
+    if (audioT.joinable())
+        audioT.join();
+    bool result = success && !_cancel && concatDumps(chunks, audio.get());
+    fs::remove_all(tmpDir, ec);
+    _progress = 1.0f;
+    return result;
+}
+
+bool Transcoder::openInput(AVFormatContext **ic)
+{
+    if (avformat_open_input(ic, _config.input.c_str(), nullptr, nullptr) != 0)
+    {
+        display_message(NAME, "failed to open " + _config.input, MESSAGE_WARN);
+        return false;
+    }
+    if (avformat_find_stream_info(*ic, nullptr) < 0)
+    {
+        display_message(NAME, "failed to get stream info", MESSAGE_WARN);
+        return false;
+    }
+    return true;
+}
+
+std::unique_ptr<InputStream> Transcoder::openDecoder(AVFormatContext *ic, AVMediaType type, int threads)
+{
+    const AVCodec *codecIn = nullptr;
+    int idx = av_find_best_stream(ic, type, -1, -1, &codecIn, 0);
+    if (idx < 0)
+    {
+        if (type == AVMEDIA_TYPE_VIDEO)
+            display_message(NAME, "no video in " + _config.input, MESSAGE_WARN);
+        return nullptr;
+    }
+    auto ist = std::make_unique<InputStream>();
+    ist->streamIdx = idx;
+    auto codecName = std::string(avcodec_get_name(ic->streams[idx]->codecpar->codec_id));
+    ist->decCtx = avcodec_alloc_context3(codecIn);
+    if (!ist->decCtx)
+    {
+        display_message(NAME, "failed to allocate decoder for " + codecName, MESSAGE_WARN);
+        return nullptr;
+    }
+    if (avcodec_parameters_to_context(ist->decCtx, ic->streams[idx]->codecpar) < 0)
+    {
+        display_message(NAME, "failed to copy decoder params for " + codecName, MESSAGE_WARN);
+        return nullptr;
+    }
+    ist->decCtx->pkt_timebase = ic->streams[idx]->time_base;
+    if (threads > 0)
+        ist->decCtx->thread_count = threads;
+    if (avcodec_open2(ist->decCtx, codecIn, nullptr) < 0)
+    {
+        display_message(NAME, "failed to open decoder for " + codecName, MESSAGE_WARN);
+        return nullptr;
+    }
+    ist->frame = av_frame_alloc();
+    if (!ist->frame)
+    {
+        display_message(NAME, "failed to allocate decoder frame", MESSAGE_WARN);
+        return nullptr;
+    }
+    return ist;
+}
+
+AVFormatContext *Transcoder::allocOutput()
+{
+    auto formatOut = av_guess_format(nullptr, _config.output.path.c_str(), nullptr);
+    if (!formatOut)
+    {
+        display_message(NAME, "failed to guess format for " + _config.output.path, MESSAGE_WARN);
+        return nullptr;
+    }
+    AVFormatContext *oc = nullptr;
+    if (avformat_alloc_output_context2(&oc, formatOut, nullptr, _config.output.path.c_str()) < 0)
+    {
+        display_message(NAME, "failed to allocate format for " + _config.output.path, MESSAGE_WARN);
+        return nullptr;
+    }
+    oc->video_codec_id = _config.videoCodec != AV_CODEC_ID_NONE ? _config.videoCodec : formatOut->video_codec;
+    oc->audio_codec_id = _config.audioCodec;
+    return oc;
+}
+
+bool Transcoder::openVideoEncoder(OutputStream *ost, AVFormatContext *oc, AVFormatContext *ic, InputStream *ist,
+                                  int threads)
+{
+    // keep recorded size & rate
+    auto decCtx = ist->decCtx;
+    auto rate = av_guess_frame_rate(ic, ic->streams[ist->streamIdx], nullptr);
+    int fps = rate.num > 0 && rate.den > 0 ? static_cast<int>(av_q2d(rate) + 0.5) : VIDEO_DEFAULT_FPS;
+    auto bitRate = _config.videoBitRate ? _config.videoBitRate : int64_t(decCtx->width) * decCtx->height * fps;
+    if (!VideoCapture::openEncoder(ost, oc, decCtx->width, decCtx->height, fps, bitRate, decCtx->pix_fmt, threads))
+        return false;
+    ost->swsCtx = sws_getContext(decCtx->width, decCtx->height, decCtx->pix_fmt, ost->encCtx->width,
+                                 ost->encCtx->height, ost->encCtx->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
+    if (!ost->swsCtx)
+    {
+        display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
+        return false;
+    }
+    return true;
+}
+
+bool Transcoder::openAudioEncoder(OutputStream *ost, AVFormatContext *oc, InputStream *ist)
+{
+    auto decCtx = ist->decCtx;
+    int sampleRate = _config.sampleRate;
+    auto bitRate = _config.audioBitRate ? _config.audioBitRate : sampleRate * 16 * AUDIO_OUTPUT_CHANNELS / 10;
+    if (!AudioCapture::openEncoder(ost, oc, sampleRate, bitRate))
+        return false;
+    ost->swrCtx = swr_alloc();
+    if (!ost->swrCtx)
+    {
+        display_message(NAME, "failed to allocate resampler context", MESSAGE_WARN);
+        return false;
+    }
+    auto layout = decCtx->channel_layout ? decCtx->channel_layout : av_get_default_channel_layout(decCtx->channels);
+    av_opt_set_int(ost->swrCtx, "in_sample_rate", decCtx->sample_rate, 0);
+    av_opt_set_channel_layout(ost->swrCtx, "in_channel_layout", layout, 0);
+    av_opt_set_sample_fmt(ost->swrCtx, "in_sample_fmt", decCtx->sample_fmt, 0);
+    av_opt_set_int(ost->swrCtx, "out_sample_rate", ost->encCtx->sample_rate, 0);
+    av_opt_set_channel_layout(ost->swrCtx, "out_channel_layout", ost->encCtx->channel_layout, 0);
+    av_opt_set_sample_fmt(ost->swrCtx, "out_sample_fmt", ost->encCtx->sample_fmt, 0);
+    if (swr_init(ost->swrCtx) < 0)
+    {
+        display_message(NAME, "failed to init resampler context", MESSAGE_WARN);
+        return false;
+    }
+    return true;
+}
+
+void Transcoder::encodeVideo(OutputStream *ost, AVRational inTimeBase, AVFrame *frame, const PacketCallback &onPacket)
+{
+    AVFrame *encFrame = nullptr;
+    if (frame)
+    {
+        if (av_frame_make_writable(ost->frame) < 0)
+            return;
+        sws_scale(ost->swsCtx, frame->data, frame->linesize, 0, frame->height, ost->frame->data,
+                  ost->frame->linesize);
+        ost->frame->pts = av_rescale_q(frame->best_effort_timestamp, inTimeBase, ost->encCtx->time_base);
+        encFrame = ost->frame;
+    }
+    bool frameSent = false;
+    while (encode(ost->encCtx, encFrame, ost->pkt, frameSent))
+    {
+        ost->pkt->stream_index = ost->st->index;
+        onPacket(ost->pkt);
+        av_packet_unref(ost->pkt);
+    }
+}
+
+void Transcoder::encodeAudio(OutputStream *ost, AVFrame *frame, const PacketCallback &onPacket)
+{
+    // frame capacity chosen by AudioCapture::openEncoder
+    int frameSize = (ost->encCtx->codec->capabilities & AV_CODEC_CAP_VARIABLE_FRAME_SIZE) ? 10000
+                                                                                         : ost->encCtx->frame_size;
+    if (frame)
+        swr_convert(ost->swrCtx, nullptr, 0, const_cast<const uint8_t **>(frame->extended_data), frame->nb_samples);
+    while (swr_get_delay(ost->swrCtx, ost->encCtx->sample_rate) >= frameSize ||
+           (!frame && swr_get_delay(ost->swrCtx, ost->encCtx->sample_rate) > 0))
+    {
+        ost->frame->nb_samples = frameSize;
+        if (av_frame_make_writable(ost->frame) < 0)
+            return;
+        int nb_samples = swr_convert(ost->swrCtx, ost->frame->data, frameSize, nullptr, 0);
+        if (nb_samples <= 0)
+            break;
+        ost->frame->nb_samples = nb_samples;
+        ost->frame->pts = av_rescale_q(ost->samples, {1, ost->encCtx->sample_rate}, ost->encCtx->time_base);
+        ost->samples += nb_samples;
+        bool frameSent = false;
+        while (encode(ost->encCtx, ost->frame, ost->pkt, frameSent))
+        {
+            ost->pkt->stream_index = ost->st->index;
+            onPacket(ost->pkt);
+            av_packet_unref(ost->pkt);
+        }
+    }
+    if (!frame)
+    {
+        bool frameSent = false;
+        while (encode(ost->encCtx, nullptr, ost->pkt, frameSent))
+        {
+            ost->pkt->stream_index = ost->st->index;
+            onPacket(ost->pkt);
+            av_packet_unref(ost->pkt);
+        }
+    }
+}
+
+bool Transcoder::scanKeyFrames(std::vector<int64_t> &keys)
+{
+    int idx = av_find_best_stream(_ic, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    auto pkt = av_packet_alloc();
+    if (idx < 0 || !pkt)
+    {
+        display_message(NAME, "no video in " + _config.input, MESSAGE_WARN);
+        av_packet_free(&pkt);
+        return false;
+    }
+    // demux only, no decoding
+    while (!_cancel && av_read_frame(_ic, pkt) >= 0)
+    {
+        if (pkt->stream_index == idx && (pkt->flags & AV_PKT_FLAG_KEY) && pkt->pts != AV_NOPTS_VALUE)
+            keys.push_back(pkt->pts);
+        av_packet_unref(pkt);
+    }
+    av_packet_free(&pkt);
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    return !_cancel && !keys.empty();
+}
+
+bool Transcoder::transcodeChunk(PacketDump *chunk)
+{
+    AVFormatContext *ic = nullptr;
+    AVFormatContext *tmpl = nullptr;
+    bool success = openInput(&ic);
+    // each job runs single threaded codecs, jobs themselves fill the cores
+    auto ist = success ? openDecoder(ic, AVMEDIA_TYPE_VIDEO, 1) : nullptr;
+    success = ist && (tmpl = allocOutput());
+    auto ost = std::make_unique<OutputStream>();
+    success = success && openVideoEncoder(ost.get(), tmpl, ic, ist.get(), 1);
+    auto pkt = success ? av_packet_alloc() : nullptr;
+    success = success && pkt;
+    if (success)
+    {
+        auto tb = ic->streams[ist->streamIdx]->time_base;
+        std::ofstream f(chunk->path, std::ios::binary);
+        PacketCallback onPacket = [this, &f](const AVPacket *p) { writeDump(f, p); };
+        // keyframe at chunk start
+        if (chunk->start != INT64_MIN)
+            avformat_seek_file(ic, ist->streamIdx, INT64_MIN, chunk->start, chunk->start, 0);
+        bool ended = false;
+        auto onFrame = [&]() {
+            // frames leave the decoder in presentation order
+            auto pts = ist->frame->best_effort_timestamp;
+            if (pts >= chunk->end)
+                ended = true;
+            else if (pts >= chunk->start)
+                encodeVideo(ost.get(), tb, ist->frame, onPacket);
+        };
+        while (!ended && !_cancel && av_read_frame(ic, pkt) >= 0)
+        {
+            bool packetSent = false;
+            while (!ended && pkt->stream_index == ist->streamIdx && decode(ist->decCtx, ist->frame, pkt, packetSent))
+                onFrame();
+            av_packet_unref(pkt);
+        }
+        bool packetSent = false;
+        while (!ended && decode(ist->decCtx, ist->frame, nullptr, packetSent))
+            onFrame();
+        encodeVideo(ost.get(), tb, nullptr, onPacket);
+        success = f.good() && avcodec_parameters_from_context(chunk->par, ost->encCtx) >= 0;
+        chunk->timeBase = ost->encCtx->time_base;
+        if (!f.good())
+            display_message(NAME, "failed to write " + chunk->path, MESSAGE_WARN);
+    }
+    av_packet_free(&pkt);
+    ost = nullptr;
+    if (tmpl)
+        avformat_free_context(tmpl);
+    if (ic)
+        avformat_close_input(&ic);
+    return success && !_cancel;
+}
+
+bool Transcoder::transcodeAudio(PacketDump *audio)
+{
+    AVFormatContext *ic = nullptr;
+    AVFormatContext *tmpl = nullptr;
+    bool success = openInput(&ic);
+    auto ist = success ? openDecoder(ic, AVMEDIA_TYPE_AUDIO, 1) : nullptr;
+    success = ist && (tmpl = allocOutput());
+    auto ost = std::make_unique<OutputStream>();
+    success = success && openAudioEncoder(ost.get(), tmpl, ist.get());
+    auto pkt = success ? av_packet_alloc() : nullptr;
+    success = success && pkt;
+    if (success)
+    {
+        std::ofstream f(audio->path, std::ios::binary);
+        PacketCallback onPacket = [this, &f](const AVPacket *p) { writeDump(f, p); };
+        while (!_cancel && av_read_frame(ic, pkt) >= 0)
+        {
+            bool packetSent = false;
+            while (pkt->stream_index == ist->streamIdx && decode(ist->decCtx, ist->frame, pkt, packetSent))
+                encodeAudio(ost.get(), ist->frame, onPacket);
+            av_packet_unref(pkt);
+        }
+        bool packetSent = false;
+        while (decode(ist->decCtx, ist->frame, nullptr, packetSent))
+            encodeAudio(ost.get(), ist->frame, onPacket);
+        encodeAudio(ost.get(), nullptr, onPacket);
+        success = f.good() && avcodec_parameters_from_context(audio->par, ost->encCtx) >= 0;
+        audio->timeBase = ost->encCtx->time_base;
+        if (!f.good())
+            display_message(NAME, "failed to write " + audio->path, MESSAGE_WARN);
+    }
+    av_packet_free(&pkt);
+    ost = nullptr;
+    if (tmpl)
+        avformat_free_context(tmpl);
+    if (ic)
+        avformat_close_input(&ic);
+    return success && !_cancel;
+}
+
+bool Transcoder::concatDumps(const std::vector<std::unique_ptr<PacketDump>> &chunks, PacketDump *audio)
+{
+    // chunk encoders share settings, so their headers are expected to match
+    auto vpar = chunks.front()->par;
+    for (auto &chunk : chunks)
+    {
+        if (chunk->par->extradata_size != vpar->extradata_size ||
+            (vpar->extradata_size &&
+             std::memcmp(chunk->par->extradata, vpar->extradata, vpar->extradata_size) != 0))
+        {
+            display_message(NAME, "chunk codec headers differ, output may not play", MESSAGE_WARN);
+            break;
+        }
+    }
+    auto tmpl = allocOutput();
+    if (!tmpl)
+        return false;
+    bool success = true;
+    for (auto dump : {chunks.front().get(), audio})
+    {
+        if (!dump)
+            continue;
+        auto st = avformat_new_stream(tmpl, nullptr);
+        if (!st || avcodec_parameters_copy(st->codecpar, dump->par) < 0)
+        {
+            display_message(NAME, "failed to prepare output stream", MESSAGE_WARN);
+            success = false;
+            break;
+        }
+        st->time_base = dump->timeBase;
+        st->id = tmpl->nb_streams - 1;
+    }
+    auto output = _config.output;
+    output.blocking = true;
+    MediaMuxer muxer;
+    success = success && muxer.open(tmpl, output);
+    if (success)
+    {
+        // join chunks & interleave with audio by decode time, packets are copied as is
+        size_t chunkIdx = 0;
+        std::ifstream vf(chunks.front()->path, std::ios::binary), af;
+        if (audio)
+            af.open(audio->path, std::ios::binary);
+        auto vpkt = av_packet_alloc();
+        auto apkt = av_packet_alloc();
+        auto nextVideo = [&]() {
+            while (!readDump(vf, vpkt))
+            {
+                if (++chunkIdx >= chunks.size())
+                    return false;
+                vf.close();
+                vf.clear();
+                vf.open(chunks[chunkIdx]->path, std::ios::binary);
+            }
+            return true;
+        };
+        bool hasVideo = nextVideo();
+        bool hasAudio = audio && readDump(af, apkt);
+        while (hasVideo || hasAudio)
+        {
+            bool takeVideo =
+                hasVideo && (!hasAudio || av_compare_ts(vpkt->dts, chunks.front()->timeBase, apkt->dts,
+                                                        audio->timeBase) <= 0);
+            if (takeVideo)
+            {
+                vpkt->stream_index = 0;
+                muxer.writePacket(vpkt);
+                av_packet_unref(vpkt);
+                hasVideo = nextVideo();
+            }
+            else
+            {
+                apkt->stream_index = 1;
+                muxer.writePacket(apkt);
+                av_packet_unref(apkt);
+                hasAudio = readDump(af, apkt);
+            }
+        }
+        av_packet_free(&vpkt);
+        av_packet_free(&apkt);
+        muxer.close();
+        success = !muxer.failed();
+    }
+    avformat_free_context(tmpl);
+    return success;
+}
+
+void Transcoder::writeDump(std::ofstream &f, const AVPacket *pkt)
+{
+    int64_t header[5] = {pkt->pts, pkt->dts, pkt->duration, pkt->flags, pkt->size};
+    f.write(reinterpret_cast<const char *>(header), sizeof(header));
+    f.write(reinterpret_cast<const char *>(pkt->data), pkt->size);
+}
+
+bool Transcoder::readDump(std::ifstream &f, AVPacket *pkt)
+{
+    int64_t header[5];
+    if (!f.read(reinterpret_cast<char *>(header), sizeof(header)))
+        return false;
+    if (av_new_packet(pkt, static_cast<int>(header[4])) < 0)
+        return false;
+    pkt->pts = header[0];
+    pkt->dts = header[1];
+    pkt->duration = header[2];
+    pkt->flags = static_cast<int>(header[3]);
+    if (!f.read(reinterpret_cast<char *>(pkt->data), pkt->size))
+    {
+        av_packet_unref(pkt);
+        return false;
+    }
+    return true;
+}
+
+bool Transcoder::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent)
+{
+    int ret;
+    char buf[512];
+    if (!packetSent && (ret = avcodec_send_packet(codecCtx, pkt)) < 0)
+    {
+        display_message(NAME, "decoder packet (" + std::string(av_make_error_string(buf, sizeof(buf), ret)) + ")",
+                        MESSAGE_WARN);
+        return false;
+    }
+    packetSent = true;
+    return avcodec_receive_frame(codecCtx, frame) >= 0;
+}
+
+bool Transcoder::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent)
+{
+    int ret;
+    char buf[512];
+    if (!frameSent && (ret = avcodec_send_frame(codecCtx, frame)) < 0)
+    {
+        display_message(NAME, "encoder frame (" + std::string(av_make_error_string(buf, sizeof(buf), ret)) + ")",
+                        MESSAGE_WARN);
+        return false;
+    }
+    frameSent = true;
+    return avcodec_receive_packet(codecCtx, pkt) >= 0;
+}
+
+void Transcoder::lowerPriority()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    // background mode lowers cpu, disk and memory priority of this thread
+    SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+#elif __linux__
+    // nice value is per thread on Linux, encoder threads started later inherit it
+    setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+#endif
+}
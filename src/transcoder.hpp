@@ -0,0 +1,190 @@
+#pragma once
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libswresample/swresample.h>
+#include <libswscale/swscale.h>
+}
+
+#include "muxer.hpp"
+#include "streams.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** @file */
+
+/// Minimum source duration (seconds) of one parallel video chunk
+#define TRANSCODE_MIN_CHUNK_TIME 2.0
+
+/// Parallel video chunks per job, so that uneven chunks still keep every job busy
+#define TRANSCODE_CHUNKS_PER_JOB 4
+
+/**
+ * @brief Transcode Config
+ *
+ * This structure stores settings of one background transcode.
+ */
+struct TranscodeConfig
+{
+    std::string input;
+    MuxerConfig output;
+    AVCodecID videoCodec; // AV_CODEC_ID_NONE for output format default
+    AVCodecID audioCodec; // AV_CODEC_ID_NONE to drop audio
+    int64_t videoBitRate; // 0 for width * height * fps
+    int32_t sampleRate;
+    int64_t audioBitRate; // 0 for sample rate based default
+    int32_t jobs;         // parallel video chunks, 1 to encode serially
+
+    TranscodeConfig()
+        : videoCodec(AV_CODEC_ID_NONE), audioCodec(AV_CODEC_ID_NONE), videoBitRate(0), sampleRate(44100),
+          audioBitRate(0), jobs(1)
+    {
+    }
+};
+
+/**
+ * @brief Packet Dump
+ *
+ * This structure stores one encoded stream part kept in a temporary packet file.
+ */
+struct PacketDump
+{
+    std::string path;
+    AVCodecParameters *par;
+    AVRational timeBase;
+    int64_t start, end; // source video time range, in input stream time base
+
+    PacketDump() : par(avcodec_parameters_alloc()), timeBase{0, 1}, start(0), end(INT64_MAX)
+    {
+    }
+
+    ~PacketDump()
+    {
+        avcodec_parameters_free(&par);
+    }
+};
+
+/**
+ * @brief Transcoder
+ *
+ * This class encodes a finished recording into another format on a low priority thread.
+ * Video can be split at keyframes into chunks encoded in parallel, then joined without re-encoding.
+ */
+class Transcoder
+{
+  public:
+    Transcoder();
+    ~Transcoder();
+
+    /**
+     * @brief Start Transcode
+     *
+     * Meant to be called from MediaHandler once the input file is closed, or from command line.
+     *
+     * @param config Transcode configs
+     * @param onDone Called from transcode thread with the result
+     * @return true if started
+     * @return false otherwise
+     */
+    bool start(const TranscodeConfig &config, const std::function<void(bool)> &onDone);
+
+    /**
+     * @brief Cancel Transcode
+     *
+     * Stops a running transcode and waits for it, output is left incomplete.
+     */
+    void cancel();
+
+    /// Wait for running transcode to finish
+    void wait();
+
+    /// Whether a transcode is running
+    bool isRunning();
+
+    /// Progress of running transcode in [0, 1]
+    float progress();
+
+    /**
+     * @brief Get File Conversion Config
+     *
+     * Converts an existing file with output format default codecs, on every core.
+     *
+     * @param input Input file path
+     * @param output Output file path
+     * @return TranscodeConfig
+     */
+    static TranscodeConfig convertConfig(const std::string &input, const std::string &output);
+
+    const std::string NAME = "Transcoder";
+
+  private:
+    /// Internal transcode process, one pass through input
+    bool transcodeInternal();
+
+    /// Internal transcode process, parallel video chunks
+    bool transcodeChunked();
+
+    /// Open input file
+    bool openInput(AVFormatContext **ic);
+
+    /// Open decoder of best stream of given type, nullptr if none
+    std::unique_ptr<InputStream> openDecoder(AVFormatContext *ic, AVMediaType type, int threads);
+
+    /// Allocate output format context carrying codec choices
+    AVFormatContext *allocOutput();
+
+    /// Create video encoder & converter for decoded input
+    bool openVideoEncoder(OutputStream *ost, AVFormatContext *oc, AVFormatContext *ic, InputStream *ist,
+                          int threads);
+
+    /// Create audio encoder & resampler for decoded input
+    bool openAudioEncoder(OutputStream *ost, AVFormatContext *oc, InputStream *ist);
+
+    /// Convert and encode video frame, nullptr flushes encoder
+    void encodeVideo(OutputStream *ost, AVRational inTimeBase, AVFrame *frame, const PacketCallback &onPacket);
+
+    /// Resample and encode audio frame, nullptr flushes resampler & encoder
+    void encodeAudio(OutputStream *ost, AVFrame *frame, const PacketCallback &onPacket);
+
+    /// Find video keyframe times of input
+    bool scanKeyFrames(std::vector<int64_t> &keys);
+
+    /// Encode one video chunk to a packet file
+    bool transcodeChunk(PacketDump *chunk);
+
+    /// Encode whole audio stream to a packet file
+    bool transcodeAudio(PacketDump *audio);
+
+    /// Interleave packet files into output
+    bool concatDumps(const std::vector<std::unique_ptr<PacketDump>> &chunks, PacketDump *audio);
+
+    /// Append packet to packet file
+    void writeDump(std::ofstream &f, const AVPacket *pkt);
+
+    /// Read next packet from packet file
+    bool readDump(std::ifstream &f, AVPacket *pkt);
+
+    /// Decode frame from input stream packet
+    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent);
+
+    /// Encode frame to output stream packet
+    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent);
+
+    /// Lower priority of calling thread
+    void lowerPriority();
+
+    TranscodeConfig _config;
+    AVFormatContext *_ic;
+
+    std::atomic<bool> _running, _cancel;
+    std::atomic<float> _progress;
+    std::thread _transcodeT;
+};
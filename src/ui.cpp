@@ -1,11 +1,15 @@
 #include <imgui.h>
 
 #include "audiocapture.hpp"
+#include "calibration.hpp"
 #include "context.hpp"
 #include "media.hpp"
 #include "videocapture.hpp"
+#include "windowgrab.hpp"
 
+#include <algorithm>
 #include <string>
+#include <vector>
 
 void AppContext::UI()
 {
@@ -35,16 +39,166 @@ void AppContext::UI()
             ImGui::Text("Toggle Recording");
             ImGui::TreePop();
         }
+        auto replayHotkey = "CTRL+SHIFT+F" + std::to_string(_hotkeyNum);
+        if (ImGui::TreeNode(replayHotkey.c_str()))
+        {
+            ImGui::Text("Save Instant Replay");
+            ImGui::TreePop();
+        }
     }
 }
 
 void MediaHandler::UI()
 {
+    std::lock_guard<std::recursive_mutex> lock(_commandLock);
     ImGui::Text("Output File Path:");
     ImGui::TextWrapped(_media->path.c_str());
     if (ImGui::Button("Set File"))
         SelectOutputPath();
     ImGui::DragInt("Skip Time (ms)", &_media->skipTime, 10, 0, 10000);
+    if (_media->canRaw)
+        ImGui::Checkbox("Write to stdout", &_media->rawStdout);
+    if (!_media->replay && !_media->rawStdout)
+        ImGui::Checkbox("Capture First (encode after stop)", &_media->captureFirst);
+    if (_transcoder->isRunning())
+        ImGui::ProgressBar(_transcoder->progress(), ImVec2(-1.0f, 0.0f), "Encoding");
+    else if (!_recording && ImGui::Button("Convert File..."))
+        ConvertFile();
+    if (_media->canFragment)
+    {
+        ImGui::Text("Layout:");
+        ImGui::SameLine();
+        ImGui::RadioButton("Default", &_media->layout, OUTPUT_LAYOUT_DEFAULT);
+        ImGui::SameLine();
+        ImGui::RadioButton("Fragmented", &_media->layout, OUTPUT_LAYOUT_FRAGMENTED);
+        ImGui::SameLine();
+        ImGui::RadioButton("Fast Start", &_media->layout, OUTPUT_LAYOUT_FASTSTART);
+        if (_media->layout == OUTPUT_LAYOUT_FASTSTART)
+            ImGui::DragInt("Expected Length (min)", &_media->expectedTime, 1, 1, 600);
+    }
+    ImGui::DragInt("Segment Time (min)", &_media->segmentTime, 1, 0, 600);
+    ImGui::DragInt("Segment Size (MB)", &_media->segmentSize, 10, 0, 100000);
+    if (_media->canFragment)
+    {
+        ImGui::Text("Live:");
+        ImGui::SameLine();
+        ImGui::RadioButton("Off", &_media->live, OUTPUT_LIVE_NONE);
+        ImGui::SameLine();
+        ImGui::RadioButton("HLS", &_media->live, OUTPUT_LIVE_HLS);
+        ImGui::SameLine();
+        ImGui::RadioButton("LHLS (prefetch, experimental)", &_media->live, OUTPUT_LIVE_LHLS);
+        if (_media->live != OUTPUT_LIVE_NONE)
+            ImGui::TextWrapped("Playlist: %s", livePlaylist().c_str());
+    }
+    if (ImGui::TreeNode("Extra Outputs"))
+    {
+        for (size_t i = 0; i < _media->sinks.size(); i++)
+        {
+            auto &sink = _media->sinks[i];
+            ImGui::PushID(static_cast<int>(i));
+            ImGui::Separator();
+            ImGui::TextWrapped(sink.path.c_str());
+            auto ext = fs::path(sink.path).extension().string();
+            if (!ext.compare(".mp4") || !ext.compare(".mov"))
+            {
+                ImGui::RadioButton("Default", &sink.layout, OUTPUT_LAYOUT_DEFAULT);
+                ImGui::SameLine();
+                ImGui::RadioButton("Fragmented", &sink.layout, OUTPUT_LAYOUT_FRAGMENTED);
+                ImGui::SameLine();
+                ImGui::RadioButton("Fast Start", &sink.layout, OUTPUT_LAYOUT_FASTSTART);
+            }
+            ImGui::DragInt("Segment Time (min)", &sink.segmentTime, 1, 0, 600);
+            ImGui::DragInt("Segment Size (MB)", &sink.segmentSize, 10, 0, 100000);
+            // status of the last recording
+            for (auto &muxer : _muxers)
+            {
+                if (muxer->getPath() != sink.path)
+                    continue;
+                if (muxer->failed())
+                    ImGui::Text("Status: failed");
+                else
+                    ImGui::Text("Status: %lld packets dropped", static_cast<long long>(muxer->droppedPackets()));
+            }
+            bool remove = !_recording && ImGui::Button("Remove");
+            ImGui::PopID();
+            if (remove)
+            {
+                _media->sinks.erase(_media->sinks.begin() + i);
+                break;
+            }
+        }
+        if (!_recording && ImGui::Button("Add Output"))
+            AddOutputPath();
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Video Renditions"))
+    {
+        for (size_t i = 0; i < _media->renditions.size(); i++)
+        {
+            auto &rendition = _media->renditions[i];
+            ImGui::PushID(static_cast<int>(i));
+            ImGui::Separator();
+            ImGui::TextWrapped(rendition.path.c_str());
+            ImGui::DragInt("Scale (%)", &rendition.scale, 1, 10, 100);
+            bool remove = !_recording && ImGui::Button("Remove");
+            ImGui::PopID();
+            if (remove)
+            {
+                _media->renditions.erase(_media->renditions.begin() + i);
+                break;
+            }
+        }
+        if (!_recording && ImGui::Button("Add Rendition"))
+            AddRenditionPath();
+        ImGui::TreePop();
+    }
+    if (ImGui::TreeNode("Extra Monitors"))
+    {
+        // each ticked monitor is captured beside the region, with its own grab thread & encoder
+        static std::vector<MonitorInfo> monitors;
+        if (monitors.empty())
+            monitors = ScreenSource::listMonitors();
+        auto &selected = _media->monitors;
+        for (size_t i = 0; i < monitors.size(); i++)
+        {
+            auto &m = monitors[i];
+            auto text = m.name + (m.primary ? " (primary) " : " ") + std::to_string(m.w) + "x" + std::to_string(m.h) +
+                        " at " + std::to_string(m.x) + ", " + std::to_string(m.y);
+            auto label = text + "##" + std::to_string(i);
+            auto found = std::find(selected.begin(), selected.end(), static_cast<int32_t>(i));
+            bool ticked = found != selected.end();
+            if (_recording)
+                ImGui::Text("%s %s", ticked ? "[x]" : "[ ]", text.c_str());
+            else if (ImGui::Checkbox(label.c_str(), &ticked))
+            {
+                if (ticked)
+                    selected.push_back(static_cast<int32_t>(i));
+                else
+                    selected.erase(found);
+            }
+        }
+        if (!_recording)
+        {
+            if (ImGui::Button("Refresh"))
+                monitors = ScreenSource::listMonitors();
+            ImGui::Text("Write To:");
+            ImGui::SameLine();
+            ImGui::RadioButton("Tracks", &_media->monitorOutput, OUTPUT_MONITORS_TRACKS);
+            ImGui::SameLine();
+            ImGui::RadioButton("Files", &_media->monitorOutput, OUTPUT_MONITORS_FILES);
+        }
+        if (!selected.empty() && monitorFiles())
+            ImGui::TextWrapped("Files: %s ...", monitorPath(selected.front()).c_str());
+        ImGui::TreePop();
+    }
+    ImGui::Checkbox("Instant Replay", &_media->replay);
+    if (_media->replay)
+    {
+        ImGui::DragInt("Replay Time (s)", &_media->replayTime, 1, 5, 3600);
+        ImGui::DragInt("Replay Memory (MB)", &_media->replayMemory, 16, 16, 16384);
+        ImGui::Text("Replay Buffer: %.1f s, %.1f / %d MB", _replay->bufferedTime(),
+                    _replay->bufferedBytes() / 1048576.0, _media->replayMemory);
+    }
     ImGui::Separator();
     if (ImGui::CollapsingHeader("Video"))
     {
@@ -56,12 +210,164 @@ void MediaHandler::UI()
     }
 }
 
+void MediaHandler::StatsUI()
+{
+    bool enabled = _stats->enabled();
+    if (ImGui::Checkbox("Stage Timing", &enabled))
+        _stats->setEnabled(enabled);
+    // trace settings take effect on next recording
+    ImGui::Checkbox("Trace Export", &_media->trace);
+    if (_media->trace)
+        ImGui::DragInt("Trace Memory (MB)", &_media->traceMemory, 16, 16, 4096);
+    if (_trace->droppedEvents())
+        ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "%lld trace events dropped",
+                           static_cast<long long>(_trace->droppedEvents()));
+    auto stats = Stats();
+    ImGui::Text("Frames: %lld, %lld packets dropped", static_cast<long long>(stats.frames),
+                static_cast<long long>(stats.dropped));
+    ImGui::Text("Video: %lld slots skipped by source, %lld frames dropped under load, %lld duplicated",
+                static_cast<long long>(stats.frameDrops.sourceGaps),
+                static_cast<long long>(stats.frameDrops.queueDrops),
+                static_cast<long long>(stats.frameDrops.duplicated));
+    ImGui::Text("CPU: record thread %.1f s, output threads %.1f s", stats.captureCpu, stats.muxCpu);
+    ImGui::Separator();
+    ImGui::Text("Show:");
+    ImGui::SameLine();
+    if (ImGui::RadioButton("Last Seconds", _statsRolling))
+        _statsRolling = true;
+    ImGui::SameLine();
+    if (ImGui::RadioButton("Whole Recording", !_statsRolling))
+        _statsRolling = false;
+    // font is monospace, so columns line up
+    ImGui::Text("%-15s %8s %9s %9s %9s %9s", "Stage", "Count", "p50 ms", "p95 ms", "p99 ms", "max ms");
+    for (int i = 0; i < STATS_STAGES; i++)
+    {
+        auto s = _stats->summary(i, _statsRolling);
+        if (s.count == 0)
+            continue;
+        ImGui::Text("%-15s %8lld %9.3f %9.3f %9.3f %9.3f", PipelineStats::stageName(i), static_cast<long long>(s.count),
+                    s.p50 / 1e3, s.p95 / 1e3, s.p99 / 1e3, s.max / 1e3);
+    }
+    if (!enabled)
+        ImGui::TextWrapped("Stage timing is off, tables keep the last recorded values.");
+}
+
 void VideoCapture::UI()
 {
-    ImGui::DragInt("FPS", &_configs[4], 5, 5, 60);
+#if __linux__
+    // capture source can only change between recordings
+    static std::vector<WindowInfo> windows;
+    if (_windowGrab)
+    {
+        auto geometry = _windowGrab->geometry();
+        ImGui::Text("Window: %s (%dx%d at %d, %d)", _windowGrab->name().c_str(), geometry[2], geometry[3],
+                    geometry[0], geometry[1]);
+    }
+    else if (!_ist && (_source.type == SOURCE_DEVICE || _source.type == SOURCE_WINDOW))
+    {
+        std::string current = "Screen Region";
+        for (auto &window : windows)
+            if (_source.type == SOURCE_WINDOW && _source.url == std::to_string(window.id))
+                current = window.name;
+        if (ImGui::BeginCombo("Source", current.c_str()))
+        {
+            if (ImGui::Selectable("Screen Region", _source.type == SOURCE_DEVICE))
+                _source = SourceConfig();
+            for (auto &window : windows)
+            {
+                auto id = std::to_string(window.id);
+                auto label = window.name + "##" + id;
+                if (ImGui::Selectable(label.c_str(), _source.type == SOURCE_WINDOW && _source.url == id))
+                {
+                    _source.type = SOURCE_WINDOW;
+                    _source.url = id;
+                }
+            }
+            ImGui::EndCombo();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Refresh") || windows.empty())
+            windows = WindowGrab::listWindows();
+    }
+#endif
+    // frame rate & bit rate also apply to a running capture
+    if (ImGui::DragInt("FPS", &_configs[4], 5, 5, 60))
+        _liveFps = _configs[4];
+    if (_ist && _configs[4] > _captureFps)
+        ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "Capped at %d FPS until next recording", _captureFps);
     ImGui::Checkbox("Auto Bit Rate", &_autoBitRate);
-    if (!_autoBitRate)
-        ImGui::DragInt("Bit Rate", &_configs[5], 10000, 10000, 10000000);
+    if (!_autoBitRate && ImGui::DragInt("Bit Rate", &_configs[5], 10000, 10000, 10000000))
+        _liveBitRate = _configs[5];
+    ImGui::Text("Rate Control:");
+    ImGui::SameLine();
+    ImGui::RadioButton("Average", &_rateControl, VIDEO_RATE_AVERAGE);
+    ImGui::SameLine();
+    ImGui::RadioButton("Capped", &_rateControl, VIDEO_RATE_CAPPED);
+    ImGui::Text("Resized Region:");
+    ImGui::SameLine();
+    ImGui::RadioButton("Pad", &_regionPolicy, VIDEO_REGION_PAD);
+    ImGui::SameLine();
+    ImGui::RadioButton("Stretch", &_regionPolicy, VIDEO_REGION_STRETCH);
+    auto codec = findEncoder(_calibrationCodec);
+    int presets = codec ? presetCount(codec) : 0;
+    ImGui::Checkbox("Auto Preset", &_autoPreset);
+    if (_calibration->running())
+        ImGui::ProgressBar(_calibration->progress(), ImVec2(-1.0f, 0.0f), "Calibrating");
+    else if (_autoPreset)
+    {
+        bool sustained = false;
+        _preset = _calibration->select(_configs[4], sustained);
+        if (_preset >= 0 && !sustained)
+            ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "No preset sustains %d FPS, using %s", _configs[4],
+                               presetName(codec, _preset).c_str());
+    }
+    if (!_autoPreset && presets > 0)
+    {
+        _preset = (std::clamp)(_preset, 0, presets - 1);
+        ImGui::SliderInt("Preset", &_preset, 0, presets - 1, presetName(codec, _preset).c_str());
+    }
+    if (codec && ImGui::TreeNode("Calibration"))
+    {
+        for (auto &result : _calibration->results())
+            ImGui::Text("%s%s: %.0f FPS", result.preset == _preset ? "> " : "  ",
+                        presetName(codec, result.preset).c_str(), result.fps);
+        ImGui::TreePop();
+    }
+    ImGui::Text("Under Load:");
+    ImGui::SameLine();
+    ImGui::RadioButton("Drop Oldest", &_dropPolicy, VIDEO_DROP_OLDEST);
+    ImGui::SameLine();
+    ImGui::RadioButton("Drop Newest", &_dropPolicy, VIDEO_DROP_NEWEST);
+    ImGui::SameLine();
+    ImGui::RadioButton("Duplicate", &_dropPolicy, VIDEO_DROP_DUPLICATE);
+    ImGui::Checkbox("Adaptive Quality", &_adaptiveBounds.enabled);
+    if (_adaptiveBounds.enabled)
+    {
+        // steps in the order they are taken, frame rate last
+        ImGui::Checkbox("Allow Fast Conversion", &_adaptiveBounds.fastScale);
+        ImGui::Checkbox("Allow Lower Bit Rate (x264)", &_adaptiveBounds.lowBitRate);
+        ImGui::Checkbox("Allow Smaller Picture", &_adaptiveBounds.downscale);
+        ImGui::DragInt("Lowest FPS", &_adaptiveBounds.minFps, 1, 1, 60);
+        ImGui::TextWrapped("Steps down: fast conversion, bit rate to 75%% and 50%%, picture to 75%% and 50%% "
+                           "(padded), then every 2nd, 3rd, ... frame.");
+    }
+    if (_adaptive->levelIndex() > 0)
+        ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "Lowered to %s",
+                           _adaptive->describe(_adaptive->levelIndex()).c_str());
+    auto drops = frameDrops();
+    if (drops.sourceGaps || drops.queueDrops || drops.duplicated)
+        ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "%lld skipped, %lld dropped, %lld duplicated, queue %d",
+                           static_cast<long long>(drops.sourceGaps), static_cast<long long>(drops.queueDrops),
+                           static_cast<long long>(drops.duplicated), queueDepth());
+    for (auto &branch : _branches)
+    {
+        ImGui::Separator();
+        ImGui::TextWrapped(branch->path.c_str());
+        ImGui::Text("Encoder CPU: %.1f %%, %lld frames dropped", branch->cpuUsage.load(),
+                    static_cast<long long>(branch->dropped));
+        if (branch->behind)
+            ImGui::TextColored(ImVec4(1.0f, 0.5f, 0.0f, 1.0f), "Falling behind");
+    }
 }
 
 void AudioCapture::UI()
@@ -1,6 +1,12 @@
 #pragma once
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+#include <Windows.h>
+#endif
+
 #include <termcolor/termcolor.hpp>
 
+#include <cstdint>
+#include <ctime>
 #include <iostream>
 #include <string>
 
@@ -50,3 +56,47 @@ inline void display_message(const std::string &title, const std::string &message
         break;
     }
 }
+
+/**
+ * @brief Get CPU time consumed by calling thread
+ *
+ * @return double Seconds
+ */
+inline double thread_cpu_time()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    FILETIME creation, exit, kernel, user;
+    if (!GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user))
+        return 0.0;
+    // 100 ns ticks
+    auto ticks = ((uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime) +
+                 ((uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime);
+    return ticks * 1e-7;
+#else
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+/**
+ * @brief Get CPU time consumed by all threads of the process
+ *
+ * @return double Seconds
+ */
+inline double process_cpu_time()
+{
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
+    FILETIME creation, exit, kernel, user;
+    if (!GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user))
+        return 0.0;
+    // 100 ns ticks
+    auto ticks = ((uint64_t(kernel.dwHighDateTime) << 32) | kernel.dwLowDateTime) +
+                 ((uint64_t(user.dwHighDateTime) << 32) | user.dwLowDateTime);
+    return ticks * 1e-7;
+#else
+    timespec ts{};
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
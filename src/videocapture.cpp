@@ -1,5 +1,42 @@
 #include "videocapture.hpp"
+#include "calibration.hpp"
 #include "utils.hpp"
+#include "windowgrab.hpp"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+#include <libavutil/opt.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+/// x264 & x265 presets, fastest first
+static const char *x26xPresets[VIDEO_PRESETS] = {"ultrafast", "superfast", "veryfast", "faster", "fast", "medium"};
+
+/// libvpx realtime cpu-used values, fastest first
+static const char *vpxSpeeds[VIDEO_PRESETS] = {"8", "6", "5", "4", "3", "2"};
+
+/// Whether encoder takes x264 style presets
+static bool isX26x(const AVCodec *codec)
+{
+    return codec && (!std::strcmp(codec->name, "libx264") || !std::strcmp(codec->name, "libx265"));
+}
+
+/// Whether encoder takes libvpx cpu-used speeds
+static bool isVpx(const AVCodec *codec)
+{
+    return codec && (!std::strcmp(codec->name, "libvpx") || !std::strcmp(codec->name, "libvpx-vp9"));
+}
 
 // reference:
 // https://github.com/leandromoreira/ffmpeg-libav-tutorial
@@ -8,8 +45,17 @@
 // reference:
 // https://stackoverflow.com/questions/70390402/why-ffmpeg-screen-recorder-output-shows-green-screen-only
 
-VideoCapture::VideoCapture() : _autoBitRate(true)
+VideoCapture::VideoCapture()
+    : _grabLoop(false), _grabEnd(true), _prevFrame(nullptr), _slotBase(-1), _policy(VIDEO_DROP_OLDEST),
+      _sourceGaps(0), _queueDrops(0), _duplicated(0), _scaleFlags(SWS_BICUBIC), _scalePercent(100),
+      _bitRatePercent(100), _captureFps(VIDEO_DEFAULT_FPS), _grabOrigin(AV_NOPTS_VALUE), _grabSlot(-1),
+      _paceSlot(0.0), _liveFps(VIDEO_DEFAULT_FPS), _liveBitRate(VIDEO_DEFAULT_BITRATE), _bitRate(0),
+      _pendingBitRate(0), _region({0, 0, 0, 0}), _regionPending(false), _autoBitRate(true), _autoPreset(true),
+      _preset(-1), _rateControl(VIDEO_RATE_AVERAGE), _regionPolicy(VIDEO_REGION_PAD), _dropPolicy(VIDEO_DROP_OLDEST),
+      _calibrationCodec(AV_CODEC_ID_NONE), _calibrationWidth(0), _calibrationHeight(0), _stats(nullptr)
 {
+    _adaptive = std::make_unique<AdaptiveController>();
+    _calibration = std::make_unique<EncoderCalibration>();
     _configs = {0, 0, 0, 0, VIDEO_DEFAULT_FPS, VIDEO_DEFAULT_BITRATE};
 }
 
@@ -18,26 +64,118 @@ VideoCapture::~VideoCapture()
     closeCapture();
 }
 
-bool VideoCapture::openCapture(AVFormatContext *oc, const std::array<int, 4> &window)
+bool VideoCapture::openCapture(AVFormatContext *oc, const std::array<int, 4> &window,
+                               const std::vector<RenditionConfig> &renditions)
 {
     // update capture window configs
     for (int i = 0; i < 4; i++)
         _configs[i] = window[i];
+    _captureFps = _configs[4];
+    _liveFps = _configs[4];
+    _grabOrigin = AV_NOPTS_VALUE;
+    _grabSlot = -1;
+    _paceSlot = 0.0;
+    {
+        std::lock_guard<std::mutex> lock(_regionLock);
+        _region = window;
+        _regionPending = false;
+    }
     // refresh streams
     _ist = std::make_unique<InputStream>();
     _ost = std::make_unique<OutputStream>();
-    bool success = true;
-    // open capture device
-    success = success && openDevice();
-    // config input (decoder) context & stream
-    success = success && configIStream();
+    _prevFrame = av_frame_alloc();
+    _slotBase = -1;
+    _policy = _dropPolicy;
+    _sourceGaps = 0;
+    _queueDrops = 0;
+    _duplicated = 0;
+    // calibration must not compete with the recording for CPU
+    _calibration->cancel();
+    if (_autoPreset)
+    {
+        bool sustained = false;
+        _preset = _calibration->select(_configs[4], sustained);
+        auto codec = findEncoder(oc->video_codec_id);
+        if (_preset < 0 && codec && presetCount(codec) > 0)
+        {
+            _preset = 0;
+            display_message(NAME, "encoder is not calibrated yet, using fastest preset", MESSAGE_WARN);
+        }
+        else if (_preset >= 0 && !sustained)
+            display_message(NAME, "no preset sustains " + std::to_string(_configs[4]) + " fps, using fastest",
+                            MESSAGE_WARN);
+    }
+    bool success = _prevFrame != nullptr;
+    if (_source.type == SOURCE_WINDOW)
+    {
+        // window grab hands out frames itself, output takes the window size
+        _windowGrab = std::make_unique<WindowGrab>();
+        success = success && _windowGrab->open(_source.url, _captureFps);
+        if (success)
+        {
+            auto geometry = _windowGrab->geometry();
+            _configs[2] = (std::max)(2, geometry[2] & ~1);
+            _configs[3] = (std::max)(2, geometry[3] & ~1);
+        }
+    }
+    else
+    {
+        // open capture device
+        success = success && openDevice();
+        // config input (decoder) context & stream
+        success = success && configIStream();
+    }
     // config output (encoder) context & stream
     success = success && configOStream(oc);
+    // renditions share grab & decode, a failing one does not stop the capture
+    for (auto &config : renditions)
+    {
+        if (!success)
+            break;
+        auto branch = openBranch(config);
+        if (branch)
+            _branches.push_back(std::move(branch));
+        else
+            display_message(NAME, "skipping rendition " + config.path, MESSAGE_WARN);
+    }
+    // grab runs ahead of encoder by up to VIDEO_CAPTURE_QUEUE frames
+    if (success)
+        startGrab();
     return success;
 }
 
 bool VideoCapture::closeCapture()
 {
+    stopGrab();
+    for (auto frame : _frames)
+        av_frame_free(&frame);
+    _frames.clear();
+    if (_prevFrame)
+        av_frame_free(&_prevFrame);
+    auto drops = frameDrops();
+    if (_ist && (drops.sourceGaps || drops.queueDrops || drops.duplicated))
+        display_message(NAME,
+                        std::to_string(drops.sourceGaps) + " frame slots skipped by source, " +
+                            std::to_string(drops.queueDrops) + " frames dropped under load, " +
+                            std::to_string(drops.duplicated) + " frames duplicated",
+                        MESSAGE_WARN);
+    // drain & finish renditions
+    for (auto &branch : _branches)
+    {
+        {
+            std::lock_guard<std::mutex> lock(branch->framesLock);
+            branch->loop = false;
+        }
+        branch->framesCV.notify_one();
+        if (branch->t.joinable())
+            branch->t.join();
+        if (branch->dropped)
+            display_message(NAME,
+                            std::to_string(branch->dropped) + " frames dropped for rendition " + branch->path,
+                            MESSAGE_WARN);
+    }
+    _branches.clear();
+    _windowGrab = nullptr;
     if (_ist && _ist->fmtCtx)
         avformat_close_input(&_ist->fmtCtx);
     _ist = nullptr;
@@ -45,37 +183,102 @@ bool VideoCapture::closeCapture()
     return true;
 }
 
-bool VideoCapture::writeFrame(AVFormatContext *oc, bool skip, bool flush)
+bool VideoCapture::writeFrame(const PacketCallback &onPacket, bool skip, bool flush)
 {
-    if (av_read_frame(_ist->fmtCtx, _ist->pkt) < 0)
-        return false;
-    if (_ist->pkt->stream_index == _ist->streamIdx && !skip)
+    // grab & decode are timed on the grab thread, these stages record the time taken for this frame
+    StageTimer convertT(_stats, STATS_VIDEO_CONVERT), encodeT(_stats, STATS_VIDEO_ENCODE);
+    if (flush)
     {
-        if (flush)
-        {
-            av_packet_unref(_ist->pkt);
-            _ist->pkt->data = nullptr;
-        }
-        av_frame_make_writable(_ost->frame);
-        bool packetSent = false;
-        while (decode(_ist->decCtx, _ist->frame, _ist->pkt, packetSent))
+        // write frames captured before stop
+        stopGrab();
+        while (auto frame = popFrame())
         {
-            sws_scale(_ost->swsCtx, _ist->frame->data, _ist->frame->linesize, 0, _ist->decCtx->height,
-                      _ost->frame->data, _ost->frame->linesize);
-            _ost->frame->pts = ++_ost->samples;
-            bool frameSent = false;
-            while (encode(_ost->encCtx, _ost->frame, _ost->pkt, frameSent))
-            {
-                av_packet_rescale_ts(_ost->pkt, _ost->encCtx->time_base, _ost->st->time_base);
-                _ost->pkt->stream_index = _ost->st->index;
-                if (av_interleaved_write_frame(oc, _ost->pkt) != 0)
-                    display_message(NAME, "failed to write frame", MESSAGE_WARN);
-                av_packet_unref(_ost->pkt);
-            }
+            bool success = writeCaptured(onPacket, frame, &convertT, &encodeT);
+            av_frame_free(&frame);
+            if (!success)
+                return false;
         }
-        av_packet_unref(_ist->pkt);
+        return true;
     }
-    return true;
+    applyLive();
+    auto frame = popFrame();
+    if (!frame)
+        return false;
+    bool success = skip || writeCaptured(onPacket, frame, &convertT, &encodeT);
+    av_frame_free(&frame);
+    return success;
+}
+
+void VideoCapture::setSource(const SourceConfig &config)
+{
+    _source = config;
+}
+
+void VideoCapture::setFrameRate(int fps)
+{
+    _configs[4] = (std::max)(1, fps);
+}
+
+void VideoCapture::setStats(PipelineStats *stats)
+{
+    _stats = stats;
+}
+
+void VideoCapture::setAdaptive(const AdaptiveBounds &bounds)
+{
+    _adaptiveBounds = bounds;
+}
+
+void VideoCapture::copySettings(const VideoCapture &other)
+{
+    // rate & encoder settings only, source stays the screen
+    _configs[4] = other._configs[4];
+    _configs[5] = other._configs[5];
+    _autoBitRate = other._autoBitRate;
+    _autoPreset = false;
+    _preset = other._preset;
+    _rateControl = other._rateControl;
+    _regionPolicy = other._regionPolicy;
+    _dropPolicy = other._dropPolicy;
+    _adaptiveBounds = other._adaptiveBounds;
+}
+
+AdaptiveController &VideoCapture::adaptive()
+{
+    return *_adaptive;
+}
+
+void VideoCapture::setDropPolicy(int policy)
+{
+    _dropPolicy = (std::max)(VIDEO_DROP_OLDEST, (std::min)(VIDEO_DROP_DUPLICATE, policy));
+}
+
+void VideoCapture::setRegion(const std::array<int, 4> &window)
+{
+    std::lock_guard<std::mutex> lock(_regionLock);
+    if (window == _region)
+        return;
+    _region = window;
+    _regionPending = true;
+    _regionSince = std::chrono::steady_clock::now();
+}
+
+FrameDrops VideoCapture::frameDrops()
+{
+    return {_sourceGaps, _queueDrops, _duplicated};
+}
+
+int VideoCapture::queueDepth()
+{
+    std::lock_guard<std::mutex> lock(_framesLock);
+    return static_cast<int>(_frames.size());
+}
+
+double VideoCapture::mediaTime()
+{
+    if (!_ost || !_ost->encCtx)
+        return 0.0;
+    return _ost->samples * av_q2d(_ost->encCtx->time_base);
 }
 
 const OutputStream *VideoCapture::getStream()
@@ -85,42 +288,8 @@ const OutputStream *VideoCapture::getStream()
 
 bool VideoCapture::openDevice()
 {
-    std::string captureSource = "";
-    std::string captureURL = "";
-    AVDictionary *options{nullptr};
-    {
-        auto size = std::to_string(_configs[2]) + "x" + std::to_string(_configs[3]);
-        av_dict_set(&options, "video_size", size.c_str(), 0);
-        av_dict_set(&options, "framerate", std::to_string(_configs[4]).c_str(), 0);
-    }
-    // prepare capture source
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32__) || defined(__NT__)
-    // use gdi on windows
-    captureSource = "gdigrab";
-    captureURL = "desktop";
-    {
-        av_dict_set(&options, "offset_x", std::to_string(_configs[0]).c_str(), 0);
-        av_dict_set(&options, "offset_y", std::to_string(_configs[1]).c_str(), 0);
-    }
-#elif __linux__
-    // by default assume X11 backend (wayland won't work)
-    captureSource = "x11grab";
-    {
-        av_dict_set(&options, "grab_x", std::to_string(_configs[0]).c_str(), 0);
-        av_dict_set(&options, "grab_y", std::to_string(_configs[1]).c_str(), 0);
-    }
-#else
-    display_message(NAME, "unsupported capture platform!", MESSAGE_WARN);
-    return false;
-#endif
-    // get format and try to open
-    auto formatIn = av_find_input_format(captureSource.c_str());
-    if (0 != avformat_open_input(&_ist->fmtCtx, captureURL.c_str(), formatIn, &options))
-    {
-        display_message(NAME, "failed to open capture source " + captureSource, MESSAGE_WARN);
-        return false;
-    }
-    return true;
+    auto source = InputSource::createVideo(_source, {_configs[0], _configs[1], _configs[2], _configs[3], _captureFps});
+    return source->open(&_ist->fmtCtx);
 }
 
 bool VideoCapture::configIStream()
@@ -206,9 +375,10 @@ bool VideoCapture::configIStream()
     return true;
 }
 
-bool VideoCapture::configOStream(AVFormatContext *oc)
+bool VideoCapture::openEncoder(OutputStream *ost, AVFormatContext *oc, int width, int height, int fps, int64_t bitRate,
+                               AVPixelFormat rawFormat, int threads, int preset, int rateControl)
 {
-    _ost->samples = 0;
+    ost->samples = 0;
     // allocate parameters
     AVCodecParameters *param = avcodec_parameters_alloc();
     {
@@ -217,15 +387,10 @@ bool VideoCapture::configOStream(AVFormatContext *oc)
             display_message(NAME, "failed to allocate codec params", MESSAGE_WARN);
             return false;
         }
-        if (_autoBitRate)
-            _configs[5] = _configs[2] * _configs[3] * _configs[4];
-        param->width = _configs[2];
-        param->height = _configs[3];
-        param->bit_rate = _configs[5];
-        param->codec_id = oc->video_codec_id;
-        // this is a temp fix for webm format to work
-        if (param->codec_id == AV_CODEC_ID_VP9)
-            param->codec_id = AV_CODEC_ID_VP8;
+        param->width = width;
+        param->height = height;
+        param->bit_rate = bitRate;
+        param->codec_id = encoderCodecId(oc->video_codec_id);
         param->codec_type = AVMEDIA_TYPE_VIDEO;
     }
     // prepare codec
@@ -237,8 +402,8 @@ bool VideoCapture::configOStream(AVFormatContext *oc)
             display_message(NAME, "failed to find encoder for " + codecName, MESSAGE_WARN);
             return false;
         }
-        _ost->encCtx = avcodec_alloc_context3(codecOut);
-        if (!_ost->encCtx)
+        ost->encCtx = avcodec_alloc_context3(codecOut);
+        if (!ost->encCtx)
         {
             display_message(NAME, "failed to allocate encoder for " + codecName, MESSAGE_WARN);
             return false;
@@ -246,7 +411,7 @@ bool VideoCapture::configOStream(AVFormatContext *oc)
     }
     // open codec
     {
-        if (avcodec_parameters_to_context(_ost->encCtx, param) < 0)
+        if (avcodec_parameters_to_context(ost->encCtx, param) < 0)
         {
             display_message(NAME, "failed to copy encoder params for " + codecName, MESSAGE_WARN);
             return false;
@@ -254,45 +419,71 @@ bool VideoCapture::configOStream(AVFormatContext *oc)
         switch (param->codec_id)
         {
         case AV_CODEC_ID_GIF:
-            _ost->encCtx->pix_fmt = AV_PIX_FMT_RGB8;
+            ost->encCtx->pix_fmt = AV_PIX_FMT_RGB8;
             break;
         case AV_CODEC_ID_APNG:
-            _ost->encCtx->pix_fmt = AV_PIX_FMT_RGBA;
+            ost->encCtx->pix_fmt = AV_PIX_FMT_RGBA;
+            break;
+        case AV_CODEC_ID_RAWVIDEO:
+            ost->encCtx->pix_fmt = rawFormat;
             break;
         default:
-            _ost->encCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+            ost->encCtx->pix_fmt = AV_PIX_FMT_YUV420P;
             break;
         }
-        _ost->encCtx->gop_size = 12;
-        _ost->encCtx->time_base = {1, _configs[4]};
-        _ost->encCtx->framerate = {_configs[4], 1};
-        if (avcodec_open2(_ost->encCtx, codecOut, nullptr) < 0)
+        ost->encCtx->gop_size = 12;
+        ost->encCtx->time_base = {1, fps};
+        ost->encCtx->framerate = {fps, 1};
+        // codec headers must be in extradata so that every output file gets them
+        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+            ost->encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+        if (threads > 0)
+            ost->encCtx->thread_count = threads;
+        // one second buffer, so the cap holds over any second of output
+        if (rateControl == VIDEO_RATE_CAPPED)
+        {
+            ost->encCtx->rc_max_rate = bitRate;
+            ost->encCtx->rc_buffer_size = static_cast<int>((std::min)(bitRate, int64_t(INT_MAX)));
+        }
+        // speed preset, encoders without presets keep their defaults
+        if (preset >= 0 && preset < presetCount(codecOut))
+        {
+            if (isX26x(codecOut))
+                av_opt_set(ost->encCtx->priv_data, "preset", x26xPresets[preset], 0);
+            else if (isVpx(codecOut))
+            {
+                av_opt_set(ost->encCtx->priv_data, "deadline", "realtime", 0);
+                av_opt_set(ost->encCtx->priv_data, "cpu-used", vpxSpeeds[preset], 0);
+            }
+        }
+        if (avcodec_open2(ost->encCtx, codecOut, nullptr) < 0)
         {
             display_message(NAME, "failed to open encoder for " + codecName, MESSAGE_WARN);
             return false;
         }
-        if (oc->oformat->flags & AVFMT_GLOBALHEADER)
-            _ost->encCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
     }
     // prepare stream
     {
-        _ost->st = avformat_new_stream(oc, codecOut);
-        if (!_ost->st)
+        ost->st = avformat_new_stream(oc, codecOut);
+        if (!ost->st)
         {
             display_message(NAME, "failed to open encoder stream", MESSAGE_WARN);
             return false;
         }
-        if (avcodec_parameters_copy(_ost->st->codecpar, param) < 0)
+        if (avcodec_parameters_from_context(ost->st->codecpar, ost->encCtx) < 0)
         {
             display_message(NAME, "failed to copy encoder stream params", MESSAGE_WARN);
             return false;
         }
-        _ost->st->id = oc->nb_streams - 1;
+        // muxer expects packets in encoder time base
+        ost->st->time_base = ost->encCtx->time_base;
+        ost->st->avg_frame_rate = ost->encCtx->framerate;
+        ost->st->id = oc->nb_streams - 1;
     }
     // prepare packet
     {
-        _ost->pkt = av_packet_alloc();
-        if (!_ost->pkt)
+        ost->pkt = av_packet_alloc();
+        if (!ost->pkt)
         {
             display_message(NAME, "failed to allocate encoder packet", MESSAGE_WARN);
             return false;
@@ -300,44 +491,740 @@ bool VideoCapture::configOStream(AVFormatContext *oc)
     }
     // prepare frame
     {
-        _ost->frame = av_frame_alloc();
-        if (!_ost->frame)
+        ost->frame = av_frame_alloc();
+        if (!ost->frame)
         {
             display_message(NAME, "failed to allocate encoder frame", MESSAGE_WARN);
             return false;
         }
-        _ost->frame->width = _ost->encCtx->width;
-        _ost->frame->height = _ost->encCtx->height;
-        _ost->frame->format = _ost->encCtx->pix_fmt;
-        if (av_frame_get_buffer(_ost->frame, 0) < 0)
+        ost->frame->width = ost->encCtx->width;
+        ost->frame->height = ost->encCtx->height;
+        ost->frame->format = ost->encCtx->pix_fmt;
+        if (av_frame_get_buffer(ost->frame, 0) < 0)
         {
             display_message(NAME, "failed to allocate encoder frame buffer", MESSAGE_WARN);
             return false;
         }
     }
+    avcodec_parameters_free(&param);
+    return true;
+}
+
+const AVCodec *VideoCapture::findEncoder(AVCodecID codecId)
+{
+    return avcodec_find_encoder(encoderCodecId(codecId));
+}
+
+int VideoCapture::presetCount(const AVCodec *codec)
+{
+    return isX26x(codec) || isVpx(codec) ? VIDEO_PRESETS : 0;
+}
+
+std::string VideoCapture::presetName(const AVCodec *codec, int preset)
+{
+    if (preset < 0 || preset >= presetCount(codec))
+        return "default";
+    if (isVpx(codec))
+        return std::string("cpu-used ") + vpxSpeeds[preset];
+    return x26xPresets[preset];
+}
+
+void VideoCapture::setCalibrationTarget(AVCodecID codecId, int width, int height)
+{
+    _calibrationCodec = codecId;
+    _calibrationWidth = width;
+    _calibrationHeight = height;
+    if (!_ist)
+        _calibration->request(codecId, width, height);
+}
+
+AVCodecID VideoCapture::encoderCodecId(AVCodecID codecId)
+{
+    // this is a temp fix for webm format to work
+    return codecId == AV_CODEC_ID_VP9 ? AV_CODEC_ID_VP8 : codecId;
+}
+
+bool VideoCapture::configOStream(AVFormatContext *oc)
+{
+    int srcWidth, srcHeight;
+    AVPixelFormat srcFormat;
+    if (!sourceFormat(srcWidth, srcHeight, srcFormat))
+    {
+        display_message(NAME, "input stream not allocated", MESSAGE_WARN);
+        return false;
+    }
+    if (_autoBitRate)
+        _configs[5] = _configs[2] * _configs[3] * _configs[4];
+    if (!openEncoder(_ost.get(), oc, _configs[2], _configs[3], _configs[4], _configs[5], srcFormat, 0, _preset,
+                     _rateControl))
+        return false;
+    _liveBitRate = _configs[5];
+    _bitRate = _pendingBitRate = _configs[5];
+    // paced file & lavfi sources always have a full queue, they are never adapted
+    auto bounds = liveSource() ? _adaptiveBounds : AdaptiveBounds();
+    // bit rate steps need an encoder that takes a new rate while running, see applyBitRate
+    bounds.lowBitRate = bounds.lowBitRate && std::strcmp(_ost->encCtx->codec->name, "libx264") == 0;
+    _adaptive->reset(_configs[4], bounds);
     // prepare sws ctx
-    if (_ist->decCtx)
+    _scaleFlags = SWS_BICUBIC;
+    _scalePercent = 100;
+    _bitRatePercent = 100;
+    _ost->swsCtx = sws_getContext(srcWidth, srcHeight, srcFormat, _ost->encCtx->width, _ost->encCtx->height,
+                                  _ost->encCtx->pix_fmt, _scaleFlags, nullptr, nullptr, nullptr);
+    if (!_ost->swsCtx)
+    {
+        display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
+        return false;
+    }
+    return true;
+}
+
+bool VideoCapture::sourceFormat(int &width, int &height, AVPixelFormat &format)
+{
+    if (_windowGrab)
+    {
+        auto geometry = _windowGrab->geometry();
+        width = geometry[2];
+        height = geometry[3];
+        format = AV_PIX_FMT_BGR0;
+        return true;
+    }
+    if (!_ist || !_ist->decCtx)
+        return false;
+    width = _ist->decCtx->width;
+    height = _ist->decCtx->height;
+    format = _ist->decCtx->pix_fmt;
+    return true;
+}
+
+bool VideoCapture::liveSource()
+{
+    return _source.type == SOURCE_DEVICE || _source.type == SOURCE_WINDOW;
+}
+
+void VideoCapture::startGrab()
+{
+    _grabLoop = true;
+    _grabEnd = false;
+    _grabT = std::thread([this] { grabInternal(); });
+}
+
+void VideoCapture::stopGrab()
+{
+    {
+        std::lock_guard<std::mutex> lock(_framesLock);
+        _grabLoop = false;
+    }
+    _framesCV.notify_all();
+    if (_grabT.joinable())
+        _grabT.join();
+}
+
+void VideoCapture::grabInternal()
+{
+    PipelineTrace::nameThread("grab");
+    if (_windowGrab)
+    {
+        grabWindow();
+        return;
+    }
+    auto timeBase = _ist->fmtCtx->streams[_ist->streamIdx]->time_base;
+    while (_grabLoop)
+    {
+        // each stage records the time it took for this packet when the timers go out of scope
+        StageTimer grabT(_stats, STATS_VIDEO_GRAB), decodeT(_stats, STATS_VIDEO_DECODE);
+        grabT.start();
+        // end of input leaves an empty packet, which drains the decoder
+        bool end = av_read_frame(_ist->fmtCtx, _ist->pkt) < 0;
+        grabT.stop();
+        if (!end && _ist->pkt->stream_index != _ist->streamIdx)
+        {
+            av_packet_unref(_ist->pkt);
+            continue;
+        }
+        bool packetSent = false;
+        while (decode(_ist->decCtx, _ist->frame, _ist->pkt, packetSent, &decodeT))
+        {
+            auto slot = frameSlot(_ist->frame->best_effort_timestamp, timeBase);
+            auto frame = av_frame_clone(_ist->frame);
+            if (!frame)
+            {
+                display_message(NAME, "failed to reference frame", MESSAGE_WARN);
+                continue;
+            }
+            frame->pts = slot;
+            pushFrame(frame);
+        }
+        av_packet_unref(_ist->pkt);
+        if (end)
+            break;
+    }
     {
-        _ost->swsCtx =
-            sws_getContext(_ist->decCtx->width, _ist->decCtx->height, _ist->decCtx->pix_fmt, _ost->encCtx->width,
-                           _ost->encCtx->height, _ost->encCtx->pix_fmt, SWS_BICUBIC, nullptr, nullptr, nullptr);
-        if (!_ost->swsCtx)
+        std::lock_guard<std::mutex> lock(_framesLock);
+        _grabEnd = true;
+    }
+    _framesCV.notify_all();
+}
+
+void VideoCapture::grabWindow()
+{
+    while (_grabLoop)
+    {
+        StageTimer grabT(_stats, STATS_VIDEO_GRAB);
+        grabT.start();
+        auto frame = _windowGrab->grab();
+        grabT.stop();
+        // no frame while the window is unmapped
+        if (!frame)
         {
-            display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
+            if (_windowGrab->ended())
+                break;
+            continue;
+        }
+        frame->pts = frameSlot(frame->pts, {1, WINDOW_TIME_BASE});
+        pushFrame(frame);
+    }
+    {
+        std::lock_guard<std::mutex> lock(_framesLock);
+        _grabEnd = true;
+    }
+    _framesCV.notify_all();
+}
+
+int64_t VideoCapture::frameSlot(int64_t ts, AVRational timeBase)
+{
+    // frame slot at nominal rate from source timestamp, so late grabs show up as gaps
+    if (_grabOrigin == AV_NOPTS_VALUE)
+        _grabOrigin = ts;
+    int64_t slot = _grabSlot + 1;
+    if (ts != AV_NOPTS_VALUE)
+        slot = (std::max)(slot, av_rescale_q_rnd(ts - _grabOrigin, timeBase, {1, _captureFps},
+                                                 static_cast<AVRounding>(AV_ROUND_NEAR_INF | AV_ROUND_PASS_MINMAX)));
+    if (_grabSlot >= 0)
+        _sourceGaps += slot - _grabSlot - 1;
+    _grabSlot = slot;
+    return slot;
+}
+
+void VideoCapture::pushFrame(AVFrame *frame)
+{
+    {
+        std::unique_lock<std::mutex> lock(_framesLock);
+        // live capture keeps pace with the screen, other sources and duplicate policy wait for the encoder
+        bool live = liveSource() && _policy != VIDEO_DROP_DUPLICATE;
+        if (!live)
+            _framesCV.wait(lock, [this] { return _frames.size() < VIDEO_CAPTURE_QUEUE || !_grabLoop; });
+        if (_frames.size() >= VIDEO_CAPTURE_QUEUE)
+        {
+            // waiting capture only gets here when stopping
+            if (live)
+                _queueDrops++;
+            if (!live || _policy == VIDEO_DROP_NEWEST)
+            {
+                av_frame_free(&frame);
+                return;
+            }
+            av_frame_free(&_frames.front());
+            _frames.pop_front();
+        }
+        _frames.push_back(frame);
+    }
+    _framesCV.notify_all();
+}
+
+AVFrame *VideoCapture::popFrame()
+{
+    AVFrame *frame = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(_framesLock);
+        _framesCV.wait(lock, [this] { return !_frames.empty() || _grabEnd; });
+        if (_frames.empty())
+            return nullptr;
+        frame = _frames.front();
+        _frames.pop_front();
+    }
+    _framesCV.notify_all();
+    return frame;
+}
+
+bool VideoCapture::writeCaptured(const PacketCallback &onPacket, AVFrame *frame, StageTimer *convertT,
+                                 StageTimer *encodeT)
+{
+    // output starts at pts 1 with the first written frame, counters start there too
+    if (_slotBase < 0)
+    {
+        _slotBase = frame->pts - 1;
+        _sourceGaps = 0;
+        _queueDrops = 0;
+    }
+    frame->pts -= _slotBase;
+    // frames are due every step slots at the lower of live & adaptive frame rate, timestamps keep their slots
+    int fps = (std::max)(1, (std::min)(_captureFps, _liveFps.load()));
+    double step = static_cast<double>(_adaptive->level().fpsDivisor) * _captureFps / fps;
+    if (_ost->samples > 0 && frame->pts + 0.5 < _paceSlot)
+        return true;
+    // due slots before this frame were skipped by the source or dropped under load
+    if (_policy == VIDEO_DROP_DUPLICATE && _ost->samples > 0)
+    {
+        int64_t copies = 0;
+        while (frame->pts + 0.5 >= _paceSlot + step && copies < VIDEO_DUPLICATE_LIMIT)
+        {
+            _prevFrame->pts = std::llround(_paceSlot);
+            _paceSlot += step;
+            copies++;
+            if (!encodeFrame(onPacket, _prevFrame, true, convertT, encodeT))
+                return false;
+        }
+        _duplicated += copies;
+    }
+    auto startT = std::chrono::steady_clock::now();
+    if (!encodeFrame(onPacket, frame, false, convertT, encodeT))
+        return false;
+    _paceSlot = (std::max)(_paceSlot, static_cast<double>(frame->pts)) + step;
+    auto encodeTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startT).count();
+    if (_adaptive->update(queueDepth(), encodeTime, mediaTime()))
+        applyLevel();
+    if (_policy == VIDEO_DROP_DUPLICATE)
+    {
+        av_frame_unref(_prevFrame);
+        if (av_frame_ref(_prevFrame, frame) < 0)
+        {
+            display_message(NAME, "failed to reference frame", MESSAGE_WARN);
             return false;
         }
     }
+    return true;
+}
+
+bool VideoCapture::encodeFrame(const PacketCallback &onPacket, AVFrame *frame, bool duplicate, StageTimer *convertT,
+                               StageTimer *encodeT)
+{
+    _ost->samples = frame->pts;
+    if (_ost->encCtx->codec_id == AV_CODEC_ID_RAWVIDEO)
+    {
+        // raw output takes captured frames as is, no colour conversion or encoder
+        for (auto &branch : _branches)
+            pushBranchFrame(branch.get(), frame);
+        if (!wrapFrame(frame, _ost.get()))
+            return false;
+        _ost->pkt->stream_index = _ost->st->index;
+        onPacket(_ost->pkt);
+        av_packet_unref(_ost->pkt);
+        return true;
+    }
+    // a duplicate is the converted frame still held by the encoder, only its pts changes
+    if (!duplicate)
+    {
+        // previous frame may still be referenced by encoder or renditions
+        if (!refreshFrame(_ost.get()))
+            return false;
+        convertT->start();
+        bool converted = convertFrame(&_ost->swsCtx, frame, _ost->frame, _scaleFlags, _scalePercent);
+        convertT->stop();
+        if (!converted)
+            return false;
+    }
+    _ost->frame->pts = frame->pts;
+    for (auto &branch : _branches)
+        pushBranchFrame(branch.get(), branch->fromEncoderFrame ? _ost->frame : frame);
+    bool frameSent = false;
+    while (encode(_ost->encCtx, _ost->frame, _ost->pkt, frameSent, encodeT))
+    {
+        _ost->pkt->stream_index = _ost->st->index;
+        onPacket(_ost->pkt);
+        av_packet_unref(_ost->pkt);
+    }
+    return true;
+}
+
+void VideoCapture::applyLevel()
+{
+    // conversion context is rebuilt with the next frame
+    auto level = _adaptive->level();
+    _scaleFlags = level.scaleFlags;
+    _scalePercent = level.scalePercent;
+    if (level.bitRatePercent != _bitRatePercent)
+    {
+        _bitRatePercent = level.bitRatePercent;
+        applyBitRate(_bitRate * _bitRatePercent / 100);
+    }
+}
+
+void VideoCapture::applyLive()
+{
+    auto now = std::chrono::steady_clock::now();
+    auto since = [&now](std::chrono::steady_clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now - t).count();
+    };
+    // automatic bit rate follows frame rate
+    int fps = (std::max)(1, (std::min)(_captureFps, _liveFps.load()));
+    int64_t bitRate =
+        _autoBitRate ? int64_t(_ost->encCtx->width) * _ost->encCtx->height * fps : _liveBitRate.load();
+    if (bitRate != _pendingBitRate)
+    {
+        _pendingBitRate = bitRate;
+        _bitRateSince = now;
+    }
+    if (_pendingBitRate != _bitRate && since(_bitRateSince) >= VIDEO_LIVE_SETTLE)
+    {
+        _bitRate = _pendingBitRate;
+        // adaptive quality keeps its share of the new rate
+        applyBitRate(_bitRate * _bitRatePercent / 100);
+    }
+    std::array<int, 4> region;
+    {
+        std::lock_guard<std::mutex> lock(_regionLock);
+        if (!_regionPending || since(_regionSince) < VIDEO_LIVE_SETTLE)
+            return;
+        region = _region;
+        _regionPending = false;
+    }
+    // file & lavfi sources have no region
+    if (_source.type == SOURCE_DEVICE)
+        reopenGrab(region);
+}
+
+void VideoCapture::applyBitRate(int64_t bitRate)
+{
+    auto encCtx = _ost->encCtx;
+    if (encCtx->codec_id == AV_CODEC_ID_RAWVIDEO || encCtx->codec_id == AV_CODEC_ID_WRAPPED_AVFRAME)
+        return;
+    // libx264 reconfigures itself when these change, other encoders read them only when opened
+    if (std::strcmp(encCtx->codec->name, "libx264") != 0)
+    {
+        display_message(NAME, std::string(encCtx->codec->name) + " keeps its bit rate until next recording",
+                        MESSAGE_WARN);
+        return;
+    }
+    encCtx->bit_rate = bitRate;
+    // capped rate control can only be kept on, not switched on while running
+    if (encCtx->rc_max_rate > 0)
+    {
+        encCtx->rc_max_rate = bitRate;
+        encCtx->rc_buffer_size = static_cast<int>((std::min)(bitRate, int64_t(INT_MAX)));
+    }
+    char at[32];
+    std::snprintf(at, sizeof(at), " at %.3f s", mediaTime());
+    display_message(NAME, "bit rate changed to " + std::to_string(bitRate / 1000) + " kbps" + at, MESSAGE_INFO);
+}
+
+bool VideoCapture::reopenGrab(const std::array<int, 4> &window)
+{
+    std::array<int, 4> previous = {_configs[0], _configs[1], _configs[2], _configs[3]};
+    auto region = window;
+    // rawvideo packets have a fixed size, so raw output only moves its region
+    if (_ost->encCtx->codec_id == AV_CODEC_ID_RAWVIDEO)
+    {
+        region[2] = _ost->encCtx->width;
+        region[3] = _ost->encCtx->height;
+    }
+    if (region == previous || region[2] < 2 || region[3] < 2)
+        return true;
+    // frames still queued keep the previous size, conversion follows the size of each frame
+    stopGrab();
+    avformat_close_input(&_ist->fmtCtx);
+    auto open = [this](const std::array<int, 4> &r) {
+        for (int i = 0; i < 4; i++)
+            _configs[i] = r[i];
+        _ist = std::make_unique<InputStream>();
+        return openDevice() && configIStream();
+    };
+    auto describe = [](const std::array<int, 4> &r) {
+        return "(" + std::to_string(r[0]) + "," + std::to_string(r[1]) + "|" + std::to_string(r[2]) + "x" +
+               std::to_string(r[3]) + ")";
+    };
+    bool success = open(region);
+    if (success)
+    {
+        char at[32];
+        std::snprintf(at, sizeof(at), " at %.3f s", mediaTime());
+        display_message(NAME, "capture region moved to " + describe(region) + at, MESSAGE_INFO);
+    }
     else
     {
-        display_message(NAME, "input stream not allocated", MESSAGE_WARN);
+        display_message(NAME, "failed to move capture region to " + describe(region) + ", keeping previous",
+                        MESSAGE_WARN);
+        if (_ist->fmtCtx)
+            avformat_close_input(&_ist->fmtCtx);
+        success = open(previous);
+    }
+    if (success)
+        startGrab();
+    else
+        display_message(NAME, "failed to reopen capture, video ends here", MESSAGE_WARN);
+    return success;
+}
+
+bool VideoCapture::convertFrame(struct SwsContext **swsCtx, const AVFrame *frame, AVFrame *dst, int flags,
+                                int scalePercent)
+{
+    auto fmt = static_cast<AVPixelFormat>(dst->format);
+    int x = 0, y = 0, w = dst->width, h = dst->height;
+    uint8_t *data[4] = {dst->data[0], dst->data[1], dst->data[2], dst->data[3]};
+    bool fit = _regionPolicy == VIDEO_REGION_PAD && int64_t(frame->width) * h != int64_t(frame->height) * w;
+    if (fit || scalePercent < 100)
+    {
+        // largest size of region aspect ratio that fits, on chroma sample boundaries
+        auto desc = av_pix_fmt_desc_get(fmt);
+        int alignW = 1 << desc->log2_chroma_w, alignH = 1 << desc->log2_chroma_h;
+        if (fit && int64_t(frame->width) * h > int64_t(frame->height) * w)
+            h = static_cast<int>(int64_t(w) * frame->height / frame->width);
+        else if (fit)
+            w = static_cast<int>(int64_t(h) * frame->width / frame->height);
+        // smaller picture of adaptive quality, encoder & output keep their size
+        w = w * scalePercent / 100;
+        h = h * scalePercent / 100;
+        w = (std::max)(alignW, w / alignW * alignW);
+        h = (std::max)(alignH, h / alignH * alignH);
+        x = (dst->width - w) / 2 / alignW * alignW;
+        y = (dst->height - h) / 2 / alignH * alignH;
+        // pooled buffers hold old content, formats without a black level keep it in the border
+        ptrdiff_t linesize[4] = {dst->linesize[0], dst->linesize[1], dst->linesize[2], dst->linesize[3]};
+        av_image_fill_black(dst->data, linesize, fmt, dst->color_range, dst->width, dst->height);
+        int steps[4];
+        av_image_fill_max_pixsteps(steps, nullptr, desc);
+        int planes = desc->flags & AV_PIX_FMT_FLAG_PAL ? 1 : 4;
+        for (int i = 0; i < planes && data[i]; i++)
+        {
+            bool chroma = i == 1 || i == 2;
+            data[i] += (y >> (chroma ? desc->log2_chroma_h : 0)) * dst->linesize[i] +
+                       (x >> (chroma ? desc->log2_chroma_w : 0)) * steps[i];
+        }
+    }
+    *swsCtx = sws_getCachedContext(*swsCtx, frame->width, frame->height, static_cast<AVPixelFormat>(frame->format), w,
+                                   h, fmt, flags, nullptr, nullptr, nullptr);
+    if (!*swsCtx)
+    {
+        display_message(NAME, "failed to prepare sws context", MESSAGE_WARN);
         return false;
     }
-    avcodec_parameters_free(&param);
+    sws_scale(*swsCtx, frame->data, frame->linesize, 0, frame->height, data, dst->linesize);
     return true;
 }
 
-bool VideoCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent)
+bool VideoCapture::refreshFrame(OutputStream *ost)
+{
+    if (av_frame_is_writable(ost->frame))
+        return true;
+    // content is overwritten anyway, so take a pooled buffer instead of av_frame_make_writable copying it
+    auto encCtx = ost->encCtx;
+    av_frame_unref(ost->frame);
+    if (!ost->pool)
+    {
+        auto size = av_image_get_buffer_size(encCtx->pix_fmt, encCtx->width, encCtx->height, VIDEO_FRAME_ALIGN);
+        ost->pool = size > 0 ? av_buffer_pool_init(size, nullptr) : nullptr;
+    }
+    if (ost->pool)
+        ost->frame->buf[0] = av_buffer_pool_get(ost->pool);
+    if (!ost->frame->buf[0] || av_image_fill_arrays(ost->frame->data, ost->frame->linesize, ost->frame->buf[0]->data,
+                                                    encCtx->pix_fmt, encCtx->width, encCtx->height,
+                                                    VIDEO_FRAME_ALIGN) < 0)
+    {
+        display_message(NAME, "failed to allocate encoder frame buffer", MESSAGE_WARN);
+        return false;
+    }
+    ost->frame->width = encCtx->width;
+    ost->frame->height = encCtx->height;
+    ost->frame->format = encCtx->pix_fmt;
+    return true;
+}
+
+bool VideoCapture::wrapFrame(const AVFrame *frame, OutputStream *ost)
+{
+    auto fmt = static_cast<AVPixelFormat>(frame->format);
+    auto size = av_image_get_buffer_size(fmt, frame->width, frame->height, 1);
+    if (size < 0)
+    {
+        display_message(NAME, "unsupported raw frame format", MESSAGE_WARN);
+        return false;
+    }
+    // planes already laid out like a rawvideo packet can be referenced without a copy
+    int linesize[4];
+    uint8_t *data[4];
+    bool packed = frame->buf[0] && !frame->buf[1] && av_image_fill_linesizes(linesize, fmt, frame->width) >= 0 &&
+                  av_image_fill_pointers(data, fmt, frame->height, frame->data[0], linesize) >= 0 &&
+                  frame->data[0] + size <= frame->buf[0]->data + frame->buf[0]->size;
+    for (int i = 0; packed && i < 4 && data[i]; i++)
+        packed = linesize[i] == frame->linesize[i] && data[i] == frame->data[i];
+    auto pkt = ost->pkt;
+    if (packed)
+    {
+        pkt->buf = av_buffer_ref(frame->buf[0]);
+        pkt->data = frame->data[0];
+    }
+    else
+    {
+        // raw output never calls refreshFrame, so the pool holds packet sized buffers only
+        if (!ost->pool)
+            ost->pool = av_buffer_pool_init(size, nullptr);
+        pkt->buf = ost->pool ? av_buffer_pool_get(ost->pool) : nullptr;
+        if (pkt->buf)
+        {
+            pkt->data = pkt->buf->data;
+            av_image_copy_to_buffer(pkt->data, size, frame->data, frame->linesize, fmt, frame->width, frame->height,
+                                    1);
+        }
+    }
+    if (!pkt->buf)
+    {
+        display_message(NAME, "failed to allocate raw packet", MESSAGE_WARN);
+        return false;
+    }
+    pkt->size = size;
+    pkt->pts = pkt->dts = frame->pts;
+    pkt->duration = 1;
+    pkt->flags |= AV_PKT_FLAG_KEY;
+    return true;
+}
+
+std::unique_ptr<VideoBranch> VideoCapture::openBranch(const RenditionConfig &config)
+{
+    auto branch = std::make_unique<VideoBranch>();
+    branch->path = config.path;
+    // allocate format
+    auto formatOut = av_guess_format(nullptr, config.path.c_str(), nullptr);
+    {
+        if (!formatOut || formatOut->video_codec == AV_CODEC_ID_NONE)
+        {
+            display_message(NAME, "failed to guess video format for " + config.path, MESSAGE_WARN);
+            return nullptr;
+        }
+        if (avformat_alloc_output_context2(&branch->fmtCtx, formatOut, nullptr, config.path.c_str()) < 0)
+        {
+            display_message(NAME, "failed to allocate format for " + config.path, MESSAGE_WARN);
+            return nullptr;
+        }
+        branch->fmtCtx->video_codec_id = formatOut->video_codec;
+    }
+    // open encoder, size is kept even for H264
+    int width = (std::max)(2, _configs[2] * config.scale / 100) & ~1;
+    int height = (std::max)(2, _configs[3] * config.scale / 100) & ~1;
+    int srcWidth, srcHeight;
+    AVPixelFormat srcFormat;
+    if (!sourceFormat(srcWidth, srcHeight, srcFormat))
+        return nullptr;
+    branch->ost = std::make_unique<OutputStream>();
+    if (!openEncoder(branch->ost.get(), branch->fmtCtx, width, height, _configs[4],
+                     int64_t(width) * height * _configs[4], srcFormat, 0, _preset))
+        return nullptr;
+    // reuse main colour conversion when pixel format matches
+    auto encCtx = branch->ost->encCtx;
+    branch->fromEncoderFrame =
+        encCtx->pix_fmt == _ost->encCtx->pix_fmt && _ost->encCtx->codec_id != AV_CODEC_ID_RAWVIDEO;
+    branch->sharedConversion =
+        branch->fromEncoderFrame && width == _ost->encCtx->width && height == _ost->encCtx->height;
+    if (!branch->sharedConversion)
+    {
+        if (branch->fromEncoderFrame)
+        {
+            srcWidth = _ost->encCtx->width;
+            srcHeight = _ost->encCtx->height;
+            srcFormat = _ost->encCtx->pix_fmt;
+        }
+        branch->ost->swsCtx = sws_getContext(srcWidth, srcHeight, srcFormat, width, height, encCtx->pix_fmt,
+                                             SWS_BICUBIC, nullptr, nullptr, nullptr);
+        if (!branch->ost->swsCtx)
+        {
+            display_message(NAME, "failed to prepare sws context for " + config.path, MESSAGE_WARN);
+            return nullptr;
+        }
+    }
+    // open output
+    MuxerConfig muxerConfig;
+    muxerConfig.path = config.path;
+    if (!branch->muxer.open(branch->fmtCtx, muxerConfig))
+        return nullptr;
+    branch->loop = true;
+    branch->t = std::thread([this, ptr = branch.get()] { branchInternal(ptr); });
+    return branch;
+}
+
+void VideoCapture::pushBranchFrame(VideoBranch *branch, const AVFrame *frame)
+{
+    auto ref = av_frame_clone(frame);
+    if (!ref)
+    {
+        display_message(NAME, "failed to reference frame", MESSAGE_WARN);
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(branch->framesLock);
+        // a slow rendition must not stall capture, keep latest frames
+        if (branch->frames.size() >= VIDEO_RENDITION_QUEUE)
+        {
+            av_frame_free(&branch->frames.front());
+            branch->frames.pop_front();
+            branch->dropped++;
+            branch->behind = true;
+        }
+        branch->frames.push_back(ref);
+    }
+    branch->framesCV.notify_one();
+}
+
+void VideoCapture::branchInternal(VideoBranch *branch)
+{
+    PipelineTrace::nameThread("rendition " + fs::path(branch->path).filename().string());
+    using clock = std::chrono::steady_clock;
+    auto lastT = clock::now();
+    auto lastCpu = thread_cpu_time();
+    std::unique_lock<std::mutex> lock(branch->framesLock);
+    while (true)
+    {
+        branch->framesCV.wait(lock, [branch] { return !branch->frames.empty() || !branch->loop; });
+        // drain queue before exit
+        if (branch->frames.empty())
+            break;
+        auto frame = branch->frames.front();
+        branch->frames.pop_front();
+        if (branch->frames.empty())
+            branch->behind = false;
+        lock.unlock();
+        {
+            TraceScope encodeScope(_stats ? _stats->trace() : nullptr, "rendition_encode", frame->pts);
+            encodeBranch(branch, frame);
+        }
+        av_frame_free(&frame);
+        // update cpu usage about once per second
+        auto elapsed = std::chrono::duration<double>(clock::now() - lastT).count();
+        if (elapsed >= 1.0)
+        {
+            auto cpu = thread_cpu_time();
+            branch->cpuUsage = static_cast<float>((cpu - lastCpu) / elapsed * 100.0);
+            lastCpu = cpu;
+            lastT = clock::now();
+        }
+        lock.lock();
+    }
+    lock.unlock();
+    encodeBranch(branch, nullptr);
+    branch->muxer.close();
+}
+
+void VideoCapture::encodeBranch(VideoBranch *branch, AVFrame *frame)
+{
+    auto ost = branch->ost.get();
+    auto encFrame = frame;
+    if (frame && !branch->sharedConversion)
+    {
+        if (!refreshFrame(ost) || !convertFrame(&ost->swsCtx, frame, ost->frame, SWS_BICUBIC))
+            return;
+        ost->frame->pts = frame->pts;
+        encFrame = ost->frame;
+    }
+    bool frameSent = false;
+    while (encode(ost->encCtx, encFrame, ost->pkt, frameSent))
+    {
+        ost->pkt->stream_index = ost->st->index;
+        branch->muxer.writePacket(ost->pkt);
+        av_packet_unref(ost->pkt);
+    }
+}
+
+bool VideoCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent,
+                          StageTimer *timer)
 {
+    StageScope scope(timer);
     int ret;
     char buf[512];
     if (!packetSent && (ret = avcodec_send_packet(codecCtx, pkt)) < 0)
@@ -350,8 +1237,10 @@ bool VideoCapture::decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pk
     return avcodec_receive_frame(codecCtx, frame) >= 0;
 }
 
-bool VideoCapture::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent)
+bool VideoCapture::encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent,
+                          StageTimer *timer)
 {
+    StageScope scope(timer);
     int ret;
     char buf[512];
     if (!frameSent && (ret = avcodec_send_frame(codecCtx, frame) < 0))
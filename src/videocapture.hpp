@@ -7,11 +7,22 @@ extern "C"
 #include <libswscale/swscale.h>
 }
 
+#include "adaptive.hpp"
+#include "muxer.hpp"
+#include "source.hpp"
+#include "stats.hpp"
 #include "streams.hpp"
 
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 
 /** @file */
 
@@ -21,6 +32,115 @@ extern "C"
 /// Video capture default bit rate
 #define VIDEO_DEFAULT_BITRATE 4000000
 
+/// Line alignment of converted frames
+#define VIDEO_FRAME_ALIGN 32
+
+/// Rendition default size (percent of capture size)
+#define VIDEO_RENDITION_SCALE 50
+
+/// Maximum frames queued per rendition before old frames are dropped
+#define VIDEO_RENDITION_QUEUE 8
+
+/// Speed presets of encoders that have them, fastest first
+#define VIDEO_PRESETS 6
+
+/// Maximum captured frames queued for the encoder
+#define VIDEO_CAPTURE_QUEUE 8
+
+/// Maximum copies of the previous frame filling one gap, longer gaps stay in the timestamps
+#define VIDEO_DUPLICATE_LIMIT 60
+
+/// Under load: drop oldest queued frame, output follows the latest screen content
+#define VIDEO_DROP_OLDEST 0
+
+/// Under load: drop newly captured frame, queued frames are kept
+#define VIDEO_DROP_NEWEST 1
+
+/// Under load: hold capture and fill skipped frame slots with the previous frame, output keeps constant frame rate
+#define VIDEO_DROP_DUPLICATE 2
+
+/// Region resized while recording: scale keeping aspect ratio, pad the rest of the output with black
+#define VIDEO_REGION_PAD 0
+
+/// Region resized while recording: stretch to output size
+#define VIDEO_REGION_STRETCH 1
+
+/// Rate control: average bit rate
+#define VIDEO_RATE_AVERAGE 0
+
+/// Rate control: bit rate capped over a one second buffer
+#define VIDEO_RATE_CAPPED 1
+
+/// Time (milliseconds) a live bit rate or region change must stay unchanged before it is applied
+#define VIDEO_LIVE_SETTLE 250
+
+/**
+ * @brief Frame Drops
+ *
+ * This structure stores video frames lost or inserted by a capture, per cause.
+ */
+struct FrameDrops
+{
+    int64_t sourceGaps; // frame slots skipped by the source, from its timestamps
+    int64_t queueDrops; // captured frames dropped because the encoder fell behind
+    int64_t duplicated; // copies of the previous frame filling skipped slots
+};
+
+/**
+ * @brief Rendition Config
+ *
+ * This structure stores settings of one extra video rendition.
+ */
+struct RenditionConfig
+{
+    std::string path;
+    int32_t scale; // percent of capture size
+
+    RenditionConfig() : scale(VIDEO_RENDITION_SCALE)
+    {
+    }
+};
+
+/**
+ * @brief Video Branch
+ *
+ * This structure stores one rendition encoder fed by VideoCapture.
+ */
+struct VideoBranch
+{
+    std::string path;
+    AVFormatContext *fmtCtx; // stream template for muxer
+    std::unique_ptr<OutputStream> ost;
+    MediaMuxer muxer;
+    bool fromEncoderFrame; // scale from main encoder frame instead of decoded frame
+    bool sharedConversion; // main encoder frame is used as is
+    std::deque<AVFrame *> frames;
+    std::mutex framesLock;
+    std::condition_variable framesCV;
+    bool loop;
+    std::thread t;
+    std::atomic<int64_t> dropped;
+    std::atomic<float> cpuUsage; // percent of one core
+    std::atomic<bool> behind;
+
+    VideoBranch()
+        : fmtCtx(nullptr), fromEncoderFrame(false), sharedConversion(false), loop(false), dropped(0), cpuUsage(0.0f),
+          behind(false)
+    {
+    }
+
+    ~VideoBranch()
+    {
+        for (auto frame : frames)
+            av_frame_free(&frame);
+        if (fmtCtx)
+            avformat_free_context(fmtCtx);
+    }
+};
+
+class EncoderCalibration;
+class WindowGrab;
+
 /**
  * @brief Video Capture
  *
@@ -39,10 +159,12 @@ class VideoCapture
      *
      * @param oc Output format context
      * @param window Capture window configs
+     * @param renditions Extra encoders fed by the same capture, each written to its own file
      * @return true if starts capture
      * @return false otherwise
      */
-    bool openCapture(AVFormatContext *oc, const std::array<int, 4> &window);
+    bool openCapture(AVFormatContext *oc, const std::array<int, 4> &window,
+                     const std::vector<RenditionConfig> &renditions = {});
 
     /**
      * @brief Close Video Capture
@@ -59,13 +181,85 @@ class VideoCapture
      *
      * Meant to be called from MediaHandler.
      *
-     * @param oc Output format context
+     * @param onPacket Callback receiving encoded packets
      * @param skip Whether to skip writing current frame
      * @param flush Whether to flush output with empty packets
      * @return true if success
      * @return false otherwise
      */
-    bool writeFrame(AVFormatContext *oc, bool skip, bool flush);
+    bool writeFrame(const PacketCallback &onPacket, bool skip, bool flush);
+
+    /**
+     * @brief Set Input Source
+     *
+     * Takes effect on next capture.
+     *
+     * @param config Source configs
+     */
+    void setSource(const SourceConfig &config);
+
+    /**
+     * @brief Set Capture Frame Rate
+     *
+     * Takes effect on next capture.
+     *
+     * @param fps Frame rate
+     */
+    void setFrameRate(int fps);
+
+    /**
+     * @brief Set Policy Under Load
+     *
+     * Takes effect on next capture.
+     * Only device & window sources drop frames, file & lavfi sources wait for the encoder.
+     *
+     * @param policy One of VIDEO_DROP_*
+     */
+    void setDropPolicy(int policy);
+
+    /**
+     * @brief Set Adaptive Quality Bounds
+     *
+     * Takes effect on next capture, only device & window sources adapt.
+     *
+     * @param bounds Lowest quality the controller may step down to
+     */
+    void setAdaptive(const AdaptiveBounds &bounds);
+
+    /**
+     * @brief Copy Settings
+     *
+     * Takes frame rate, bit rate, preset and load policies of another capture, for captures running beside it.
+     * Takes effect on next capture.
+     *
+     * @param other Capture to copy from
+     */
+    void copySettings(const VideoCapture &other);
+
+    /**
+     * @brief Move Capture Region
+     *
+     * Safe to call from any thread while capturing. Once the region settled the grabber is reopened on it,
+     * the output keeps its size and the region is placed in it by region policy.
+     *
+     * @param window Capture window: x, y, w, h
+     */
+    void setRegion(const std::array<int, 4> &window);
+
+    /// Quality controller of current or last capture
+    AdaptiveController &adaptive();
+
+    /// Frames lost or inserted by current or last capture, safe to call from any thread
+    FrameDrops frameDrops();
+
+    /// Captured frames waiting for the encoder, safe to call from any thread
+    int queueDepth();
+
+    /// Timestamp (seconds) of last written frame
+    double mediaTime();
+
+    /// Set stage timers receiver, nullptr disables timing
+    void setStats(PipelineStats *stats);
 
     /**
      * @brief Get the Output Stream
@@ -81,10 +275,58 @@ class VideoCapture
      */
     void UI();
 
-    const std::string NAME = "VideoCapture";
+    /**
+     * @brief Open Video Encoder
+     *
+     * Adds encoder stream to format context, also used for renditions and offline transcoding.
+     *
+     * @param ost Output stream to configure
+     * @param oc Output format context, its video codec is used
+     * @param width Frame width
+     * @param height Frame height
+     * @param fps Frame rate
+     * @param bitRate Bit rate
+     * @param rawFormat Pixel format for rawvideo output
+     * @param threads Encoder threads, 0 for codec default
+     * @param preset Speed preset below presetCount, -1 for codec default
+     * @param rateControl One of VIDEO_RATE_*
+     * @return true if success
+     * @return false otherwise
+     */
+    static bool openEncoder(OutputStream *ost, AVFormatContext *oc, int width, int height, int fps, int64_t bitRate,
+                            AVPixelFormat rawFormat = AV_PIX_FMT_YUV420P, int threads = 0, int preset = -1,
+                            int rateControl = VIDEO_RATE_AVERAGE);
+
+    /**
+     * @brief Find Video Encoder
+     *
+     * @param codecId Video codec of output format
+     * @return const AVCodec* Encoder openEncoder uses, nullptr if none
+     */
+    static const AVCodec *findEncoder(AVCodecID codecId);
+
+    /// Number of speed presets of encoder, 0 if it has none
+    static int presetCount(const AVCodec *codec);
+
+    /// Display name of encoder speed preset
+    static std::string presetName(const AVCodec *codec, int preset);
+
+    /**
+     * @brief Set Calibration Target
+     *
+     * Meant to be called while idle. Calibration runs in background when output codec or capture size changed
+     * significantly, and is cancelled when a capture opens.
+     *
+     * @param codecId Video codec of output format
+     * @param width Capture width
+     * @param height Capture height
+     */
+    void setCalibrationTarget(AVCodecID codecId, int width, int height);
+
+    static inline const std::string NAME = "VideoCapture";
 
   private:
-    /// Open video capture device
+    /// Open video input source
     bool openDevice();
 
     /// Configure input stream
@@ -93,16 +335,132 @@ class VideoCapture
     /// Configure output stream
     bool configOStream(AVFormatContext *oc);
 
-    /// Decode frame from input stream packet
-    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent);
+    /// Start grab thread, reading & decoding input into the frame queue
+    void startGrab();
+
+    /// Stop grab thread, queued frames are kept
+    void stopGrab();
+
+    /// Internal grab process
+    void grabInternal();
+
+    /// Internal grab process of window source
+    void grabWindow();
+
+    /// Slot of source timestamp at capture rate, counts skipped slots
+    int64_t frameSlot(int64_t ts, AVRational timeBase);
+
+    /// Size & pixel format of grabbed frames when capture opened, false without source
+    bool sourceFormat(int &width, int &height, AVPixelFormat &format);
+
+    /// Whether source runs at screen pace instead of waiting for the encoder
+    bool liveSource();
+
+    /// Queue captured frame, applies policy when full
+    void pushFrame(AVFrame *frame);
+
+    /// Take next captured frame, waits for one, nullptr once grabbing has ended & queue is empty
+    AVFrame *popFrame();
+
+    /// Write captured frame at its slot, filling skipped slots first under duplicate policy
+    bool writeCaptured(const PacketCallback &onPacket, AVFrame *frame, StageTimer *convertT, StageTimer *encodeT);
+
+    /// Convert & encode frame at its pts, duplicate reuses the last converted frame
+    bool encodeFrame(const PacketCallback &onPacket, AVFrame *frame, bool duplicate, StageTimer *convertT,
+                     StageTimer *encodeT);
+
+    /// Apply colour conversion, bit rate & picture size of current quality level
+    void applyLevel();
 
-    /// Encode frame to output stream packet
-    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent);
+    /// Apply settled live changes from UI: encoder bit rate & capture region
+    void applyLive();
+
+    /// Set bit rate of running encoder, only encoders that reconfigure while running take it
+    void applyBitRate(int64_t bitRate);
+
+    /// Reopen grabber on region, falls back to previous region on failure
+    bool reopenGrab(const std::array<int, 4> &window);
+
+    /// Scale frame into dst, a frame of other aspect ratio is placed by region policy,
+    /// scalePercent below 100 shrinks the picture & pads it to dst size
+    bool convertFrame(struct SwsContext **swsCtx, const AVFrame *frame, AVFrame *dst, int flags,
+                      int scalePercent = 100);
+
+    /// Encoder codec of output codec
+    static AVCodecID encoderCodecId(AVCodecID codecId);
+
+    /// Make encoder frame writable without copying old content
+    bool refreshFrame(OutputStream *ost);
+
+    /// Fill rawvideo packet from frame, referencing its buffer when planes are packed
+    bool wrapFrame(const AVFrame *frame, OutputStream *ost);
+
+    /// Open rendition encoder, muxer and thread
+    std::unique_ptr<VideoBranch> openBranch(const RenditionConfig &config);
+
+    /// Queue frame for rendition, drops oldest frame when full
+    void pushBranchFrame(VideoBranch *branch, const AVFrame *frame);
+
+    /// Internal rendition process
+    void branchInternal(VideoBranch *branch);
+
+    /// Convert and encode frame for rendition, nullptr flushes encoder
+    void encodeBranch(VideoBranch *branch, AVFrame *frame);
+
+    /// Decode frame from input stream packet, time spent is added to timer if given
+    bool decode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &packetSent,
+                StageTimer *timer = nullptr);
+
+    /// Encode frame to output stream packet, time spent is added to timer if given
+    bool encode(AVCodecContext *codecCtx, AVFrame *frame, AVPacket *pkt, bool &frameSent,
+                StageTimer *timer = nullptr);
 
     std::unique_ptr<InputStream> _ist;
     std::unique_ptr<OutputStream> _ost;
+    std::unique_ptr<WindowGrab> _windowGrab; // window source instead of demuxer & decoder
+    std::vector<std::unique_ptr<VideoBranch>> _branches;
+
+    // captured frames, pts in frame slots since first grabbed frame
+    std::deque<AVFrame *> _frames;
+    std::mutex _framesLock;
+    std::condition_variable _framesCV;
+    std::atomic<bool> _grabLoop;
+    bool _grabEnd;
+    std::thread _grabT;
+    AVFrame *_prevFrame; // last written frame, for duplicates
+    int64_t _slotBase;   // slot of output pts 0, -1 before first written frame
+    int32_t _policy;     // policy of running capture
+    std::atomic<int64_t> _sourceGaps, _queueDrops, _duplicated;
+    std::unique_ptr<AdaptiveController> _adaptive;
+    int _scaleFlags;     // SWS_* flags of main colour conversion
+    int _scalePercent;   // picture size of main conversion, percent of output size
+    int _bitRatePercent; // main encoder bit rate, percent of live bit rate
+
+    // live changes, frame slots stay at the rate the capture opened with
+    int _captureFps;
+    int64_t _grabOrigin, _grabSlot; // first source timestamp & last slot, kept when the grabber reopens
+    double _paceSlot;               // slot the next written frame is due at
+    std::atomic<int> _liveFps;
+    std::atomic<int64_t> _liveBitRate;
+    int64_t _bitRate, _pendingBitRate; // bit rate set on encoder, and waiting to settle
+    std::chrono::steady_clock::time_point _bitRateSince;
+    std::mutex _regionLock;
+    std::array<int, 4> _region; // latest requested region
+    bool _regionPending;
+    std::chrono::steady_clock::time_point _regionSince;
 
     // x, y, w, h, fps, bitrate
     std::array<int, 6> _configs;
+    SourceConfig _source;
     bool _autoBitRate;
+    bool _autoPreset; // preset from calibration
+    int32_t _preset;
+    int32_t _rateControl;
+    int32_t _regionPolicy;
+    int32_t _dropPolicy;
+    AdaptiveBounds _adaptiveBounds;
+    std::unique_ptr<EncoderCalibration> _calibration;
+    AVCodecID _calibrationCodec;
+    int _calibrationWidth, _calibrationHeight;
+    PipelineStats *_stats;
 };
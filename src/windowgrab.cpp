@@ -0,0 +1,509 @@
+#include "windowgrab.hpp"
+#include "utils.hpp"
+
+extern "C"
+{
+#include <libavutil/imgutils.h>
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <thread>
+
+#if __linux__
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/XShm.h>
+#include <X11/extensions/Xcomposite.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+// X error handler is process wide, one trap at a time records errors of its own connection
+static std::mutex trapLock;
+static std::atomic<Display *> trapDisplay{nullptr};
+static std::atomic<bool> trapFailed{false};
+static XErrorHandler trapPrevious = nullptr;
+
+/// Record errors of trapped connection, others go to the previous handler
+static int trapXError(Display *dpy, XErrorEvent *event)
+{
+    if (dpy == trapDisplay)
+    {
+        trapFailed = true;
+        return 0;
+    }
+    return trapPrevious ? trapPrevious(dpy, event) : 0;
+}
+
+/// Whether a request on trapped connection failed since last check, waits for pending replies
+static bool trappedError(Display *dpy)
+{
+    XSync(dpy, False);
+    return trapFailed.exchange(false);
+}
+
+/// Catches X errors of requests that may fail (window gone or resized) while in scope
+class XErrorTrap
+{
+  public:
+    explicit XErrorTrap(Display *dpy) : _lock(trapLock), _dpy(dpy)
+    {
+        trapFailed = false;
+        trapDisplay = dpy;
+        trapPrevious = XSetErrorHandler(trapXError);
+    }
+
+    ~XErrorTrap()
+    {
+        XSync(_dpy, False);
+        XSetErrorHandler(trapPrevious);
+        trapDisplay = nullptr;
+    }
+
+    bool failed()
+    {
+        return trappedError(_dpy);
+    }
+
+  private:
+    std::lock_guard<std::mutex> _lock;
+    Display *_dpy;
+};
+
+/// Window name from _NET_WM_NAME or WM_NAME
+static std::string windowName(Display *dpy, Window window)
+{
+    std::string name;
+    Atom utf8 = XInternAtom(dpy, "UTF8_STRING", False);
+    Atom netName = XInternAtom(dpy, "_NET_WM_NAME", False);
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *data = nullptr;
+    if (XGetWindowProperty(dpy, window, netName, 0, 1024, False, utf8, &type, &format, &count, &after, &data) ==
+            Success &&
+        data)
+    {
+        name = reinterpret_cast<char *>(data);
+        XFree(data);
+    }
+    char *wmName = nullptr;
+    if (name.empty() && XFetchName(dpy, window, &wmName) && wmName)
+    {
+        name = wmName;
+        XFree(wmName);
+    }
+    return name;
+}
+#endif
+
+WindowGrab::WindowGrab()
+    : _dpy(nullptr), _window(0), _pixmap(0), _image(nullptr), _shmInfo(nullptr), _useShm(false), _mapped(false),
+      _ended(true), _stale(false), _width(0), _height(0), _depth(0), _border(0), _visual(nullptr),
+      _geometry({0, 0, 0, 0}), _interval(0)
+{
+}
+
+WindowGrab::~WindowGrab()
+{
+    close();
+}
+
+bool WindowGrab::open(const std::string &target, int fps)
+{
+    close();
+#if __linux__
+    auto dpy = XOpenDisplay(nullptr);
+    if (!dpy)
+    {
+        display_message(NAME, "failed to open display", MESSAGE_WARN);
+        return false;
+    }
+    _dpy = dpy;
+    // composite pixmaps need version 0.2
+    int eventBase, errorBase, major = 0, minor = 2;
+    if (!XCompositeQueryExtension(dpy, &eventBase, &errorBase) || !XCompositeQueryVersion(dpy, &major, &minor) ||
+        (major == 0 && minor < 2))
+    {
+        display_message(NAME, "XComposite 0.2 is not available", MESSAGE_WARN);
+        close();
+        return false;
+    }
+    // id first, then exact name
+    char *end = nullptr;
+    _window = std::strtoul(target.c_str(), &end, 0);
+    if (target.empty() || *end)
+    {
+        _window = 0;
+        for (auto &info : listWindows())
+        {
+            if (info.name == target)
+            {
+                _window = info.id;
+                break;
+            }
+        }
+    }
+    XWindowAttributes attrs;
+    bool found = false;
+    if (_window)
+    {
+        XErrorTrap trap(dpy);
+        found = XGetWindowAttributes(dpy, _window, &attrs) && !trap.failed();
+    }
+    if (!found)
+    {
+        display_message(NAME, "failed to find window " + target, MESSAGE_WARN);
+        close();
+        return false;
+    }
+    if (attrs.depth < 24)
+    {
+        display_message(NAME, "window depth " + std::to_string(attrs.depth) + " is not supported", MESSAGE_WARN);
+        close();
+        return false;
+    }
+    _width = attrs.width;
+    _height = attrs.height;
+    _depth = attrs.depth;
+    _visual = attrs.visual;
+    _mapped = attrs.map_state == IsViewable;
+    bool redirected = false;
+    {
+        XErrorTrap trap(dpy);
+        _name = windowName(dpy, _window);
+        // window keeps its content off screen, also where other windows cover it
+        XCompositeRedirectWindow(dpy, _window, CompositeRedirectAutomatic);
+        XSelectInput(dpy, _window, StructureNotifyMask);
+        updatePosition();
+        redirected = !trap.failed();
+    }
+    if (!redirected)
+    {
+        display_message(NAME, "failed to redirect window " + target, MESSAGE_WARN);
+        close();
+        return false;
+    }
+    _useShm = XShmQueryExtension(dpy);
+    _ended = false;
+    _stale = true;
+    _interval = std::chrono::microseconds(1000000 / (std::max)(1, fps));
+    _nextT = std::chrono::steady_clock::now();
+    display_message(NAME,
+                    "capturing window \"" + _name + "\" (" + std::to_string(_width) + "x" + std::to_string(_height) +
+                        (_useShm ? ", MIT-SHM" : "") + ")",
+                    MESSAGE_INFO);
+    return true;
+#else
+    display_message(NAME, "window capture needs X11, unsupported capture platform!", MESSAGE_WARN);
+    return false;
+#endif
+}
+
+void WindowGrab::close()
+{
+#if __linux__
+    auto dpy = static_cast<Display *>(_dpy);
+    if (!dpy)
+        return;
+    {
+        // window may be gone already
+        XErrorTrap trap(dpy);
+        releasePixmap();
+        if (_window && !_ended)
+        {
+            XSelectInput(dpy, _window, NoEventMask);
+            XCompositeUnredirectWindow(dpy, _window, CompositeRedirectAutomatic);
+        }
+    }
+    XCloseDisplay(dpy);
+#endif
+    _dpy = nullptr;
+    _window = 0;
+    _ended = true;
+}
+
+AVFrame *WindowGrab::grab()
+{
+#if __linux__
+    // pace to frame interval, late grabs skip ahead and show up as gaps in the timestamps
+    std::this_thread::sleep_until(_nextT);
+    auto now = std::chrono::steady_clock::now();
+    _nextT += _interval;
+    if (_nextT < now)
+        _nextT = now + _interval;
+    auto dpy = static_cast<Display *>(_dpy);
+    XErrorTrap trap(dpy);
+    handleEvents();
+    // unmapped windows have no pixmap, wait for them to come back
+    if (_ended || !_mapped)
+        return nullptr;
+    if (_stale && !preparePixmap())
+        return nullptr;
+    auto image = static_cast<XImage *>(_image);
+    bool success =
+        _useShm ? XShmGetImage(dpy, _pixmap, image, _border, _border, AllPlanes)
+                : (image = XGetImage(dpy, _pixmap, _border, _border, _width, _height, AllPlanes, ZPixmap)) != nullptr;
+    if (trap.failed())
+    {
+        if (success && !_useShm)
+            XDestroyImage(image);
+        success = false;
+    }
+    if (!success)
+    {
+        // size may have changed before the event arrived
+        _stale = true;
+        return nullptr;
+    }
+    if (image->bits_per_pixel != 32)
+    {
+        display_message(NAME, "window pixel layout is not supported", MESSAGE_WARN);
+        XDestroyImage(image);
+        _ended = true;
+        return nullptr;
+    }
+    auto frame = av_frame_alloc();
+    bool copied = frame != nullptr;
+    if (copied)
+    {
+        frame->width = _width;
+        frame->height = _height;
+        frame->format = AV_PIX_FMT_BGR0;
+        copied = av_frame_get_buffer(frame, 0) >= 0;
+    }
+    if (copied)
+    {
+        av_image_copy_plane(frame->data[0], frame->linesize[0], reinterpret_cast<uint8_t *>(image->data),
+                            image->bytes_per_line, _width * 4, _height);
+        frame->pts = std::chrono::duration_cast<std::chrono::microseconds>(now.time_since_epoch()).count();
+    }
+    else
+    {
+        display_message(NAME, "failed to allocate frame", MESSAGE_WARN);
+        av_frame_free(&frame);
+    }
+    if (!_useShm)
+        XDestroyImage(image);
+    return frame;
+#else
+    return nullptr;
+#endif
+}
+
+bool WindowGrab::ended()
+{
+    return _ended;
+}
+
+std::array<int, 4> WindowGrab::geometry()
+{
+    std::lock_guard<std::mutex> lock(_geometryLock);
+    return _geometry;
+}
+
+std::string WindowGrab::name()
+{
+    return _name;
+}
+
+std::vector<WindowInfo> WindowGrab::listWindows()
+{
+    std::vector<WindowInfo> windows;
+#if __linux__
+    auto dpy = XOpenDisplay(nullptr);
+    if (!dpy)
+        return windows;
+    listClients(dpy, windows);
+    XCloseDisplay(dpy);
+#endif
+    return windows;
+}
+
+#if __linux__
+void WindowGrab::listClients(void *display, std::vector<WindowInfo> &windows)
+{
+    auto dpy = static_cast<Display *>(display);
+    // windows may go away while listed
+    XErrorTrap trap(dpy);
+    auto root = DefaultRootWindow(dpy);
+    std::vector<Window> ids;
+    // window managers list client windows, bare X servers only have root children
+    Atom type;
+    int format;
+    unsigned long count, after;
+    unsigned char *data = nullptr;
+    if (XGetWindowProperty(dpy, root, XInternAtom(dpy, "_NET_CLIENT_LIST", False), 0, 4096, False, XA_WINDOW, &type,
+                           &format, &count, &after, &data) == Success &&
+        data)
+    {
+        auto list = reinterpret_cast<Window *>(data);
+        ids.assign(list, list + count);
+        XFree(data);
+    }
+    else
+    {
+        Window rootRet, parent, *children = nullptr;
+        unsigned int n = 0;
+        if (XQueryTree(dpy, root, &rootRet, &parent, &children, &n) && children)
+        {
+            ids.assign(children, children + n);
+            XFree(children);
+        }
+    }
+    for (auto id : ids)
+    {
+        XWindowAttributes attrs;
+        if (!XGetWindowAttributes(dpy, id, &attrs) || attrs.map_state != IsViewable || attrs.c_class != InputOutput)
+            continue;
+        auto name = windowName(dpy, id);
+        if (!name.empty())
+            windows.push_back({id, name});
+    }
+}
+#endif
+
+void WindowGrab::handleEvents()
+{
+#if __linux__
+    auto dpy = static_cast<Display *>(_dpy);
+    while (XPending(dpy))
+    {
+        XEvent event;
+        XNextEvent(dpy, &event);
+        switch (event.type)
+        {
+        case ConfigureNotify:
+            if (event.xconfigure.width != _width || event.xconfigure.height != _height)
+            {
+                // new size gets a new pixmap
+                _width = event.xconfigure.width;
+                _height = event.xconfigure.height;
+                _stale = true;
+            }
+            updatePosition();
+            break;
+        case MapNotify:
+            _mapped = true;
+            _stale = true;
+            break;
+        case UnmapNotify:
+            _mapped = false;
+            break;
+        case DestroyNotify:
+            display_message(NAME, "window \"" + _name + "\" closed", MESSAGE_INFO);
+            _ended = true;
+            break;
+        }
+    }
+#endif
+}
+
+bool WindowGrab::preparePixmap()
+{
+#if __linux__
+    releasePixmap();
+    auto dpy = static_cast<Display *>(_dpy);
+    XWindowAttributes attrs;
+    if (!XGetWindowAttributes(dpy, _window, &attrs))
+    {
+        _ended = true;
+        return false;
+    }
+    _width = attrs.width;
+    _height = attrs.height;
+    // pixmap includes the window border
+    _border = attrs.border_width;
+    _pixmap = XCompositeNameWindowPixmap(dpy, _window);
+    if (trappedError(dpy))
+    {
+        // window unmapped or resized meanwhile, no pixmap was named
+        _pixmap = 0;
+        return false;
+    }
+    if (_useShm)
+    {
+        auto shmInfo = new XShmSegmentInfo();
+        shmInfo->shmid = -1;
+        shmInfo->shmaddr = nullptr;
+        shmInfo->readOnly = False;
+        _shmInfo = shmInfo;
+        auto image = XShmCreateImage(dpy, static_cast<Visual *>(_visual), _depth, ZPixmap, nullptr, shmInfo, _width,
+                                     _height);
+        _image = image;
+        bool attached = false;
+        if (image)
+            shmInfo->shmid = shmget(IPC_PRIVATE, image->bytes_per_line * image->height, IPC_CREAT | 0600);
+        if (shmInfo->shmid >= 0)
+        {
+            auto addr = shmat(shmInfo->shmid, nullptr, 0);
+            if (addr != reinterpret_cast<void *>(-1))
+            {
+                shmInfo->shmaddr = image->data = static_cast<char *>(addr);
+                attached = XShmAttach(dpy, shmInfo) && !trappedError(dpy);
+            }
+            // segment is freed once both sides detach
+            shmctl(shmInfo->shmid, IPC_RMID, nullptr);
+        }
+        if (!attached)
+        {
+            display_message(NAME, "failed to prepare shared memory image, using XGetImage", MESSAGE_WARN);
+            releasePixmap();
+            _useShm = false;
+            _pixmap = XCompositeNameWindowPixmap(dpy, _window);
+        }
+        else if (image->bits_per_pixel != 32)
+        {
+            display_message(NAME, "window pixel layout is not supported", MESSAGE_WARN);
+            _ended = true;
+            return false;
+        }
+    }
+    _stale = false;
+    return true;
+#else
+    return false;
+#endif
+}
+
+void WindowGrab::releasePixmap()
+{
+#if __linux__
+    auto dpy = static_cast<Display *>(_dpy);
+    auto image = static_cast<XImage *>(_image);
+    auto shmInfo = static_cast<XShmSegmentInfo *>(_shmInfo);
+    if (shmInfo)
+    {
+        if (shmInfo->shmaddr)
+        {
+            XShmDetach(dpy, shmInfo);
+            XSync(dpy, False);
+            shmdt(shmInfo->shmaddr);
+        }
+        if (image)
+            image->data = nullptr;
+        delete shmInfo;
+    }
+    if (image)
+        XDestroyImage(image);
+    if (_pixmap)
+        XFreePixmap(dpy, _pixmap);
+#endif
+    _image = nullptr;
+    _shmInfo = nullptr;
+    _pixmap = 0;
+}
+
+void WindowGrab::updatePosition()
+{
+#if __linux__
+    auto dpy = static_cast<Display *>(_dpy);
+    int x = 0, y = 0;
+    Window child;
+    XTranslateCoordinates(dpy, _window, DefaultRootWindow(dpy), 0, 0, &x, &y, &child);
+    std::lock_guard<std::mutex> lock(_geometryLock);
+    _geometry = {x, y, _width, _height};
+#endif
+}
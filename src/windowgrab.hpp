@@ -0,0 +1,106 @@
+#pragma once
+extern "C"
+{
+#include <libavutil/frame.h>
+}
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/** @file */
+
+/// Time base of grabbed frame timestamps (microseconds)
+#define WINDOW_TIME_BASE 1000000
+
+/**
+ * @brief Window Info
+ *
+ * This structure stores one top-level window that can be captured.
+ */
+struct WindowInfo
+{
+    unsigned long id;
+    std::string name;
+};
+
+/**
+ * @brief Window Grab
+ *
+ * This class captures one X window from its composite pixmap, so overlapping windows do not show
+ * and only the window's own pixels are copied. Size and position are tracked while grabbing.
+ */
+class WindowGrab
+{
+  public:
+    WindowGrab();
+    ~WindowGrab();
+
+    /**
+     * @brief Open Window
+     *
+     * @param target Window id (decimal or 0x hex) or exact window name
+     * @param fps Grab rate
+     * @return true if success
+     * @return false otherwise
+     */
+    bool open(const std::string &target, int fps);
+
+    /// Release window & display
+    void close();
+
+    /**
+     * @brief Grab Frame
+     *
+     * Waits for the next frame interval, meant to be called from one grab thread.
+     *
+     * @return AVFrame* BGR0 frame at window size, pts in WINDOW_TIME_BASE, nullptr if none this interval
+     */
+    AVFrame *grab();
+
+    /// Whether the window is gone or grabbing failed for good
+    bool ended();
+
+    /// Window position on root & size: x, y, w, h, safe to call from any thread
+    std::array<int, 4> geometry();
+
+    /// Window name
+    std::string name();
+
+    /// Top-level windows of default display
+    static std::vector<WindowInfo> listWindows();
+
+    static inline const std::string NAME = "WindowGrab";
+
+  private:
+    /// Handle configure, map & destroy events of the window
+    void handleEvents();
+
+    /// Name composite pixmap & prepare image at current size
+    bool preparePixmap();
+
+    /// Free composite pixmap & image
+    void releasePixmap();
+
+    /// Update root position of window
+    void updatePosition();
+
+    /// Append named top-level windows of display (Display *)
+    static void listClients(void *display, std::vector<WindowInfo> &windows);
+
+    void *_dpy; // Display *
+    unsigned long _window, _pixmap;
+    void *_image;   // XImage *
+    void *_shmInfo; // XShmSegmentInfo *, nullptr without MIT-SHM
+    bool _useShm, _mapped, _ended, _stale;
+    int _width, _height, _depth, _border;
+    void *_visual; // Visual *
+    std::string _name;
+    std::mutex _geometryLock;
+    std::array<int, 4> _geometry;
+    std::chrono::microseconds _interval;
+    std::chrono::steady_clock::time_point _nextT;
+};
@@ -0,0 +1,75 @@
+#include "record_test.hpp"
+
+#include <csignal>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Kill test: records generated sources with the fragmented layout in a child process,
+// kills it with SIGKILL mid-recording and checks that the partial file still demuxes & decodes.
+
+static const std::string NAME = "KillTest";
+
+/// Bytes written before the recorder is killed, several fragments of TEST_WIDTH x TEST_HEIGHT video
+#define KILL_AFTER_BYTES (1 << 20)
+
+/// Record forever, only returns on failure
+static int recordChild(const std::string &path)
+{
+    auto config = testSessionConfig(path);
+    config.layout = OUTPUT_LAYOUT_FRAGMENTED;
+    RecordSession session;
+    if (!session.configure(config) || !session.start())
+        return 1;
+    while (session.stats().recording)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return 1;
+}
+
+int main()
+{
+    auto path = (testDir("kill") / "killed.mp4").string();
+    // fork before any thread exists, the child owns the whole pipeline
+    auto pid = fork();
+    if (pid < 0)
+    {
+        expect(NAME, false, "fork");
+        return 1;
+    }
+    if (pid == 0)
+        _exit(recordChild(path));
+
+    bool running = true;
+    auto startT = sysclock::now();
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        int status = 0;
+        if (waitpid(pid, &status, WNOHANG) == pid)
+        {
+            running = false;
+            break;
+        }
+        std::error_code ec;
+        auto size = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+        if (size >= KILL_AFTER_BYTES ||
+            std::chrono::duration<double>(sysclock::now() - startT).count() > TEST_TIMEOUT)
+            break;
+    }
+    if (running)
+    {
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+    }
+
+    bool ok = expect(NAME, running, "recorder was still running when killed");
+    std::error_code ec;
+    ok = expect(NAME, fs::exists(path, ec) && fs::file_size(path, ec) > 0, "partial file exists") && ok;
+    auto result = decodeFile(path);
+    ok = expect(NAME, result.opened, "partial file demuxes") && ok;
+    ok = expect(NAME, result.frames > 0, std::to_string(result.frames) + " frames decoded") && ok;
+    // only the fragment cut by the kill may be damaged
+    ok = expect(NAME, result.errors <= 1, std::to_string(result.errors) + " decode errors") && ok;
+    ok = expect(NAME, result.width == TEST_WIDTH && result.height == TEST_HEIGHT, "frame size") && ok;
+    return ok ? 0 : 1;
+}
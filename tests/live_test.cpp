@@ -0,0 +1,143 @@
+#include "record_test.hpp"
+
+#include <fstream>
+#include <vector>
+
+// Live test: records generated sources with HLS and LHLS (prefetch) live output,
+// then reads the playlists back and decodes every listed segment on its own.
+
+static const std::string NAME = "LiveTest";
+
+/// Seconds of video recorded per live mode, several OUTPUT_LIVE_SEGMENT_TIME segments
+#define LIVE_MEDIA_TIME 4.0
+
+/**
+ * @brief Playlist
+ *
+ * This structure stores the entries of one m3u8 file, resolved against its directory.
+ */
+struct Playlist
+{
+    bool opened;
+    std::string map;                // init segment of fMP4 media playlists
+    std::vector<std::string> uris;  // segments, or variant playlists of a master playlist
+    std::vector<std::string> media; // URI attributes of EXT-X-MEDIA, e.g. audio renditions
+
+    Playlist() : opened(false)
+    {
+    }
+};
+
+/// Value of a quoted attribute in a playlist tag, empty if missing
+static std::string attribute(const std::string &line, const std::string &name)
+{
+    auto pos = line.find(name + "=\"");
+    if (pos == std::string::npos)
+        return "";
+    pos += name.size() + 2;
+    auto end = line.find('"', pos);
+    return end == std::string::npos ? "" : line.substr(pos, end - pos);
+}
+
+/// Parse m3u8 file, relative URIs are resolved against its directory
+static Playlist readPlaylist(const std::string &path)
+{
+    Playlist playlist;
+    std::ifstream f(path);
+    std::string line;
+    if (!std::getline(f, line) || line.rfind("#EXTM3U", 0) != 0)
+        return playlist;
+    playlist.opened = true;
+    auto dir = fs::path(path).parent_path();
+    auto resolve = [&dir](const std::string &uri) { return fs::path(uri).is_absolute() ? uri : (dir / uri).string(); };
+    while (std::getline(f, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.rfind("#EXT-X-MAP:", 0) == 0)
+            playlist.map = resolve(attribute(line, "URI"));
+        else if (line.rfind("#EXT-X-MEDIA:", 0) == 0 && !attribute(line, "URI").empty())
+            playlist.media.push_back(resolve(attribute(line, "URI")));
+        else if (!line.empty() && line[0] != '#')
+            playlist.uris.push_back(resolve(line));
+    }
+    return playlist;
+}
+
+/// Append file content to stream, false if it cannot be read
+static bool appendFile(std::ofstream &out, const std::string &path)
+{
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+        return false;
+    out << in.rdbuf();
+    return true;
+}
+
+/// Decode each segment of a media playlist joined to its init segment, false if any is bad
+static bool checkMediaPlaylist(const std::string &path, const fs::path &scratch)
+{
+    auto playlist = readPlaylist(path);
+    auto name = fs::path(path).filename().string();
+    if (!expect(NAME, playlist.opened, name + " parses"))
+        return false;
+    if (!expect(NAME, !playlist.map.empty(), name + " has an init segment"))
+        return false;
+    // every segment starts on a keyframe, so each one decodes without its predecessors
+    if (!expect(NAME, playlist.uris.size() >= 2, name + " lists " + std::to_string(playlist.uris.size()) + " segments"))
+        return false;
+    bool ok = true;
+    for (auto &uri : playlist.uris)
+    {
+        auto joined = (scratch / "segment.mp4").string();
+        {
+            std::ofstream out(joined, std::ios::binary | std::ios::trunc);
+            if (!expect(NAME, appendFile(out, playlist.map) && appendFile(out, uri), "read " + uri))
+                return false;
+        }
+        auto result = decodeFile(joined);
+        ok = expect(NAME, result.opened && result.frames > 0 && result.errors == 0,
+                    fs::path(uri).filename().string() + ": " + std::to_string(result.frames) + " frames, " +
+                        std::to_string(result.errors) + " errors") &&
+             ok;
+    }
+    return ok;
+}
+
+/// Record with given live mode and check the playlists it leaves behind
+static bool checkLive(int live, const std::string &name)
+{
+    auto dir = testDir("live_" + name);
+    auto path = (dir / "out.mp4").string();
+    auto config = testSessionConfig(path);
+    config.live = live;
+    RecordSession session;
+    if (!expect(NAME, session.configure(config) && recordFor(session, LIVE_MEDIA_TIME), name + " recording"))
+        return false;
+    // out.mp4 -> out_live/
+    auto liveDir = dir / "out_live";
+    if (live == OUTPUT_LIVE_HLS)
+        return checkMediaPlaylist((liveDir / "index.m3u8").string(), dir);
+    // master playlist points at one media playlist per stream, video ones are decoded
+    auto master = readPlaylist((liveDir / "master.m3u8").string());
+    if (!expect(NAME, master.opened && !master.uris.empty(), "master.m3u8 lists variants"))
+        return false;
+    bool ok = true;
+    for (auto &uri : master.uris)
+        ok = checkMediaPlaylist(uri, dir) && ok;
+    for (auto &uri : master.media)
+    {
+        auto playlist = readPlaylist(uri);
+        ok = expect(NAME, playlist.opened && !playlist.map.empty() && !playlist.uris.empty(),
+                    fs::path(uri).filename().string() + " lists segments") &&
+             ok;
+    }
+    return ok;
+}
+
+int main()
+{
+    bool ok = checkLive(OUTPUT_LIVE_HLS, "hls");
+    ok = checkLive(OUTPUT_LIVE_LHLS, "lhls") && ok;
+    return ok ? 0 : 1;
+}
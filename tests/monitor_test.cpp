@@ -0,0 +1,119 @@
+#include "record_test.hpp"
+
+#include <algorithm>
+#include <vector>
+
+// Monitor test: splits an Xvfb screen into two RandR monitors, checks that they are listed
+// and records both through recorder-cli as tracks of one file & as separate files.
+// Skipped without Xvfb or xrandr.
+
+static const std::string NAME = "MonitorTest";
+
+/// Size of each test monitor, the screen holds two side by side
+#define MONITOR_TEST_WIDTH 640
+#define MONITOR_TEST_HEIGHT 480
+
+/// Seconds recorded by recorder-cli
+#define MONITOR_TEST_DURATION 2
+
+/// Sizes of the video streams of a file, empty if it cannot be opened
+static std::vector<std::pair<int, int>> videoSizes(const std::string &path)
+{
+    std::vector<std::pair<int, int>> sizes;
+    AVFormatContext *ic = nullptr;
+    if (avformat_open_input(&ic, path.c_str(), nullptr, nullptr) < 0)
+        return sizes;
+    if (avformat_find_stream_info(ic, nullptr) >= 0)
+    {
+        for (unsigned i = 0; i < ic->nb_streams; i++)
+        {
+            auto par = ic->streams[i]->codecpar;
+            if (par->codec_type == AVMEDIA_TYPE_VIDEO)
+                sizes.emplace_back(par->width, par->height);
+        }
+    }
+    avformat_close_input(&ic);
+    return sizes;
+}
+
+/// Run recorder-cli on both monitors, false if it fails
+static bool record(const std::string &cli, const std::string &monitors, const std::string &output,
+                   const std::string &path)
+{
+    auto command = "'" + cli + "' --monitors " + monitors + " --monitor-output " + output +
+                   " --audio-source lavfi --fps 30 --duration " + std::to_string(MONITOR_TEST_DURATION) +
+                   " --output '" + path + "'";
+    return std::system(command.c_str()) == 0;
+}
+
+/// Whether a file holds exactly the given number of monitor-sized video streams
+static bool expectStreams(const std::string &path, size_t count)
+{
+    auto sizes = videoSizes(path);
+    bool sized = std::all_of(sizes.begin(), sizes.end(), [](const std::pair<int, int> &size) {
+        return size.first == MONITOR_TEST_WIDTH && size.second == MONITOR_TEST_HEIGHT;
+    });
+    return expect(NAME, sizes.size() == count && sized,
+                  fs::path(path).filename().string() + " has " + std::to_string(sizes.size()) + " video streams, " +
+                      std::to_string(count) + " expected at monitor size");
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        display_message(NAME, "usage: " + std::string(argv[0]) + " <recorder-cli>", MESSAGE_ERROR);
+        return 1;
+    }
+    std::string cli = argv[1];
+    TestXvfb xvfb(MONITOR_TEST_WIDTH * 2, MONITOR_TEST_HEIGHT);
+    if (!xvfb.running() || !hasProgram("xrandr"))
+    {
+        display_message(NAME, "Xvfb or xrandr is not available, skipping", MESSAGE_WARN);
+        return TEST_SKIP;
+    }
+    // monitors without outputs, RandR 1.5 lists them as they are
+    auto geometry = std::to_string(MONITOR_TEST_WIDTH) + "/170x" + std::to_string(MONITOR_TEST_HEIGHT) + "/130";
+    if (std::system(("xrandr --setmonitor TEST-LEFT " + geometry + "+0+0 none").c_str()) != 0 ||
+        std::system(("xrandr --setmonitor TEST-RIGHT " + geometry + "+" + std::to_string(MONITOR_TEST_WIDTH) +
+                     "+0 none")
+                        .c_str()) != 0)
+    {
+        display_message(NAME, "X server does not take RandR monitors, skipping", MESSAGE_WARN);
+        return TEST_SKIP;
+    }
+
+    auto monitors = ScreenSource::listMonitors();
+    auto find = [&monitors](const std::string &name, int x) {
+        auto it = std::find_if(monitors.begin(), monitors.end(), [&name, x](const MonitorInfo &m) {
+            return m.name == name && m.x == x && m.y == 0 && m.w == MONITOR_TEST_WIDTH && m.h == MONITOR_TEST_HEIGHT;
+        });
+        return it == monitors.end() ? -1 : static_cast<int>(it - monitors.begin());
+    };
+    int left = find("TEST-LEFT", 0), right = find("TEST-RIGHT", MONITOR_TEST_WIDTH);
+    bool ok = expect(NAME, left >= 0, "listMonitors has TEST-LEFT");
+    ok = expect(NAME, right >= 0, "listMonitors has TEST-RIGHT") && ok;
+    if (!ok)
+        return 1;
+    auto indices = std::to_string(left) + "," + std::to_string(right);
+
+    // tracks: one file, one video stream per monitor
+    auto dir = testDir("monitors");
+    auto tracks = (dir / "tracks.mp4").string();
+    if (expect(NAME, record(cli, indices, "tracks", tracks), "record --monitor-output tracks"))
+        ok = expectStreams(tracks, 2) && ok;
+    else
+        ok = false;
+
+    // files: first monitor in the output, the other beside it as out_monitor<i>.mp4
+    auto files = (dir / "files.mp4").string();
+    auto second = (dir / ("files_monitor" + std::to_string(right) + ".mp4")).string();
+    if (expect(NAME, record(cli, indices, "files", files), "record --monitor-output files"))
+    {
+        ok = expectStreams(files, 1) && ok;
+        ok = expectStreams(second, 1) && ok;
+    }
+    else
+        ok = false;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,243 @@
+#pragma once
+#include "session.hpp"
+#include "utils.hpp"
+
+extern "C"
+{
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <string>
+#include <thread>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/** @file */
+
+/// Exit code of a test that cannot run here, see SKIP_RETURN_CODE in CMakeLists.txt
+#define TEST_SKIP 77
+
+/// Seconds a test waits for the pipeline before giving up
+#define TEST_TIMEOUT 30.0
+
+/// Capture size of generated sources
+#define TEST_WIDTH 320
+#define TEST_HEIGHT 240
+
+namespace fs = std::filesystem;
+
+using sysclock = std::chrono::system_clock;
+
+/**
+ * @brief Test Decode Result
+ *
+ * This structure stores what decodeFile found in one input.
+ */
+struct TestDecode
+{
+    bool opened;
+    int64_t frames; // decoded video frames
+    int64_t errors; // packets the decoder rejected
+    int width, height;
+
+    TestDecode() : opened(false), frames(0), errors(0), width(0), height(0)
+    {
+    }
+};
+
+/// Receives each decoded video frame
+using TestFrameCallback = std::function<void(const AVFrame *)>;
+
+/// Empty directory for test outputs, relative to the working directory
+inline fs::path testDir(const std::string &name)
+{
+    auto dir = fs::absolute(fs::path("test_out") / name);
+    std::error_code ec;
+    fs::remove_all(dir, ec);
+    fs::create_directories(dir, ec);
+    return dir;
+}
+
+/// Report a check, returns it so failures can be counted
+inline bool expect(const std::string &name, bool ok, const std::string &what)
+{
+    display_message(name, (ok ? "ok: " : "FAIL: ") + what, ok ? MESSAGE_INFO : MESSAGE_ERROR);
+    return ok;
+}
+
+/// Session config recording generated video & audio at TEST_WIDTH x TEST_HEIGHT
+inline SessionConfig testSessionConfig(const std::string &output)
+{
+    SessionConfig config;
+    config.output = output;
+    config.region = {0, 0, TEST_WIDTH, TEST_HEIGHT};
+    config.video.type = SOURCE_LAVFI;
+    config.audio.type = SOURCE_LAVFI;
+    config.fps = 30;
+    config.skipTime = 0;
+    return config;
+}
+
+/// Record until given seconds of video are written, false if the pipeline stopped or timed out
+inline bool recordFor(RecordSession &session, double mediaTime)
+{
+    if (!session.start())
+        return false;
+    auto startT = sysclock::now();
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        auto elapsed = std::chrono::duration<double>(sysclock::now() - startT).count();
+        auto stats = session.stats();
+        if (stats.mediaTime >= mediaTime)
+            break;
+        if (elapsed > TEST_TIMEOUT || (elapsed > 1.0 && !stats.recording))
+        {
+            session.stop();
+            return false;
+        }
+    }
+    return session.stop();
+}
+
+/// Demux & decode every video packet of url, a truncated tail ends the input like EOF
+inline TestDecode decodeFile(const std::string &url, const TestFrameCallback &onFrame = nullptr)
+{
+    TestDecode result;
+    AVFormatContext *ic = nullptr;
+    if (avformat_open_input(&ic, url.c_str(), nullptr, nullptr) < 0)
+        return result;
+    AVCodecContext *decCtx = nullptr;
+    int idx = -1;
+    if (avformat_find_stream_info(ic, nullptr) >= 0)
+        idx = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, nullptr, 0);
+    if (idx >= 0)
+    {
+        auto codec = avcodec_find_decoder(ic->streams[idx]->codecpar->codec_id);
+        decCtx = codec ? avcodec_alloc_context3(codec) : nullptr;
+        if (decCtx && (avcodec_parameters_to_context(decCtx, ic->streams[idx]->codecpar) < 0 ||
+                       avcodec_open2(decCtx, codec, nullptr) < 0))
+            avcodec_free_context(&decCtx);
+    }
+    if (!decCtx)
+    {
+        avformat_close_input(&ic);
+        return result;
+    }
+    result.opened = true;
+    auto pkt = av_packet_alloc();
+    auto frame = av_frame_alloc();
+    auto receive = [&]() {
+        while (avcodec_receive_frame(decCtx, frame) == 0)
+        {
+            result.frames++;
+            result.width = frame->width;
+            result.height = frame->height;
+            if (onFrame)
+                onFrame(frame);
+            av_frame_unref(frame);
+        }
+    };
+    while (av_read_frame(ic, pkt) >= 0)
+    {
+        if (pkt->stream_index == idx)
+        {
+            if (avcodec_send_packet(decCtx, pkt) < 0)
+                result.errors++;
+            receive();
+        }
+        av_packet_unref(pkt);
+    }
+    avcodec_send_packet(decCtx, nullptr);
+    receive();
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
+    avcodec_free_context(&decCtx);
+    avformat_close_input(&ic);
+    return result;
+}
+
+/// Whether a program is on PATH
+inline bool hasProgram(const std::string &name)
+{
+    return std::system(("command -v " + name + " >/dev/null 2>&1").c_str()) == 0;
+}
+
+/**
+ * @brief Test X Server
+ *
+ * This class runs an Xvfb server for its lifetime and points DISPLAY at it.
+ */
+class TestXvfb
+{
+  public:
+    TestXvfb(int w, int h) : _pid(-1)
+    {
+        int fds[2];
+        if (!hasProgram("Xvfb") || pipe(fds) != 0)
+            return;
+        _pid = fork();
+        if (_pid == 0)
+        {
+            ::close(fds[0]);
+            auto fd = std::to_string(fds[1]);
+            auto screen = std::to_string(w) + "x" + std::to_string(h) + "x24";
+            execlp("Xvfb", "Xvfb", "-displayfd", fd.c_str(), "-screen", "0", screen.c_str(), "-nolisten", "tcp",
+                   static_cast<char *>(nullptr));
+            _exit(127);
+        }
+        ::close(fds[1]);
+        // display number is written once the server accepts connections
+        std::string number;
+        char c;
+        while (_pid > 0 && read(fds[0], &c, 1) == 1 && c != '\n')
+            number += c;
+        ::close(fds[0]);
+        if (number.empty())
+        {
+            stop();
+            return;
+        }
+        _display = ":" + number;
+        setenv("DISPLAY", _display.c_str(), 1);
+    }
+
+    ~TestXvfb()
+    {
+        stop();
+    }
+
+    /// Whether the server is up, tests skip otherwise
+    bool running() const
+    {
+        return !_display.empty();
+    }
+
+    /// Display name, e.g. :99
+    const std::string &display() const
+    {
+        return _display;
+    }
+
+  private:
+    void stop()
+    {
+        if (_pid > 0)
+        {
+            kill(_pid, SIGTERM);
+            waitpid(_pid, nullptr, 0);
+        }
+        _pid = -1;
+    }
+
+    pid_t _pid;
+    std::string _display;
+};
@@ -0,0 +1,109 @@
+#include "record_test.hpp"
+#include "windowgrab.hpp"
+
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+
+#include <algorithm>
+
+// Window test: grabs an Xlib window on Xvfb through its composite pixmap,
+// then resizes it and covers it with another window. Skipped without Xvfb.
+
+static const std::string NAME = "WindowTest";
+
+/// Grabs tried before a check gives up, at WINDOW_TEST_FPS
+#define WINDOW_TEST_GRABS 60
+#define WINDOW_TEST_FPS 30
+
+/// Window colours, 24-bit TrueColor pixels of the default Xvfb visual
+#define WINDOW_TEST_RED 0xff0000
+#define WINDOW_TEST_BLUE 0x0000ff
+
+/// Create, name & map a plain window filled with a colour
+static Window createWindow(Display *dpy, int x, int y, int w, int h, unsigned long color, const char *name)
+{
+    auto win = XCreateSimpleWindow(dpy, DefaultRootWindow(dpy), x, y, w, h, 0, 0, color);
+    XStoreName(dpy, win, name);
+    XMapRaised(dpy, win);
+    XSync(dpy, False);
+    return win;
+}
+
+/// Pixel of a BGR0 frame as 0xRRGGBB
+static unsigned long pixelAt(const AVFrame *frame, int x, int y)
+{
+    auto p = frame->data[0] + y * frame->linesize[0] + x * 4;
+    return (static_cast<unsigned long>(p[2]) << 16) | (static_cast<unsigned long>(p[1]) << 8) | p[0];
+}
+
+/// Grab until a frame of given size arrives, true if its centre & corners have the colour
+static bool grabFrame(WindowGrab &grab, int w, int h, unsigned long color, const std::string &what)
+{
+    for (int i = 0; i < WINDOW_TEST_GRABS; i++)
+    {
+        auto frame = grab.grab();
+        if (!frame)
+            continue;
+        bool sized = frame->width == w && frame->height == h;
+        bool filled = sized && pixelAt(frame, w / 2, h / 2) == color && pixelAt(frame, 0, 0) == color &&
+                      pixelAt(frame, w - 1, h - 1) == color;
+        auto size = std::to_string(frame->width) + "x" + std::to_string(frame->height);
+        av_frame_free(&frame);
+        // a resize shows up after the configure event, the frames before still have the old size
+        if (sized)
+            return expect(NAME, filled, what + ": " + size + " frame has the window colour");
+    }
+    return expect(NAME, false, what + ": no " + std::to_string(w) + "x" + std::to_string(h) + " frame");
+}
+
+int main()
+{
+    TestXvfb xvfb(640, 480);
+    if (!xvfb.running())
+    {
+        display_message(NAME, "Xvfb is not available, skipping", MESSAGE_WARN);
+        return TEST_SKIP;
+    }
+    auto dpy = XOpenDisplay(xvfb.display().c_str());
+    if (!expect(NAME, dpy != nullptr, "open " + xvfb.display()))
+        return 1;
+    auto win = createWindow(dpy, 50, 50, 200, 150, WINDOW_TEST_RED, "record-test-a");
+
+    auto windows = WindowGrab::listWindows();
+    bool ok = expect(NAME,
+                     std::any_of(windows.begin(), windows.end(),
+                                 [win](const WindowInfo &info) { return info.id == win; }),
+                     "listWindows finds the window");
+
+    WindowGrab grab;
+    if (!expect(NAME, grab.open("record-test-a", WINDOW_TEST_FPS), "open window by name"))
+    {
+        XCloseDisplay(dpy);
+        return 1;
+    }
+    ok = grabFrame(grab, 200, 150, WINDOW_TEST_RED, "initial") && ok;
+
+    XResizeWindow(dpy, win, 300, 200);
+    XSync(dpy, False);
+    ok = grabFrame(grab, 300, 200, WINDOW_TEST_RED, "resized") && ok;
+    auto geometry = grab.geometry();
+    ok = expect(NAME, geometry[2] == 300 && geometry[3] == 200, "geometry follows resize") && ok;
+
+    // composite pixmap holds the window's own pixels, a window on top must not show
+    auto cover = createWindow(dpy, 0, 0, 640, 480, WINDOW_TEST_BLUE, "record-test-b");
+    ok = grabFrame(grab, 300, 200, WINDOW_TEST_RED, "covered") && ok;
+
+    XDestroyWindow(dpy, win);
+    XSync(dpy, False);
+    for (int i = 0; i < WINDOW_TEST_GRABS && !grab.ended(); i++)
+    {
+        auto frame = grab.grab();
+        av_frame_free(&frame);
+    }
+    ok = expect(NAME, grab.ended(), "grab ends with the window") && ok;
+
+    grab.close();
+    XDestroyWindow(dpy, cover);
+    XCloseDisplay(dpy);
+    return ok ? 0 : 1;
+}